@@ -0,0 +1,75 @@
+#!/bin/sh
+# Compares the resident memory and CPU time of serving ZONES renderers from
+# one process (--zone) with running one process per renderer.
+#
+# Usage: scripts/zone-footprint.sh [gmediarender-binary] [zones] [seconds]
+#
+# Uses the null output, so it runs without audio hardware. Each process
+# gets its own port on the loopback interface. After SECONDS (default 30)
+# the sum of VmRSS and of user+system CPU time of all processes is printed
+# for both setups, e.g.
+#   one process, 8 zones:   rss 9876KiB  cpu 0.12s
+#   8 processes, 1 zone:    rss 54321KiB cpu 0.80s
+
+BINARY=${1:-src/gmediarender}
+ZONES=${2:-8}
+SECONDS_RUN=${3:-30}
+BASE_PORT=49600
+CLK_TCK=$(getconf CLK_TCK)
+
+# Prints "<rss KiB> <cpu ticks>" of the given pid.
+footprint() {
+	rss=$(awk '/^VmRSS:/ { print $2 }' /proc/$1/status)
+	# utime and stime are fields 14 and 15; the name in field 2 has no
+	# spaces here.
+	cpu=$(awk '{ print $14 + $15 }' /proc/$1/stat)
+	echo "$rss $cpu"
+}
+
+# Prints the summed footprint of all given pids.
+report() {
+	label=$1
+	shift
+	total_rss=0
+	total_cpu=0
+	for pid in "$@"; do
+		f=$(footprint $pid)
+		total_rss=$((total_rss + ${f% *}))
+		total_cpu=$((total_cpu + ${f#* }))
+	done
+	printf "%-24s rss %dKiB cpu %d.%02ds\n" "$label" $total_rss \
+		$((total_cpu / CLK_TCK)) $((total_cpu % CLK_TCK * 100 / CLK_TCK))
+}
+
+if [ ! -x "$BINARY" ]; then
+	echo "$BINARY: not found; build first or pass the binary." >&2
+	exit 1
+fi
+
+ZONE_ARGS=""
+i=1
+while [ $i -le $ZONES ]; do
+	ZONE_ARGS="$ZONE_ARGS --zone=Zone$i"
+	i=$((i + 1))
+done
+
+$BINARY -o null -I lo -p $BASE_PORT $ZONE_ARGS --logfile=/dev/null &
+SINGLE=$!
+sleep $SECONDS_RUN
+report "one process, $ZONES zones:" $SINGLE
+kill $SINGLE
+wait $SINGLE 2>/dev/null
+
+PIDS=""
+i=1
+while [ $i -le $ZONES ]; do
+	$BINARY -o null -I lo -p $((BASE_PORT + i)) -f "Zone$i" \
+		-u "$(printf '00000000-0000-0000-0000-%012d' $i)" \
+		--logfile=/dev/null &
+	PIDS="$PIDS $!"
+	i=$((i + 1))
+done
+sleep $SECONDS_RUN
+report "$ZONES processes, 1 zone:" $PIDS
+kill $PIDS
+wait 2>/dev/null
@@ -0,0 +1,177 @@
+/* dispatch-bench - Microbenchmark for dispatching UPnP action requests.
+ *
+ * Copyright (C) 2026 GMediaRender contributors
+ *
+ * This file is part of GMediaRender.
+ *
+ * GMediaRender is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * GMediaRender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GMediaRender; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ * -----------------
+ *
+ * Sets up the renderer device on the loopback interface (without output)
+ * and feeds a mix of read-only action requests directly into the action
+ * dispatch, bypassing the network. Reports the time per request, which is
+ * the overhead of lookup, argument handling and response assembly.
+ * Needs libupnp >= 1.8 to construct the requests.
+ *
+ * Not built by default:  make -C src dispatch-bench
+ *                        src/dispatch-bench [iterations] [interface]
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <glib.h>
+#include <upnp.h>
+#include <ixml.h>
+
+#include "logging.h"
+#include "upnp_compat.h"
+#include "upnp_device.h"
+#include "upnp_renderer.h"
+#include "upnp_transport.h"
+#include "upnp_control.h"
+
+#define AVT_SERVICE "urn:upnp-org:serviceId:AVTransport"
+#define RC_SERVICE  "urn:upnp-org:serviceId:RenderingControl"
+#define CM_SERVICE  "urn:upnp-org:serviceId:ConnectionManager"
+
+struct bench_request {
+	const char *service_id;
+	const char *action;
+	const char *body;  // SOAP body as sent by a control point.
+};
+
+// Roughly what a control point polling the renderer sends.
+static const struct bench_request kRequests[] = {
+	{ AVT_SERVICE, "GetPositionInfo",
+	  "<u:GetPositionInfo xmlns:u=\"urn:schemas-upnp-org:service:"
+	  "AVTransport:1\"><InstanceID>0</InstanceID></u:GetPositionInfo>" },
+	{ AVT_SERVICE, "GetTransportInfo",
+	  "<u:GetTransportInfo xmlns:u=\"urn:schemas-upnp-org:service:"
+	  "AVTransport:1\"><InstanceID>0</InstanceID></u:GetTransportInfo>" },
+	{ AVT_SERVICE, "GetMediaInfo",
+	  "<u:GetMediaInfo xmlns:u=\"urn:schemas-upnp-org:service:"
+	  "AVTransport:1\"><InstanceID>0</InstanceID></u:GetMediaInfo>" },
+	{ RC_SERVICE, "GetVolume",
+	  "<u:GetVolume xmlns:u=\"urn:schemas-upnp-org:service:"
+	  "RenderingControl:1\"><InstanceID>0</InstanceID>"
+	  "<Channel>Master</Channel></u:GetVolume>" },
+	{ RC_SERVICE, "GetMute",
+	  "<u:GetMute xmlns:u=\"urn:schemas-upnp-org:service:"
+	  "RenderingControl:1\"><InstanceID>0</InstanceID>"
+	  "<Channel>Master</Channel></u:GetMute>" },
+	{ CM_SERVICE, "GetProtocolInfo",
+	  "<u:GetProtocolInfo xmlns:u=\"urn:schemas-upnp-org:service:"
+	  "ConnectionManager:1\"></u:GetProtocolInfo>" },
+	{ CM_SERVICE, "GetCurrentConnectionIDs",
+	  "<u:GetCurrentConnectionIDs xmlns:u=\"urn:schemas-upnp-org:"
+	  "service:ConnectionManager:1\"></u:GetCurrentConnectionIDs>" },
+};
+#define NUM_REQUESTS (int)(sizeof(kRequests) / sizeof(kRequests[0]))
+
+static gint64 now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (gint64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Send request and return time it took in nanoseconds.
+static gint64 dispatch(struct upnp_device *device,
+		       const struct bench_request *r,
+		       IXML_Document *request_doc) {
+	UpnpActionRequest *request = UpnpActionRequest_new();
+	UpnpActionRequest_strcpy_ActionName(request, r->action);
+	UpnpActionRequest_strcpy_ServiceID(request, r->service_id);
+	UpnpActionRequest_set_ActionRequest(request, request_doc);
+
+	const gint64 start = now_ns();
+	upnp_device_handle_action(device, request);
+	const gint64 elapsed = now_ns() - start;
+
+	IXML_Document *result = UpnpActionRequest_get_ActionResult(request);
+	if (result != NULL) {
+		ixmlDocument_free(result);
+		UpnpActionRequest_set_ActionResult(request, NULL);
+	}
+	UpnpActionRequest_set_ActionRequest(request, NULL);
+	UpnpActionRequest_delete(request);
+	return elapsed;
+}
+
+int main(int argc, char *argv[]) {
+	const int iterations = (argc > 1) ? atoi(argv[1]) : 20000;
+	const char *interface_name = (argc > 2) ? argv[2] : "lo";
+	if (iterations <= 0) {
+		fprintf(stderr, "usage: %s [iterations] [interface]\n",
+			argv[0]);
+		return 1;
+	}
+#if !GLIB_CHECK_VERSION(2,32,0)
+	g_thread_init(NULL);
+#endif
+	Log_init(NULL);
+
+	struct upnp_device_descriptor *descriptor =
+		upnp_renderer_descriptor("dispatch-bench", "dispatch-bench",
+					 "");
+	struct upnp_device *device =
+		upnp_device_init(descriptor, interface_name, 0);
+	if (device == NULL) {
+		fprintf(stderr, "Could not initialize device on %s\n",
+			interface_name);
+		return 1;
+	}
+	// No output: all requests are read-only.
+	upnp_transport_init(upnp_transport_get_service(), device, NULL);
+	upnp_control_init(upnp_control_get_service(), device, NULL);
+
+	IXML_Document *docs[NUM_REQUESTS];
+	gint64 total_ns[NUM_REQUESTS];
+	for (int i = 0; i < NUM_REQUESTS; ++i) {
+		docs[i] = ixmlParseBuffer(kRequests[i].body);
+		total_ns[i] = 0;
+		dispatch(device, &kRequests[i], docs[i]);  // warm up.
+	}
+
+	gint64 all_ns = 0;
+	for (int n = 0; n < iterations; ++n) {
+		const int i = n % NUM_REQUESTS;
+		const gint64 ns = dispatch(device, &kRequests[i], docs[i]);
+		total_ns[i] += ns;
+		all_ns += ns;
+	}
+
+	const int per_action = iterations / NUM_REQUESTS;
+	for (int i = 0; i < NUM_REQUESTS; ++i) {
+		printf("%-24s %8.0f ns/request\n", kRequests[i].action,
+		       per_action ? (double) total_ns[i] / per_action : 0.0);
+	}
+	printf("%-24s %8.0f ns/request (%d requests)\n", "mixed",
+	       (double) all_ns / iterations, iterations);
+
+	for (int i = 0; i < NUM_REQUESTS; ++i) {
+		ixmlDocument_free(docs[i]);
+	}
+	upnp_device_shutdown(device);
+	return 0;
+}
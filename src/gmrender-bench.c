@@ -0,0 +1,595 @@
+/* gmrender-bench - Control point simulator to load test the UPnP layer.
+ *
+ * Copyright (C) 2026 GMediaRender contributors
+ *
+ * This file is part of GMediaRender.
+ *
+ * GMediaRender is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * GMediaRender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GMediaRender; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ * -----------------
+ *
+ * Starts the renderer on the loopback interface with the null output and
+ * talks to it over HTTP the way control points do:
+ *
+ *  - a number of clients polling GetPositionInfo at a fixed rate,
+ *  - volume slider drags: bursts of SetVolume in quick succession,
+ *  - track changes: SetAVTransportURI, Play, Stop,
+ *  - subscribers that SUBSCRIBE, renew a couple of times and UNSUBSCRIBE.
+ *
+ * Reports throughput and latency percentiles per request type and the CPU
+ * time spent in the renderer.
+ *
+ * Not built by default:  make -C src gmrender-bench
+ *                        src/gmrender-bench --help
+ */
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE   // strcasestr()
+#endif
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include <glib.h>
+#include <upnp.h>
+
+#include "logging.h"
+#include "output.h"
+#include "upnp_device.h"
+#include "upnp_renderer.h"
+#include "upnp_service.h"
+#include "upnp_transport.h"
+#include "upnp_control.h"
+
+// -- Options
+static int duration_sec = 10;
+static int poll_clients = 4;
+static int poll_hz = 2;
+static int volume_burst = 20;    // SetVolume requests per slider drag.
+static int churn_per_min = 60;   // Track changes per minute.
+static int subscribers = 2;
+static gchar *interface_name = NULL;
+
+static GOptionEntry option_entries[] = {
+	{ "duration", 'd', 0, G_OPTION_ARG_INT, &duration_sec,
+	  "Seconds to run the load.", NULL },
+	{ "poll-clients", 0, 0, G_OPTION_ARG_INT, &poll_clients,
+	  "Number of clients polling GetPositionInfo.", NULL },
+	{ "poll-hz", 0, 0, G_OPTION_ARG_INT, &poll_hz,
+	  "Polling rate of each client.", NULL },
+	{ "volume-burst", 0, 0, G_OPTION_ARG_INT, &volume_burst,
+	  "SetVolume requests per slider drag (one drag per second).",
+	  NULL },
+	{ "churn", 0, 0, G_OPTION_ARG_INT, &churn_per_min,
+	  "SetAVTransportURI/Play/Stop cycles per minute.", NULL },
+	{ "subscribers", 0, 0, G_OPTION_ARG_INT, &subscribers,
+	  "Number of clients continuously subscribing and renewing.",
+	  NULL },
+	{ "interface", 'I', 0, G_OPTION_ARG_STRING, &interface_name,
+	  "Interface to run the renderer on (default: lo).", NULL },
+	{ NULL }
+};
+
+// -- Latency statistics per request type
+enum request_type {
+	REQ_GET_POSITION_INFO,
+	REQ_SET_VOLUME,
+	REQ_SET_AV_TRANSPORT_URI,
+	REQ_PLAY,
+	REQ_STOP,
+	REQ_SUBSCRIBE,
+	REQ_RENEW,
+	REQ_UNSUBSCRIBE,
+	REQ_COUNT
+};
+
+static const char *const request_names[REQ_COUNT] = {
+	[REQ_GET_POSITION_INFO] =    "GetPositionInfo",
+	[REQ_SET_VOLUME] =           "SetVolume",
+	[REQ_SET_AV_TRANSPORT_URI] = "SetAVTransportURI",
+	[REQ_PLAY] =                 "Play",
+	[REQ_STOP] =                 "Stop",
+	[REQ_SUBSCRIBE] =            "SUBSCRIBE",
+	[REQ_RENEW] =                "SUBSCRIBE (renew)",
+	[REQ_UNSUBSCRIBE] =          "UNSUBSCRIBE",
+};
+
+struct latency_stats {
+	gint64 *samples_us;
+	int count;
+	int capacity;
+	int errors;
+};
+
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct latency_stats stats[REQ_COUNT];
+static gint64 client_cpu_ns = 0;   // CPU used by our simulated clients.
+static gint64 event_sink_cpu_ns = 0;  // CPU used receiving events.
+static volatile int running = 1;
+static int events_received = 0;
+
+static void record(enum request_type type, gint64 latency_us, int ok) {
+	pthread_mutex_lock(&stats_mutex);
+	struct latency_stats *s = &stats[type];
+	if (!ok) {
+		s->errors++;
+	} else {
+		if (s->count == s->capacity) {
+			s->capacity = s->capacity ? 2 * s->capacity : 1024;
+			s->samples_us = (gint64*)
+				realloc(s->samples_us,
+					s->capacity * sizeof(gint64));
+		}
+		s->samples_us[s->count++] = latency_us;
+	}
+	pthread_mutex_unlock(&stats_mutex);
+}
+
+static int compare_gint64(const void *a, const void *b) {
+	const gint64 x = *(const gint64*) a;
+	const gint64 y = *(const gint64*) b;
+	return (x > y) - (x < y);
+}
+
+static gint64 percentile(const struct latency_stats *s, int percent) {
+	if (s->count == 0)
+		return 0;
+	return s->samples_us[(s->count - 1) * percent / 100];
+}
+
+static gint64 thread_cpu_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (gint64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static gint64 process_cpu_ns(void) {
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return ((gint64) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)
+		* 1000000000
+		+ (gint64) (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec)
+		* 1000);
+}
+
+static void client_finished(gint64 cpu_start_ns) {
+	const gint64 used = thread_cpu_ns() - cpu_start_ns;
+	pthread_mutex_lock(&stats_mutex);
+	client_cpu_ns += used;
+	pthread_mutex_unlock(&stats_mutex);
+}
+
+// Sleep until given monotonic time (microseconds) or we're done.
+static void sleep_until(gint64 when_us) {
+	const gint64 now = g_get_monotonic_time();
+	if (when_us > now && running)
+		g_usleep(when_us - now);
+}
+
+// -- Minimal HTTP client. One connection per request, as most control
+// points do.
+static const char *server_ip;
+static unsigned short server_port;
+
+// Sends request, receives the complete response into "response" (NUL
+// terminated, truncated to size). Returns the HTTP status code or -1.
+static int http_exchange(const char *request, size_t request_len,
+			 char *response, size_t size) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(server_port);
+	inet_pton(AF_INET, server_ip, &addr.sin_addr);
+	if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	size_t sent = 0;
+	while (sent < request_len) {
+		ssize_t w = send(fd, request + sent, request_len - sent,
+				 MSG_NOSIGNAL);
+		if (w <= 0) {
+			close(fd);
+			return -1;
+		}
+		sent += w;
+	}
+	size_t got = 0;
+	char discard[4096];
+	for (;;) {
+		char *buf = (got + 1 < size) ? response + got : discard;
+		size_t room = (got + 1 < size) ? size - got - 1
+			: sizeof(discard);
+		ssize_t r = recv(fd, buf, room, 0);
+		if (r <= 0)
+			break;
+		if (buf != discard)
+			got += r;
+	}
+	response[got] = '\0';
+	close(fd);
+	int status = -1;
+	if (sscanf(response, "HTTP/%*d.%*d %d", &status) != 1)
+		return -1;
+	return status;
+}
+
+static void soap_action(enum request_type type, const struct service *srv,
+			const char *action, const char *arguments) {
+	char body[2048];
+	const int body_len = snprintf(
+		body, sizeof(body),
+		"<?xml version=\"1.0\" encoding=\"utf-8\"?>\r\n"
+		"<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/"
+		"envelope/\" s:encodingStyle=\"http://schemas.xmlsoap.org/"
+		"soap/encoding/\"><s:Body><u:%s xmlns:u=\"%s\">"
+		"<InstanceID>0</InstanceID>%s</u:%s></s:Body></s:Envelope>",
+		action, srv->service_type, arguments, action);
+	char request[4096];
+	const int len = snprintf(
+		request, sizeof(request),
+		"POST %s HTTP/1.1\r\n"
+		"HOST: %s:%d\r\n"
+		"CONTENT-TYPE: text/xml; charset=\"utf-8\"\r\n"
+		"CONTENT-LENGTH: %d\r\n"
+		"SOAPACTION: \"%s#%s\"\r\n"
+		"Connection: close\r\n"
+		"\r\n%s",
+		srv->control_url, server_ip, server_port, body_len,
+		srv->service_type, action, body);
+	char response[8192];
+	const gint64 start = g_get_monotonic_time();
+	const int status = http_exchange(request, len,
+					 response, sizeof(response));
+	record(type, g_get_monotonic_time() - start, status == 200);
+}
+
+// Subscribe or renew ("sid" set) or unsubscribe. Returns SID on subscribe.
+static char *gena_request(enum request_type type, const struct service *srv,
+			  const char *sid, unsigned short callback_port) {
+	char request[1024];
+	int len;
+	if (type == REQ_SUBSCRIBE) {
+		len = snprintf(request, sizeof(request),
+			       "SUBSCRIBE %s HTTP/1.1\r\n"
+			       "HOST: %s:%d\r\n"
+			       "CALLBACK: <http://127.0.0.1:%d/>\r\n"
+			       "NT: upnp:event\r\n"
+			       "TIMEOUT: Second-300\r\n"
+			       "Connection: close\r\n\r\n",
+			       srv->event_url, server_ip, server_port,
+			       callback_port);
+	} else {
+		len = snprintf(request, sizeof(request),
+			       "%s %s HTTP/1.1\r\n"
+			       "HOST: %s:%d\r\n"
+			       "SID: %s\r\n"
+			       "%s"
+			       "Connection: close\r\n\r\n",
+			       type == REQ_RENEW ? "SUBSCRIBE" : "UNSUBSCRIBE",
+			       srv->event_url, server_ip, server_port, sid,
+			       type == REQ_RENEW
+			       ? "TIMEOUT: Second-300\r\n" : "");
+	}
+	char response[2048];
+	const gint64 start = g_get_monotonic_time();
+	const int status = http_exchange(request, len,
+					 response, sizeof(response));
+	record(type, g_get_monotonic_time() - start, status == 200);
+	if (type != REQ_SUBSCRIBE || status != 200)
+		return NULL;
+	const char *sid_header = strcasestr(response, "\nSID:");
+	if (sid_header == NULL)
+		return NULL;
+	sid_header += strlen("\nSID:");
+	while (*sid_header == ' ')
+		++sid_header;
+	return g_strndup(sid_header, strcspn(sid_header, "\r\n"));
+}
+
+// -- Event sink: accepts the NOTIFY requests sent to our subscribers.
+static int event_sink_fd = -1;
+
+static void *event_sink_thread(void *unused) {
+	(void) unused;
+	char buffer[16384];
+	static const char kOk[] =
+		"HTTP/1.1 200 OK\r\nContent-Length: 0\r\n"
+		"Connection: close\r\n\r\n";
+	for (;;) {
+		int fd = accept(event_sink_fd, NULL, NULL);
+		if (fd < 0)
+			break;
+		// Read headers and body; we just need to know when it's done.
+		size_t got = 0;
+		long content_length = -1;
+		char *body = NULL;
+		while (got < sizeof(buffer) - 1) {
+			ssize_t r = recv(fd, buffer + got,
+					 sizeof(buffer) - 1 - got, 0);
+			if (r <= 0)
+				break;
+			got += r;
+			buffer[got] = '\0';
+			if (body == NULL && (body = strstr(buffer, "\r\n\r\n"))) {
+				body += 4;
+				const char *cl = strcasestr(buffer,
+							    "\nContent-Length:");
+				if (cl)
+					content_length = atol(cl + 16);
+			}
+			if (body && (content_length < 0
+				     || buffer + got - body >= content_length))
+				break;
+		}
+		send(fd, kOk, sizeof(kOk) - 1, MSG_NOSIGNAL);
+		close(fd);
+		g_atomic_int_inc(&events_received);
+		const gint64 cpu = thread_cpu_ns();
+		pthread_mutex_lock(&stats_mutex);
+		event_sink_cpu_ns = cpu;
+		pthread_mutex_unlock(&stats_mutex);
+	}
+	return NULL;
+}
+
+static unsigned short start_event_sink(void) {
+	event_sink_fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addr_len = sizeof(addr);
+	if (bind(event_sink_fd, (struct sockaddr*) &addr, sizeof(addr)) < 0
+	    || listen(event_sink_fd, 64) < 0
+	    || getsockname(event_sink_fd, (struct sockaddr*) &addr,
+			   &addr_len) < 0) {
+		perror("event sink");
+		exit(1);
+	}
+	pthread_t thread;
+	pthread_create(&thread, NULL, event_sink_thread, NULL);
+	pthread_detach(thread);
+	return ntohs(addr.sin_port);
+}
+
+// -- Simulated control points
+static unsigned short event_sink_port;
+
+static void *poll_client(void *unused) {
+	(void) unused;
+	const gint64 cpu_start = thread_cpu_ns();
+	const gint64 interval = 1000000 / (poll_hz > 0 ? poll_hz : 1);
+	// Spread the clients over the interval.
+	gint64 next = (g_get_monotonic_time()
+		       + g_random_int_range(0, interval));
+	while (running) {
+		sleep_until(next);
+		if (!running)
+			break;
+		soap_action(REQ_GET_POSITION_INFO, upnp_transport_get_service(),
+			    "GetPositionInfo", "");
+		next += interval;
+	}
+	client_finished(cpu_start);
+	return NULL;
+}
+
+static void *volume_slider(void *unused) {
+	(void) unused;
+	const gint64 cpu_start = thread_cpu_ns();
+	gint64 next = g_get_monotonic_time();
+	int direction = 1;
+	while (running) {
+		for (int i = 0; i < volume_burst && running; ++i) {
+			char args[128];
+			const int step = (direction > 0) ? i : volume_burst - i;
+			snprintf(args, sizeof(args),
+				 "<Channel>Master</Channel>"
+				 "<DesiredVolume>%d</DesiredVolume>",
+				 (30 + step) % 101);
+			soap_action(REQ_SET_VOLUME, upnp_control_get_service(),
+				    "SetVolume", args);
+		}
+		direction = -direction;
+		next += 1000000;
+		sleep_until(next);
+	}
+	client_finished(cpu_start);
+	return NULL;
+}
+
+static void *track_churn(void *unused) {
+	(void) unused;
+	const gint64 cpu_start = thread_cpu_ns();
+	const struct service *avt = upnp_transport_get_service();
+	const gint64 interval = 60000000 / churn_per_min;
+	gint64 next = g_get_monotonic_time();
+	for (int track = 0; running; ++track) {
+		char args[512];
+		snprintf(args, sizeof(args),
+			 "<CurrentURI>http://127.0.0.1:9/track-%d.mp3"
+			 "</CurrentURI><CurrentURIMetaData>&lt;DIDL-Lite "
+			 "xmlns=&quot;urn:schemas-upnp-org:metadata-1-0/"
+			 "DIDL-Lite/&quot; xmlns:dc=&quot;http://purl.org/dc/"
+			 "elements/1.1/&quot;&gt;&lt;item&gt;&lt;dc:title&gt;"
+			 "Track %d&lt;/dc:title&gt;&lt;/item&gt;"
+			 "&lt;/DIDL-Lite&gt;</CurrentURIMetaData>",
+			 track, track);
+		soap_action(REQ_SET_AV_TRANSPORT_URI, avt,
+			    "SetAVTransportURI", args);
+		soap_action(REQ_PLAY, avt, "Play", "<Speed>1</Speed>");
+		soap_action(REQ_STOP, avt, "Stop", "");
+		next += interval;
+		sleep_until(next);
+	}
+	client_finished(cpu_start);
+	return NULL;
+}
+
+static void *subscriber(void *unused) {
+	(void) unused;
+	const gint64 cpu_start = thread_cpu_ns();
+	struct service *services[] = {
+		upnp_transport_get_service(),
+		upnp_control_get_service(),
+	};
+	for (int round = 0; running; ++round) {
+		const struct service *srv = services[round % 2];
+		char *sid = gena_request(REQ_SUBSCRIBE, srv, NULL,
+					 event_sink_port);
+		if (sid == NULL) {
+			g_usleep(10000);
+			continue;
+		}
+		for (int i = 0; i < 5 && running; ++i) {
+			gena_request(REQ_RENEW, srv, sid, 0);
+		}
+		gena_request(REQ_UNSUBSCRIBE, srv, sid, 0);
+		g_free(sid);
+	}
+	client_finished(cpu_start);
+	return NULL;
+}
+
+static gpointer main_loop_thread(gpointer loop) {
+	g_main_loop_run((GMainLoop*) loop);
+	return NULL;
+}
+
+static void report(double seconds, gint64 renderer_cpu_ns) {
+	int total_requests = 0;
+	printf("\n%-20s %8s %6s %9s %9s %9s %9s\n", "request", "count",
+	       "errors", "req/s", "p50 [us]", "p99 [us]", "max [us]");
+	for (int i = 0; i < REQ_COUNT; ++i) {
+		struct latency_stats *s = &stats[i];
+		if (s->count == 0 && s->errors == 0)
+			continue;
+		qsort(s->samples_us, s->count, sizeof(gint64), compare_gint64);
+		printf("%-20s %8d %6d %9.1f %9" G_GINT64_FORMAT
+		       " %9" G_GINT64_FORMAT " %9" G_GINT64_FORMAT "\n",
+		       request_names[i], s->count, s->errors,
+		       s->count / seconds, percentile(s, 50),
+		       percentile(s, 99), percentile(s, 100));
+		total_requests += s->count;
+	}
+	printf("\n%d requests in %.1fs: %.1f req/s; %d events received\n",
+	       total_requests, seconds, total_requests / seconds,
+	       g_atomic_int_get(&events_received));
+	printf("renderer CPU: %.2fs (%.1f%% of one core, %.1fus/request)\n",
+	       renderer_cpu_ns / 1e9, 100.0 * renderer_cpu_ns / 1e9 / seconds,
+	       total_requests ? renderer_cpu_ns / 1e3 / total_requests : 0.0);
+}
+
+int main(int argc, char *argv[]) {
+	GOptionContext *ctx = g_option_context_new(
+		"- load test the gmediarender UPnP layer over loopback");
+	g_option_context_add_main_entries(ctx, option_entries, NULL);
+	output_add_options(ctx);  // Only the --nullout-* ones matter here.
+	GError *err = NULL;
+	if (!g_option_context_parse(ctx, &argc, &argv, &err)) {
+		fprintf(stderr, "%s\n", err->message);
+		return 1;
+	}
+	if (duration_sec <= 0 || churn_per_min <= 0) {
+		fprintf(stderr, "--duration and --churn need to be positive\n");
+		return 1;
+	}
+#if !GLIB_CHECK_VERSION(2,32,0)
+	g_thread_init(NULL);
+#endif
+	Log_init(NULL);
+
+	struct upnp_device_descriptor *descriptor =
+		upnp_renderer_descriptor("gmrender-bench", "gmrender-bench",
+					 "");
+	struct output *output = NULL;
+	if (output_init("null") != 0
+	    || (output = output_new(NULL)) == NULL) {
+		fprintf(stderr, "Could not initialize null output.\n");
+		return 1;
+	}
+	struct upnp_device *device =
+		upnp_device_init(descriptor,
+				 interface_name ? interface_name : "lo", 0);
+	if (device == NULL) {
+		fprintf(stderr, "Could not start renderer.\n");
+		return 1;
+	}
+	upnp_transport_init(upnp_transport_get_service(), device, output);
+	upnp_control_init(upnp_control_get_service(), device, output);
+	server_ip = UpnpGetServerIpAddress();
+	server_port = UpnpGetServerPort();
+	printf("Renderer at http://%s:%d/\n", server_ip, server_port);
+
+	GMainLoop *loop = g_main_loop_new(NULL, FALSE);
+	GThread *loop_thread = g_thread_new("main-loop", main_loop_thread,
+					    loop);
+	event_sink_port = start_event_sink();
+
+	printf("Load: %d pollers at %d Hz, volume bursts of %d/s, "
+	       "%d track changes/min, %d subscribers; %ds\n",
+	       poll_clients, poll_hz, volume_burst, churn_per_min,
+	       subscribers, duration_sec);
+
+	const int thread_count = poll_clients + subscribers + 2;
+	pthread_t *threads = (pthread_t*) calloc(thread_count,
+						 sizeof(pthread_t));
+	int t = 0;
+	const gint64 cpu_start = process_cpu_ns();
+	const gint64 start = g_get_monotonic_time();
+	for (int i = 0; i < poll_clients; ++i)
+		pthread_create(&threads[t++], NULL, poll_client, NULL);
+	for (int i = 0; i < subscribers; ++i)
+		pthread_create(&threads[t++], NULL, subscriber, NULL);
+	if (volume_burst > 0)
+		pthread_create(&threads[t++], NULL, volume_slider, NULL);
+	pthread_create(&threads[t++], NULL, track_churn, NULL);
+
+	g_usleep((gulong) duration_sec * G_USEC_PER_SEC);
+	running = 0;
+	for (int i = 0; i < t; ++i)
+		pthread_join(threads[i], NULL);
+	const double seconds = (g_get_monotonic_time() - start) / 1e6;
+	const gint64 cpu_used = process_cpu_ns() - cpu_start;
+
+	pthread_mutex_lock(&stats_mutex);
+	const gint64 renderer_cpu = cpu_used - client_cpu_ns - event_sink_cpu_ns;
+	pthread_mutex_unlock(&stats_mutex);
+	report(seconds, renderer_cpu);
+
+	g_main_loop_quit(loop);
+	g_thread_join(loop_thread);
+	upnp_device_shutdown(device);
+	free(threads);
+	return 0;
+}
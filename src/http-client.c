@@ -0,0 +1,253 @@
+/* http-client - Minimal HTTP client for fetching media.
+ *
+ * Copyright (C) 2026 GMediaRender contributors
+ *
+ * This file is part of GMediaRender.
+ *
+ * GMediaRender is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * GMediaRender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GMediaRender; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+#endif
+
+#include "http-client.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "logging.h"
+
+static const int kMaxRedirects = 5;
+static const int kSocketTimeoutSeconds = 30;
+
+static void replace_string(char **dest, const char *value) {
+	free(*dest);
+	*dest = (value != NULL) ? strdup(value) : NULL;
+}
+
+
+void http_reader_init(struct http_reader *r, int fd) {
+	r->fd = fd;
+	r->len = r->pos = 0;
+}
+
+int http_read_line(struct http_reader *r, char *line, size_t size) {
+	size_t out = 0;
+	for (;;) {
+		if (r->pos == r->len) {
+			ssize_t got = read(r->fd, r->buf, sizeof(r->buf));
+			if (got <= 0) return -1;
+			r->len = got;
+			r->pos = 0;
+		}
+		const char c = r->buf[r->pos++];
+		if (c == '\n') break;
+		if (c == '\r') continue;
+		if (out + 1 >= size) return -1;
+		line[out++] = c;
+	}
+	line[out] = '\0';
+	return 0;
+}
+
+ssize_t http_read_body(struct http_reader *r, char *buf, size_t size) {
+	if (r->pos < r->len) {
+		size_t n = r->len - r->pos;
+		if (n > size) n = size;
+		memcpy(buf, r->buf + r->pos, n);
+		r->pos += n;
+		return n;
+	}
+	return read(r->fd, buf, size);
+}
+
+int http_write_all(int fd, const char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t w = send(fd, buf, len, MSG_NOSIGNAL);
+		if (w <= 0) {
+			if (w < 0 && errno == EINTR) continue;
+			return -1;
+		}
+		buf += w;
+		len -= w;
+	}
+	return 0;
+}
+
+void http_set_socket_timeout(int fd) {
+	struct timeval tv = { kSocketTimeoutSeconds, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+void http_response_clear(struct http_response *resp) {
+	if (resp->reader.fd >= 0) close(resp->reader.fd);
+	resp->reader.fd = -1;
+	free(resp->etag);
+	free(resp->last_modified);
+	free(resp->content_type);
+	free(resp->location);
+	resp->etag = resp->last_modified = NULL;
+	resp->content_type = resp->location = NULL;
+}
+
+static int split_http_url(const char *url, char *host, size_t host_size,
+			  char *port, size_t port_size, const char **path) {
+	if (strncasecmp(url, "http://", 7) != 0)
+		return -1;
+	const char *start = url + 7;
+	const char *end = start + strcspn(start, "/?#");
+	*path = (*end == '/') ? end : "/";
+	const char *colon = memchr(start, ':', end - start);
+	const char *host_end = colon ? colon : end;
+	if (host_end == start || (size_t)(host_end - start) >= host_size)
+		return -1;
+	memcpy(host, start, host_end - start);
+	host[host_end - start] = '\0';
+	if (colon) {
+		if ((size_t)(end - colon - 1) >= port_size) return -1;
+		memcpy(port, colon + 1, end - colon - 1);
+		port[end - colon - 1] = '\0';
+	} else {
+		snprintf(port, port_size, "80");
+	}
+	return 0;
+}
+
+static int connect_to(const char *host, const char *port) {
+	struct addrinfo hints, *addrs = NULL;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &addrs) != 0)
+		return -1;
+	int fd = -1;
+	for (struct addrinfo *a = addrs; a != NULL; a = a->ai_next) {
+		fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if (fd < 0) continue;
+		http_set_socket_timeout(fd);
+		if (connect(fd, a->ai_addr, a->ai_addrlen) == 0) break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(addrs);
+	return fd;
+}
+
+// We speak HTTP/1.0, so that we never have to deal with chunked encoding.
+int http_request(const char *uri, const char *method, int64_t from,
+		 struct http_response *resp) {
+	char *current = strdup(uri);
+	int result = -1;
+	memset(resp, 0, sizeof(*resp));
+	resp->reader.fd = -1;
+	for (int redirect = 0; redirect <= kMaxRedirects; ++redirect) {
+		char host[256], port[16];
+		const char *path;
+		if (split_http_url(current, host, sizeof(host),
+				   port, sizeof(port), &path) != 0)
+			break;
+		const int fd = connect_to(host, port);
+		if (fd < 0) {
+			Log_error("http", "Can't connect to %s:%s", host, port);
+			break;
+		}
+		http_reader_init(&resp->reader, fd);
+		char *request = NULL;
+		const int len = asprintf(&request,
+					 "%s %s HTTP/1.0\r\n"
+					 "Host: %s\r\n"
+					 "Range: bytes=%" PRId64 "-\r\n"
+					 "User-Agent: gmediarender\r\n"
+					 "\r\n", method, path, host, from);
+		const int sent =
+			(len > 0) ? http_write_all(fd, request, len) : -1;
+		free(request);
+		if (sent != 0)
+			break;
+
+		char line[4096];
+		int status = 0;
+		if (http_read_line(&resp->reader, line, sizeof(line)) != 0
+		    || sscanf(line, "HTTP/%*d.%*d %d", &status) != 1)
+			break;
+		resp->status = status;
+		resp->content_length = -1;
+		resp->total_length = -1;
+		resp->range_start = 0;
+		while (http_read_line(&resp->reader, line, sizeof(line)) == 0
+		       && line[0] != '\0') {
+			char *value = strchr(line, ':');
+			if (value == NULL) continue;
+			*value++ = '\0';
+			while (*value == ' ') ++value;
+			if (strcasecmp(line, "Content-Length") == 0) {
+				resp->content_length = strtoll(value, NULL, 10);
+			} else if (strcasecmp(line, "Content-Range") == 0) {
+				int64_t start, end, total;
+				if (sscanf(value, "bytes %" SCNd64 "-%" SCNd64
+					   "/%" SCNd64, &start, &end,
+					   &total) == 3) {
+					resp->range_start = start;
+					resp->total_length = total;
+				}
+			} else if (strcasecmp(line, "ETag") == 0) {
+				replace_string(&resp->etag, value);
+			} else if (strcasecmp(line, "Last-Modified") == 0) {
+				replace_string(&resp->last_modified, value);
+			} else if (strcasecmp(line, "Content-Type") == 0) {
+				replace_string(&resp->content_type, value);
+			} else if (strcasecmp(line, "Location") == 0) {
+				replace_string(&resp->location, value);
+			}
+		}
+		if (status >= 300 && status < 400 && resp->location) {
+			free(current);
+			current = resp->location;
+			resp->location = NULL;
+			http_response_clear(resp);
+			continue;
+		}
+		if (status == 200 && resp->content_length >= 0) {
+			// Server ignored our range; that is fine, the
+			// caller skips what it doesn't need.
+			resp->total_length = resp->content_length;
+		}
+		result = (status == 200 || status == 206) ? 0 : -1;
+		break;
+	}
+	free(current);
+	if (result != 0) {
+		http_response_clear(resp);
+	}
+	return result;
+}
+
@@ -0,0 +1,76 @@
+/* http-client - Minimal HTTP client for fetching media.
+ *
+ * Copyright (C) 2026 GMediaRender contributors
+ *
+ * This file is part of GMediaRender.
+ *
+ * GMediaRender is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * GMediaRender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GMediaRender; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ * -----------------
+ *
+ * Just enough HTTP to talk to media servers: plain http:// URLs, range
+ * requests and redirects. Used by the media cache and the outputs that
+ * fetch streams themselves.
+ */
+#ifndef _HTTP_CLIENT_H
+#define _HTTP_CLIENT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Buffered reading from a socket.
+struct http_reader {
+	int fd;
+	char buf[8192];
+	size_t len;
+	size_t pos;
+};
+
+void http_reader_init(struct http_reader *r, int fd);
+
+// Read a line, stripping CRLF. Returns 0 on success, -1 on EOF or overlong.
+int http_read_line(struct http_reader *r, char *line, size_t size);
+
+// Read body data, first from what is left in the buffer.
+ssize_t http_read_body(struct http_reader *r, char *buf, size_t size);
+
+int http_write_all(int fd, const char *buf, size_t len);
+void http_set_socket_timeout(int fd);
+
+// Response from the origin server.
+struct http_response {
+	struct http_reader reader;
+	int status;
+	int64_t content_length;    // of this response, -1 if unknown.
+	int64_t range_start;       // first byte delivered.
+	int64_t total_length;      // of the resource, -1 if unknown.
+	char *etag;
+	char *last_modified;
+	char *content_type;
+	char *location;
+};
+
+// Send a request for the resource, starting at byte 'from', following
+// redirects. Returns 0 if we got a successful response; the body can then
+// be read from resp->reader. The server might ignore the range and answer
+// with status 200; it is up to the caller to skip what it doesn't need.
+int http_request(const char *uri, const char *method, int64_t from,
+		 struct http_response *resp);
+
+// Close connection and free the response fields.
+void http_response_clear(struct http_response *resp);
+
+#endif /* _HTTP_CLIENT_H */
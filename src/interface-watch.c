@@ -0,0 +1,165 @@
+/* interface-watch - Wait for a network interface to become usable.
+ *
+ * Copyright (C) 2026 GMediaRender contributors
+ *
+ * This file is part of GMediaRender.
+ *
+ * GMediaRender is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * GMediaRender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GMediaRender; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include "interface-watch.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#  include <errno.h>
+#  include <net/if.h>
+#  include <poll.h>
+#  include <sys/socket.h>
+#  include <unistd.h>
+#  include <linux/netlink.h>
+#  include <linux/rtnetlink.h>
+#endif
+
+#include <glib.h>
+
+#include "logging.h"
+
+#ifdef __linux__
+
+struct interface_watch {
+	int fd;
+	char *interface_name;  // NULL: any but loopback.
+};
+
+struct interface_watch *InterfaceWatch_new(const char *interface_name) {
+	const int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC,
+			      NETLINK_ROUTE);
+	if (fd < 0) {
+		Log_error("netlink", "Can't open netlink socket: %s",
+			  strerror(errno));
+		return NULL;
+	}
+	struct sockaddr_nl addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		Log_error("netlink", "Can't subscribe to interface changes: %s",
+			  strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	struct interface_watch *watch = malloc(sizeof(*watch));
+	watch->fd = fd;
+	watch->interface_name = interface_name ? strdup(interface_name) : NULL;
+	return watch;
+}
+
+static int is_watched(const struct interface_watch *watch, int index) {
+	char name[IF_NAMESIZE];
+	if (if_indextoname(index, name) == NULL)
+		return 0;
+	if (watch->interface_name != NULL)
+		return strcmp(name, watch->interface_name) == 0;
+	return 1;
+}
+
+// Returns 1 if the message tells us the interface might be usable now.
+static int is_relevant(const struct interface_watch *watch,
+		       const struct nlmsghdr *msg) {
+	if (msg->nlmsg_type == RTM_NEWADDR) {
+		const struct ifaddrmsg *ifa = NLMSG_DATA(msg);
+		// IPv6 addresses can't be bound to until duplicate address
+		// detection is done; there will be another message then.
+		if (ifa->ifa_scope == RT_SCOPE_HOST
+		    || (ifa->ifa_flags & IFA_F_TENTATIVE))
+			return 0;
+		return is_watched(watch, ifa->ifa_index);
+	}
+	if (msg->nlmsg_type == RTM_NEWLINK) {
+		const struct ifinfomsg *ifi = NLMSG_DATA(msg);
+		if (!(ifi->ifi_flags & IFF_UP)
+		    || (ifi->ifi_flags & IFF_LOOPBACK))
+			return 0;
+		return is_watched(watch, ifi->ifi_index);
+	}
+	return 0;
+}
+
+int InterfaceWatch_wait(struct interface_watch *watch, int timeout_ms) {
+	const gint64 deadline = g_get_monotonic_time() + timeout_ms * 1000LL;
+	for (;;) {
+		const gint64 remaining_ms =
+			(deadline - g_get_monotonic_time()) / 1000;
+		if (remaining_ms <= 0)
+			return 0;
+		struct pollfd pfd = { watch->fd, POLLIN, 0 };
+		const int ready = poll(&pfd, 1, remaining_ms);
+		if (ready < 0 && errno != EINTR)
+			return 0;
+		if (ready <= 0)
+			continue;
+
+		char buf[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+		const ssize_t len = recv(watch->fd, buf, sizeof(buf), 0);
+		if (len < 0) {
+			// ENOBUFS: we missed messages; might as well retry.
+			if (errno == ENOBUFS)
+				return 1;
+			continue;
+		}
+		int size = len;
+		for (const struct nlmsghdr *msg = (const struct nlmsghdr *) buf;
+		     NLMSG_OK(msg, size); msg = NLMSG_NEXT(msg, size)) {
+			if (is_relevant(watch, msg))
+				return 1;
+		}
+	}
+}
+
+void InterfaceWatch_free(struct interface_watch *watch) {
+	if (watch == NULL)
+		return;
+	close(watch->fd);
+	free(watch->interface_name);
+	free(watch);
+}
+
+#else  // !__linux__
+
+struct interface_watch *InterfaceWatch_new(const char *interface_name) {
+	(void) interface_name;
+	return NULL;
+}
+
+int InterfaceWatch_wait(struct interface_watch *watch, int timeout_ms) {
+	(void) watch;
+	g_usleep(timeout_ms * 1000LL);
+	return 0;
+}
+
+void InterfaceWatch_free(struct interface_watch *watch) {
+	(void) watch;
+}
+
+#endif
@@ -0,0 +1,52 @@
+/* interface-watch - Wait for a network interface to become usable.
+ *
+ * Copyright (C) 2026 GMediaRender contributors
+ *
+ * This file is part of GMediaRender.
+ *
+ * GMediaRender is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * GMediaRender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GMediaRender; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ * -----------------
+ *
+ * At boot, we might be started before the network is up. Instead of
+ * polling, we listen on a netlink socket for links coming up and addresses
+ * being assigned, so that we can retry right away. Only on Linux; elsewhere
+ * there is no watch and callers fall back to sleeping.
+ *
+ * To try it out with a dummy interface in a network namespace:
+ *   ip netns add gmr
+ *   ip netns exec gmr ip link add gmr0 type dummy
+ *   ip netns exec gmr gmediarender -I gmr0 --startup-report &
+ *   ip netns exec gmr ip addr add 10.42.0.1/24 dev gmr0
+ *   ip netns exec gmr ip link set gmr0 up
+ */
+#ifndef _INTERFACE_WATCH_H
+#define _INTERFACE_WATCH_H
+
+struct interface_watch;
+
+// Watch the given interface, or any interface but loopback if NULL. Create
+// before checking if the interface is usable, so that no change is missed.
+// Returns NULL if not supported on this system.
+struct interface_watch *InterfaceWatch_new(const char *interface_name);
+
+// Wait up to timeout_ms for the interface to come up or get an address.
+// Returns 1 if it did, 0 on timeout.
+int InterfaceWatch_wait(struct interface_watch *watch, int timeout_ms);
+
+void InterfaceWatch_free(struct interface_watch *watch);
+
+#endif /* _INTERFACE_WATCH_H */
@@ -0,0 +1,271 @@
+/* lastchange-bench - Microbenchmark for assembling LastChange events.
+ *
+ * Copyright (C) 2026 GMediaRender contributors
+ *
+ * This file is part of GMediaRender.
+ *
+ * GMediaRender is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * GMediaRender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GMediaRender; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ * -----------------
+ *
+ * Compares building the escaped LastChange payload via an ixml DOM plus
+ * xmlescape() (how it used to be done) with the streaming
+ * UPnPLastChangeBuilder, writing variables through the event plan of their
+ * container like the collector does. Reports time and heap allocations per
+ * event.
+ * Also reports the allocations of variable changes while playing.
+ *
+ * Not built by default:  make -C src lastchange-bench
+ *                        src/lastchange-bench [iterations]
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "upnp_device.h"
+#include "upnp_service.h"
+#include "variable-container.h"
+#include "xmldoc.h"
+#include "xmlescape.h"
+
+#define LASTCHANGE_NS "urn:schemas-upnp-org:metadata-1-0/AVT/"
+
+// Count every allocation, including those done inside libixml and glib.
+// Only possible where we can forward to the real allocator.
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long allocations = 0;
+
+void *malloc(size_t size) {
+	++allocations;
+	return __libc_malloc(size);
+}
+void *calloc(size_t nmemb, size_t size) {
+	++allocations;
+	return __libc_calloc(nmemb, size);
+}
+void *realloc(void *ptr, size_t size) {
+	++allocations;
+	return __libc_realloc(ptr, size);
+}
+#  define HAVE_ALLOCATION_COUNT 1
+#else
+static unsigned long allocations = 0;
+#  define HAVE_ALLOCATION_COUNT 0
+#endif
+
+// The collector in variable-container.c wants to send events; we don't.
+int upnp_device_notify(struct upnp_device *device,
+                       const char *serviceID,
+                       const char **varnames,
+                       const char **varvalues, int varcount) {
+	return 0;
+}
+
+// A typical event when a new track starts.
+static const char *const kNames[] = {
+	"TransportState",
+	"CurrentTrackDuration",
+	"RelativeTimePosition",
+	"Volume",
+	"CurrentTrackMetaData",
+};
+static const char *const kValues[] = {
+	"PLAYING",
+	"0:04:12",
+	"0:00:00",
+	"42",
+	"<DIDL-Lite xmlns=\"urn:schemas-upnp-org:metadata-1-0/DIDL-Lite/\" "
+	"xmlns:dc=\"http://purl.org/dc/elements/1.1/\" "
+	"xmlns:upnp=\"urn:schemas-upnp-org:metadata-1-0/upnp/\">"
+	"<item id=\"64$1$2\" parentID=\"64$1\" restricted=\"1\">"
+	"<dc:title>Rock &amp; Roll Ain't Noise Pollution</dc:title>"
+	"<upnp:artist>AC/DC</upnp:artist>"
+	"<upnp:album>Back in Black</upnp:album>"
+	"<upnp:class>object.item.audioItem.musicTrack</upnp:class>"
+	"<res protocolInfo=\"http-get:*:audio/flac:*\" duration=\"0:04:12\">"
+	"http://192.168.1.2:8200/MediaItems/1234.flac</res>"
+	"</item></DIDL-Lite>",
+};
+#define NUM_VARS (int)(sizeof(kNames) / sizeof(kNames[0]))
+
+// The same variables in a container, as the services have them.
+static const struct var_meta kEventVars[NUM_VARS] = {
+	{ 0, "TransportState", "STOPPED", EV_NO, DATATYPE_STRING,
+	  NULL, NULL },
+	{ 1, "CurrentTrackDuration", "0:00:00", EV_NO, DATATYPE_STRING,
+	  NULL, NULL },
+	{ 2, "RelativeTimePosition", "0:00:00", EV_NO, DATATYPE_STRING,
+	  NULL, NULL },
+	{ 3, "Volume", "0", EV_NO, DATATYPE_UI2, NULL, NULL },
+	{ 4, "CurrentTrackMetaData", "", EV_NO, DATATYPE_STRING,
+	  NULL, NULL },
+};
+
+// The way it was done before: DOM, serialize, escape.
+static size_t dom_event(void) {
+	struct xmldoc *doc = xmldoc_new();
+	struct xmlelement *top =
+		xmldoc_new_topelement(doc, "Event", LASTCHANGE_NS);
+	struct xmlelement *instance =
+		add_attributevalue_element(doc, top, "InstanceID", "val", "0");
+	for (int i = 0; i < NUM_VARS; ++i) {
+		struct xmlelement *e =
+			add_attributevalue_element(doc, instance, kNames[i],
+						   "val", kValues[i]);
+		if (strcmp(kNames[i], "Volume") == 0) {
+			xmlelement_set_attribute(doc, e, "channel", "Master");
+		}
+	}
+	char *xml = xmldoc_tostring(doc);
+	xmldoc_free(doc);
+	char *escaped = xmlescape(xml, 0);
+	const size_t len = strlen(escaped);
+	free(xml);
+	free(escaped);
+	return len;
+}
+
+static size_t builder_event(upnp_last_change_builder_t *builder,
+			    variable_container_t *event_vars) {
+	const char *escaped;
+	for (int i = 0; i < NUM_VARS; ++i) {
+		UPnPLastChangeBuilder_add_variable(builder, event_vars, i,
+						   kValues[i]);
+	}
+	UPnPLastChangeBuilder_get_xml(builder, &escaped);
+	const size_t len = strlen(escaped);
+	UPnPLastChangeBuilder_reset(builder);
+	return len;
+}
+
+// Steady state while playing: the position changes every second, the
+// metadata with every new track (here: every 200 seconds).
+static const char *kStates[] = { "STOPPED", "PLAYING", NULL };
+static const struct var_meta kPlayingVars[] = {
+	{ 0, "TransportState", "STOPPED", EV_YES, DATATYPE_STRING,
+	  kStates, NULL },
+	{ 1, "RelativeTimePosition", "00:00:00", EV_NO, DATATYPE_STRING,
+	  NULL, NULL },
+	{ 2, "CurrentTrackMetaData", "", EV_YES, DATATYPE_STRING,
+	  NULL, NULL },
+};
+
+static void play_seconds(variable_container_t *vars, int from, int count) {
+	char position[16];
+	char meta[1024];
+	for (int i = from; i < from + count; ++i) {
+		snprintf(position, sizeof(position), "%02d:%02d:%02d",
+			 i / 3600, i / 60 % 60, i % 60);
+		VariableContainer_change(vars, 1, position);
+		if (i % 200 == 0) {
+			snprintf(meta, sizeof(meta), "%s<!-- track %d -->",
+				 kValues[4], i / 200);
+			VariableContainer_change(vars, 0, "STOPPED");
+			VariableContainer_change(vars, 2, meta);
+			VariableContainer_change(vars, 0, "PLAYING");
+		}
+	}
+}
+
+static void report(const char *name, int iterations,
+		   gint64 elapsed_us, unsigned long allocs) {
+	printf("%-20s %8.0f ns/event", name,
+	       1000.0 * elapsed_us / iterations);
+	if (HAVE_ALLOCATION_COUNT) {
+		printf(" %8.1f allocations/event",
+		       (double) allocs / iterations);
+	}
+	printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+	const int iterations = (argc > 1) ? atoi(argv[1]) : 100000;
+	if (iterations <= 0) {
+		fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+		return 1;
+	}
+	upnp_last_change_builder_t *builder =
+		UPnPLastChangeBuilder_new(LASTCHANGE_NS);
+	variable_container_t *event_vars =
+		VariableContainer_new(NUM_VARS, kEventVars);
+
+	// Make sure the streamed document is actually well-formed.
+	for (int i = 0; i < NUM_VARS; ++i) {
+		UPnPLastChangeBuilder_add_variable(builder, event_vars, i,
+						   kValues[i]);
+	}
+	struct xmldoc *check =
+		xmldoc_parsexml(UPnPLastChangeBuilder_get_xml(builder, NULL));
+	if (check == NULL) {
+		fprintf(stderr, "Builder produced invalid XML:\n%s\n",
+			UPnPLastChangeBuilder_get_xml(builder, NULL));
+		return 1;
+	}
+	xmldoc_free(check);
+	UPnPLastChangeBuilder_reset(builder);
+
+	size_t dom_bytes = 0, builder_bytes = 0;
+	unsigned long start_allocs = allocations;
+	gint64 start = g_get_monotonic_time();
+	for (int i = 0; i < iterations; ++i) {
+		dom_bytes += dom_event();
+	}
+	report("dom+xmlescape", iterations, g_get_monotonic_time() - start,
+	       allocations - start_allocs);
+
+	start_allocs = allocations;
+	start = g_get_monotonic_time();
+	for (int i = 0; i < iterations; ++i) {
+		builder_bytes += builder_event(builder, event_vars);
+	}
+	report("streaming builder", iterations,
+	       g_get_monotonic_time() - start, allocations - start_allocs);
+
+	printf("payload: %zu bytes (dom), %zu bytes (streaming)\n",
+	       dom_bytes / iterations, builder_bytes / iterations);
+	UPnPLastChangeBuilder_delete(builder);
+	VariableContainer_delete(event_vars);
+
+	variable_container_t *vars =
+		VariableContainer_new(3, kPlayingVars);
+	play_seconds(vars, 0, 1000);  // Warm up: first two tracks.
+	struct variable_container_stats stats;
+	VariableContainer_get_stats(vars, &stats);
+	const unsigned long start_changes = stats.changes;
+	const unsigned long start_var_allocs = stats.allocations;
+	start_allocs = allocations;
+	start = g_get_monotonic_time();
+	play_seconds(vars, 1000, iterations);
+	VariableContainer_get_stats(vars, &stats);
+	const int changes = stats.changes - start_changes;
+	report("variable change", changes, g_get_monotonic_time() - start,
+	       allocations - start_allocs);
+	printf("variable container: %lu allocations in %d changes\n",
+	       stats.allocations - start_var_allocs, changes);
+	VariableContainer_delete(vars);
+	return 0;
+}
@@ -54,6 +54,7 @@
 #include "git-version.h"
 #include "logging.h"
 #include "output.h"
+#include "startup-profile.h"
 #include "upnp_service.h"
 #include "upnp_control.h"
 #include "upnp_device.h"
@@ -68,9 +69,11 @@ static gboolean show_control_scpd = FALSE;
 static gboolean show_transport_scpd = FALSE;
 static gboolean show_outputs = FALSE;
 static gboolean daemon_mode = FALSE;
+static gboolean startup_report = FALSE;
 
 static const gchar *interface_name = NULL;
 static int listen_port = 49494;
+static int event_moderation_ms = 200;
 
 #ifdef GMRENDER_UUID
 // Compile-time uuid.
@@ -83,6 +86,7 @@ static const gchar *output = NULL;
 static const gchar *pid_file = NULL;
 static const gchar *log_file = NULL;
 static const gchar *mime_filter = NULL;
+static gchar **zone_specs = NULL;
 
 /* Generic GMediaRender options */
 static GOptionEntry option_entries[] = {
@@ -95,6 +99,9 @@ static GOptionEntry option_entries[] = {
 	{ "port", 'p', 0, G_OPTION_ARG_INT, &listen_port,
 	  "Port to listen to; [49152..65535] (libupnp does not use "
 	  "SO_REUSEADDR, so might increment)", NULL },
+	{ "event-moderation", 0, 0, G_OPTION_ARG_INT, &event_moderation_ms,
+	  "Minimum milliseconds between LastChange events; changes within "
+	  "that time are merged into one event. 0 to disable.", NULL },
 	{ "uuid", 'u', 0, G_OPTION_ARG_STRING, &uuid,
 	  "UUID to advertise", NULL },
 	{ "friendly-name", 'f', 0, G_OPTION_ARG_STRING, &friendly_name,
@@ -108,6 +115,11 @@ static GOptionEntry option_entries[] = {
 	{ "mime-filter", 0, 0, G_OPTION_ARG_STRING, &mime_filter,
 	  "Filter the supported media types. "
 		"e.g. Audio only: '--mime-filter audio'. Disable FLAC: '--mime-filter -audio/x-flac'.", NULL },
+	{ "zone", 0, 0, G_OPTION_ARG_STRING_ARRAY, &zone_specs,
+	  "Run a renderer with this friendly name, playing on SINK if given "
+	  "(e.g. 'alsasink device=hw:1' for the gst output). Can be given "
+	  "several times to serve several zones from one process; replaces "
+	  "the default renderer.", "NAME[=SINK]" },
 	{ "logfile", 0, 0, G_OPTION_ARG_STRING, &log_file,
 	  "Debug log filename. Use 'stdout' or 'stderr' to log to console.", NULL },
 	{ "list-outputs", 0, 0, G_OPTION_ARG_NONE, &show_outputs,
@@ -120,6 +132,9 @@ static GOptionEntry option_entries[] = {
 	  "Dump Rendering Control service description XML and exit.", NULL },
 	{ "dump-transport-scpd", 0, 0, G_OPTION_ARG_NONE, &show_transport_scpd,
 	  "Dump A/V Transport service description XML and exit.", NULL },
+	{ "startup-report", 0, 0, G_OPTION_ARG_NONE, &startup_report,
+	  "Print how long each phase of startup took and exit once the "
+	  "device is advertised.", NULL },
 	{ NULL }
 };
 
@@ -198,6 +213,53 @@ static void log_variable_change(void *userdata, int var_num,
 		 variable_value, needs_newline ? "\n" : "");
 }
 
+// A renderer served by this process; only one unless --zone is given.
+struct zone {
+	const char *name;
+	const char *uuid;
+	const char *sink;  // NULL for the one configured for the output.
+	struct upnp_device_descriptor *descriptor;
+	struct output *output;
+};
+
+// Each zone needs its own, stable UUID: derive it from the configured one
+// and the zone name.
+static char *zone_uuid(const char *base_uuid, const char *name) {
+	char *seed = g_strdup_printf("%s/%s", base_uuid, name);
+	gchar *sha1 = g_compute_checksum_for_string(G_CHECKSUM_SHA1, seed, -1);
+	char *result = g_strdup_printf("%.8s-%.4s-%.4s-%.4s-%.12s",
+				       sha1, sha1 + 8, sha1 + 12, sha1 + 16,
+				       sha1 + 20);
+	g_free(sha1);
+	g_free(seed);
+	return result;
+}
+
+// Returns the number of zones from the --zone options, or the default
+// renderer if there are none.
+static int parse_zones(struct zone **result) {
+	const int count = zone_specs ? (int) g_strv_length(zone_specs) : 0;
+	if (count == 0) {
+		*result = (struct zone*) calloc(1, sizeof(struct zone));
+		(*result)[0].name = friendly_name;
+		(*result)[0].uuid = uuid;
+		return 1;
+	}
+	*result = (struct zone*) calloc(count, sizeof(struct zone));
+	for (int i = 0; i < count; ++i) {
+		struct zone *zone = &(*result)[i];
+		char *name = g_strdup(zone_specs[i]);
+		char *sink = strchr(name, '=');
+		if (sink != NULL) {
+			*sink++ = '\0';
+		}
+		zone->name = name;
+		zone->sink = sink;
+		zone->uuid = zone_uuid(uuid, name);
+	}
+	return count;
+}
+
 static void init_logging(const char *log_file) {
 	char version[1024];
 	GetVersionInfo(version, sizeof(version));
@@ -218,15 +280,18 @@ static void init_logging(const char *log_file) {
 int main(int argc, char **argv)
 {
 	int rc;
-	struct upnp_device_descriptor *upnp_renderer;
+	struct zone *zones;
 
 #if !GLIB_CHECK_VERSION(2,32,0)
 	g_thread_init (NULL);  // Was necessary < glib 2.32, deprecated since.
 #endif
 
+	StartupProfile_start();
 	if (!process_cmdline(argc, argv)) {
 		return EXIT_FAILURE;
 	}
+	// Includes initializing GStreamer with its option group.
+	StartupProfile_phase("cmdline");
 
 	if (show_version) {
 		do_show_version();
@@ -273,10 +338,17 @@ int main(int argc, char **argv)
 		fclose(pid_file_stream);
 	}
 
-	upnp_renderer = upnp_renderer_descriptor(friendly_name, uuid, mime_filter);
-	if (upnp_renderer == NULL) {
-		return EXIT_FAILURE;
+	const int zone_count = parse_zones(&zones);
+	struct upnp_device_descriptor *descriptors[zone_count];
+	for (int i = 0; i < zone_count; ++i) {
+		zones[i].descriptor = upnp_renderer_zone_descriptor(
+			i, zones[i].name, zones[i].uuid, mime_filter);
+		if (zones[i].descriptor == NULL) {
+			return EXIT_FAILURE;
+		}
+		descriptors[i] = zones[i].descriptor;
 	}
+	StartupProfile_phase("setup");
 
 	rc = output_init(output);
 	if (rc != 0) {
@@ -284,8 +356,17 @@ int main(int argc, char **argv)
 			  "ERROR: Failed to initialize Output subsystem");
 		return EXIT_FAILURE;
 	}
+	for (int i = 0; i < zone_count; ++i) {
+		zones[i].output = output_new(zones[i].sink);
+		if (zones[i].output == NULL) {
+			Log_error("main", "ERROR: Failed to create output for "
+				  "'%s'", zones[i].name);
+			return EXIT_FAILURE;
+		}
+	}
+	StartupProfile_phase("output-init");
 
-	struct upnp_device *device;
+	struct upnp_device *devices[zone_count];
 	if (listen_port != 0 &&
 	    (listen_port < 49152 || listen_port > 65535)) {
 		// Somewhere obscure internally in libupnp, they clamp the
@@ -297,41 +378,67 @@ int main(int argc, char **argv)
 			  listen_port);
 		return EXIT_FAILURE;
 	}
-	device = upnp_device_init(upnp_renderer, interface_name, listen_port);
-	if (device == NULL) {
+	if (upnp_devices_init(descriptors, zone_count,
+			      interface_name, listen_port, devices) != 0) {
 		Log_error("main", "ERROR: Failed to initialize UPnP device");
 		return EXIT_FAILURE;
 	}
 
-	upnp_transport_init(device);
-	upnp_control_init(device);
+	UPnPLastChangeCollector_set_moderation_window(event_moderation_ms);
+	for (int i = 0; i < zone_count; ++i) {
+		upnp_transport_init(upnp_transport_get_zone_service(i),
+				    devices[i], zones[i].output);
+		upnp_control_init(upnp_control_get_zone_service(i),
+				  devices[i], zones[i].output);
+	}
+	StartupProfile_phase("services");
 
 	if (show_devicedesc) {
 		// This can only be run after all services have been
 		// initialized.
-		char *buf = upnp_create_device_desc(upnp_renderer);
+		const char *buf = upnp_get_device_desc(descriptors[0]);
 		assert(buf != NULL);
 		fputs(buf, stdout);
 		exit(EXIT_SUCCESS);
 	}
 
 	if (Log_info_enabled()) {
-		upnp_transport_register_variable_listener(log_variable_change,
-							  (void*) "transport");
-		upnp_control_register_variable_listener(log_variable_change,
-							(void*) "control");
+		for (int i = 0; i < zone_count; ++i) {
+			// Tell zones apart in the log, if there are several.
+			const char *prefix = zone_specs ? zones[i].name : NULL;
+			upnp_transport_register_variable_listener(
+				upnp_transport_get_zone_service(i),
+				log_variable_change,
+				prefix ? g_strdup_printf("%s/transport", prefix)
+				       : (void*) "transport");
+			upnp_control_register_variable_listener(
+				upnp_control_get_zone_service(i),
+				log_variable_change,
+				prefix ? g_strdup_printf("%s/control", prefix)
+				       : (void*) "control");
+		}
 	}
 
 	// Write both to the log (which might be disabled) and console.
 	Log_info("main", "Ready for rendering.");
 	fprintf(stderr, "Ready for rendering.\n");
 
+	StartupProfile_report(startup_report ? stdout : NULL);
+	if (startup_report) {
+		for (int i = 0; i < zone_count; ++i) {
+			upnp_device_shutdown(devices[i]);
+		}
+		return EXIT_SUCCESS;
+	}
+
 	output_loop();
 
 	// We're here, because the loop exited. Probably due to catching
 	// a signal.
 	Log_info("main", "Exiting.");
-	upnp_device_shutdown(device);
+	for (int i = 0; i < zone_count; ++i) {
+		upnp_device_shutdown(devices[i]);
+	}
 
 	return EXIT_SUCCESS;
 }
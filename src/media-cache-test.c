@@ -0,0 +1,415 @@
+/* media-cache-test - Range handling, pinning and eviction of the cache.
+ *
+ * Copyright (C) 2026 GMediaRender contributors
+ *
+ * This file is part of GMediaRender.
+ *
+ * GMediaRender is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * GMediaRender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GMediaRender; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ * -----------------
+ *
+ * Runs a small origin server on the loopback interface and talks to the
+ * cache proxy like the player would. Run with 'make check'.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+#endif
+
+#include <arpa/inet.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "http-client.h"
+#include "media-cache.h"
+
+#define CONTENT_LENGTH 10000
+
+static int failures = 0;
+
+#define CHECK(cond) do {						\
+		if (!(cond)) {						\
+			fprintf(stderr, "%s:%d: FAILED: %s\n",		\
+				__FILE__, __LINE__, #cond);		\
+			++failures;					\
+		}							\
+	} while (0)
+
+static char content[CONTENT_LENGTH];
+
+// -- Origin server: serves 'content' at every path, honoring "bytes=N-".
+
+static int origin_port;
+static int origin_requests;
+static pthread_mutex_t origin_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void *origin_connection(void *userdata) {
+	const int fd = (int) (intptr_t) userdata;
+	struct http_reader reader;
+	char line[1024], method[16], header[512];
+	int64_t from = 0;
+	http_reader_init(&reader, fd);
+	if (http_read_line(&reader, line, sizeof(line)) != 0
+	    || sscanf(line, "%15s", method) != 1) {
+		close(fd);
+		return NULL;
+	}
+	while (http_read_line(&reader, line, sizeof(line)) == 0
+	       && line[0] != '\0') {
+		if (strncasecmp(line, "Range: bytes=", 13) == 0)
+			from = strtoll(line + 13, NULL, 10);
+	}
+	pthread_mutex_lock(&origin_mutex);
+	origin_requests++;
+	pthread_mutex_unlock(&origin_mutex);
+	if (from >= CONTENT_LENGTH) {
+		const char *reply = "HTTP/1.0 416 Range Not Satisfiable\r\n\r\n";
+		http_write_all(fd, reply, strlen(reply));
+		close(fd);
+		return NULL;
+	}
+	const int len = snprintf(header, sizeof(header),
+				 "HTTP/1.0 206 Partial Content\r\n"
+				 "Content-Type: audio/x-test\r\n"
+				 "Content-Length: %" PRId64 "\r\n"
+				 "Content-Range: bytes %" PRId64 "-%d/%d\r\n"
+				 "ETag: \"v1\"\r\n"
+				 "Last-Modified: Sat, 01 Jan 2000 00:00:00 GMT"
+				 "\r\n\r\n",
+				 CONTENT_LENGTH - from, from,
+				 CONTENT_LENGTH - 1, CONTENT_LENGTH);
+	http_write_all(fd, header, len);
+	if (strcmp(method, "GET") == 0) {
+		http_write_all(fd, content + from, CONTENT_LENGTH - from);
+	}
+	close(fd);
+	return NULL;
+}
+
+static void *origin_accept(void *userdata) {
+	const int listen_fd = (int) (intptr_t) userdata;
+	for (;;) {
+		const int fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0)
+			continue;
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, origin_connection,
+				   (void*) (intptr_t) fd) == 0) {
+			pthread_detach(thread);
+		} else {
+			close(fd);
+		}
+	}
+	return NULL;
+}
+
+// Returns the port of a new listening socket on the loopback interface.
+static int listen_loopback(int *port) {
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+	const int fd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (fd < 0
+	    || bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0
+	    || listen(fd, 16) != 0
+	    || getsockname(fd, (struct sockaddr*) &addr, &addr_len) != 0) {
+		perror("origin");
+		exit(1);
+	}
+	*port = ntohs(addr.sin_port);
+	return fd;
+}
+
+static void start_origin(void) {
+	pthread_t thread;
+	const int fd = listen_loopback(&origin_port);
+	pthread_create(&thread, NULL, origin_accept, (void*) (intptr_t) fd);
+	pthread_detach(thread);
+}
+
+static int get_origin_requests(void) {
+	pthread_mutex_lock(&origin_mutex);
+	const int result = origin_requests;
+	pthread_mutex_unlock(&origin_mutex);
+	return result;
+}
+
+// -- Player side.
+
+struct reply {
+	int status;
+	char content_range[64];
+	char body[CONTENT_LENGTH + 1];
+	int64_t body_len;
+};
+
+// GET the proxy URI with the given Range header value (or NULL).
+static void fetch(const char *proxy_uri, const char *range,
+		  struct reply *reply) {
+	int port = 0;
+	char path[64];
+	char line[1024];
+	struct http_reader reader;
+	struct sockaddr_in addr;
+	memset(reply, 0, sizeof(*reply));
+	if (sscanf(proxy_uri, "http://127.0.0.1:%d%63s", &port, path) != 2)
+		return;
+	const int fd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+		close(fd);
+		return;
+	}
+	const int len = snprintf(line, sizeof(line),
+				 "GET %s HTTP/1.0\r\n%s%s%s\r\n", path,
+				 range ? "Range: " : "", range ? range : "",
+				 range ? "\r\n" : "");
+	http_write_all(fd, line, len);
+	http_reader_init(&reader, fd);
+	if (http_read_line(&reader, line, sizeof(line)) != 0
+	    || sscanf(line, "HTTP/%*d.%*d %d", &reply->status) != 1) {
+		close(fd);
+		return;
+	}
+	while (http_read_line(&reader, line, sizeof(line)) == 0
+	       && line[0] != '\0') {
+		if (strncasecmp(line, "Content-Range: ", 15) == 0) {
+			const int len = snprintf(reply->content_range,
+						 sizeof(reply->content_range),
+						 "%s", line + 15);
+			CHECK(len < (int) sizeof(reply->content_range));
+		}
+	}
+	ssize_t got;
+	while (reply->body_len < CONTENT_LENGTH
+	       && (got = http_read_body(&reader, reply->body + reply->body_len,
+					CONTENT_LENGTH - reply->body_len)) > 0) {
+		reply->body_len += got;
+	}
+	// The proxy updates its stats before closing the connection; wait for
+	// that so the checks on them don't race with it.
+	char rest[256];
+	while (http_read_body(&reader, rest, sizeof(rest)) > 0)
+		;
+	close(fd);
+}
+
+// Check that the reply carries bytes [start, end) of the content.
+static int has_content(const struct reply *reply, int64_t start, int64_t end) {
+	return reply->body_len == end - start
+		&& memcmp(reply->body, content + start, end - start) == 0;
+}
+
+static char *make_temp_dir(void) {
+	char *dir = strdup("/tmp/media-cache-test.XXXXXX");
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		exit(1);
+	}
+	return dir;
+}
+
+static char *origin_uri(const char *path) {
+	char *uri = NULL;
+	if (asprintf(&uri, "http://127.0.0.1:%d/%s", origin_port, path) < 0)
+		exit(1);
+	return uri;
+}
+
+static void test_ranges(void) {
+	struct reply reply;
+	struct media_cache_stats stats;
+	char *dir = make_temp_dir();
+	struct media_cache *cache = MediaCache_new(dir, 1 << 20);
+	CHECK(cache != NULL);
+	if (cache == NULL)
+		return;
+	char *uri = origin_uri("a.wav");
+	char *proxy = MediaCache_proxy_uri(cache, uri);
+	CHECK(proxy != NULL);
+
+	fetch(proxy, NULL, &reply);
+	CHECK(reply.status == 200);
+	CHECK(has_content(&reply, 0, CONTENT_LENGTH));
+
+	// Everything is on disk now; nothing more goes to the origin.
+	const int requests = get_origin_requests();
+
+	fetch(proxy, "bytes=100-199", &reply);
+	CHECK(reply.status == 206);
+	CHECK(has_content(&reply, 100, 200));
+	CHECK(strcmp(reply.content_range, "bytes 100-199/10000") == 0);
+
+	fetch(proxy, "bytes=9990-", &reply);
+	CHECK(reply.status == 206);
+	CHECK(has_content(&reply, 9990, CONTENT_LENGTH));
+
+	fetch(proxy, "bytes=9000-20000", &reply);
+	CHECK(reply.status == 206);
+	CHECK(has_content(&reply, 9000, CONTENT_LENGTH));
+
+	// Suffix ranges are the last N bytes, not a negative offset.
+	fetch(proxy, "bytes=-500", &reply);
+	CHECK(reply.status == 206);
+	CHECK(has_content(&reply, 9500, CONTENT_LENGTH));
+	CHECK(strcmp(reply.content_range, "bytes 9500-9999/10000") == 0);
+
+	fetch(proxy, "bytes=-20000", &reply);
+	CHECK(reply.status == 206);
+	CHECK(has_content(&reply, 0, CONTENT_LENGTH));
+
+	// Not satisfiable.
+	fetch(proxy, "bytes=10000-", &reply);
+	CHECK(reply.status == 416);
+	CHECK(strcmp(reply.content_range, "bytes */10000") == 0);
+	fetch(proxy, "bytes=-0", &reply);
+	CHECK(reply.status == 416);
+
+	// What we don't understand is ignored: whole content.
+	fetch(proxy, "bytes=5-2", &reply);
+	CHECK(reply.status == 200);
+	CHECK(has_content(&reply, 0, CONTENT_LENGTH));
+	fetch(proxy, "bytes=0-1,5-6", &reply);
+	CHECK(reply.status == 200);
+	fetch(proxy, "bytes=abc", &reply);
+	CHECK(reply.status == 200);
+
+	CHECK(get_origin_requests() == requests);
+	MediaCache_get_stats(cache, &stats);
+	CHECK(stats.misses == 1);
+	CHECK(stats.hits == 8);
+	CHECK(stats.errors == 2);
+
+	// Suffix range on an entry we don't know the length of yet.
+	char *uri_b = origin_uri("b.wav");
+	char *proxy_b = MediaCache_proxy_uri(cache, uri_b);
+	fetch(proxy_b, "bytes=-300", &reply);
+	CHECK(reply.status == 206);
+	CHECK(has_content(&reply, 9700, CONTENT_LENGTH));
+
+	// Origin down: an error, not a hit.
+	int dead_port;
+	close(listen_loopback(&dead_port));
+	char *dead_uri = NULL;
+	if (asprintf(&dead_uri, "http://127.0.0.1:%d/c.wav", dead_port) < 0)
+		exit(1);
+	char *proxy_dead = MediaCache_proxy_uri(cache, dead_uri);
+	MediaCache_get_stats(cache, &stats);
+	const unsigned long hits = stats.hits;
+	fetch(proxy_dead, NULL, &reply);
+	CHECK(reply.status == 502);
+	MediaCache_get_stats(cache, &stats);
+	CHECK(stats.hits == hits);
+	CHECK(stats.errors == 3);
+
+	// Entries without content go away once released.
+	char *meta = NULL;
+	struct stat st;
+	if (asprintf(&meta, "%s/%s.meta", dir,
+		     strrchr(proxy_dead, '/') + 1) < 0)
+		exit(1);
+	CHECK(stat(meta, &st) == 0);
+	MediaCache_release_uri(cache, proxy_dead);
+	CHECK(stat(meta, &st) != 0);
+	fetch(proxy_dead, NULL, &reply);
+	CHECK(reply.status == 404);
+
+	MediaCache_release_uri(cache, proxy);
+	MediaCache_release_uri(cache, proxy_b);
+	free(meta);
+	free(proxy_dead);
+	free(dead_uri);
+	free(proxy_b);
+	free(uri_b);
+	free(proxy);
+	free(uri);
+	free(dir);
+}
+
+static void test_pinning(void) {
+	struct reply reply;
+	struct media_cache_stats stats;
+	char *dir = make_temp_dir();
+	// Room for one entry only.
+	struct media_cache *cache = MediaCache_new(dir, 15000);
+	CHECK(cache != NULL);
+	if (cache == NULL)
+		return;
+	char *uri_a = origin_uri("pin-a.wav");
+	char *uri_b = origin_uri("pin-b.wav");
+	char *proxy_a = MediaCache_proxy_uri(cache, uri_a);
+	char *proxy_b = MediaCache_proxy_uri(cache, uri_b);
+
+	fetch(proxy_a, NULL, &reply);
+	CHECK(has_content(&reply, 0, CONTENT_LENGTH));
+	fetch(proxy_b, NULL, &reply);
+	CHECK(has_content(&reply, 0, CONTENT_LENGTH));
+
+	// Over budget, but the player still has both URLs, e.g. to seek.
+	MediaCache_get_stats(cache, &stats);
+	CHECK(stats.evictions == 0);
+	fetch(proxy_a, "bytes=5000-", &reply);
+	CHECK(reply.status == 206);
+	CHECK(has_content(&reply, 5000, CONTENT_LENGTH));
+
+	// Once released, it can go.
+	MediaCache_release_uri(cache, proxy_a);
+	MediaCache_get_stats(cache, &stats);
+	CHECK(stats.evictions == 1);
+	CHECK(stats.bytes_stored == CONTENT_LENGTH);
+	fetch(proxy_b, "bytes=0-9", &reply);
+	CHECK(reply.status == 206);
+	CHECK(has_content(&reply, 0, 10));
+
+	MediaCache_release_uri(cache, proxy_b);
+	free(proxy_a);
+	free(proxy_b);
+	free(uri_a);
+	free(uri_b);
+	free(dir);
+}
+
+int main(void) {
+	for (int i = 0; i < CONTENT_LENGTH; ++i) {
+		content[i] = (char) (i * 7 + i / 256);
+	}
+	start_origin();
+	test_ranges();
+	test_pinning();
+	if (failures) {
+		fprintf(stderr, "%d checks failed.\n", failures);
+		return 1;
+	}
+	printf("media-cache-test: all checks passed.\n");
+	return 0;
+}
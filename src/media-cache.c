@@ -0,0 +1,892 @@
+/* media-cache - Local on-disk cache for media fetched over HTTP.
+ *
+ * Copyright (C) 2026 GMediaRender contributors
+ *
+ * This file is part of GMediaRender.
+ *
+ * GMediaRender is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * GMediaRender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GMediaRender; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+#endif
+
+#include "media-cache.h"
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "http-client.h"
+#include "logging.h"
+
+// If we haven't talked to the origin about an entry for this long, we check
+// its validators before serving it from disk.
+static const int kRevalidateSeconds = 60;
+
+// If the player goes away (stop, seek) while we are fetching from the
+// origin, we still read this much further into the cache, as it is likely
+// needed soon anyway.
+static const int64_t kReadAheadBytes = 1 << 20;
+
+static const size_t kTransferChunk = 64 << 10;
+
+// Byte range [start, end) available on disk.
+struct cache_range {
+	int64_t start;
+	int64_t end;
+};
+
+struct cache_entry {
+	char key[17];              // Hex hash of the URI, names files & URL.
+	char *uri;
+	char *etag;                // Validators as last seen from the origin.
+	char *last_modified;
+	char *content_type;
+	int64_t length;            // Total length, -1 if not known yet.
+	struct cache_range *ranges;  // sorted, non-overlapping.
+	int range_count;
+	int64_t stored;            // Sum of all ranges.
+	time_t last_access;
+	time_t validated;          // Last time we compared validators.
+	int users;                 // Connections currently using this.
+	int pins;                  // Proxy URLs handed out, not released.
+	int generation;            // Incremented when content is dropped.
+	struct cache_entry *next;
+};
+
+struct media_cache {
+	char *dir;
+	int64_t max_bytes;
+	int listen_fd;
+	int port;
+
+	pthread_mutex_t mutex;     // Protects everything below.
+	struct cache_entry *entries;
+	struct media_cache_stats stats;
+};
+
+// -- Entries and ranges. Functions in this section need to be called with
+// the cache mutex held.
+
+static void make_key(const char *uri, char key[17]) {
+	// FNV-1a; collisions are handled by comparing the stored URI.
+	uint64_t hash = 14695981039346656037ULL;
+	for (const unsigned char *p = (const unsigned char*) uri; *p; ++p) {
+		hash ^= *p;
+		hash *= 1099511628211ULL;
+	}
+	snprintf(key, 17, "%016" PRIx64, hash);
+}
+
+static char *entry_filename(const struct media_cache *cache,
+			    const struct cache_entry *entry,
+			    const char *suffix) {
+	char *result = NULL;
+	if (asprintf(&result, "%s/%s.%s", cache->dir, entry->key, suffix) < 0)
+		return NULL;
+	return result;
+}
+
+static void replace_string(char **dest, const char *value) {
+	free(*dest);
+	*dest = (value != NULL) ? strdup(value) : NULL;
+}
+
+static int string_equal(const char *a, const char *b) {
+	if (a == NULL || b == NULL) return a == b;
+	return strcmp(a, b) == 0;
+}
+
+// Returns the end of the range containing pos, or pos if not on disk.
+static int64_t range_available_until(const struct cache_entry *entry,
+				     int64_t pos) {
+	for (int i = 0; i < entry->range_count; ++i) {
+		const struct cache_range *r = &entry->ranges[i];
+		if (pos >= r->start && pos < r->end)
+			return r->end;
+	}
+	return pos;
+}
+
+// Returns the start of the first range after pos.
+static int64_t range_next_start(const struct cache_entry *entry,
+				int64_t pos) {
+	for (int i = 0; i < entry->range_count; ++i) {
+		if (entry->ranges[i].start > pos)
+			return entry->ranges[i].start;
+	}
+	return INT64_MAX;
+}
+
+// Add range, merging with neighbors. Returns number of new bytes.
+static int64_t range_add(struct cache_entry *entry,
+			 int64_t start, int64_t end) {
+	struct cache_range *merged = (struct cache_range*)
+		malloc((entry->range_count + 1) * sizeof(struct cache_range));
+	int count = 0;
+	int inserted = 0;
+	int64_t total = 0;
+	for (int i = 0; i < entry->range_count; ++i) {
+		const struct cache_range r = entry->ranges[i];
+		if (r.end < start) {
+			merged[count++] = r;
+		} else if (r.start > end) {
+			if (!inserted) {
+				merged[count++] = (struct cache_range){start, end};
+				inserted = 1;
+			}
+			merged[count++] = r;
+		} else {
+			// Overlapping or adjacent: widen what we insert.
+			if (r.start < start) start = r.start;
+			if (r.end > end) end = r.end;
+		}
+	}
+	if (!inserted) {
+		merged[count++] = (struct cache_range){start, end};
+	}
+	for (int i = 0; i < count; ++i) {
+		total += merged[i].end - merged[i].start;
+	}
+	free(entry->ranges);
+	entry->ranges = merged;
+	entry->range_count = count;
+	const int64_t added = total - entry->stored;
+	entry->stored = total;
+	return added;
+}
+
+static void entry_write_meta(const struct media_cache *cache,
+			     const struct cache_entry *entry) {
+	char *fname = entry_filename(cache, entry, "meta");
+	char *tmpname = entry_filename(cache, entry, "meta.tmp");
+	FILE *out = (fname && tmpname) ? fopen(tmpname, "w") : NULL;
+	if (out != NULL) {
+		fprintf(out, "uri %s\n", entry->uri);
+		if (entry->etag)
+			fprintf(out, "etag %s\n", entry->etag);
+		if (entry->last_modified)
+			fprintf(out, "last-modified %s\n",
+				entry->last_modified);
+		if (entry->content_type)
+			fprintf(out, "content-type %s\n", entry->content_type);
+		fprintf(out, "length %" PRId64 "\n", entry->length);
+		fprintf(out, "access %ld\n", (long) entry->last_access);
+		for (int i = 0; i < entry->range_count; ++i) {
+			fprintf(out, "range %" PRId64 " %" PRId64 "\n",
+				entry->ranges[i].start, entry->ranges[i].end);
+		}
+		if (fclose(out) == 0) {
+			rename(tmpname, fname);
+		}
+	}
+	free(fname);
+	free(tmpname);
+}
+
+static struct cache_entry *entry_new(const char *key, const char *uri) {
+	struct cache_entry *entry = (struct cache_entry*)
+		calloc(1, sizeof(struct cache_entry));
+	memcpy(entry->key, key, sizeof(entry->key));  // Always 16 + '\0'.
+	entry->uri = strdup(uri);
+	entry->length = -1;
+	return entry;
+}
+
+static void entry_free(struct cache_entry *entry) {
+	free(entry->uri);
+	free(entry->etag);
+	free(entry->last_modified);
+	free(entry->content_type);
+	free(entry->ranges);
+	free(entry);
+}
+
+// Forget all content of the entry, e.g. because the origin changed.
+static void entry_reset(struct media_cache *cache, struct cache_entry *entry) {
+	char *data = entry_filename(cache, entry, "data");
+	if (data) {
+		if (truncate(data, 0) != 0 && errno != ENOENT) {
+			Log_error("cache", "Can't truncate %s: %s",
+				  data, strerror(errno));
+		}
+		free(data);
+	}
+	cache->stats.bytes_stored -= entry->stored;
+	entry->generation++;
+	free(entry->ranges);
+	entry->ranges = NULL;
+	entry->range_count = 0;
+	entry->stored = 0;
+	entry->length = -1;
+	replace_string(&entry->etag, NULL);
+	replace_string(&entry->last_modified, NULL);
+}
+
+static void entry_remove_files(const struct media_cache *cache,
+			       const struct cache_entry *entry) {
+	char *data = entry_filename(cache, entry, "data");
+	char *meta = entry_filename(cache, entry, "meta");
+	if (data) unlink(data);
+	if (meta) unlink(meta);
+	free(data);
+	free(meta);
+}
+
+static struct cache_entry *find_entry(struct media_cache *cache,
+				      const char *key) {
+	for (struct cache_entry *e = cache->entries; e; e = e->next) {
+		if (strcmp(e->key, key) == 0)
+			return e;
+	}
+	return NULL;
+}
+
+static int entry_in_use(const struct cache_entry *entry) {
+	return entry->users > 0 || entry->pins > 0;
+}
+
+// Evict least recently used entries until we're within bounds. Entries
+// currently in use, or whose proxy URL the player still has, are never
+// evicted. Entries without content are dropped right away.
+static void evict_if_needed(struct media_cache *cache) {
+	for (struct cache_entry **e = &cache->entries; *e; ) {
+		struct cache_entry *empty = *e;
+		if (empty->stored > 0 || entry_in_use(empty)) {
+			e = &empty->next;
+			continue;
+		}
+		*e = empty->next;
+		entry_remove_files(cache, empty);
+		entry_free(empty);
+	}
+	while (cache->stats.bytes_stored > cache->max_bytes) {
+		struct cache_entry **victim = NULL;
+		for (struct cache_entry **e = &cache->entries; *e;
+		     e = &(*e)->next) {
+			if (entry_in_use(*e))
+				continue;
+			if (victim == NULL
+			    || (*e)->last_access < (*victim)->last_access) {
+				victim = e;
+			}
+		}
+		if (victim == NULL)
+			return;  // Everything in use; allow to overshoot.
+		struct cache_entry *evicted = *victim;
+		*victim = evicted->next;
+		Log_info("cache", "Evicting %s (%" PRId64 " bytes)",
+			 evicted->uri, evicted->stored);
+		cache->stats.bytes_stored -= evicted->stored;
+		cache->stats.evictions++;
+		entry_remove_files(cache, evicted);
+		entry_free(evicted);
+	}
+}
+
+static void load_entry(struct media_cache *cache, const char *meta_path) {
+	FILE *in = fopen(meta_path, "r");
+	if (in == NULL)
+		return;
+	char line[4096];
+	struct cache_entry *entry = NULL;
+	while (fgets(line, sizeof(line), in)) {
+		line[strcspn(line, "\r\n")] = '\0';
+		char *value = strchr(line, ' ');
+		if (value == NULL) continue;
+		*value++ = '\0';
+		if (strcmp(line, "uri") == 0 && entry == NULL) {
+			char key[17];
+			make_key(value, key);
+			entry = entry_new(key, value);
+		} else if (entry == NULL) {
+			break;  // uri needs to be first.
+		} else if (strcmp(line, "etag") == 0) {
+			replace_string(&entry->etag, value);
+		} else if (strcmp(line, "last-modified") == 0) {
+			replace_string(&entry->last_modified, value);
+		} else if (strcmp(line, "content-type") == 0) {
+			replace_string(&entry->content_type, value);
+		} else if (strcmp(line, "length") == 0) {
+			entry->length = strtoll(value, NULL, 10);
+		} else if (strcmp(line, "access") == 0) {
+			entry->last_access = strtol(value, NULL, 10);
+		} else if (strcmp(line, "range") == 0) {
+			int64_t start, end;
+			if (sscanf(value, "%" SCNd64 " %" SCNd64,
+				   &start, &end) == 2 && start < end) {
+				range_add(entry, start, end);
+			}
+		}
+	}
+	fclose(in);
+	if (entry == NULL)
+		return;
+
+	// Don't trust ranges beyond what is actually in the data file.
+	char *data = entry_filename(cache, entry, "data");
+	struct stat st;
+	if (data == NULL || stat(data, &st) != 0
+	    || (entry->range_count > 0
+		&& entry->ranges[entry->range_count-1].end > st.st_size)) {
+		entry_remove_files(cache, entry);
+		entry_free(entry);
+	} else {
+		cache->stats.bytes_stored += entry->stored;
+		entry->next = cache->entries;
+		cache->entries = entry;
+	}
+	free(data);
+}
+
+static void load_index(struct media_cache *cache) {
+	DIR *dir = opendir(cache->dir);
+	if (dir == NULL)
+		return;
+	struct dirent *d;
+	while ((d = readdir(dir)) != NULL) {
+		const size_t len = strlen(d->d_name);
+		if (len != 16 + 5 || strcmp(d->d_name + 16, ".meta") != 0)
+			continue;
+		char *path = NULL;
+		if (asprintf(&path, "%s/%s", cache->dir, d->d_name) < 0)
+			continue;
+		load_entry(cache, path);
+		free(path);
+	}
+	closedir(dir);
+}
+
+// Compare validators of the response with what we have. If the resource
+// changed, the entry content is thrown away. Needs the mutex held.
+static void entry_validate(struct media_cache *cache,
+			   struct cache_entry *entry,
+			   const struct http_response *resp) {
+	if (entry->length >= 0
+	    && (!string_equal(entry->etag, resp->etag)
+		|| !string_equal(entry->last_modified, resp->last_modified)
+		|| entry->length != resp->total_length)) {
+		Log_info("cache", "%s changed on origin; dropping %" PRId64
+			 " cached bytes.", entry->uri, entry->stored);
+		entry_reset(cache, entry);
+	}
+	entry->length = resp->total_length;
+	replace_string(&entry->etag, resp->etag);
+	replace_string(&entry->last_modified, resp->last_modified);
+	if (resp->content_type) {
+		replace_string(&entry->content_type, resp->content_type);
+	}
+	entry->validated = time(NULL);
+}
+
+// -- Proxy serving the player.
+
+struct proxy_request {
+	struct media_cache *cache;
+	int fd;
+};
+
+// Range requested by the player. Only single ranges are supported; others
+// are ignored and answered with the whole content, as HTTP allows.
+struct byte_range {
+	int present;
+	int64_t first;   // -1 for a suffix range ("bytes=-N").
+	int64_t last;    // Inclusive; -1 if open ended, N for a suffix range.
+};
+
+// Parse the value of a Range header. Returns 0 if understood.
+static int parse_range(const char *value, struct byte_range *range) {
+	char *end;
+	while (*value == ' ') ++value;
+	if (strncmp(value, "bytes=", 6) != 0)
+		return -1;
+	value += 6;
+	if (*value == '-') {
+		// Suffix: the last N bytes.
+		if (value[1] < '0' || value[1] > '9')
+			return -1;
+		range->first = -1;
+		range->last = strtoll(value + 1, &end, 10);
+	} else {
+		if (*value < '0' || *value > '9')
+			return -1;
+		range->first = strtoll(value, &end, 10);
+		if (*end++ != '-')
+			return -1;
+		range->last = -1;
+		if (*end >= '0' && *end <= '9') {
+			range->last = strtoll(end, &end, 10);
+			if (range->last < range->first)
+				return -1;
+		}
+	}
+	while (*end == ' ') ++end;
+	if (*end != '\0')
+		return -1;  // Multiple ranges or trailing garbage.
+	range->present = 1;
+	return 0;
+}
+
+// Resolve the range against the content length into [start, end). Returns
+// -1 if it is not satisfiable.
+static int resolve_range(const struct byte_range *range, int64_t length,
+			 int64_t *start, int64_t *end) {
+	*start = 0;
+	*end = length;
+	if (!range->present)
+		return 0;
+	if (range->first < 0) {
+		if (range->last == 0 || length == 0)
+			return -1;
+		*start = (range->last < length) ? length - range->last : 0;
+		return 0;
+	}
+	if (range->first >= length)
+		return -1;
+	*start = range->first;
+	if (range->last >= 0 && range->last + 1 < length)
+		*end = range->last + 1;
+	return 0;
+}
+
+static void send_status(int fd, int status, const char *text) {
+	char buf[256];
+	const int len = snprintf(buf, sizeof(buf),
+				 "HTTP/1.1 %d %s\r\nContent-Length: 0\r\n"
+				 "Connection: close\r\n\r\n", status, text);
+	http_write_all(fd, buf, len);
+}
+
+// Connection to the origin while serving a request; opened lazily for the
+// parts that are not on disk.
+struct origin_stream {
+	struct http_response resp;
+	int open;
+	int64_t pos;   // The byte offset the next read returns.
+	int generation;  // of the entry content we promised to the player.
+	int committed;   // Response headers are sent to the player.
+};
+
+static int origin_stream_seek(struct media_cache *cache,
+			      struct cache_entry *entry,
+			      struct origin_stream *origin, int64_t pos) {
+	if (origin->open && origin->pos == pos)
+		return 0;
+	if (origin->open) {
+		http_response_clear(&origin->resp);
+		origin->open = 0;
+	}
+	if (http_request(entry->uri, "GET", pos, &origin->resp) != 0)
+		return -1;
+	pthread_mutex_lock(&cache->mutex);
+	entry_validate(cache, entry, &origin->resp);
+	const int changed = (entry->generation != origin->generation);
+	origin->generation = entry->generation;
+	pthread_mutex_unlock(&cache->mutex);
+	if (changed && origin->committed) {
+		// We already sent parts of the old content to the player.
+		http_response_clear(&origin->resp);
+		return -1;
+	}
+	origin->open = 1;
+	origin->pos = origin->resp.range_start;
+	// Server might not support ranges and starts from zero.
+	char skip[4096];
+	while (origin->pos < pos) {
+		size_t want = sizeof(skip);
+		if ((int64_t) want > pos - origin->pos) want = pos - origin->pos;
+		ssize_t got = http_read_body(&origin->resp.reader, skip, want);
+		if (got <= 0) return -1;
+		origin->pos += got;
+	}
+	return 0;
+}
+
+static void serve_request(struct media_cache *cache, int fd) {
+	struct http_reader reader;
+	http_reader_init(&reader, fd);
+	char line[4096];
+	char method[16], path[256];
+	if (http_read_line(&reader, line, sizeof(line)) != 0
+	    || sscanf(line, "%15s %255s", method, path) != 2) {
+		return;
+	}
+	struct byte_range range;
+	memset(&range, 0, sizeof(range));
+	while (http_read_line(&reader, line, sizeof(line)) == 0
+	       && line[0] != '\0') {
+		if (strncasecmp(line, "Range:", 6) == 0
+		    && parse_range(line + 6, &range) != 0) {
+			memset(&range, 0, sizeof(range));
+		}
+	}
+	const int is_head = (strcmp(method, "HEAD") == 0);
+	if (!is_head && strcmp(method, "GET") != 0) {
+		send_status(fd, 501, "Not Implemented");
+		return;
+	}
+
+	pthread_mutex_lock(&cache->mutex);
+	struct cache_entry *entry = find_entry(cache, path + 1);
+	if (entry) {
+		entry->users++;
+		entry->last_access = time(NULL);
+	}
+	const int need_validation = entry
+		&& (entry->length < 0
+		    || time(NULL) - entry->validated > kRevalidateSeconds);
+	// Where we likely start; a suffix range needs the length first.
+	int64_t start = range.first > 0 ? range.first : 0, end;
+	if (entry && entry->length >= 0
+	    && resolve_range(&range, entry->length, &start, &end) != 0) {
+		start = 0;
+	}
+	const int suffix_unknown = entry && entry->length < 0
+		&& range.present && range.first < 0;
+	const int start_cached = entry
+		&& range_available_until(entry, start) > start;
+	pthread_mutex_unlock(&cache->mutex);
+	if (entry == NULL) {
+		send_status(fd, 404, "Not Found");
+		return;
+	}
+
+	struct origin_stream origin;
+	memset(&origin, 0, sizeof(origin));
+	origin.resp.reader.fd = -1;
+	origin.generation = entry->generation;  // Only changed with users == 0
+	int used_origin = 0;
+	int served = 0;  // Sent a successful response.
+	int64_t from_cache = 0, from_origin = 0;
+
+	if (need_validation) {
+		// If we need the data anyway, we can validate with the GET.
+		if (start_cached || suffix_unknown) {
+			struct http_response resp;
+			if (http_request(entry->uri, "HEAD", 0, &resp) == 0) {
+				pthread_mutex_lock(&cache->mutex);
+				entry_validate(cache, entry, &resp);
+				pthread_mutex_unlock(&cache->mutex);
+				http_response_clear(&resp);
+			}
+		} else if (origin_stream_seek(cache, entry, &origin, start) == 0) {
+			used_origin = 1;
+		}
+	}
+
+	pthread_mutex_lock(&cache->mutex);
+	const int64_t length = entry->length;
+	char *content_type = entry->content_type
+		? strdup(entry->content_type) : NULL;
+	origin.generation = entry->generation;
+	origin.committed = 1;
+	pthread_mutex_unlock(&cache->mutex);
+
+	if (length < 0) {
+		// Origin didn't tell us the length (or is unreachable).
+		send_status(fd, 502, "Bad Gateway");
+		goto done;
+	}
+	char header[1024];
+	int hlen;
+	if (resolve_range(&range, length, &start, &end) != 0) {
+		hlen = snprintf(header, sizeof(header),
+				"HTTP/1.1 416 Range Not Satisfiable\r\n"
+				"Content-Range: bytes */%" PRId64 "\r\n"
+				"Content-Length: 0\r\n"
+				"Connection: close\r\n\r\n", length);
+		http_write_all(fd, header, hlen);
+		goto done;
+	}
+
+	hlen = snprintf(header, sizeof(header),
+			    "HTTP/1.1 %s\r\n"
+			    "Content-Type: %s\r\n"
+			    "Content-Length: %" PRId64 "\r\n"
+			    "Accept-Ranges: bytes\r\n",
+			    range.present ? "206 Partial Content" : "200 OK",
+			    content_type ? content_type
+			    : "application/octet-stream",
+			    end - start);
+	if (range.present) {
+		hlen += snprintf(header + hlen, sizeof(header) - hlen,
+				 "Content-Range: bytes %" PRId64 "-%" PRId64
+				 "/%" PRId64 "\r\n", start, end - 1, length);
+	}
+	hlen += snprintf(header + hlen, sizeof(header) - hlen,
+			 "Connection: close\r\n\r\n");
+	if (http_write_all(fd, header, hlen) != 0)
+		goto done;
+	served = 1;
+	if (is_head)
+		goto done;
+
+	char *data_name = entry_filename(cache, entry, "data");
+	const int data_fd = data_name ? open(data_name, O_RDWR|O_CREAT, 0644)
+		: -1;
+	free(data_name);
+	if (data_fd < 0) {
+		Log_error("cache", "Can't open data file for %s", entry->uri);
+		goto done;
+	}
+
+	char *buf = (char*) malloc(kTransferChunk);
+	int player_gone = 0;
+	int64_t pos = start;
+	while (pos < end) {
+		pthread_mutex_lock(&cache->mutex);
+		const int64_t available = range_available_until(entry, pos);
+		const int64_t next_cached = range_next_start(entry, pos);
+		pthread_mutex_unlock(&cache->mutex);
+
+		size_t chunk = kTransferChunk;
+		if (available > pos) {
+			if (player_gone)
+				break;  // Nothing to read ahead here.
+			if ((int64_t) chunk > available - pos)
+				chunk = available - pos;
+			if ((int64_t) chunk > end - pos)
+				chunk = end - pos;
+			ssize_t got = pread(data_fd, buf, chunk, pos);
+			if (got <= 0)
+				break;
+			if (http_write_all(fd, buf, got) != 0)
+				break;
+			pos += got;
+			from_cache += got;
+			continue;
+		}
+
+		if (origin_stream_seek(cache, entry, &origin, pos) != 0)
+			break;
+		used_origin = 1;
+		if ((int64_t) chunk > next_cached - pos)
+			chunk = next_cached - pos;
+		if ((int64_t) chunk > end - pos)
+			chunk = end - pos;
+		ssize_t got = http_read_body(&origin.resp.reader, buf, chunk);
+		if (got <= 0)
+			break;
+		if (pwrite(data_fd, buf, got, pos) == got) {
+			pthread_mutex_lock(&cache->mutex);
+			cache->stats.bytes_stored +=
+				range_add(entry, pos, pos + got);
+			evict_if_needed(cache);
+			pthread_mutex_unlock(&cache->mutex);
+		}
+		if (!player_gone && http_write_all(fd, buf, got) != 0) {
+			// Player stopped or seeks elsewhere. Read a bit
+			// further, it'll likely come back for it.
+			player_gone = 1;
+			end = (pos + got + kReadAheadBytes < length)
+				? pos + got + kReadAheadBytes : length;
+		}
+		pos += got;
+		origin.pos = pos;
+		from_origin += got;
+	}
+	free(buf);
+	close(data_fd);
+
+done:
+	free(content_type);
+	if (origin.open) {
+		http_response_clear(&origin.resp);
+	}
+	pthread_mutex_lock(&cache->mutex);
+	if (!served) {
+		cache->stats.errors++;
+	} else if (used_origin) {
+		cache->stats.misses++;
+	} else {
+		cache->stats.hits++;
+	}
+	cache->stats.bytes_from_cache += from_cache;
+	cache->stats.bytes_from_origin += from_origin;
+	entry->users--;
+	entry_write_meta(cache, entry);
+	const struct media_cache_stats *stats = &cache->stats;
+	Log_info("cache", "%s %s bytes %" PRId64 "-: %" PRId64 " from cache, %"
+		 PRId64 " from origin. [hits=%lu misses=%lu errors=%lu; "
+		 "cache=%" PRId64 " origin=%" PRId64 " stored=%" PRId64
+		 " bytes]",
+		 !served ? "ERROR" : used_origin ? "MISS" : "HIT",
+		 entry->uri, start, from_cache, from_origin,
+		 stats->hits, stats->misses, stats->errors,
+		 stats->bytes_from_cache, stats->bytes_from_origin,
+		 stats->bytes_stored);
+	evict_if_needed(cache);
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+static void *proxy_connection_thread(void *userdata) {
+	struct proxy_request *request = (struct proxy_request*) userdata;
+	http_set_socket_timeout(request->fd);
+	serve_request(request->cache, request->fd);
+	close(request->fd);
+	free(request);
+	return NULL;
+}
+
+static void *proxy_accept_thread(void *userdata) {
+	struct media_cache *cache = (struct media_cache*) userdata;
+	for (;;) {
+		const int fd = accept(cache->listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR) continue;
+			Log_error("cache", "accept(): %s", strerror(errno));
+			break;
+		}
+		struct proxy_request *request = (struct proxy_request*)
+			malloc(sizeof(struct proxy_request));
+		request->cache = cache;
+		request->fd = fd;
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, proxy_connection_thread,
+				   request) != 0) {
+			close(fd);
+			free(request);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+	return NULL;
+}
+
+static int start_proxy(struct media_cache *cache) {
+	const int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;  // Let the kernel choose.
+	socklen_t addr_len = sizeof(addr);
+	if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0
+	    || listen(fd, 16) != 0
+	    || getsockname(fd, (struct sockaddr*) &addr, &addr_len) != 0) {
+		Log_error("cache", "Can't start proxy: %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+	cache->listen_fd = fd;
+	cache->port = ntohs(addr.sin_port);
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, proxy_accept_thread, cache) != 0) {
+		close(fd);
+		return -1;
+	}
+	pthread_detach(thread);
+	return 0;
+}
+
+struct media_cache *MediaCache_new(const char *dir, int64_t max_bytes) {
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+		Log_error("cache", "Can't create cache directory %s: %s",
+			  dir, strerror(errno));
+		return NULL;
+	}
+	struct media_cache *cache = (struct media_cache*)
+		calloc(1, sizeof(struct media_cache));
+	cache->dir = strdup(dir);
+	cache->max_bytes = max_bytes;
+	pthread_mutex_init(&cache->mutex, NULL);
+	load_index(cache);
+	evict_if_needed(cache);
+	if (start_proxy(cache) != 0) {
+		// Leaking the entries; we only get here once at startup.
+		free(cache->dir);
+		free(cache);
+		return NULL;
+	}
+	Log_info("cache", "Media cache in %s: %" PRId64 " of %" PRId64
+		 " bytes used; proxy on 127.0.0.1:%d", dir,
+		 cache->stats.bytes_stored, max_bytes, cache->port);
+	return cache;
+}
+
+char *MediaCache_proxy_uri(struct media_cache *cache, const char *uri) {
+	if (uri == NULL || strncasecmp(uri, "http://", 7) != 0)
+		return NULL;
+	char key[17];
+	make_key(uri, key);
+	pthread_mutex_lock(&cache->mutex);
+	struct cache_entry *entry = find_entry(cache, key);
+	if (entry != NULL && strcmp(entry->uri, uri) != 0) {
+		if (entry_in_use(entry)) {
+			// Hash collision with something playing right now.
+			pthread_mutex_unlock(&cache->mutex);
+			return NULL;
+		}
+		entry_reset(cache, entry);
+		replace_string(&entry->uri, uri);
+	}
+	if (entry == NULL) {
+		entry = entry_new(key, uri);
+		entry->next = cache->entries;
+		cache->entries = entry;
+	}
+	entry->last_access = time(NULL);
+	entry->pins++;
+	pthread_mutex_unlock(&cache->mutex);
+
+	char *result = NULL;
+	if (asprintf(&result, "http://127.0.0.1:%d/%s", cache->port, key) < 0)
+		return NULL;
+	return result;
+}
+
+void MediaCache_release_uri(struct media_cache *cache, const char *proxy_uri) {
+	const char *key = proxy_uri ? strrchr(proxy_uri, '/') : NULL;
+	if (key == NULL)
+		return;
+	pthread_mutex_lock(&cache->mutex);
+	struct cache_entry *entry = find_entry(cache, key + 1);
+	if (entry != NULL && entry->pins > 0) {
+		entry->pins--;
+		evict_if_needed(cache);
+	}
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+void MediaCache_get_stats(struct media_cache *cache,
+			  struct media_cache_stats *stats) {
+	pthread_mutex_lock(&cache->mutex);
+	*stats = cache->stats;
+	pthread_mutex_unlock(&cache->mutex);
+}
@@ -0,0 +1,66 @@
+/* media-cache - Local on-disk cache for media fetched over HTTP.
+ *
+ * Copyright (C) 2026 GMediaRender contributors
+ *
+ * This file is part of GMediaRender.
+ *
+ * GMediaRender is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * GMediaRender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GMediaRender; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ * -----------------
+ *
+ * The cache is a small HTTP proxy listening on the loopback interface.
+ * The player is handed a proxy URL instead of the original one; all range
+ * requests (initial play, seeks) are answered from the sparse data file
+ * on disk where the bytes are available, and only the missing parts are
+ * fetched from the origin server and stored on the way through.
+ *
+ * Entries are keyed by the URI and only valid as long as the validators
+ * of the origin (ETag, Last-Modified, Content-Length) don't change. The
+ * store is bounded in size; least recently used entries are evicted.
+ */
+#ifndef _MEDIA_CACHE_H
+#define _MEDIA_CACHE_H
+
+#include <stdint.h>
+
+struct media_cache;
+
+struct media_cache_stats {
+	unsigned long hits;         // Requests served entirely from disk.
+	unsigned long misses;       // Requests that needed the origin.
+	unsigned long errors;       // Requests we couldn't answer.
+	unsigned long evictions;
+	int64_t bytes_from_cache;
+	int64_t bytes_from_origin;
+	int64_t bytes_stored;       // Currently on disk.
+};
+
+// Create cache in given directory, bounded by max_bytes, and start the
+// loopback proxy. Returns NULL on failure.
+struct media_cache *MediaCache_new(const char *dir, int64_t max_bytes);
+
+// Returns a newly allocated URI to be used instead of the given one
+// or NULL if this URI can't be cached (only plain http is supported).
+// The entry is kept until the URI is released.
+char *MediaCache_proxy_uri(struct media_cache *cache, const char *uri);
+
+// The player is done with a URI returned by MediaCache_proxy_uri().
+void MediaCache_release_uri(struct media_cache *cache, const char *proxy_uri);
+
+void MediaCache_get_stats(struct media_cache *cache,
+			  struct media_cache_stats *stats);
+
+#endif /* _MEDIA_CACHE_H */
@@ -40,20 +40,29 @@
 #ifdef HAVE_GST
 #include "output_gstreamer.h"
 #endif
+#ifdef HAVE_ALSA
+#include "output_alsa.h"
+#endif
+#include "output_null.h"
 #include "output.h"
 
+// The first one is the default.
 static struct output_module *modules[] = {
 #ifdef HAVE_GST
 	&gstreamer_output,
-#else
-	// this will be a runtime error, but there is not much point
-	// in waiting till then.
-#error "No output configured. You need to ./configure --with-gstreamer"
 #endif
+#ifdef HAVE_ALSA
+	&alsa_output,
+#endif
+	&null_output,
 };
 
 static struct output_module *output_module = NULL;
 
+struct output {
+	void *instance;  // of output_module.
+};
+
 void output_dump_modules(void)
 {
 	int count;
@@ -83,6 +92,10 @@ int output_init(const char *shortname)
 	}
 	if (shortname == NULL) {
 		output_module = modules[0];
+		if (output_module == &null_output) {
+			Log_error("output", "Compiled without GStreamer; "
+				  "there won't be any sound.");
+		}
 	} else {
 		int i;
 		for (i=0; i<count; i++) {
@@ -109,6 +122,22 @@ int output_init(const char *shortname)
 	return 0;
 }
 
+struct output *output_new(const char *sink)
+{
+	if (output_module == NULL || output_module->create == NULL)
+		return NULL;
+	void *instance = output_module->create(sink);
+	if (instance == NULL) {
+		Log_error("output", "Couldn't create %s player%s%s",
+			  output_module->shortname,
+			  sink ? " for " : "", sink ? sink : "");
+		return NULL;
+	}
+	struct output *result = (struct output*) malloc(sizeof(*result));
+	result->instance = instance;
+	return result;
+}
+
 static GMainLoop *main_loop_ = NULL;
 static void exit_loop_sighandler(int sig) {
 	if (main_loop_) {
@@ -147,73 +176,79 @@ int output_add_options(GOptionContext *ctx)
 	return 0;
 }
 
-void output_set_uri(const char *uri, output_update_meta_cb_t meta_cb) {
+void output_set_uri(struct output *output, const char *uri,
+		    output_update_meta_cb_t meta_cb, void *userdata) {
 	if (output_module && output_module->set_uri) {
-		output_module->set_uri(uri, meta_cb);
+		output_module->set_uri(output->instance, uri, meta_cb,
+				       userdata);
 	}
 }
-void output_set_next_uri(const char *uri) {
+void output_set_next_uri(struct output *output, const char *uri) {
 	if (output_module && output_module->set_next_uri) {
-		output_module->set_next_uri(uri);
+		output_module->set_next_uri(output->instance, uri);
 	}
 }
 
-int output_play(output_transition_cb_t transition_callback) {
+int output_play(struct output *output,
+		output_transition_cb_t transition_callback, void *userdata) {
 	if (output_module && output_module->play) {
-		return output_module->play(transition_callback);
+		return output_module->play(output->instance,
+					   transition_callback, userdata);
 	}
 	return -1;
 }
 
-int output_pause(void) {
+int output_pause(struct output *output) {
 	if (output_module && output_module->pause) {
-		return output_module->pause();
+		return output_module->pause(output->instance);
 	}
 	return -1;
 }
 
-int output_stop(void) {
+int output_stop(struct output *output) {
 	if (output_module && output_module->stop) {
-		return output_module->stop();
+		return output_module->stop(output->instance);
 	}
 	return -1;
 }
 
-int output_seek(gint64 position_nanos) {
+int output_seek(struct output *output, gint64 position_nanos) {
 	if (output_module && output_module->seek) {
-		return output_module->seek(position_nanos);
+		return output_module->seek(output->instance, position_nanos);
 	}
 	return -1;
 }
 
-int output_get_position(gint64 *track_dur, gint64 *track_pos) {
+int output_get_position(struct output *output,
+			gint64 *track_dur, gint64 *track_pos) {
 	if (output_module && output_module->get_position) {
-		return output_module->get_position(track_dur, track_pos);
+		return output_module->get_position(output->instance,
+						   track_dur, track_pos);
 	}
 	return -1;
 }
 
-int output_get_volume(float *value) {
+int output_get_volume(struct output *output, float *value) {
 	if (output_module && output_module->get_volume) {
-		return output_module->get_volume(value);
+		return output_module->get_volume(output->instance, value);
 	}
 	return -1;
 }
-int output_set_volume(float value) {
+int output_set_volume(struct output *output, float value) {
 	if (output_module && output_module->set_volume) {
-		return output_module->set_volume(value);
+		return output_module->set_volume(output->instance, value);
 	}
 	return -1;
 }
-int output_get_mute(int *value) {
+int output_get_mute(struct output *output, int *value) {
 	if (output_module && output_module->get_mute) {
-		return output_module->get_mute(value);
+		return output_module->get_mute(output->instance, value);
 	}
 	return -1;
 }
-int output_set_mute(int value) {
+int output_set_mute(struct output *output, int value) {
 	if (output_module && output_module->set_mute) {
-		return output_module->set_mute(value);
+		return output_module->set_mute(output->instance, value);
 	}
 	return -1;
 }
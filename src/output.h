@@ -33,30 +33,42 @@ enum PlayFeedback {
 	PLAY_STOPPED,
 	PLAY_STARTED_NEXT_STREAM,
 };
-typedef void (*output_transition_cb_t)(enum PlayFeedback);
+typedef void (*output_transition_cb_t)(enum PlayFeedback, void *userdata);
 
 // In case the stream gets to know details about the song, this is a
 // callback with changes we send back to the controlling layer.
-typedef void (*output_update_meta_cb_t)(const struct SongMetaData *);
+typedef void (*output_update_meta_cb_t)(const struct SongMetaData *,
+					void *userdata);
+
+// A player of the selected output module. Every renderer has its own.
+struct output;
 
 int output_init(const char *shortname);
 int output_add_options(GOptionContext *ctx);
 void output_dump_modules(void);
 
+// Create a player on the given sink; what that is depends on the module
+// (e.g. a GStreamer pipeline or an ALSA device). NULL for the sink
+// configured with the module options. Returns NULL on failure.
+struct output *output_new(const char *sink);
+
 int output_loop(void);
 
-void output_set_uri(const char *uri, output_update_meta_cb_t meta_info);
-void output_set_next_uri(const char *uri);
+void output_set_uri(struct output *output, const char *uri,
+		    output_update_meta_cb_t meta_info, void *userdata);
+void output_set_next_uri(struct output *output, const char *uri);
 
-int output_play(output_transition_cb_t done_callback);
-int output_stop(void);
-int output_pause(void);
-int output_get_position(gint64 *track_dur_nanos, gint64 *track_pos_nanos);
-int output_seek(gint64 position_nanos);
+int output_play(struct output *output,
+		output_transition_cb_t done_callback, void *userdata);
+int output_stop(struct output *output);
+int output_pause(struct output *output);
+int output_get_position(struct output *output,
+			gint64 *track_dur_nanos, gint64 *track_pos_nanos);
+int output_seek(struct output *output, gint64 position_nanos);
 
-int output_get_volume(float *v);
-int output_set_volume(float v);
-int output_get_mute(int *m);
-int output_set_mute(int m);
+int output_get_volume(struct output *output, float *v);
+int output_set_volume(struct output *output, float v);
+int output_get_mute(struct output *output, int *m);
+int output_set_mute(struct output *output, int m);
 
 #endif /* _OUTPUT_H */
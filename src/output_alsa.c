@@ -0,0 +1,1366 @@
+/* output_alsa.c - Output module playing PCM streams directly with ALSA
+ *
+ * Copyright (C) 2026 GMediaRender contributors
+ *
+ * This file is part of GMediaRender.
+ *
+ * GMediaRender is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * GMediaRender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GMediaRender; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ * -----------------
+ *
+ * Uncompressed streams (audio/L16, 16 bit WAV) don't need typefinding,
+ * decoding or conversion; all playbin would do for us is adding latency
+ * and CPU. So for these, we fetch the stream ourselves and write it to the
+ * ALSA device from a playback thread, only swapping the byte order where
+ * needed. Everything else is handed to the GStreamer output.
+ *
+ * When a PCM stream ends and the next one is PCM as well, it is played
+ * right away from the same thread without closing the device.
+ *
+ * For each stream, the time from play() to the first period written and
+ * the CPU used are logged; with --alsaout-via-gst, all streams take the
+ * GStreamer path so that the two can be compared on the same source.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+#endif
+
+#include <alsa/asoundlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  include <arm_neon.h>
+#  define HAVE_NEON_SWAP 1
+#endif
+
+#include <glib.h>
+
+#include "http-client.h"
+#include "logging.h"
+#include "upnp_connmgr.h"
+#include "output_module.h"
+#ifdef HAVE_GST
+#include "output_gstreamer.h"
+#endif
+#include "output_alsa.h"
+
+// Enough socket buffer for a few seconds of CD audio to ride out hiccups
+// of the network; the ALSA buffer itself is kept short.
+static const int kSocketBufferBytes = 1 << 20;
+
+// Volume is applied as Q15 fixed point gain.
+static const int kUnityGain = 1 << 15;
+
+// How long we watch GStreamer for the first sample to be played.
+static const int kFirstSamplePollMs = 5;
+static const gint64 kFirstSampleTimeoutUs = 10 * G_USEC_PER_SEC;
+
+struct pcm_format {
+	unsigned int rate;
+	unsigned int channels;
+	int big_endian;
+};
+
+// A PCM stream being read, over HTTP or from a local file.
+struct pcm_source {
+	struct http_reader reader;  // Buffered reads work for files as well.
+	struct pcm_format format;
+	int64_t data_start;         // Offset of the first sample.
+	int64_t data_length;        // Bytes of audio, -1 if unknown.
+	int64_t remaining;          // Bytes left to read, -1 if unknown.
+};
+
+enum probe_result {
+	PROBE_ERROR = -1,
+	PROBE_PCM,
+	PROBE_OTHER,   // Not something we play ourselves.
+};
+
+enum alsa_backend {
+	BACKEND_NONE,
+	BACKEND_DIRECT,
+	BACKEND_GST,
+};
+
+// Startup latency and CPU of the current stream.
+struct stream_metrics {
+	const char *path;           // "alsa" or "gst"; NULL if not measuring.
+	gint64 play_us;             // When play() was called.
+	gint64 first_sample_us;     // 0 until the first sample was output.
+	gint64 cpu_us;              // Process CPU time at play().
+};
+
+static pthread_mutex_t mutex_ = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t state_changed_ = PTHREAD_COND_INITIALIZER;
+// Everything below is protected by mutex_.
+static enum alsa_backend backend_ = BACKEND_NONE;
+static char *uri_ = NULL;           // locally strdup()ed
+static char *next_uri_ = NULL;      // locally strdup()ed
+static output_transition_cb_t play_trans_callback_ = NULL;
+static void *play_trans_userdata_ = NULL;
+static output_update_meta_cb_t meta_update_callback_ = NULL;
+static void *meta_update_userdata_ = NULL;
+static struct stream_metrics metrics_;
+
+// Playback thread and its requests.
+static pthread_t thread_;
+static int thread_running_ = 0;
+static int generation_ = 0;         // Outdates transitions of old threads.
+static int stop_requested_ = 0;
+static int paused_ = 0;
+static int64_t seek_frame_ = -1;
+static int source_fd_ = -1;         // To interrupt a read() on stop.
+
+// Reported by the playback thread.
+static unsigned int rate_ = 0;
+static int64_t position_frames_ = 0;
+static int64_t duration_frames_ = 0;
+
+static float volume_ = 1.0;
+static int mute_ = 0;
+static volatile gint gain_;         // Q15; read by the playback thread.
+
+// There is only one sound card per process to drive directly: the first
+// create() gets it, everything else has to use GStreamer sinks.
+static int created_ = 0;
+#ifdef HAVE_GST
+static void *gst_player_ = NULL;    // For everything that is not PCM.
+#endif
+
+// Options.
+static gchar *alsa_device = NULL;
+static int period_us = 20000;
+static int buffer_us = 200000;
+static gboolean via_gst = FALSE;
+
+static GOptionEntry option_entries[] = {
+	{ "alsaout-device", 0, 0, G_OPTION_ARG_STRING, &alsa_device,
+	  "ALSA device to play PCM streams on (default: 'default').", NULL },
+	{ "alsaout-period-us", 0, 0, G_OPTION_ARG_INT, &period_us,
+	  "ALSA period time in microseconds; how much is written at once.",
+	  NULL },
+	{ "alsaout-buffer-us", 0, 0, G_OPTION_ARG_INT, &buffer_us,
+	  "ALSA buffer time in microseconds.", NULL },
+	{ "alsaout-via-gst", 0, 0, G_OPTION_ARG_NONE, &via_gst,
+	  "Hand all streams to GStreamer; to compare startup latency "
+	  "and CPU with the direct path.", NULL },
+	{ NULL }
+};
+
+static gint64 process_cpu_us(void) {
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return ((gint64) usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)
+		* G_USEC_PER_SEC
+		+ usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+// -- Metrics. All need mutex_ held.
+
+static void metrics_start(const char *path, gint64 play_us) {
+	metrics_.path = path;
+	metrics_.play_us = play_us;
+	metrics_.first_sample_us = 0;
+	metrics_.cpu_us = process_cpu_us();
+}
+
+static void metrics_first_sample(gint64 when_us) {
+	if (metrics_.path == NULL || metrics_.first_sample_us != 0)
+		return;
+	metrics_.first_sample_us = when_us;
+	Log_info("alsa", "%s: first sample %.1fms after play.",
+		 metrics_.path, (when_us - metrics_.play_us) / 1000.0);
+}
+
+static void metrics_report(void) {
+	if (metrics_.path == NULL)
+		return;
+	const gint64 now = g_get_monotonic_time();
+	const gint64 cpu = process_cpu_us() - metrics_.cpu_us;
+	const gint64 wall = now - metrics_.play_us;
+	if (metrics_.first_sample_us != 0) {
+		const gint64 startup =
+			metrics_.first_sample_us - metrics_.play_us;
+		Log_info("alsa", "%s: startup %.1fms; %.1fs played using "
+			 "%.1fms CPU (%.2f%%).", metrics_.path,
+			 startup / 1000.0, wall / 1e6, cpu / 1000.0,
+			 wall > 0 ? 100.0 * cpu / wall : 0.0);
+	} else {
+		Log_info("alsa", "%s: stopped after %.1fs before the first "
+			 "sample; %.1fms CPU.", metrics_.path, wall / 1e6,
+			 cpu / 1000.0);
+	}
+	metrics_.path = NULL;
+}
+
+// -- Sample conversion.
+
+// Swap the bytes of each 16 bit sample in place. This is on the path of
+// every sample, so use SIMD where we know we have it.
+static void pcm_swap16(int16_t *samples, size_t count) {
+	uint16_t *s = (uint16_t *) samples;
+	size_t i = 0;
+#if defined(__SSE2__)
+	for (; i + 16 <= count; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *) (s + i));
+		__m128i b = _mm_loadu_si128((const __m128i *) (s + i + 8));
+		a = _mm_or_si128(_mm_slli_epi16(a, 8), _mm_srli_epi16(a, 8));
+		b = _mm_or_si128(_mm_slli_epi16(b, 8), _mm_srli_epi16(b, 8));
+		_mm_storeu_si128((__m128i *) (s + i), a);
+		_mm_storeu_si128((__m128i *) (s + i + 8), b);
+	}
+#elif defined(HAVE_NEON_SWAP)
+	for (; i + 16 <= count; i += 16) {
+		uint8x16_t a = vld1q_u8((const uint8_t *) (s + i));
+		uint8x16_t b = vld1q_u8((const uint8_t *) (s + i + 8));
+		vst1q_u8((uint8_t *) (s + i), vrev16q_u8(a));
+		vst1q_u8((uint8_t *) (s + i + 8), vrev16q_u8(b));
+	}
+#endif
+	for (; i < count; ++i) {
+		s[i] = (uint16_t) ((s[i] << 8) | (s[i] >> 8));
+	}
+}
+
+// Simple enough for the compiler to vectorize.
+static void pcm_scale(int16_t *samples, size_t count, int gain) {
+	for (size_t i = 0; i < count; ++i) {
+		samples[i] = (int16_t) ((samples[i] * gain) >> 15);
+	}
+}
+
+static void update_gain(void) {
+	int gain = mute_ ? 0 : (int) (volume_ * kUnityGain + 0.5);
+	if (gain > kUnityGain) gain = kUnityGain;
+	if (gain < 0) gain = 0;
+	g_atomic_int_set(&gain_, gain);
+}
+
+// -- Reading PCM streams.
+
+static void source_close(struct pcm_source *src) {
+	if (src->reader.fd >= 0)
+		close(src->reader.fd);
+	src->reader.fd = -1;
+}
+
+// Read as much as possible up to size; short only at the end of the
+// stream. Returns the number of bytes read or -1 on error.
+static ssize_t source_read(struct pcm_source *src, char *buf, size_t size) {
+	if (src->remaining >= 0 && (int64_t) size > src->remaining)
+		size = src->remaining;
+	size_t total = 0;
+	while (total < size) {
+		ssize_t got = http_read_body(&src->reader, buf + total,
+					     size - total);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got < 0)
+			return total > 0 ? (ssize_t) total : -1;
+		if (got == 0)
+			break;
+		total += got;
+	}
+	if (src->remaining >= 0)
+		src->remaining -= total;
+	return total;
+}
+
+static int source_skip(struct pcm_source *src, int64_t bytes) {
+	char skip[4096];
+	while (bytes > 0) {
+		const size_t want = bytes < (int64_t) sizeof(skip)
+			? (size_t) bytes : sizeof(skip);
+		ssize_t got = http_read_body(&src->reader, skip, want);
+		if (got <= 0)
+			return -1;
+		bytes -= got;
+	}
+	return 0;
+}
+
+static int read_exact(struct pcm_source *src, void *buf, size_t size) {
+	return source_read(src, buf, size) == (ssize_t) size ? 0 : -1;
+}
+
+static uint32_t le32(const unsigned char *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+static uint16_t le16(const unsigned char *p) {
+	return p[0] | (p[1] << 8);
+}
+
+// Read the RIFF header up to the start of the samples. Only plain 16 bit
+// PCM is taken, everything else goes to GStreamer.
+static enum probe_result parse_wav_header(struct pcm_source *src) {
+	unsigned char header[40];
+	int64_t offset = 12;
+	int have_format = 0;
+	if (read_exact(src, header, 12) != 0
+	    || memcmp(header, "RIFF", 4) != 0
+	    || memcmp(header + 8, "WAVE", 4) != 0)
+		return PROBE_OTHER;
+	for (;;) {
+		if (read_exact(src, header, 8) != 0)
+			return PROBE_OTHER;
+		offset += 8;
+		const uint32_t chunk_size = le32(header + 4);
+		if (memcmp(header, "data", 4) == 0) {
+			if (!have_format)
+				return PROBE_OTHER;
+			src->data_start = offset;
+			// Streaming writers don't know the size in advance.
+			src->data_length = (chunk_size == 0
+					    || chunk_size == 0xffffffff)
+				? -1 : (int64_t) chunk_size;
+			return PROBE_PCM;
+		}
+		const int64_t padded = chunk_size + (chunk_size & 1);
+		if (memcmp(header, "fmt ", 4) == 0 && chunk_size >= 16) {
+			const size_t len = chunk_size < sizeof(header)
+				? chunk_size : sizeof(header);
+			if (read_exact(src, header, len) != 0
+			    || source_skip(src, padded - len) != 0)
+				return PROBE_OTHER;
+			uint16_t tag = le16(header);
+			if (tag == 0xfffe && len >= 26) {
+				// WAVE_FORMAT_EXTENSIBLE: look at sub-format.
+				tag = le16(header + 24);
+			}
+			if (tag != 1 || le16(header + 14) != 16)
+				return PROBE_OTHER;
+			src->format.channels = le16(header + 2);
+			src->format.rate = le32(header + 4);
+			src->format.big_endian = 0;
+			have_format = (src->format.channels > 0
+				       && src->format.rate > 0);
+		} else if (source_skip(src, padded) != 0) {
+			return PROBE_OTHER;
+		}
+		offset += padded;
+	}
+}
+
+// audio/L16;rate=44100;channels=2 (RFC 2586); always big endian.
+static int parse_l16_type(const char *content_type, struct pcm_format *f) {
+	if (strncasecmp(content_type, "audio/L16", 9) != 0
+	    || (content_type[9] != '\0' && content_type[9] != ';'
+		&& content_type[9] != ' '))
+		return -1;
+	f->rate = 44100;
+	f->channels = 1;
+	f->big_endian = 1;
+	for (const char *p = strchr(content_type, ';'); p != NULL;
+	     p = strchr(p + 1, ';')) {
+		const char *param = p + 1;
+		while (*param == ' ') ++param;
+		if (strncasecmp(param, "rate=", 5) == 0) {
+			f->rate = atoi(param + 5);
+		} else if (strncasecmp(param, "channels=", 9) == 0) {
+			f->channels = atoi(param + 9);
+		}
+	}
+	return (f->rate > 0 && f->channels > 0) ? 0 : -1;
+}
+
+static int is_wav_type(const char *content_type) {
+	static const char *const kWavTypes[] = {
+		"audio/wav", "audio/x-wav", "audio/wave", "audio/vnd.wave",
+		NULL
+	};
+	for (const char *const *t = kWavTypes; *t; ++t) {
+		const size_t len = strlen(*t);
+		if (strncasecmp(content_type, *t, len) == 0
+		    && (content_type[len] == '\0' || content_type[len] == ';'))
+			return 1;
+	}
+	return 0;
+}
+
+// Open the resource at byte offset 'from'. Returns PROBE_OTHER for URIs
+// we can't fetch ourselves. The content type, if any, is returned in a
+// newly allocated string.
+static enum probe_result source_connect(const char *uri, int64_t from,
+					struct pcm_source *src,
+					char **content_type,
+					int64_t *content_length) {
+	memset(src, 0, sizeof(*src));
+	http_reader_init(&src->reader, -1);
+	src->data_length = src->remaining = -1;
+	*content_type = NULL;
+	*content_length = -1;
+	if (strncasecmp(uri, "file://", 7) == 0) {
+		char *filename = g_filename_from_uri(uri, NULL, NULL);
+		if (filename == NULL)
+			return PROBE_OTHER;
+		const int fd = open(filename, O_RDONLY);
+		if (fd < 0) {
+			Log_error("alsa", "Can't open %s: %s", filename,
+				  strerror(errno));
+			g_free(filename);
+			return PROBE_ERROR;
+		}
+		g_free(filename);
+		struct stat st;
+		if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+			*content_length = st.st_size - from;
+		}
+		if (from > 0 && lseek(fd, from, SEEK_SET) != from) {
+			close(fd);
+			return PROBE_ERROR;
+		}
+		http_reader_init(&src->reader, fd);
+		return PROBE_PCM;
+	}
+	if (strncasecmp(uri, "http://", 7) != 0)
+		return PROBE_OTHER;  // https, rtsp, ...
+
+	struct http_response resp;
+	if (http_request(uri, "GET", from, &resp) != 0) {
+		Log_error("alsa", "Can't fetch %s", uri);
+		return PROBE_ERROR;
+	}
+	setsockopt(resp.reader.fd, SOL_SOCKET, SO_RCVBUF,
+		   &kSocketBufferBytes, sizeof(kSocketBufferBytes));
+	src->reader = resp.reader;
+	resp.reader.fd = -1;  // Now owned by src.
+	*content_length = resp.content_length;
+	*content_type = resp.content_type;
+	resp.content_type = NULL;
+	http_response_clear(&resp);
+	if (resp.status == 200 && from > 0) {
+		// Server ignored our range.
+		if (source_skip(src, from) != 0) {
+			source_close(src);
+			free(*content_type);
+			*content_type = NULL;
+			return PROBE_ERROR;
+		}
+		if (*content_length >= 0)
+			*content_length -= from;
+	}
+	return PROBE_PCM;
+}
+
+// Open the URI and find out if it is a PCM stream we can play. On
+// PROBE_PCM, src is positioned at the first sample.
+static enum probe_result source_open(const char *uri, struct pcm_source *src) {
+	char *content_type;
+	int64_t content_length;
+	enum probe_result result = source_connect(uri, 0, src, &content_type,
+						  &content_length);
+	if (result != PROBE_PCM)
+		return result;
+	src->data_start = 0;
+	src->data_length = content_length;
+	if (content_type != NULL
+	    && parse_l16_type(content_type, &src->format) == 0) {
+		result = PROBE_PCM;
+	} else if (content_type == NULL || is_wav_type(content_type)
+		   || strncasecmp(content_type,
+				  "application/octet-stream", 24) == 0) {
+		// Local files and sloppy servers: look at the content.
+		result = parse_wav_header(src);
+		if (result == PROBE_PCM && content_length >= 0) {
+			const int64_t available =
+				content_length - src->data_start;
+			if (src->data_length < 0
+			    || src->data_length > available)
+				src->data_length = available;
+		}
+	} else {
+		result = PROBE_OTHER;
+	}
+	free(content_type);
+	if (result != PROBE_PCM) {
+		source_close(src);
+		return result;
+	}
+	src->remaining = src->data_length;
+	return PROBE_PCM;
+}
+
+// Reopen a stream we already know about at the given sample offset.
+static int source_reopen(const char *uri, const struct pcm_source *known,
+			 int64_t data_offset, struct pcm_source *src) {
+	char *content_type;
+	int64_t content_length;
+	if (source_connect(uri, known->data_start + data_offset, src,
+			   &content_type, &content_length) != PROBE_PCM)
+		return -1;
+	free(content_type);
+	src->format = known->format;
+	src->data_start = known->data_start;
+	src->data_length = known->data_length;
+	src->remaining = (known->data_length >= 0)
+		? known->data_length - data_offset : -1;
+	return 0;
+}
+
+// -- ALSA device.
+
+static int pcm_configure(snd_pcm_t *pcm, const struct pcm_format *format,
+			 snd_pcm_uframes_t *period_frames, int *can_pause) {
+	snd_pcm_hw_params_t *hw;
+	snd_pcm_sw_params_t *sw;
+	snd_pcm_hw_params_alloca(&hw);
+	snd_pcm_sw_params_alloca(&sw);
+	unsigned int rate = format->rate;
+	unsigned int period_time = period_us;
+	unsigned int buffer_time = buffer_us;
+	snd_pcm_uframes_t buffer_frames;
+	int err;
+	if ((err = snd_pcm_hw_params_any(pcm, hw)) < 0
+	    || (err = snd_pcm_hw_params_set_rate_resample(pcm, hw, 1)) < 0
+	    || (err = snd_pcm_hw_params_set_access(
+			pcm, hw, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0
+	    || (err = snd_pcm_hw_params_set_format(pcm, hw,
+						   SND_PCM_FORMAT_S16)) < 0
+	    || (err = snd_pcm_hw_params_set_channels(pcm, hw,
+						     format->channels)) < 0
+	    || (err = snd_pcm_hw_params_set_rate_near(pcm, hw, &rate,
+						      NULL)) < 0
+	    || (err = snd_pcm_hw_params_set_buffer_time_near(
+			pcm, hw, &buffer_time, NULL)) < 0
+	    || (err = snd_pcm_hw_params_set_period_time_near(
+			pcm, hw, &period_time, NULL)) < 0
+	    || (err = snd_pcm_hw_params(pcm, hw)) < 0) {
+		Log_error("alsa", "Can't set up %s for %uHz, %u channels: %s",
+			  alsa_device, format->rate, format->channels,
+			  snd_strerror(err));
+		return -1;
+	}
+	if (rate != format->rate) {
+		Log_error("alsa", "%s plays %uHz instead of %uHz.",
+			  alsa_device, rate, format->rate);
+	}
+	snd_pcm_hw_params_get_period_size(hw, period_frames, NULL);
+	snd_pcm_hw_params_get_buffer_size(hw, &buffer_frames);
+	*can_pause = snd_pcm_hw_params_can_pause(hw);
+
+	// Start as soon as we have two periods; there is plenty more
+	// waiting in the socket buffer.
+	snd_pcm_uframes_t start = 2 * *period_frames;
+	if (start > buffer_frames) start = buffer_frames;
+	if ((err = snd_pcm_sw_params_current(pcm, sw)) < 0
+	    || (err = snd_pcm_sw_params_set_start_threshold(pcm, sw,
+							    start)) < 0
+	    || (err = snd_pcm_sw_params_set_avail_min(pcm, sw,
+						      *period_frames)) < 0
+	    || (err = snd_pcm_sw_params(pcm, sw)) < 0) {
+		Log_error("alsa", "Can't set software parameters: %s",
+			  snd_strerror(err));
+		return -1;
+	}
+	Log_info("alsa", "%s: %uHz, %u channels; period %lu frames, "
+		 "buffer %lu frames.", alsa_device, rate, format->channels,
+		 (unsigned long) *period_frames, (unsigned long) buffer_frames);
+	return 0;
+}
+
+// -- Playback thread.
+
+struct player {
+	int generation;
+	struct pcm_source src;
+	snd_pcm_t *pcm;
+	snd_pcm_uframes_t period_frames;
+	int can_pause;
+	int swap;                 // Stream byte order differs from ours.
+	size_t frame_bytes;
+	char *buffer;             // One period plus partial frame.
+	size_t buffered;
+	int64_t start_frame;      // Where in the stream we started writing.
+	int64_t frames_written;
+	unsigned long underruns;
+};
+
+// Transition to be reported to the transport from the main loop.
+struct transition {
+	int generation;
+	enum PlayFeedback feedback;
+	char *gst_uri;     // If set, continue with this URI in GStreamer.
+};
+
+static gboolean deliver_transition(gpointer data);
+
+static void post_transition(int generation, enum PlayFeedback feedback,
+			    char *gst_uri) {
+	struct transition *t = malloc(sizeof(*t));
+	t->generation = generation;
+	t->feedback = feedback;
+	t->gst_uri = gst_uri;
+	g_idle_add(deliver_transition, t);
+}
+
+static int is_big_endian_host(void) {
+	return G_BYTE_ORDER == G_BIG_ENDIAN;
+}
+
+// (Re-)configure the device for the format of the current source.
+static int player_setup(struct player *p) {
+	const struct pcm_format *f = &p->src.format;
+	if (pcm_configure(p->pcm, f, &p->period_frames, &p->can_pause) != 0)
+		return -1;
+	p->swap = (f->big_endian != is_big_endian_host());
+	p->frame_bytes = 2 * f->channels;
+	free(p->buffer);
+	p->buffer = malloc(p->period_frames * p->frame_bytes);
+	p->buffered = 0;
+	pthread_mutex_lock(&mutex_);
+	rate_ = f->rate;
+	pthread_mutex_unlock(&mutex_);
+	return 0;
+}
+
+static void player_set_source(struct player *p, struct pcm_source *src,
+			      int64_t start_frame) {
+	pthread_mutex_lock(&mutex_);
+	source_fd_ = src->reader.fd;
+	duration_frames_ = (src->data_length >= 0)
+		? src->data_length / (2 * src->format.channels) : 0;
+	position_frames_ = start_frame;
+	pthread_mutex_unlock(&mutex_);
+	p->src = *src;
+	p->start_frame = start_frame;
+	p->frames_written = 0;
+	p->buffered = 0;
+}
+
+static void player_close_source(struct player *p) {
+	pthread_mutex_lock(&mutex_);
+	source_fd_ = -1;
+	pthread_mutex_unlock(&mutex_);
+	source_close(&p->src);
+}
+
+static void player_update_position(struct player *p) {
+	snd_pcm_sframes_t delay = 0;
+	if (snd_pcm_delay(p->pcm, &delay) < 0 || delay < 0)
+		delay = 0;
+	int64_t position = p->start_frame + p->frames_written - delay;
+	if (position < p->start_frame)
+		position = p->start_frame;  // Previous stream still playing.
+	pthread_mutex_lock(&mutex_);
+	position_frames_ = position;
+	pthread_mutex_unlock(&mutex_);
+}
+
+static int player_write(struct player *p, char *data,
+			snd_pcm_uframes_t frames) {
+	while (frames > 0) {
+		snd_pcm_sframes_t written =
+			snd_pcm_writei(p->pcm, data, frames);
+		if (written < 0) {
+			if (written == -EPIPE)
+				p->underruns++;
+			if (snd_pcm_recover(p->pcm, written, 1) < 0) {
+				Log_error("alsa", "Write failed: %s",
+					  snd_strerror(written));
+				return -1;
+			}
+			continue;
+		}
+		data += written * p->frame_bytes;
+		frames -= written;
+		p->frames_written += written;
+	}
+	return 0;
+}
+
+// Block while paused. Returns non-zero if we're asked to stop.
+static int player_wait_while_paused(struct player *p) {
+	pthread_mutex_lock(&mutex_);
+	if (!paused_ || stop_requested_) {
+		const int stop = stop_requested_;
+		pthread_mutex_unlock(&mutex_);
+		return stop;
+	}
+	pthread_mutex_unlock(&mutex_);
+
+	if (p->can_pause) {
+		snd_pcm_pause(p->pcm, 1);
+	} else {
+		// Whatever is in the buffer is lost; continue from what
+		// was actually played.
+		player_update_position(p);
+		snd_pcm_drop(p->pcm);
+		pthread_mutex_lock(&mutex_);
+		p->frames_written = position_frames_ - p->start_frame;
+		pthread_mutex_unlock(&mutex_);
+	}
+
+	pthread_mutex_lock(&mutex_);
+	while (paused_ && !stop_requested_) {
+		pthread_cond_wait(&state_changed_, &mutex_);
+	}
+	const int stop = stop_requested_;
+	pthread_mutex_unlock(&mutex_);
+
+	if (!stop) {
+		if (p->can_pause) {
+			snd_pcm_pause(p->pcm, 0);
+		} else {
+			snd_pcm_prepare(p->pcm);
+		}
+	}
+	return stop;
+}
+
+// Handle a seek request if there is one. Returns -1 if the stream could
+// not be reopened.
+static int player_handle_seek(struct player *p) {
+	pthread_mutex_lock(&mutex_);
+	int64_t frame = seek_frame_;
+	seek_frame_ = -1;
+	char *uri = (frame >= 0 && uri_) ? strdup(uri_) : NULL;
+	pthread_mutex_unlock(&mutex_);
+	if (uri == NULL)
+		return 0;
+
+	if (p->src.data_length >= 0
+	    && frame * (int64_t) p->frame_bytes > p->src.data_length)
+		frame = p->src.data_length / p->frame_bytes;
+	struct pcm_source src;
+	const int result = source_reopen(uri, &p->src,
+					 frame * p->frame_bytes, &src);
+	free(uri);
+	snd_pcm_drop(p->pcm);
+	snd_pcm_prepare(p->pcm);
+	player_close_source(p);
+	if (result != 0) {
+		Log_error("alsa", "Seek failed.");
+		return -1;
+	}
+	player_set_source(p, &src, frame);
+	return 0;
+}
+
+// At the end of the stream: continue with the next URI if it is PCM.
+// Returns 0 if we keep playing.
+static int player_next_stream(struct player *p) {
+	pthread_mutex_lock(&mutex_);
+	char *next = next_uri_;
+	next_uri_ = NULL;
+	pthread_mutex_unlock(&mutex_);
+
+	if (next == NULL) {
+		snd_pcm_drain(p->pcm);
+		post_transition(p->generation, PLAY_STOPPED, NULL);
+		return -1;
+	}
+	struct pcm_source src;
+	const enum probe_result probe =
+		via_gst ? PROBE_OTHER : source_open(next, &src);
+	if (probe != PROBE_PCM) {
+		snd_pcm_drain(p->pcm);
+		if (probe == PROBE_ERROR) {
+			free(next);
+			post_transition(p->generation, PLAY_STOPPED, NULL);
+		} else {
+			post_transition(p->generation,
+					PLAY_STARTED_NEXT_STREAM, next);
+		}
+		return -1;
+	}
+
+	player_close_source(p);
+	const int same_format =
+		memcmp(&src.format, &p->src.format, sizeof(src.format)) == 0;
+	player_set_source(p, &src, 0);
+	if (!same_format) {
+		snd_pcm_drain(p->pcm);
+		snd_pcm_hw_free(p->pcm);
+		if (player_setup(p) != 0) {
+			free(next);
+			post_transition(p->generation, PLAY_STOPPED, NULL);
+			return -1;
+		}
+	}
+	pthread_mutex_lock(&mutex_);
+	Log_info("alsa", "End of stream; playing next '%s'", next);
+	free(uri_);
+	uri_ = next;
+	metrics_report();
+	metrics_start("alsa", g_get_monotonic_time());
+	pthread_mutex_unlock(&mutex_);
+	post_transition(p->generation, PLAY_STARTED_NEXT_STREAM, NULL);
+	return 0;
+}
+
+static void player_run(struct player *p) {
+	for (;;) {
+		if (player_wait_while_paused(p))
+			return;
+		if (player_handle_seek(p) != 0)
+			break;
+		const size_t want = p->period_frames * p->frame_bytes;
+		ssize_t got = source_read(&p->src, p->buffer + p->buffered,
+					  want - p->buffered);
+		if (got < 0) {
+			Log_error("alsa", "Reading stream failed: %s",
+				  strerror(errno));
+			got = 0;  // Play what we have as if it ended.
+		}
+		if (got == 0) {
+			pthread_mutex_lock(&mutex_);
+			const int stop = stop_requested_;
+			pthread_mutex_unlock(&mutex_);
+			if (stop || player_next_stream(p) != 0)
+				return;
+			continue;
+		}
+		p->buffered += got;
+		const snd_pcm_uframes_t frames = p->buffered / p->frame_bytes;
+		const size_t samples = frames * p->src.format.channels;
+		if (p->swap)
+			pcm_swap16((int16_t *) p->buffer, samples);
+		const int gain = g_atomic_int_get(&gain_);
+		if (gain != kUnityGain)
+			pcm_scale((int16_t *) p->buffer, samples, gain);
+		const int64_t before = p->frames_written;
+		if (player_write(p, p->buffer, frames) != 0)
+			break;
+		if (before == 0 && p->start_frame == 0) {
+			pthread_mutex_lock(&mutex_);
+			metrics_first_sample(g_get_monotonic_time());
+			pthread_mutex_unlock(&mutex_);
+		}
+		// Keep a partial frame for the next round.
+		const size_t used = frames * p->frame_bytes;
+		memmove(p->buffer, p->buffer + used, p->buffered - used);
+		p->buffered -= used;
+		player_update_position(p);
+	}
+	post_transition(p->generation, PLAY_STOPPED, NULL);
+}
+
+static void *playback_thread(void *userdata) {
+	struct player *p = userdata;
+	const char *device = alsa_device ? alsa_device : "default";
+	int err = snd_pcm_open(&p->pcm, device, SND_PCM_STREAM_PLAYBACK, 0);
+	if (err < 0) {
+		Log_error("alsa", "Can't open %s: %s", device,
+			  snd_strerror(err));
+		post_transition(p->generation, PLAY_STOPPED, NULL);
+	} else {
+		if (player_setup(p) == 0) {
+			player_run(p);
+		} else {
+			post_transition(p->generation, PLAY_STOPPED, NULL);
+		}
+		pthread_mutex_lock(&mutex_);
+		const int stop = stop_requested_;
+		pthread_mutex_unlock(&mutex_);
+		if (stop)
+			snd_pcm_drop(p->pcm);
+		snd_pcm_close(p->pcm);
+	}
+	if (p->underruns > 0) {
+		Log_error("alsa", "%lu buffer underruns; consider a larger "
+			  "--alsaout-buffer-us", p->underruns);
+	}
+	player_close_source(p);
+	free(p->buffer);
+	free(p);
+	return NULL;
+}
+
+// Needs mutex_ held.
+static void start_playback_thread(struct pcm_source *src) {
+	struct player *p = calloc(1, sizeof(*p));
+	stop_requested_ = 0;
+	paused_ = 0;
+	seek_frame_ = -1;
+	p->generation = ++generation_;
+	p->src = *src;
+	source_fd_ = src->reader.fd;
+	rate_ = src->format.rate;
+	position_frames_ = 0;
+	duration_frames_ = (src->data_length >= 0)
+		? src->data_length / (2 * src->format.channels) : 0;
+	thread_running_ = 1;
+	backend_ = BACKEND_DIRECT;
+	pthread_create(&thread_, NULL, playback_thread, p);
+}
+
+// Stop the playback thread if running and wait for it to finish. Any
+// transition it posted is dropped. Never call from the playback thread.
+static void stop_playback_thread(void) {
+	pthread_mutex_lock(&mutex_);
+	if (!thread_running_) {
+		pthread_mutex_unlock(&mutex_);
+		return;
+	}
+	thread_running_ = 0;
+	stop_requested_ = 1;
+	++generation_;
+	pthread_cond_broadcast(&state_changed_);
+	if (source_fd_ >= 0) {
+		shutdown(source_fd_, SHUT_RDWR);  // Wake up a blocking read.
+	}
+	const pthread_t thread = thread_;
+	pthread_mutex_unlock(&mutex_);
+	pthread_join(thread, NULL);
+}
+
+// -- GStreamer fallback.
+
+#ifdef HAVE_GST
+// GStreamer went on with the next stream by itself. If that one is PCM,
+// take over and play it directly.
+static void gst_reprobe_next(const char *uri) {
+	struct pcm_source src;
+	if (source_open(uri, &src) != PROBE_PCM)
+		return;
+	Log_info("alsa", "Next '%s' is PCM; playing it directly.", uri);
+	gstreamer_output.stop(gst_player_);
+	pthread_mutex_lock(&mutex_);
+	metrics_start("alsa", g_get_monotonic_time());
+	start_playback_thread(&src);
+	pthread_mutex_unlock(&mutex_);
+}
+
+static void gst_transition(enum PlayFeedback feedback, void *userdata) {
+	(void) userdata;
+	pthread_mutex_lock(&mutex_);
+	metrics_report();
+	output_transition_cb_t callback = play_trans_callback_;
+	void *callback_userdata = play_trans_userdata_;
+	char *reprobe = NULL;
+	if (feedback == PLAY_STOPPED) {
+		backend_ = BACKEND_NONE;
+	} else {
+		free(uri_);
+		uri_ = next_uri_;
+		next_uri_ = NULL;
+		if (!via_gst && uri_ != NULL)
+			reprobe = strdup(uri_);
+	}
+	pthread_mutex_unlock(&mutex_);
+	if (reprobe != NULL) {
+		gst_reprobe_next(reprobe);
+		free(reprobe);
+	}
+	if (callback) {
+		callback(feedback, callback_userdata);
+	}
+}
+
+// Called from the main loop until GStreamer reports a position.
+static gboolean poll_gst_first_sample(gpointer data) {
+	const int generation = GPOINTER_TO_INT(data);
+	gboolean keep_polling = FALSE;
+	pthread_mutex_lock(&mutex_);
+	const gint64 now = g_get_monotonic_time();
+	if (generation == generation_ && backend_ == BACKEND_GST
+	    && metrics_.path != NULL && metrics_.first_sample_us == 0
+	    && now - metrics_.play_us < kFirstSampleTimeoutUs) {
+		gint64 duration = 0, position = 0;
+		pthread_mutex_unlock(&mutex_);
+		gstreamer_output.get_position(gst_player_, &duration,
+					      &position);
+		pthread_mutex_lock(&mutex_);
+		if (position > 0) {
+			// Playing since 'position'.
+			metrics_first_sample(now - position / 1000);
+		} else {
+			keep_polling = TRUE;
+		}
+	}
+	pthread_mutex_unlock(&mutex_);
+	return keep_polling;
+}
+
+static int play_with_gst(const char *uri, gint64 play_us) {
+	pthread_mutex_lock(&mutex_);
+	output_update_meta_cb_t meta_cb = meta_update_callback_;
+	void *meta_userdata = meta_update_userdata_;
+	char *next = next_uri_ ? strdup(next_uri_) : NULL;
+	backend_ = BACKEND_GST;
+	metrics_start("gst", play_us);
+	const int generation = ++generation_;
+	pthread_mutex_unlock(&mutex_);
+
+	gstreamer_output.set_uri(gst_player_, uri, meta_cb, meta_userdata);
+	gstreamer_output.set_next_uri(gst_player_, next);
+	free(next);
+	const int result = gstreamer_output.play(gst_player_, gst_transition,
+						 NULL);
+	g_timeout_add(kFirstSamplePollMs, poll_gst_first_sample,
+		      GINT_TO_POINTER(generation));
+	return result;
+}
+#else
+static int play_with_gst(const char *uri, gint64 play_us) {
+	(void) play_us;
+	Log_error("alsa", "Can't play '%s': neither L16 nor WAV, and no "
+		  "GStreamer to fall back to.", uri);
+	return -1;
+}
+#endif
+
+// Main loop: report what the playback thread found at the end of a stream.
+static gboolean deliver_transition(gpointer data) {
+	struct transition *t = data;
+	pthread_mutex_lock(&mutex_);
+	if (t->generation != generation_) {
+		// Stopped or restarted meanwhile.
+		pthread_mutex_unlock(&mutex_);
+		free(t->gst_uri);
+		free(t);
+		return FALSE;
+	}
+	output_transition_cb_t callback = play_trans_callback_;
+	void *callback_userdata = play_trans_userdata_;
+	const int thread_done = (t->feedback == PLAY_STOPPED
+				 || t->gst_uri != NULL);
+	pthread_t thread = thread_;
+	if (thread_done) {
+		thread_running_ = 0;
+		backend_ = BACKEND_NONE;
+		metrics_report();
+	}
+	pthread_mutex_unlock(&mutex_);
+
+	if (thread_done) {
+		pthread_join(thread, NULL);  // Exiting already.
+	}
+	if (t->gst_uri != NULL) {
+		pthread_mutex_lock(&mutex_);
+		free(uri_);
+		uri_ = strdup(t->gst_uri);
+		pthread_mutex_unlock(&mutex_);
+		Log_info("alsa", "'%s' is not PCM; continuing with GStreamer.",
+			 t->gst_uri);
+		if (play_with_gst(t->gst_uri, g_get_monotonic_time()) != 0) {
+			t->feedback = PLAY_STOPPED;
+		}
+	}
+	if (callback) {
+		callback(t->feedback, callback_userdata);
+	}
+	free(t->gst_uri);
+	free(t);
+	return FALSE;
+}
+
+// -- Output module interface.
+
+static void output_alsa_set_uri(void *instance, const char *uri,
+				output_update_meta_cb_t meta_cb,
+				void *userdata) {
+	(void) instance;
+	Log_info("alsa", "Set uri to '%s'", uri);
+	pthread_mutex_lock(&mutex_);
+	free(uri_);
+	uri_ = (uri && *uri) ? strdup(uri) : NULL;
+	meta_update_callback_ = meta_cb;
+	meta_update_userdata_ = userdata;
+	pthread_mutex_unlock(&mutex_);
+}
+
+static void output_alsa_set_next_uri(void *instance, const char *uri) {
+	(void) instance;
+	Log_info("alsa", "Set next uri to '%s'", uri);
+	pthread_mutex_lock(&mutex_);
+	free(next_uri_);
+	next_uri_ = (uri && *uri) ? strdup(uri) : NULL;
+	const int forward = (backend_ == BACKEND_GST);
+	pthread_mutex_unlock(&mutex_);
+#ifdef HAVE_GST
+	if (forward) {
+		gstreamer_output.set_next_uri(gst_player_, uri);
+	}
+#else
+	(void) forward;
+#endif
+}
+
+static int output_alsa_play(void *instance,
+			    output_transition_cb_t callback, void *userdata) {
+	(void) instance;
+	const gint64 play_us = g_get_monotonic_time();
+	pthread_mutex_lock(&mutex_);
+	play_trans_callback_ = callback;
+	play_trans_userdata_ = userdata;
+	if (backend_ == BACKEND_DIRECT) {
+		paused_ = 0;   // Continue if paused.
+		pthread_cond_broadcast(&state_changed_);
+		pthread_mutex_unlock(&mutex_);
+		return 0;
+	}
+#ifdef HAVE_GST
+	if (backend_ == BACKEND_GST) {
+		pthread_mutex_unlock(&mutex_);
+		return gstreamer_output.play(gst_player_, gst_transition,
+					     NULL);
+	}
+#endif
+	char *uri = uri_ ? strdup(uri_) : NULL;
+	pthread_mutex_unlock(&mutex_);
+	if (uri == NULL) {
+		Log_error("alsa", "Nothing to play.");
+		return -1;
+	}
+
+	struct pcm_source src;
+	const enum probe_result probe =
+		via_gst ? PROBE_OTHER : source_open(uri, &src);
+	int result = 0;
+	if (probe == PROBE_PCM) {
+		Log_info("alsa", "Playing %uHz/%u channel %s-endian PCM "
+			 "directly.", src.format.rate, src.format.channels,
+			 src.format.big_endian ? "big" : "little");
+		pthread_mutex_lock(&mutex_);
+		metrics_start("alsa", play_us);
+		start_playback_thread(&src);
+		pthread_mutex_unlock(&mutex_);
+	} else if (probe == PROBE_OTHER) {
+		result = play_with_gst(uri, play_us);
+	} else {
+		result = -1;
+	}
+	free(uri);
+	return result;
+}
+
+static int output_alsa_stop(void *instance) {
+	(void) instance;
+	stop_playback_thread();
+	pthread_mutex_lock(&mutex_);
+	const enum alsa_backend backend = backend_;
+	backend_ = BACKEND_NONE;
+	position_frames_ = 0;
+	metrics_report();
+	pthread_mutex_unlock(&mutex_);
+#ifdef HAVE_GST
+	if (backend == BACKEND_GST) {
+		return gstreamer_output.stop(gst_player_);
+	}
+#else
+	(void) backend;
+#endif
+	return 0;
+}
+
+static int output_alsa_pause(void *instance) {
+	(void) instance;
+	pthread_mutex_lock(&mutex_);
+	const enum alsa_backend backend = backend_;
+	if (backend == BACKEND_DIRECT) {
+		paused_ = 1;
+	}
+	pthread_mutex_unlock(&mutex_);
+#ifdef HAVE_GST
+	if (backend == BACKEND_GST) {
+		return gstreamer_output.pause(gst_player_);
+	}
+#endif
+	return 0;
+}
+
+static int output_alsa_seek(void *instance, gint64 position_nanos) {
+	(void) instance;
+	pthread_mutex_lock(&mutex_);
+	const enum alsa_backend backend = backend_;
+	if (backend == BACKEND_DIRECT) {
+		if (position_nanos < 0)
+			position_nanos = 0;
+		seek_frame_ = position_nanos * rate_ / 1000000000LL;
+		position_frames_ = seek_frame_;
+	}
+	pthread_mutex_unlock(&mutex_);
+#ifdef HAVE_GST
+	if (backend == BACKEND_GST) {
+		return gstreamer_output.seek(gst_player_, position_nanos);
+	}
+#endif
+	return 0;
+}
+
+static int output_alsa_get_position(void *instance,
+				    gint64 *track_duration,
+				    gint64 *track_pos) {
+	(void) instance;
+	pthread_mutex_lock(&mutex_);
+	const enum alsa_backend backend = backend_;
+	*track_duration = 0;
+	*track_pos = 0;
+	if (backend == BACKEND_DIRECT && rate_ > 0) {
+		*track_duration = duration_frames_ * 1000000000LL / rate_;
+		*track_pos = position_frames_ * 1000000000LL / rate_;
+	}
+	pthread_mutex_unlock(&mutex_);
+#ifdef HAVE_GST
+	if (backend == BACKEND_GST) {
+		return gstreamer_output.get_position(gst_player_,
+						     track_duration, track_pos);
+	}
+#endif
+	return 0;
+}
+
+static int output_alsa_get_volume(void *instance, float *v) {
+	(void) instance;
+	*v = volume_;
+	return 0;
+}
+static int output_alsa_set_volume(void *instance, float value) {
+	(void) instance;
+	Log_info("alsa", "Set volume fraction to %f", value);
+	volume_ = value;
+	update_gain();
+#ifdef HAVE_GST
+	gstreamer_output.set_volume(gst_player_, value);
+#endif
+	return 0;
+}
+static int output_alsa_get_mute(void *instance, int *m) {
+	(void) instance;
+	*m = mute_;
+	return 0;
+}
+static int output_alsa_set_mute(void *instance, int m) {
+	(void) instance;
+	Log_info("alsa", "Set mute to %s", m ? "on" : "off");
+	mute_ = m;
+	update_gain();
+#ifdef HAVE_GST
+	gstreamer_output.set_mute(gst_player_, m);
+#endif
+	return 0;
+}
+
+static int output_alsa_add_options(GOptionContext *ctx)
+{
+	GOptionGroup *option_group;
+	option_group = g_option_group_new("alsaout", "ALSA Output Options",
+	                                  "Show ALSA Output Options",
+	                                  NULL, NULL);
+	g_option_group_add_entries(option_group, option_entries);
+
+	g_option_context_add_group (ctx, option_group);
+	return 0;
+}
+
+static int output_alsa_init(void)
+{
+	if (period_us <= 0 || buffer_us < 2 * period_us) {
+		Log_error("alsa", "--alsaout-buffer-us needs to be at least "
+			  "twice --alsaout-period-us.");
+		return -1;
+	}
+	if (alsa_device == NULL) {
+		alsa_device = g_strdup("default");
+	}
+#ifdef HAVE_GST
+	// Everything that is not plain PCM is played by GStreamer. This
+	// also registers all the mime types it can handle.
+	if (gstreamer_output.init() != 0) {
+		return -1;
+	}
+#endif
+	register_mime_type("audio/L16;rate=44100;channels=2");
+	register_mime_type("audio/L16;rate=48000;channels=2");
+	register_mime_type("audio/L16");
+	register_mime_type("audio/wav");
+	register_mime_type("audio/x-wav");
+	return 0;
+}
+
+static void *output_alsa_create(const char *sink)
+{
+	if (created_) {
+		Log_error("alsa", "Only one direct ALSA output per process; "
+			  "use the GStreamer output with "
+			  "'alsasink device=...' for more.");
+		return NULL;
+	}
+	if (sink != NULL) {
+		g_free(alsa_device);
+		alsa_device = g_strdup(sink);
+	}
+#ifdef HAVE_GST
+	// The rest goes to the same device.
+	gchar *escaped_device = g_strescape(alsa_device, NULL);
+	gchar *gst_sink = g_strdup_printf("alsasink device=\"%s\"",
+					  escaped_device);
+	gst_player_ = gstreamer_output.create(gst_sink);
+	g_free(gst_sink);
+	g_free(escaped_device);
+	if (gst_player_ == NULL) {
+		return NULL;
+	}
+#endif
+	created_ = 1;
+
+	snd_pcm_t *pcm;
+	const int err = snd_pcm_open(&pcm, alsa_device, SND_PCM_STREAM_PLAYBACK,
+				     SND_PCM_NONBLOCK);
+	if (err < 0) {
+		// Might be busy right now; we'll try again when playing.
+		Log_error("alsa", "Can't open %s: %s", alsa_device,
+			  snd_strerror(err));
+	} else {
+		snd_pcm_close(pcm);
+	}
+	update_gain();
+	Log_info("alsa", "PCM streams on %s (period %dus, buffer %dus)%s.",
+		 alsa_device, period_us, buffer_us,
+		 via_gst ? "; all streams via GStreamer" : "");
+	return &created_;  // Nothing per instance; all state is static.
+}
+
+struct output_module alsa_output = {
+        .shortname = "alsa",
+	.description = "Direct ALSA output for PCM; GStreamer for the rest",
+	.add_options = output_alsa_add_options,
+
+	.init        = output_alsa_init,
+	.create      = output_alsa_create,
+	.set_uri     = output_alsa_set_uri,
+	.set_next_uri= output_alsa_set_next_uri,
+	.play        = output_alsa_play,
+	.stop        = output_alsa_stop,
+	.pause       = output_alsa_pause,
+	.seek        = output_alsa_seek,
+
+	.get_position = output_alsa_get_position,
+	.get_volume  = output_alsa_get_volume,
+	.set_volume  = output_alsa_set_volume,
+	.get_mute  = output_alsa_get_mute,
+	.set_mute  = output_alsa_set_mute,
+};
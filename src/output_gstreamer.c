@@ -31,29 +31,32 @@
 #include <assert.h>
 #include <gst/gst.h>
 #include <math.h>
+#ifdef __GLIBC__
+#  include <malloc.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <sys/stat.h>
 
 #include "logging.h"
+#include "media-cache.h"
 #include "upnp_connmgr.h"
 #include "output_module.h"
 #include "output_gstreamer.h"
+#ifdef HAVE_GST_NET
+#  include "sync-group.h"
+#endif
 
 static double buffer_duration = 0.0; /* Buffer disbled by default, see #182 */
+static gboolean rescan_mimes = FALSE;
 
-static void scan_mime_list(void)
+// Collect the names of all sink caps of all elements in the registry.
+static void scan_registry_mime_types(GstRegistry *registry,
+				     GHashTable *types)
 {
-	GstRegistry* registry = NULL;
-
-#if (GST_VERSION_MAJOR < 1)
-	registry = gst_registry_get_default();
-#else
-	registry = gst_registry_get();
-#endif
-
 	// Fetch a list of all element factories
 	GList* features =
 		gst_registry_get_feature_list(registry, GST_TYPE_ELEMENT_FACTORY);
@@ -104,8 +107,11 @@ static void scan_mime_list(void)
 
 			for (guint i = 0; i < gst_caps_get_size(capabilities); i++) {
 				GstStructure* structure = gst_caps_get_structure(capabilities, i);
-
-				register_mime_type(gst_structure_get_name(structure));
+				const gchar *name = gst_structure_get_name(structure);
+				if (!g_hash_table_lookup(types, name)) {
+					g_hash_table_insert(types, g_strdup(name),
+							    GINT_TO_POINTER(1));
+				}
 			}
 
 			gst_caps_unref(capabilities);
@@ -114,6 +120,143 @@ static void scan_mime_list(void)
 
 	// Free any allocated memory
 	gst_plugin_feature_list_free(root);
+}
+
+static gint compare_strings(gconstpointer a, gconstpointer b) {
+	return strcmp(*(const char *const *) a, *(const char *const *) b);
+}
+
+// Returns a newly allocated hash over all plugins with their version and
+// the modification time of their files. If any plugin is added, removed
+// or updated, this changes; so does the result of the registry scan.
+static char *registry_fingerprint(GstRegistry *registry)
+{
+	GList *plugins = gst_registry_get_plugin_list(registry);
+	GPtrArray *lines = g_ptr_array_new_with_free_func(g_free);
+	for (GList *it = plugins; it != NULL; it = g_list_next(it)) {
+		GstPlugin *plugin = GST_PLUGIN(it->data);
+		const gchar *filename = gst_plugin_get_filename(plugin);
+		struct stat st;
+		if (filename == NULL || stat(filename, &st) != 0) {
+			memset(&st, 0, sizeof(st));  // built-in.
+		}
+		g_ptr_array_add(lines, g_strdup_printf(
+			"%s %s %s %ld %ld\n", gst_plugin_get_name(plugin),
+			gst_plugin_get_version(plugin),
+			filename ? filename : "-",
+			(long) st.st_mtime, (long) st.st_size));
+	}
+	gst_plugin_list_free(plugins);
+	// Registry order is not something to rely on.
+	g_ptr_array_sort(lines, compare_strings);
+
+	GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA1);
+	char version[64];
+	snprintf(version, sizeof(version), "mime-cache 1; gstreamer %d.%d\n",
+		 GST_VERSION_MAJOR, GST_VERSION_MINOR);
+	g_checksum_update(checksum, (const guchar *) version, -1);
+	for (guint i = 0; i < lines->len; ++i) {
+		g_checksum_update(checksum,
+				  g_ptr_array_index(lines, i), -1);
+	}
+	char *result = strdup(g_checksum_get_string(checksum));
+	g_checksum_free(checksum);
+	g_ptr_array_free(lines, TRUE);
+	return result;
+}
+
+// The cache file has the registry fingerprint in the first line, followed
+// by one mime type per line. Returns the lines if the fingerprint matches,
+// NULL otherwise. Free with g_strfreev().
+static gchar **load_mime_cache(const char *filename, const char *key)
+{
+	gchar *content = NULL;
+	if (!g_file_get_contents(filename, &content, NULL, NULL))
+		return NULL;
+	gchar **lines = g_strsplit(content, "\n", -1);
+	g_free(content);
+	if (lines[0] == NULL || strcmp(lines[0], key) != 0) {
+		g_strfreev(lines);
+		return NULL;
+	}
+	return lines;
+}
+
+static void save_mime_cache(const char *filename, const char *key,
+			    GList *types)
+{
+	GString *content = g_string_new(key);
+	g_string_append_c(content, '\n');
+	for (GList *it = types; it != NULL; it = g_list_next(it)) {
+		g_string_append(content, it->data);
+		g_string_append_c(content, '\n');
+	}
+
+	gchar *dir = g_path_get_dirname(filename);
+	GError *error = NULL;
+	g_mkdir_with_parents(dir, 0755);
+	if (!g_file_set_contents(filename, content->str, content->len,
+				 &error)) {
+		Log_error("gstreamer", "Can't write mime type cache: %s",
+			  error->message);
+		g_error_free(error);
+	}
+	g_free(dir);
+	g_string_free(content, TRUE);
+}
+
+// Find all mime types we can decode. Walking all pad templates of all
+// elements is slow with a full set of plugins, so the result is kept in a
+// cache file, valid as long as the set of plugins doesn't change.
+static void scan_mime_list(void)
+{
+	GstRegistry* registry = NULL;
+	const gint64 start = g_get_monotonic_time();
+
+#if (GST_VERSION_MAJOR < 1)
+	registry = gst_registry_get_default();
+#else
+	registry = gst_registry_get();
+#endif
+
+	char *key = registry_fingerprint(registry);
+	gchar *cache_file = g_build_filename(g_get_user_cache_dir(),
+					     "gmediarender", "gst-mime-types",
+					     NULL);
+	gchar **cached =
+		rescan_mimes ? NULL : load_mime_cache(cache_file, key);
+	if (cached != NULL) {
+		int count = 0;
+		for (gchar **type = cached + 1; *type != NULL; ++type) {
+			if (**type == '\0') continue;
+			register_mime_type(*type);
+			++count;
+		}
+		g_strfreev(cached);
+		Log_info("gstreamer", "%d mime types from %s in %.1fms",
+			 count, cache_file,
+			 (g_get_monotonic_time() - start) / 1000.0);
+	} else {
+		GHashTable *types = g_hash_table_new_full(g_str_hash,
+							  g_str_equal,
+							  g_free, NULL);
+		scan_registry_mime_types(registry, types);
+		// Same order as when read from the cache.
+		GList *names = g_list_sort(g_hash_table_get_keys(types),
+					   (GCompareFunc) strcmp);
+		for (GList *it = names; it != NULL; it = g_list_next(it)) {
+			register_mime_type(it->data);
+		}
+		Log_info("gstreamer", "%d mime types from registry scan in "
+			 "%.1fms%s", g_hash_table_size(types),
+			 (g_get_monotonic_time() - start) / 1000.0,
+			 rescan_mimes ? " (--rescan-mimes)" : "");
+		save_mime_cache(cache_file, key, names);
+		g_list_free(names);
+		g_hash_table_destroy(types);
+	}
+	g_free(cache_file);
+	free(key);
 
 	// There seem to be all kinds of mime types out there that start with
 	// "audio/" but are not explicitly supported by gstreamer. Let's just
@@ -122,53 +265,745 @@ static void scan_mime_list(void)
 	register_mime_type("audio/*");
 }
 
-static GstElement *player_ = NULL;
-static char *gsuri_ = NULL;         // locally strdup()ed
-static char *gs_next_uri_ = NULL;   // locally strdup()ed
-static struct SongMetaData song_meta_;
-
-static output_transition_cb_t play_trans_callback_ = NULL;
-static output_update_meta_cb_t meta_update_callback_ = NULL;
-
 struct track_time_info {
 	gint64 duration;
 	gint64 position;
 };
-static struct track_time_info last_known_time_ = {0, 0};
 
-static GstState get_current_player_state() {
+// Statistics of the gapless transitions, only accessed from the main loop.
+struct transition_stats {
+	unsigned int count;
+	gint64 max_gap_ns;      // gap in the output stream (running time).
+	gint64 max_handover_us; // wall time between last and first buffer.
+	gint64 total_handover_us;
+};
+
+struct gapless_chain;
+
+// One pipeline with everything it is playing. Every renderer has its own;
+// mime types, options and the media cache are shared.
+struct gst_player {
+	GstElement *player;
+	char *gsuri;         // locally strdup()ed
+	char *gs_next_uri;   // locally strdup()ed
+	struct SongMetaData song_meta;
+
+	output_transition_cb_t play_trans_callback;
+	void *play_trans_userdata;
+	output_update_meta_cb_t meta_update_callback;
+	void *meta_update_userdata;
+
+	struct track_time_info last_known_time;
+
+	// Media cache URIs playbin might read from: the current stream and,
+	// after about-to-finish, the one finishing.
+	char *cache_uris[2];
+
+	// The element carrying the "volume" and "mute" properties; either
+	// the playbin or a volume element in gapless mode.
+	GstElement *volume_element;
+
+	// Gapless mode, see below.
+	GstElement *concat;
+
+	// Protects current_chain, next_chain and gs_next_uri which are
+	// accessed from the main loop as well as from UPnP action handlers.
+	GMutex gapless_mutex;
+	struct gapless_chain *current_chain;
+	struct gapless_chain *next_chain;
+	// The next URI changed while concat switched over to next_chain.
+	gboolean preroll_after_switch;
+
+	// Transition measurement. Only touched by the streaming thread of
+	// the concat source pad, except switch_pending.
+	volatile gint switch_pending;
+	GstSegment output_segment;
+	GstClockTime last_buffer_end;  // running time
+	gint64 last_buffer_wallclock;
+	struct transition_stats transition_stats;
+
+	// In a sync group: running time to continue at when resuming.
+	GstClockTime sync_running_time;
+
+	// Warm standby: gsuri is pre-rolled (PAUSED) while we are stopped.
+	gboolean standby;
+	gboolean standby_ready;
+
+	// Time to first sample. play_us is 0 once reported.
+	gint64 set_uri_us;
+	gint64 play_us;
+	const char *startup_path;  // "standby", "resume" or "cold".
+
+	// Idle release. Every play, pause or stop starts a new generation;
+	// a release timer only fires if nothing happened since it was set.
+	GMutex idle_mutex;
+	gint idle_generation;
+};
+
+// In gapless mode, we don't use playbin but our own pipeline with a decoder
+// chain per stream feeding into a concat element.
+static gboolean gapless_ = FALSE;
+
+// While stopped, keep the current stream pre-rolled (--gstout-standby).
+static gboolean standby_ = FALSE;
+
+// Release the pipeline after being stopped this long (--gstout-idle-release).
+static int idle_release_s = 0;
+
+// Optional local cache for http streams (--gstout-cache-dir).
+static struct media_cache *media_cache_ = NULL;
+
+#ifdef HAVE_GST_NET
+// Optional group of renderers playing in lockstep (--gstout-sync-*).
+static struct sync_group *sync_group_ = NULL;
+#endif
+
+// In a sync group, agree on the base time with the others before the
+// pipeline goes to PLAYING.
+static void sync_start(struct gst_player *p, GstClockTime running_time) {
+#ifdef HAVE_GST_NET
+	if (sync_group_) {
+		SyncGroup_set_base_time(sync_group_, p->player, p->gsuri,
+					running_time);
+	}
+#else
+	(void)p;
+	(void)running_time;
+#endif
+}
+
+// Remember where we are for sync_start() on resume.
+static void sync_remember_position(struct gst_player *p) {
+#ifdef HAVE_GST_NET
+	if (sync_group_) {
+		p->sync_running_time =
+			SyncGroup_running_time(sync_group_, p->player);
+	}
+#else
+	(void)p;
+#endif
+}
+
+// Let the media cache know we don't read from the proxy URI anymore.
+static void release_cache_uri(char **cache_uri) {
+	if (*cache_uri != NULL) {
+		MediaCache_release_uri(media_cache_, *cache_uri);
+		free(*cache_uri);
+		*cache_uri = NULL;
+	}
+}
+
+// Set the uri on the given element (playbin or uridecodebin), going
+// through the media cache if possible. The proxy URI used is stored in
+// cache_uri, to be released once the element is done with it.
+static void set_element_uri(GstElement *element, const char *uri,
+			    char **cache_uri) {
+	assert(*cache_uri == NULL);
+	char *cached = (media_cache_ && uri)
+		? MediaCache_proxy_uri(media_cache_, uri) : NULL;
+	if (cached) {
+		Log_info("gstreamer", "Playing %s via cache %s", uri, cached);
+	}
+	g_object_set(G_OBJECT(element), "uri", cached ? cached : uri, NULL);
+	*cache_uri = cached;
+}
+
+static GstState get_current_player_state(struct gst_player *p) {
 	GstState state = GST_STATE_PLAYING;
 	GstState pending = GST_STATE_NULL;
-	gst_element_get_state(player_, &state, &pending, 0);
+	gst_element_get_state(p->player, &state, &pending, 0);
 	return state;
 }
 
-static void output_gstreamer_set_next_uri(const char *uri) {
+// Drop an element that never made it into a bin.
+static void unref_floating(GstElement *element) {
+	if (element != NULL) {
+		gst_object_ref_sink(element);
+		gst_object_unref(element);
+	}
+}
+
+#if (GST_VERSION_MAJOR >= 1)
+// -- Gapless mode.
+//
+// Each stream gets its own uridecodebin, linked to a request pad of the
+// concat element. As soon as we know the next URI, its chain is created and
+// starts connecting, typefinding and decoding in the background. The concat
+// element blocks the data of the next chain until the current stream is
+// finished, then switches over at the exact sample boundary, adjusting the
+// segments so that running time is continuous.
+struct gapless_chain {
+	GstElement *decoder;   // uridecodebin of this stream.
+	GstPad *concat_pad;    // Our input pad on concat.
+	char *uri;             // locally strdup()ed
+	char *cache_uri;       // Proxy URI of the media cache, if used.
+};
+
+static void gapless_on_pad_added(GstElement *decoder, GstPad *pad,
+				 gpointer userdata) {
+	(void)decoder;
+	struct gapless_chain *chain = (struct gapless_chain*) userdata;
+	GstCaps *caps = gst_pad_get_current_caps(pad);
+	if (caps == NULL) {
+		caps = gst_pad_query_caps(pad, NULL);
+	}
+	const int is_audio = (caps != NULL && gst_caps_get_size(caps) > 0
+			      && g_str_has_prefix(gst_structure_get_name(
+				      gst_caps_get_structure(caps, 0)), "audio/"));
+	if (caps != NULL) {
+		gst_caps_unref(caps);
+	}
+	if (!is_audio || gst_pad_is_linked(chain->concat_pad)) {
+		return;  // Only the first audio stream is played.
+	}
+	if (gst_pad_link(pad, chain->concat_pad) != GST_PAD_LINK_OK) {
+		Log_error("gstreamer", "Couldn't link decoder to concat.");
+	}
+}
+
+static struct gapless_chain *gapless_chain_new(struct gst_player *p,
+					       const char *uri) {
+	GstElement *decoder = gst_element_factory_make("uridecodebin", NULL);
+	if (decoder == NULL) {
+		Log_error("gstreamer", "Couldn't create uridecodebin");
+		return NULL;
+	}
+	char *cache_uri = NULL;
+	set_element_uri(decoder, uri, &cache_uri);
+	if (buffer_duration > 0) {
+		g_object_set(G_OBJECT(decoder),
+			     "use-buffering", TRUE,
+			     "buffer-duration",
+			     (gint64) round(buffer_duration * 1.0e9),
+			     NULL);
+	}
+
+	struct gapless_chain *chain = (struct gapless_chain*)
+		malloc(sizeof(struct gapless_chain));
+	chain->decoder = decoder;
+	chain->uri = strdup(uri);
+	chain->cache_uri = cache_uri;
+	// Request the pad right away, so that the order of pads on concat
+	// is the order of the streams, independent of which decoder is
+	// faster to come up with its pad.
+#if GST_CHECK_VERSION(1,20,0)
+	chain->concat_pad = gst_element_request_pad_simple(p->concat,
+							   "sink_%u");
+#else
+	chain->concat_pad = gst_element_get_request_pad(p->concat, "sink_%u");
+#endif
+	g_signal_connect(G_OBJECT(decoder), "pad-added",
+			 G_CALLBACK(gapless_on_pad_added), chain);
+	gst_bin_add(GST_BIN(p->player), decoder);
+	gst_element_sync_state_with_parent(decoder);
+	return chain;
+}
+
+static void gapless_chain_free(struct gst_player *p,
+			       struct gapless_chain *chain) {
+	if (chain == NULL)
+		return;
+	g_signal_handlers_disconnect_by_func(chain->decoder,
+					     gapless_on_pad_added, chain);
+	// Releasing the pad first unblocks a chain that is waiting in
+	// concat to become active, so that the state change can't stall.
+	gst_element_release_request_pad(p->concat, chain->concat_pad);
+	gst_object_unref(chain->concat_pad);
+	gst_element_set_state(chain->decoder, GST_STATE_NULL);
+	gst_bin_remove(GST_BIN(p->player), chain->decoder);
+	release_cache_uri(&chain->cache_uri);
+	free(chain->uri);
+	free(chain);
+}
+
+// Whether concat already switched over to this chain. Its data might
+// be playing while gapless_finish_switch() is still to run in the main loop.
+static int gapless_chain_is_active(struct gst_player *p,
+				   struct gapless_chain *chain) {
+	GstPad *active = NULL;
+	g_object_get(G_OBJECT(p->concat), "active-pad", &active, NULL);
+	const int result = (active == chain->concat_pad);
+	if (active != NULL) {
+		gst_object_unref(active);
+	}
+	return result;
+}
+
+// Free the chains of all streams. The player needs to be in READY or NULL
+// state.
+static void gapless_unload_streams(struct gst_player *p) {
+	g_mutex_lock(&p->gapless_mutex);
+	struct gapless_chain *old_current = p->current_chain;
+	struct gapless_chain *old_next = p->next_chain;
+	p->current_chain = p->next_chain = NULL;
+	p->preroll_after_switch = FALSE;
+	g_mutex_unlock(&p->gapless_mutex);
+	gapless_chain_free(p, old_next);
+	gapless_chain_free(p, old_current);
+
+	p->last_buffer_end = GST_CLOCK_TIME_NONE;
+	p->last_buffer_wallclock = 0;
+	g_atomic_int_set(&p->switch_pending, 0);
+}
+
+// (Re-)create the chains for the current and possibly next URI. The
+// player needs to be in READY state.
+static void gapless_load_streams(struct gst_player *p) {
+	gapless_unload_streams(p);
+
+	g_mutex_lock(&p->gapless_mutex);
+	char *next_uri = p->gs_next_uri ? strdup(p->gs_next_uri) : NULL;
+	g_mutex_unlock(&p->gapless_mutex);
+	if (p->gsuri == NULL) {
+		free(next_uri);
+		return;
+	}
+	struct gapless_chain *current = gapless_chain_new(p, p->gsuri);
+	struct gapless_chain *next = (next_uri != NULL)
+		? gapless_chain_new(p, next_uri) : NULL;
+	free(next_uri);
+	g_mutex_lock(&p->gapless_mutex);
+	p->current_chain = current;
+	p->next_chain = next;
+	g_mutex_unlock(&p->gapless_mutex);
+}
+
+// Replace the chain of the next stream by one for gs_next_uri (if 'load'),
+// so that it pre-rolls while the current one is still playing.
+// Called from the main loop as well as from UPnP action handlers.
+static void gapless_preroll_next(struct gst_player *p, gboolean load) {
+	g_mutex_lock(&p->gapless_mutex);
+	struct gapless_chain *old_next = p->next_chain;
+	if (old_next != NULL && gapless_chain_is_active(p, old_next)) {
+		// Too late, that one is playing already. The main loop
+		// picks up gs_next_uri once it finished the switch.
+		p->preroll_after_switch = TRUE;
+		g_mutex_unlock(&p->gapless_mutex);
+		return;
+	}
+	p->next_chain = NULL;
+	// Without a current chain, gapless_load_streams() picks it up.
+	char *uri = (load && p->gs_next_uri != NULL && p->current_chain)
+		? strdup(p->gs_next_uri) : NULL;
+	g_mutex_unlock(&p->gapless_mutex);
+	gapless_chain_free(p, old_next);
+
+	if (uri == NULL)
+		return;
+	Log_info("gstreamer", "Pre-rolling next uri '%s'", uri);
+	struct gapless_chain *next = gapless_chain_new(p, uri);
+	g_mutex_lock(&p->gapless_mutex);
+	// Someone else pre-rolled in the meantime, or the next uri changed
+	// again and its pre-roll will follow: this one is not needed.
+	if (p->next_chain != NULL || p->gs_next_uri == NULL
+	    || strcmp(p->gs_next_uri, uri) != 0) {
+		g_mutex_unlock(&p->gapless_mutex);
+		gapless_chain_free(p, next);
+	} else {
+		p->next_chain = next;
+		g_mutex_unlock(&p->gapless_mutex);
+	}
+	free(uri);
+}
+
+// Messages from elements of the pre-rolling chain (tags, buffering) are
+// not about what we're playing right now.
+static int gapless_is_from_next_stream(struct gst_player *p,
+				       GstObject *src) {
+	if (!gapless_)
+		return 0;
+	g_mutex_lock(&p->gapless_mutex);
+	const int result = (p->next_chain != NULL &&
+			    (src == GST_OBJECT(p->next_chain->decoder) ||
+			     gst_object_has_as_ancestor(
+				     src, GST_OBJECT(p->next_chain->decoder))));
+	g_mutex_unlock(&p->gapless_mutex);
+	return result;
+}
+
+static void gapless_on_active_pad(GObject *obj, GParamSpec *pspec,
+				  gpointer userdata) {
+	(void)obj;
+	(void)pspec;
+	struct gst_player *p = (struct gst_player*) userdata;
+	g_atomic_int_set(&p->switch_pending, 1);
+}
+
+// Watches the data leaving concat. On the first buffer after a switch,
+// posts a message with the measured gap to the bus.
+static GstPadProbeReturn gapless_output_probe(GstPad *pad,
+					      GstPadProbeInfo *info,
+					      gpointer userdata) {
+	(void)pad;
+	struct gst_player *p = (struct gst_player*) userdata;
+	if (GST_PAD_PROBE_INFO_TYPE(info)
+	    & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+		GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+		if (GST_EVENT_TYPE(event) == GST_EVENT_SEGMENT) {
+			gst_event_copy_segment(event, &p->output_segment);
+		}
+		return GST_PAD_PROBE_OK;
+	}
+
+	GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+	const gint64 now = g_get_monotonic_time();
+	const GstClockTime start = gst_segment_to_running_time(
+		&p->output_segment, GST_FORMAT_TIME, GST_BUFFER_PTS(buffer));
+	if (g_atomic_int_compare_and_exchange(&p->switch_pending, 1, 0)
+	    && GST_CLOCK_TIME_IS_VALID(p->last_buffer_end)
+	    && GST_CLOCK_TIME_IS_VALID(start)) {
+		GstStructure *s = gst_structure_new(
+			"gapless-switch",
+			"gap-ns", G_TYPE_INT64,
+			(gint64) (start - p->last_buffer_end),
+			"handover-us", G_TYPE_INT64,
+			now - p->last_buffer_wallclock,
+			NULL);
+		gst_element_post_message(p->player,
+					 gst_message_new_application(
+						 GST_OBJECT(p->player), s));
+	}
+	p->last_buffer_end = GST_CLOCK_TIME_IS_VALID(start)
+		&& GST_CLOCK_TIME_IS_VALID(GST_BUFFER_DURATION(buffer))
+		? start + GST_BUFFER_DURATION(buffer)
+		: GST_CLOCK_TIME_NONE;
+	p->last_buffer_wallclock = now;
+	return GST_PAD_PROBE_OK;
+}
+
+// Called in the main loop once the next stream actually started to play.
+// Returns 1 if we switched over to the next stream.
+static int gapless_finish_switch(struct gst_player *p,
+				 const GstStructure *s) {
+	GstPad *active = NULL;
+	g_object_get(G_OBJECT(p->concat), "active-pad", &active, NULL);
+	struct gapless_chain *finished = NULL;
+	char *playing_uri = NULL;
+	char *played_next_uri = NULL;
+	int preroll_next = 0;
+	g_mutex_lock(&p->gapless_mutex);
+	if (p->next_chain != NULL && active == p->next_chain->concat_pad) {
+		finished = p->current_chain;
+		p->current_chain = p->next_chain;
+		p->next_chain = NULL;
+		playing_uri = strdup(p->current_chain->uri);
+		// gs_next_uri might have been replaced while we switched
+		// over to the previous one; then it is the one to come
+		// after this.
+		preroll_next = p->preroll_after_switch;
+		p->preroll_after_switch = FALSE;
+		if (!preroll_next) {
+			played_next_uri = p->gs_next_uri;
+			p->gs_next_uri = NULL;
+		}
+	}
+	g_mutex_unlock(&p->gapless_mutex);
+	if (active != NULL) {
+		gst_object_unref(active);
+	}
+	if (finished == NULL)
+		return 0;
+	gapless_chain_free(p, finished);
+	free(played_next_uri);
+
+	free(p->gsuri);
+	p->gsuri = playing_uri;
+	if (preroll_next) {
+		gapless_preroll_next(p, TRUE);
+	}
+
+	gint64 gap_ns = 0, handover_us = 0;
+	gst_structure_get_int64(s, "gap-ns", &gap_ns);
+	gst_structure_get_int64(s, "handover-us", &handover_us);
+	struct transition_stats *stats = &p->transition_stats;
+	stats->count++;
+	stats->total_handover_us += handover_us;
+	if (gap_ns > stats->max_gap_ns) stats->max_gap_ns = gap_ns;
+	if (handover_us > stats->max_handover_us)
+		stats->max_handover_us = handover_us;
+	Log_info("gstreamer", "Gapless transition #%u: stream gap %" PRId64
+		 "ns, hand-over %" PRId64 "us (avg %" PRId64 "us, "
+		 "max %" PRId64 "us; max gap %" PRId64 "ns)",
+		 stats->count, gap_ns, handover_us,
+		 stats->total_handover_us / stats->count,
+		 stats->max_handover_us, stats->max_gap_ns);
+	return 1;
+}
+
+// Takes ownership of the sink, also on failure.
+static int gapless_init_pipeline(struct gst_player *p, GstElement *sink) {
+	p->player = gst_pipeline_new("play");
+	p->concat = gst_element_factory_make("concat", "concat");
+	GstElement *convert = gst_element_factory_make("audioconvert", NULL);
+	GstElement *resample = gst_element_factory_make("audioresample", NULL);
+	p->volume_element = gst_element_factory_make("volume", "volume");
+	if (sink == NULL) {
+		sink = gst_element_factory_make("autoaudiosink", "sink");
+	}
+	if (p->concat == NULL || convert == NULL || resample == NULL
+	    || p->volume_element == NULL || sink == NULL) {
+		Log_error("gstreamer", "Couldn't create elements for gapless "
+			  "playback (needs GStreamer >= 1.6)");
+		unref_floating(p->concat);
+		unref_floating(convert);
+		unref_floating(resample);
+		unref_floating(p->volume_element);
+		unref_floating(sink);
+		gst_object_unref(p->player);
+		p->player = p->concat = p->volume_element = NULL;
+		return 1;
+	}
+	gst_bin_add_many(GST_BIN(p->player), p->concat, convert, resample,
+			 p->volume_element, sink, NULL);
+	if (!gst_element_link_many(p->concat, convert, resample,
+				   p->volume_element, sink, NULL)) {
+		Log_error("gstreamer", "Couldn't link gapless pipeline.");
+		gst_object_unref(p->player);  // and everything in it.
+		p->player = p->concat = p->volume_element = NULL;
+		return 1;
+	}
+
+	gst_segment_init(&p->output_segment, GST_FORMAT_TIME);
+	p->last_buffer_end = GST_CLOCK_TIME_NONE;
+	g_signal_connect(G_OBJECT(p->concat), "notify::active-pad",
+			 G_CALLBACK(gapless_on_active_pad), p);
+	GstPad *src = gst_element_get_static_pad(p->concat, "src");
+	gst_pad_add_probe(src, (GstPadProbeType)
+			  (GST_PAD_PROBE_TYPE_BUFFER
+			   | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM),
+			  gapless_output_probe, p, NULL);
+	gst_object_unref(src);
+	return 0;
+}
+#else
+// No concat element in GStreamer 0.10.
+static void gapless_unload_streams(struct gst_player *p) { (void)p; }
+static void gapless_load_streams(struct gst_player *p) { (void)p; }
+static void gapless_preroll_next(struct gst_player *p, gboolean load) {
+	(void)p;
+	(void)load;
+}
+static int gapless_is_from_next_stream(struct gst_player *p,
+				       GstObject *src) {
+	(void)p;
+	(void)src;
+	return 0;
+}
+static int gapless_finish_switch(struct gst_player *p,
+				 const GstStructure *s) {
+	(void)p;
+	(void)s;
+	return 0;
+}
+static int gapless_init_pipeline(struct gst_player *p, GstElement *sink) {
+	(void)p;
+	unref_floating(sink);
+	Log_error("gstreamer", "Gapless mode needs GStreamer 1.x");
+	return 1;
+}
+#endif
+
+// Take over gs_next_uri, which UPnP action handlers might replace any time.
+static char *take_next_uri(struct gst_player *p) {
+	g_mutex_lock(&p->gapless_mutex);
+	char *uri = p->gs_next_uri;
+	p->gs_next_uri = NULL;
+	g_mutex_unlock(&p->gapless_mutex);
+	return uri;
+}
+
+// Let the player play gsuri from the beginning. Player needs to be in
+// READY state.
+static void player_load_current_uri(struct gst_player *p) {
+	if (gapless_) {
+		gapless_load_streams(p);
+	} else {
+		// In READY, nothing reads from the old ones anymore.
+		release_cache_uri(&p->cache_uris[0]);
+		release_cache_uri(&p->cache_uris[1]);
+		set_element_uri(p->player, p->gsuri, &p->cache_uris[0]);
+	}
+}
+
+// Let go of everything held for the streams: decoder chains and media
+// cache entries. player_load_current_uri() sets them up again. Player needs
+// to be in READY or NULL state.
+static void player_unload_streams(struct gst_player *p) {
+	if (gapless_) {
+		gapless_unload_streams(p);
+	} else {
+		g_object_set(G_OBJECT(p->player), "uri", NULL, NULL);
+		release_cache_uri(&p->cache_uris[0]);
+		release_cache_uri(&p->cache_uris[1]);
+	}
+}
+
+// Open, decode and hand gsuri to the sink up to the first sample, so that
+// play() only has to flip to PLAYING.
+static int standby_preroll(struct gst_player *p) {
+	p->standby = FALSE;
+	if (gst_element_set_state(p->player, GST_STATE_READY) ==
+	    GST_STATE_CHANGE_FAILURE) {
+		return -1;
+	}
+	if (p->gsuri == NULL) {
+		return 0;
+	}
+	player_load_current_uri(p);
+	p->sync_running_time = 0;
+	p->standby = TRUE;
+	p->standby_ready = FALSE;
+	if (gst_element_set_state(p->player, GST_STATE_PAUSED) ==
+	    GST_STATE_CHANGE_FAILURE) {
+		Log_error("gstreamer", "Standby: can't pre-roll '%s'",
+			  p->gsuri);
+		p->standby = FALSE;
+	}
+	return 0;
+}
+
+// Resident set size of the process in KiB, -1 if unknown.
+static long resident_kib(void) {
+	long size = 0, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f == NULL) return -1;
+	const int items = fscanf(f, "%ld %ld", &size, &resident);
+	fclose(f);
+	if (items != 2) return -1;
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+struct idle_timer {
+	struct gst_player *p;
+	gint generation;
+};
+
+// Something happened; pending release timers are void.
+static void idle_touch(struct gst_player *p) {
+	g_mutex_lock(&p->idle_mutex);
+	p->idle_generation++;
+	g_mutex_unlock(&p->idle_mutex);
+}
+
+// Drop the pipeline to NULL and let go of the streams: closes the audio
+// device, frees buffers and decoders and unpins cache entries. The next
+// play() or pre-roll loads gsuri again, as the pipeline is not PAUSED.
+static gboolean idle_release(gpointer data) {
+	struct idle_timer *timer = (struct idle_timer*) data;
+	struct gst_player *p = timer->p;
+	g_mutex_lock(&p->idle_mutex);
+	if (timer->generation == p->idle_generation) {
+		const long before_kib = resident_kib();
+		gst_element_set_state(p->player, GST_STATE_NULL);
+		p->standby = FALSE;
+		player_unload_streams(p);
+		const long released_kib = resident_kib();
+		long trimmed_kib = released_kib;
+#ifdef __GLIBC__
+		malloc_trim(0);  // Give freed heap back to the system.
+		trimmed_kib = resident_kib();
+#endif
+		// Freed memory often stays with the process until trimmed;
+		// report both steps.
+		Log_info("gstreamer", "Stopped for %ds: released pipeline; "
+			 "resident %ldKiB, %ldKiB after release (%ldKiB), "
+			 "%ldKiB after trim (%ldKiB).",
+			 idle_release_s, before_kib,
+			 released_kib, before_kib - released_kib,
+			 trimmed_kib, released_kib - trimmed_kib);
+	}
+	g_mutex_unlock(&p->idle_mutex);
+	free(timer);
+	return FALSE;
+}
+
+// We are stopped now; release unless something happens in time.
+static void idle_start(struct gst_player *p) {
+	if (idle_release_s <= 0) return;
+	struct idle_timer *timer =
+		(struct idle_timer*) malloc(sizeof(struct idle_timer));
+	timer->p = p;
+	g_mutex_lock(&p->idle_mutex);
+	timer->generation = ++p->idle_generation;
+	g_mutex_unlock(&p->idle_mutex);
+	g_timeout_add_seconds(idle_release_s, idle_release, timer);
+}
+
+// Log time to first sample. Called with each state the pipeline reaches.
+static void report_startup(struct gst_player *p, GstState state) {
+	const gint64 now = g_get_monotonic_time();
+	if (state == GST_STATE_PAUSED && p->standby && !p->standby_ready) {
+		p->standby_ready = TRUE;
+		Log_info("gstreamer", "Standby: pre-rolled %.1fms after "
+			 "set uri.", (now - p->set_uri_us) / 1000.0);
+	} else if (state == GST_STATE_PLAYING && p->play_us != 0) {
+		Log_info("gstreamer", "Startup (%s): first sample %.1fms "
+			 "after play, %.1fms after set uri.", p->startup_path,
+			 (now - p->play_us) / 1000.0,
+			 (now - p->set_uri_us) / 1000.0);
+		p->play_us = 0;
+	}
+}
+
+static void output_gstreamer_set_next_uri(void *instance, const char *uri) {
+	struct gst_player *p = (struct gst_player*) instance;
 	Log_info("gstreamer", "Set next uri to '%s'", uri);
-	free(gs_next_uri_);
-	gs_next_uri_ = (uri && *uri) ? strdup(uri) : NULL;
+	char *next_uri = (uri && *uri) ? strdup(uri) : NULL;
+	g_mutex_lock(&p->gapless_mutex);
+	char *old_next_uri = p->gs_next_uri;
+	p->gs_next_uri = next_uri;
+	g_mutex_unlock(&p->gapless_mutex);
+	free(old_next_uri);
+	if (gapless_) {
+		gapless_preroll_next(p, TRUE);
+	}
 }
 
-static void output_gstreamer_set_uri(const char *uri,
-				     output_update_meta_cb_t meta_cb) {
+static void output_gstreamer_set_uri(void *instance, const char *uri,
+				     output_update_meta_cb_t meta_cb,
+				     void *userdata) {
+	struct gst_player *p = (struct gst_player*) instance;
 	Log_info("gstreamer", "Set uri to '%s'", uri);
-	free(gsuri_);
-	gsuri_ = (uri && *uri) ? strdup(uri) : NULL;
-	meta_update_callback_ = meta_cb;
-	SongMetaData_clear(&song_meta_);
+	free(p->gsuri);
+	p->gsuri = (uri && *uri) ? strdup(uri) : NULL;
+	p->meta_update_callback = meta_cb;
+	p->meta_update_userdata = userdata;
+	SongMetaData_clear(&p->song_meta);
+	p->set_uri_us = g_get_monotonic_time();
+	if (p->standby || get_current_player_state(p) <= GST_STATE_READY) {
+		idle_start(p);
+		if (standby_) {
+			standby_preroll(p);
+		}
+	}
 }
 
-static int output_gstreamer_play(output_transition_cb_t callback) {
-	play_trans_callback_ = callback;
-	if (get_current_player_state() != GST_STATE_PAUSED) {
-		if (gst_element_set_state(player_, GST_STATE_READY) ==
+static int output_gstreamer_play(void *instance,
+				 output_transition_cb_t callback,
+				 void *userdata) {
+	struct gst_player *p = (struct gst_player*) instance;
+	p->play_trans_callback = callback;
+	p->play_trans_userdata = userdata;
+	idle_touch(p);
+	p->play_us = g_get_monotonic_time();
+	if (p->standby) {
+		// Pre-rolled already (or on the way there).
+		p->startup_path = "standby";
+		p->standby = FALSE;
+	} else if (get_current_player_state(p) == GST_STATE_PAUSED) {
+		p->startup_path = "resume";
+	} else {
+		p->startup_path = "cold";
+		if (gst_element_set_state(p->player, GST_STATE_READY) ==
 		    GST_STATE_CHANGE_FAILURE) {
 			Log_error("gstreamer", "setting play state failed (1)");
 			// Error, but continue; can't get worse :)
 		}
-		g_object_set(G_OBJECT(player_), "uri", gsuri_, NULL);
+		player_load_current_uri(p);
+		p->sync_running_time = 0;
 	}
-	if (gst_element_set_state(player_, GST_STATE_PLAYING) ==
+	sync_start(p, p->sync_running_time);
+	if (gst_element_set_state(p->player, GST_STATE_PLAYING) ==
 	    GST_STATE_CHANGE_FAILURE) {
 		Log_error("gstreamer", "setting play state failed (2)");
 		return -1;
@@ -176,8 +1011,14 @@ static int output_gstreamer_play(output_transition_cb_t callback) {
 	return 0;
 }
 
-static int output_gstreamer_stop(void) {
-	if (gst_element_set_state(player_, GST_STATE_READY) ==
+static int output_gstreamer_stop(void *instance) {
+	struct gst_player *p = (struct gst_player*) instance;
+	idle_start(p);
+	if (standby_) {
+		// Back to the start, ready for the next play.
+		return standby_preroll(p);
+	}
+	if (gst_element_set_state(p->player, GST_STATE_READY) ==
 	    GST_STATE_CHANGE_FAILURE) {
 		return -1;
 	} else {
@@ -185,8 +1026,11 @@ static int output_gstreamer_stop(void) {
 	}
 }
 
-static int output_gstreamer_pause(void) {
-	if (gst_element_set_state(player_, GST_STATE_PAUSED) ==
+static int output_gstreamer_pause(void *instance) {
+	struct gst_player *p = (struct gst_player*) instance;
+	idle_touch(p);
+	sync_remember_position(p);
+	if (gst_element_set_state(p->player, GST_STATE_PAUSED) ==
 	    GST_STATE_CHANGE_FAILURE) {
 		return -1;
 	} else {
@@ -194,15 +1038,31 @@ static int output_gstreamer_pause(void) {
 	}
 }
 
-static int output_gstreamer_seek(gint64 position_nanos) {
-	if (gst_element_seek(player_, 1.0, GST_FORMAT_TIME,
-			     GST_SEEK_FLAG_FLUSH,
-			     GST_SEEK_TYPE_SET, position_nanos,
-			     GST_SEEK_TYPE_NONE, GST_CLOCK_TIME_NONE)) {
-		return -1;
-	} else {
-		return 0;
+static int output_gstreamer_seek(void *instance, gint64 position_nanos) {
+	struct gst_player *p = (struct gst_player*) instance;
+	gboolean result;
+#ifdef HAVE_GST_NET
+	// A flushing seek starts over at running time zero; the pipeline
+	// doesn't pick a new base time itself in a sync group, so we pause
+	// and start again like the others.
+	const gboolean restart = sync_group_ != NULL
+		&& get_current_player_state(p) == GST_STATE_PLAYING;
+	if (restart) {
+		gst_element_set_state(p->player, GST_STATE_PAUSED);
+	}
+#endif
+	result = gst_element_seek(p->player, 1.0, GST_FORMAT_TIME,
+				  GST_SEEK_FLAG_FLUSH,
+				  GST_SEEK_TYPE_SET, position_nanos,
+				  GST_SEEK_TYPE_NONE, GST_CLOCK_TIME_NONE);
+	p->sync_running_time = 0;
+#ifdef HAVE_GST_NET
+	if (restart) {
+		sync_start(p, 0);
+		gst_element_set_state(p->player, GST_STATE_PLAYING);
 	}
+#endif
+	return result ? 0 : -1;
 }
 
 #if 0
@@ -265,11 +1125,12 @@ static gboolean my_bus_callback(GstBus * bus, GstMessage * msg,
 				gpointer data)
 {
 	(void)bus;
-	(void)data;
+	struct gst_player *p = (struct gst_player*) data;
 
 	GstMessageType msgType;
 	const GstObject *msgSrc;
 	const gchar *msgSrcName;
+	char *next_uri;
 
 	msgType = GST_MESSAGE_TYPE(msg);
 	msgSrc = GST_MESSAGE_SRC(msg);
@@ -278,20 +1139,38 @@ static gboolean my_bus_callback(GstBus * bus, GstMessage * msg,
 	switch (msgType) {
 	case GST_MESSAGE_EOS:
 		Log_info("gstreamer", "%s: End-of-stream", msgSrcName);
-		if (gs_next_uri_ != NULL) {
+		next_uri = take_next_uri(p);
+		if (next_uri != NULL) {
 			// If playbin does not support gapless (old
 			// versions didn't), this will trigger.
-			free(gsuri_);
-			gsuri_ = gs_next_uri_;
-			gs_next_uri_ = NULL;
-			gst_element_set_state(player_, GST_STATE_READY);
-			g_object_set(G_OBJECT(player_), "uri", gsuri_, NULL);
-			gst_element_set_state(player_, GST_STATE_PLAYING);
-			if (play_trans_callback_) {
-				play_trans_callback_(PLAY_STARTED_NEXT_STREAM);
+			free(p->gsuri);
+			p->gsuri = next_uri;
+			gst_element_set_state(p->player, GST_STATE_READY);
+			player_load_current_uri(p);
+			gst_element_set_state(p->player, GST_STATE_PLAYING);
+			if (p->play_trans_callback) {
+				p->play_trans_callback(PLAY_STARTED_NEXT_STREAM,
+						       p->play_trans_userdata);
+			}
+		} else {
+			// Stopped: leave PLAYING, so that we report it and
+			// the next play or uri doesn't find a finished
+			// pipeline. The transport forgets the uri now, so we
+			// do as well: no standby pre-roll keeping the device
+			// open for it, and no play() starting it again.
+			Log_info("gstreamer", "Last stream ended; stopped "
+				 "without pre-roll.");
+			free(p->gsuri);
+			p->gsuri = NULL;
+			p->standby = FALSE;
+			idle_start(p);
+			gst_element_set_state(p->player, GST_STATE_READY);
+			// Releases cache entries and gapless chains.
+			player_load_current_uri(p);
+			if (p->play_trans_callback) {
+				p->play_trans_callback(PLAY_STOPPED,
+						       p->play_trans_userdata);
 			}
-		} else if (play_trans_callback_) {
-			play_trans_callback_(PLAY_STOPPED);
 		}
 		break;
 
@@ -306,6 +1185,15 @@ static gboolean my_bus_callback(GstBus * bus, GstMessage * msg,
 		g_error_free(err);
 		g_free(debug);
 
+		if (gapless_is_from_next_stream(p, GST_MESSAGE_SRC(msg))) {
+			// Don't let concat wait for a stream that never comes;
+			// we'll retry the URI at end-of-stream.
+			gapless_preroll_next(p, FALSE);
+		} else if (p->standby) {
+			// Let play() start over.
+			p->standby = FALSE;
+		}
+
 		break;
 	}
 	case GST_MESSAGE_STATE_CHANGED: {
@@ -319,24 +1207,45 @@ static gboolean my_bus_callback(GstBus * bus, GstMessage * msg,
 			gststate_get_name(newstate),
 			gststate_get_name(pending));
 		*/
+		if (msgSrc == GST_OBJECT(p->player)) {
+			report_startup(p, newstate);
+		}
+		break;
+	}
+
+	case GST_MESSAGE_APPLICATION: {
+		const GstStructure *s = gst_message_get_structure(msg);
+		if (gst_structure_has_name(s, "gapless-switch")
+		    && gapless_finish_switch(p, s)) {
+			SongMetaData_clear(&p->song_meta);
+			if (p->play_trans_callback) {
+				p->play_trans_callback(PLAY_STARTED_NEXT_STREAM,
+						       p->play_trans_userdata);
+			}
+		}
 		break;
 	}
 
 	case GST_MESSAGE_TAG: {
 		GstTagList *tags = NULL;
 
-		if (meta_update_callback_ != NULL) {
+		if (gapless_is_from_next_stream(p, GST_MESSAGE_SRC(msg))) {
+			break;  // Will see these again once it plays.
+		}
+		if (p->meta_update_callback != NULL) {
 			gst_message_parse_tag(msg, &tags);
 			/*g_print("GStreamer: Got tags from element %s\n",
 				GST_OBJECT_NAME (msg->src));
 			*/
 			struct MetaModify modify;
-			modify.meta = &song_meta_;
+			modify.meta = &p->song_meta;
 			modify.any_change = 0;
 			gst_tag_list_foreach(tags, &MetaModify_add_tag, &modify);
 			gst_tag_list_free(tags);
 			if (modify.any_change) {
-				meta_update_callback_(&song_meta_);
+				p->meta_update_callback(
+					&p->song_meta,
+					p->meta_update_userdata);
 			}
 		}
 		break;
@@ -345,6 +1254,9 @@ static gboolean my_bus_callback(GstBus * bus, GstMessage * msg,
 	case GST_MESSAGE_BUFFERING:
         {
                 if (buffer_duration <= 0.0) break;  /* nothing to buffer */
+		if (gapless_is_from_next_stream(p, GST_MESSAGE_SRC(msg))) {
+			break;  /* pre-rolling must not stall current stream */
+		}
 
                 gint percent = 0;
                 gst_message_parse_buffering (msg, &percent);
@@ -352,9 +1264,9 @@ static gboolean my_bus_callback(GstBus * bus, GstMessage * msg,
 
                 /* Pause playback until buffering is complete. */
                 if (percent < 100)
-                        gst_element_set_state(player_, GST_STATE_PAUSED);
-                else
-                        gst_element_set_state(player_, GST_STATE_PLAYING);
+                        gst_element_set_state(p->player, GST_STATE_PAUSED);
+                else if (!p->standby)  /* not while stopped */
+                        gst_element_set_state(p->player, GST_STATE_PLAYING);
 		break;
         }
 	default:
@@ -374,6 +1286,14 @@ static gchar *audio_pipe = NULL;
 static gchar *video_sink = NULL;
 static gchar *video_pipe = NULL;
 static double initial_db = 0.0;
+static gchar *cache_dir = NULL;
+static int cache_size_mb = 256;
+#ifdef HAVE_GST_NET
+static int sync_serve_port = 0;
+static gchar *sync_clock = NULL;
+static int sync_delay_ms = 500;
+static int sync_latency_ms = 200;
+#endif
 
 /* Options specific to output_gstreamer */
 static GOptionEntry option_entries[] = {
@@ -402,6 +1322,47 @@ static GOptionEntry option_entries[] = {
         { "gstout-initial-volume-db", 0, 0, G_OPTION_ARG_DOUBLE, &initial_db,
           "GStreamer initial volume in decibel (e.g. 0.0 = max; -6 = 1/2 max) ",
 	  NULL },
+        { "gstout-cache-dir", 0, 0, G_OPTION_ARG_STRING, &cache_dir,
+          "Directory to cache http media in. Repeated plays and seeks "
+          "are served locally. Caching is off if not set.",
+	  NULL },
+        { "gstout-cache-size", 0, 0, G_OPTION_ARG_INT, &cache_size_mb,
+          "Maximum size of the media cache in MiB (default 256).",
+	  NULL },
+        { "rescan-mimes", 0, 0, G_OPTION_ARG_NONE, &rescan_mimes,
+          "Ignore the cached list of supported mime types and scan the "
+          "GStreamer registry again.",
+	  NULL },
+        { "gstout-gapless", 0, 0, G_OPTION_ARG_NONE, &gapless_,
+          "Pre-roll the next stream in a second decoder chain as soon as "
+          "it is known and switch sample-accurately (audio only).",
+	  NULL },
+        { "gstout-standby", 0, 0, G_OPTION_ARG_NONE, &standby_,
+          "While stopped, keep the current stream opened and pre-rolled, "
+          "so that play starts right away. Keeps the audio device open.",
+	  NULL },
+        { "gstout-idle-release", 0, 0, G_OPTION_ARG_INT, &idle_release_s,
+          "After being stopped this many seconds, release the audio "
+          "device and pipeline; they are set up again on the next play. "
+          "0 (default) keeps them.",
+	  "SECONDS" },
+#ifdef HAVE_GST_NET
+        { "gstout-sync-serve", 0, 0, G_OPTION_ARG_INT, &sync_serve_port,
+          "Serve our clock on this UDP port (and start times on port + 1) "
+          "for other renderers to play in sync with.",
+	  "PORT" },
+        { "gstout-sync-clock", 0, 0, G_OPTION_ARG_STRING, &sync_clock,
+          "Play in sync with the renderer serving its clock at HOST:PORT.",
+	  "HOST:PORT" },
+        { "gstout-sync-delay-ms", 0, 0, G_OPTION_ARG_INT, &sync_delay_ms,
+          "In a sync group, streams start this long after play; should "
+          "cover the time to open them (default 500).",
+	  NULL },
+        { "gstout-sync-latency-ms", 0, 0, G_OPTION_ARG_INT, &sync_latency_ms,
+          "Pipeline latency all renderers in a sync group use; has to be "
+          "the same for all of them (default 200).",
+	  NULL },
+#endif
         { NULL }
 };
 
@@ -420,13 +1381,15 @@ static int output_gstreamer_add_options(GOptionContext *ctx)
 	return 0;
 }
 
-static int output_gstreamer_get_position(gint64 *track_duration,
+static int output_gstreamer_get_position(void *instance,
+					 gint64 *track_duration,
 					 gint64 *track_pos) {
-	*track_duration = last_known_time_.duration;
-	*track_pos = last_known_time_.position;
+	struct gst_player *p = (struct gst_player*) instance;
+	*track_duration = p->last_known_time.duration;
+	*track_pos = p->last_known_time.position;
 
 	int rc = 0;
-	if (get_current_player_state() != GST_STATE_PLAYING) {
+	if (get_current_player_state(p) != GST_STATE_PLAYING) {
 		return rc;  // playbin2 only returns valid values then.
 	}
 #if (GST_VERSION_MAJOR < 1)
@@ -435,80 +1398,121 @@ static int output_gstreamer_get_position(gint64 *track_duration,
 #else
 	GstFormat query_type = GST_FORMAT_TIME;
 #endif
-	if (!gst_element_query_duration(player_, query_type, track_duration)) {
+	if (!gst_element_query_duration(p->player, query_type,
+					track_duration)) {
 		Log_error("gstreamer", "Failed to get track duration.");
 		rc = -1;
 	}
-	if (!gst_element_query_position(player_, query_type, track_pos)) {
+	if (!gst_element_query_position(p->player, query_type, track_pos)) {
 		Log_error("gstreamer", "Failed to get track pos");
 		rc = -1;
 	}
 	// playbin2 does not allow to query while paused. Remember in case
 	// we're asked then (it actually returns something, but it is bogus).
-	last_known_time_.duration = *track_duration;
-	last_known_time_.position = *track_pos;
+	p->last_known_time.duration = *track_duration;
+	p->last_known_time.position = *track_pos;
 	return rc;
 }
 
-static int output_gstreamer_get_volume(float *v) {
+static int output_gstreamer_get_volume(void *instance, float *v) {
+	struct gst_player *p = (struct gst_player*) instance;
 	double volume;
-	g_object_get(player_, "volume", &volume, NULL);
+	g_object_get(p->volume_element, "volume", &volume, NULL);
 	Log_info("gstreamer", "Query volume fraction: %f", volume);
 	*v = volume;
 	return 0;
 }
-static int output_gstreamer_set_volume(float value) {
+static int output_gstreamer_set_volume(void *instance, float value) {
+	struct gst_player *p = (struct gst_player*) instance;
 	Log_info("gstreamer", "Set volume fraction to %f", value);
-	g_object_set(player_, "volume", (double) value, NULL);
+	g_object_set(p->volume_element, "volume", (double) value, NULL);
 	return 0;
 }
-static int output_gstreamer_get_mute(int *m) {
+static int output_gstreamer_get_mute(void *instance, int *m) {
+	struct gst_player *p = (struct gst_player*) instance;
 	gboolean val;
-	g_object_get(player_, "mute", &val, NULL);
+	g_object_get(p->volume_element, "mute", &val, NULL);
 	*m = val;
 	return 0;
 }
-static int output_gstreamer_set_mute(int m) {
+static int output_gstreamer_set_mute(void *instance, int m) {
+	struct gst_player *p = (struct gst_player*) instance;
 	Log_info("gstreamer", "Set mute to %s", m ? "on" : "off");
-	g_object_set(player_, "mute", (gboolean) m, NULL);
+	g_object_set(p->volume_element, "mute", (gboolean) m, NULL);
 	return 0;
 }
 
 static void prepare_next_stream(GstElement *obj, gpointer userdata) {
 	(void)obj;
-	(void)userdata;
-
-	Log_info("gstreamer", "about-to-finish cb: setting uri %s",
-		 gs_next_uri_);
-	free(gsuri_);
-	gsuri_ = gs_next_uri_;
-	gs_next_uri_ = NULL;
-	if (gsuri_ != NULL) {
-		g_object_set(G_OBJECT(player_), "uri", gsuri_, NULL);
-		if (play_trans_callback_) {
+	struct gst_player *p = (struct gst_player*) userdata;
+
+	char *next_uri = take_next_uri(p);
+	Log_info("gstreamer", "about-to-finish cb: setting uri %s", next_uri);
+	free(p->gsuri);
+	p->gsuri = next_uri;
+	if (p->gsuri != NULL) {
+		// The finishing stream is still read until it ends.
+		release_cache_uri(&p->cache_uris[1]);
+		p->cache_uris[1] = p->cache_uris[0];
+		p->cache_uris[0] = NULL;
+		set_element_uri(p->player, p->gsuri, &p->cache_uris[0]);
+		if (p->play_trans_callback) {
 			// TODO(hzeller): can we figure out when we _actually_
 			// start playing this ? there are probably a couple
 			// of seconds between now and actual start.
-			play_trans_callback_(PLAY_STARTED_NEXT_STREAM);
+			p->play_trans_callback(PLAY_STARTED_NEXT_STREAM,
+					       p->play_trans_userdata);
 		}
 	}
 }
 
-static int output_gstreamer_init(void)
-{
-	GstBus *bus;
+// Create the audio sink: the given pipeline description, otherwise as
+// configured by the user. Returns NULL if nothing specific was asked for.
+static GstElement *make_audio_sink(const char *pipeline) {
+	GstElement *sink = NULL;
+	if (pipeline != NULL) {
+		Log_info("gstreamer", "Setting audio sink-pipeline to %s",
+			 pipeline);
+		sink = gst_parse_bin_from_description(pipeline, TRUE, NULL);
+		if (sink == NULL) {
+			Log_error("gstreamer", "Could not create pipeline.");
+		}
+		return sink;
+	}
+	if (audio_sink != NULL) {
+		Log_info("gstreamer", "Setting audio sink to %s; device=%s\n",
+			 audio_sink, audio_device ? audio_device : "");
+		sink = gst_element_factory_make (audio_sink, "sink");
+		if (sink == NULL) {
+		  Log_error("gstreamer", "Couldn't create sink '%s'",
+			    audio_sink);
+		} else {
+		  if (audio_device != NULL) {
+		    g_object_set (G_OBJECT(sink), "device", audio_device, NULL);
+		  }
+		}
+	}
+	if (audio_pipe != NULL) {
+		Log_info("gstreamer", "Setting audio sink-pipeline to %s\n",audio_pipe);
+		sink = gst_parse_bin_from_description(audio_pipe, TRUE, NULL);
 
-	SongMetaData_init(&song_meta_);
-	scan_mime_list();
+		if (sink == NULL) {
+			Log_error("gstreamer", "Could not create pipeline.");
+		}
+	}
+	return sink;
+}
 
+static int playbin_init_pipeline(struct gst_player *p, GstElement *audio) {
 #if (GST_VERSION_MAJOR < 1)
 	const char player_element_name[] = "playbin2";
 #else
 	const char player_element_name[] = "playbin";
 #endif
 
-	player_ = gst_element_factory_make(player_element_name, "play");
-	assert(player_ != NULL);
+	p->player = gst_element_factory_make(player_element_name, "play");
+	assert(p->player != NULL);
+	p->volume_element = p->player;
 
         /* set buffer size */
         if (buffer_duration > 0) {
@@ -516,7 +1520,7 @@ static int output_gstreamer_init(void)
                 Log_info("gstreamer",
                          "Setting buffer duration to %" PRId64 "ms",
                          buffer_duration_ns / 1000000);
-                g_object_set(G_OBJECT(player_),
+                g_object_set(G_OBJECT(p->player),
                              "buffer-duration",
                              buffer_duration_ns,
                              NULL);
@@ -525,9 +1529,35 @@ static int output_gstreamer_init(void)
 			 "Buffering disabled (--gstout-buffer-duration)");
         }
 
-	bus = gst_pipeline_get_bus(GST_PIPELINE(player_));
-	gst_bus_add_watch(bus, my_bus_callback, NULL);
-	gst_object_unref(bus);
+	if (audio != NULL) {
+		g_object_set (G_OBJECT (p->player), "audio-sink", audio, NULL);
+	}
+	if (video_sink != NULL) {
+		GstElement *sink = NULL;
+		Log_info("gstreamer", "Setting video sink to %s", video_sink);
+		sink = gst_element_factory_make (video_sink, "sink");
+		g_object_set (G_OBJECT (p->player), "video-sink", sink, NULL);
+	}
+	if (video_pipe != NULL) {
+		GstElement *sink = NULL;
+		Log_info("gstreamer", "Setting video sink-pipeline to %s\n", video_pipe);
+		sink = gst_parse_bin_from_description(video_pipe, TRUE, NULL);
+
+		if (sink == NULL) {
+			Log_error("gstreamer", "Could not create pipeline.");
+		} else {
+			g_object_set (G_OBJECT (p->player), "video-sink", sink, NULL);
+		}
+	}
+
+	g_signal_connect(G_OBJECT(p->player), "about-to-finish",
+			 G_CALLBACK(prepare_next_stream), p);
+	return 0;
+}
+
+static int output_gstreamer_init(void)
+{
+	scan_mime_list();
 
 	if (audio_sink != NULL && audio_pipe != NULL) {
 		Log_error("gstreamer", "--gstout-audosink and --gstout-audiopipe are mutually exclusive.");
@@ -538,63 +1568,115 @@ static int output_gstreamer_init(void)
 		return 1;
 	}
 
-	if (audio_sink != NULL) {
-		GstElement *sink = NULL;
-		Log_info("gstreamer", "Setting audio sink to %s; device=%s\n",
-			 audio_sink, audio_device ? audio_device : "");
-		sink = gst_element_factory_make (audio_sink, "sink");
-		if (sink == NULL) {
-		  Log_error("gstreamer", "Couldn't create sink '%s'",
-			    audio_sink);
-		} else {
-		  if (audio_device != NULL) {
-		    g_object_set (G_OBJECT(sink), "device", audio_device, NULL);
-		  }
-		  g_object_set (G_OBJECT (player_), "audio-sink", sink, NULL);
+	if (cache_dir != NULL) {
+		media_cache_ = MediaCache_new(cache_dir,
+					      (int64_t) cache_size_mb << 20);
+		if (media_cache_ == NULL) {
+			Log_error("gstreamer", "Couldn't set up media cache "
+				  "in %s; playing without.", cache_dir);
 		}
 	}
-	if (audio_pipe != NULL) {
-		GstElement *sink = NULL;
-		Log_info("gstreamer", "Setting audio sink-pipeline to %s\n",audio_pipe);
-		sink = gst_parse_bin_from_description(audio_pipe, TRUE, NULL);
 
-		if (sink == NULL) {
-			Log_error("gstreamer", "Could not create pipeline.");
-		} else {
-			g_object_set (G_OBJECT (player_), "audio-sink", sink, NULL);
+	if (gapless_) {
+		if (video_sink != NULL || video_pipe != NULL) {
+			Log_error("gstreamer", "--gstout-gapless is audio "
+				  "only; ignoring video sink.");
 		}
+		Log_info("gstreamer", "Gapless mode: pre-rolling next "
+			 "stream in a second decoder chain.");
 	}
-	if (video_sink != NULL) {
-		GstElement *sink = NULL;
-		Log_info("gstreamer", "Setting video sink to %s", video_sink);
-		sink = gst_element_factory_make (video_sink, "sink");
-		g_object_set (G_OBJECT (player_), "video-sink", sink, NULL);
+	if (standby_) {
+		Log_info("gstreamer", "Warm standby: pre-rolling streams "
+			 "while stopped.");
+	}
+	if (idle_release_s > 0) {
+		Log_info("gstreamer", "Releasing the pipeline after %ds "
+			 "stopped.", idle_release_s);
 	}
-	if (video_pipe != NULL) {
-		GstElement *sink = NULL;
-		Log_info("gstreamer", "Setting video sink-pipeline to %s\n", video_pipe);
-		sink = gst_parse_bin_from_description(video_pipe, TRUE, NULL);
 
-		if (sink == NULL) {
-			Log_error("gstreamer", "Could not create pipeline.");
-		} else {
-			g_object_set (G_OBJECT (player_), "video-sink", sink, NULL);
+#ifdef HAVE_GST_NET
+	if (sync_serve_port > 0 && sync_clock != NULL) {
+		Log_error("gstreamer", "--gstout-sync-serve and "
+			  "--gstout-sync-clock are mutually exclusive.");
+		return 1;
+	}
+	if (sync_serve_port > 0) {
+		sync_group_ = SyncGroup_serve(sync_serve_port, sync_delay_ms,
+					      sync_latency_ms);
+		if (sync_group_ == NULL) return 1;
+	} else if (sync_clock != NULL) {
+		char *host = strdup(sync_clock);
+		char *colon = strrchr(host, ':');
+		if (colon == NULL || atoi(colon + 1) <= 0) {
+			Log_error("gstreamer", "--gstout-sync-clock expects "
+				  "HOST:PORT, got '%s'", sync_clock);
+			free(host);
+			return 1;
 		}
+		*colon = '\0';
+		sync_group_ = SyncGroup_join(host, atoi(colon + 1),
+					     sync_delay_ms, sync_latency_ms);
+		free(host);
+		if (sync_group_ == NULL) return 1;
 	}
+#endif
+	return 0;
+}
+
+// Free a player that didn't get a pipeline.
+static void player_free_unused(struct gst_player *p) {
+	g_mutex_clear(&p->gapless_mutex);
+	g_mutex_clear(&p->idle_mutex);
+	free(p);
+}
 
-	if (gst_element_set_state(player_, GST_STATE_READY) ==
+static void *output_gstreamer_create(const char *sink)
+{
+	GstBus *bus;
+	struct gst_player *p =
+		(struct gst_player*) calloc(1, sizeof(struct gst_player));
+	SongMetaData_init(&p->song_meta);
+	g_mutex_init(&p->gapless_mutex);
+	g_mutex_init(&p->idle_mutex);
+	p->last_buffer_end = GST_CLOCK_TIME_NONE;
+
+	GstElement *audio = make_audio_sink(sink);
+	if (sink != NULL && audio == NULL) {
+		// Better not play at all than on somebody else's speakers.
+		player_free_unused(p);
+		return NULL;
+	}
+	// Both take ownership of the audio sink and clean up on failure.
+	const int failed = gapless_
+		? gapless_init_pipeline(p, audio)
+		: playbin_init_pipeline(p, audio);
+	if (failed) {
+		player_free_unused(p);
+		return NULL;
+	}
+
+#ifdef HAVE_GST_NET
+	if (sync_group_) {
+		SyncGroup_setup_pipeline(sync_group_, p->player);
+	}
+#endif
+
+	bus = gst_pipeline_get_bus(GST_PIPELINE(p->player));
+	gst_bus_add_watch(bus, my_bus_callback, p);
+	gst_object_unref(bus);
+
+	if (gst_element_set_state(p->player, GST_STATE_READY) ==
 	    GST_STATE_CHANGE_FAILURE) {
 		Log_error("gstreamer", "Error: pipeline doesn't become ready.");
 	}
 
-	g_signal_connect(G_OBJECT(player_), "about-to-finish",
-			 G_CALLBACK(prepare_next_stream), NULL);
-	output_gstreamer_set_mute(0);
+	output_gstreamer_set_mute(p, 0);
 	if (initial_db < 0) {
-		output_gstreamer_set_volume(exp(initial_db / 20 * log(10)));
+		output_gstreamer_set_volume(p, exp(initial_db / 20 * log(10)));
 	}
+	idle_start(p);
 
-	return 0;
+	return p;
 }
 
 struct output_module gstreamer_output = {
@@ -603,6 +1685,7 @@ struct output_module gstreamer_output = {
 	.add_options = output_gstreamer_add_options,
 
 	.init        = output_gstreamer_init,
+	.create      = output_gstreamer_create,
 	.set_uri     = output_gstreamer_set_uri,
 	.set_next_uri= output_gstreamer_set_next_uri,
 	.play        = output_gstreamer_play,
@@ -31,21 +31,30 @@ struct output_module {
         const char *description;
 	int (*add_options)(GOptionContext *ctx);
 
-	// Commands.
+	// Called once, before any player is created.
 	int (*init)(void);
-	void (*set_uri)(const char *uri, output_update_meta_cb_t meta_info);
-	void (*set_next_uri)(const char *uri);
-	int (*play)(output_transition_cb_t transition_callback);
-	int (*stop)(void);
-	int (*pause)(void);
-	int (*seek)(gint64 position_nanos);
+	// Create a player on the given sink, NULL for the default one.
+	// Returns the instance passed to all commands, NULL on failure.
+	void *(*create)(const char *sink);
+
+	// Commands.
+	void (*set_uri)(void *instance, const char *uri,
+			output_update_meta_cb_t meta_info, void *userdata);
+	void (*set_next_uri)(void *instance, const char *uri);
+	int (*play)(void *instance,
+		    output_transition_cb_t transition_callback,
+		    void *userdata);
+	int (*stop)(void *instance);
+	int (*pause)(void *instance);
+	int (*seek)(void *instance, gint64 position_nanos);
 
 	// parameters
-	int (*get_position)(gint64 *track_duration, gint64 *track_pos);
-	int (*get_volume)(float *);
-	int (*set_volume)(float);
-	int (*get_mute)(int *);
-	int (*set_mute)(int);
+	int (*get_position)(void *instance,
+			    gint64 *track_duration, gint64 *track_pos);
+	int (*get_volume)(void *instance, float *);
+	int (*set_volume)(void *instance, float);
+	int (*get_mute)(void *instance, int *);
+	int (*set_mute)(void *instance, int);
 };
 
 #endif
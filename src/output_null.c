@@ -0,0 +1,377 @@
+/* output_null.c - Output module that only pretends to play
+ *
+ * Copyright (C) 2026 GMediaRender contributors
+ *
+ * This file is part of GMediaRender.
+ *
+ * GMediaRender is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * GMediaRender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GMediaRender; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ * -----------------
+ *
+ * Nothing is fetched or decoded. Every track is assumed to have the same
+ * duration and position advances with a virtual clock, optionally running
+ * faster than real time. The end of a track is reported to the transport
+ * like a real output would, including the switch to the next URI.
+ *
+ * Useful to test and profile the UPnP layer without audio hardware.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "logging.h"
+#include "upnp_connmgr.h"
+#include "output_module.h"
+#include "output_null.h"
+
+// The next URI is picked up that long before the end of the track (in
+// virtual time), similar to the about-to-finish signal of playbin.
+static const gint64 kAboutToFinishNanos = 2 * 1000000000LL;
+
+enum null_state {
+	NULL_STOPPED,
+	NULL_PAUSED,
+	NULL_PLAYING,
+};
+
+struct null_player {
+	GMutex mutex;                 // Protects everything below.
+	enum null_state state;
+	char *uri;                    // locally strdup()ed
+	char *next_uri;               // locally strdup()ed
+	char *queued_uri;             // next_uri taken at about-to-finish.
+	output_transition_cb_t play_trans_callback;
+	void *play_trans_userdata;
+
+	// Virtual clock: position_ns was the position at monotonic time
+	// reference_us; while playing it advances with speed_.
+	gint64 position_ns;
+	gint64 reference_us;
+	GSource *about_to_finish_timer;
+	GSource *end_timer;
+
+	float volume;
+	int mute;
+	unsigned long tracks_played;
+};
+
+// Options.
+static int track_duration_sec = 300;
+static double speed_ = 1.0;
+
+static GOptionEntry option_entries[] = {
+	{ "nullout-duration", 0, 0, G_OPTION_ARG_INT, &track_duration_sec,
+	  "Duration of every track in seconds.", NULL },
+	{ "nullout-speed", 0, 0, G_OPTION_ARG_DOUBLE, &speed_,
+	  "Speed of the virtual clock; e.g. 10 plays ten times faster "
+	  "than real time.", NULL },
+	{ NULL }
+};
+
+static gint64 track_duration_ns(void) {
+	return (gint64) track_duration_sec * 1000000000LL;
+}
+
+static gint64 current_position_ns(struct null_player *p) {
+	gint64 position = p->position_ns;
+	if (p->state == NULL_PLAYING) {
+		position += (gint64) ((g_get_monotonic_time() - p->reference_us)
+				      * 1000 * speed_);
+	}
+	return position < track_duration_ns() ? position : track_duration_ns();
+}
+
+// Set virtual clock to given position at this point in time.
+static void set_position(struct null_player *p, gint64 position_ns) {
+	p->position_ns = position_ns;
+	p->reference_us = g_get_monotonic_time();
+}
+
+static void cancel_timer(GSource **timer) {
+	if (*timer == NULL)
+		return;
+	g_source_destroy(*timer);
+	g_source_unref(*timer);
+	*timer = NULL;
+}
+
+static GSource *start_timer(struct null_player *p, gint64 virtual_nanos,
+			    GSourceFunc callback) {
+	if (virtual_nanos < 0)
+		virtual_nanos = 0;
+	GSource *timer = g_timeout_source_new(virtual_nanos / 1000000
+					      / speed_);
+	g_source_set_callback(timer, callback, p, NULL);
+	g_source_attach(timer, NULL);
+	return timer;
+}
+
+// Called from the main loop; returns TRUE if the timer was cancelled
+// meanwhile and the callback should not do anything.
+static gboolean timer_cancelled(void) {
+	return g_source_is_destroyed(g_main_current_source());
+}
+
+static gboolean about_to_finish(gpointer userdata);
+static gboolean track_finished(gpointer userdata);
+
+static void schedule_timers(struct null_player *p) {
+	cancel_timer(&p->about_to_finish_timer);
+	cancel_timer(&p->end_timer);
+	if (p->state != NULL_PLAYING)
+		return;
+	const gint64 remaining = track_duration_ns() - current_position_ns(p);
+	if (p->queued_uri == NULL && remaining > kAboutToFinishNanos) {
+		p->about_to_finish_timer =
+			start_timer(p, remaining - kAboutToFinishNanos,
+				    about_to_finish);
+	}
+	p->end_timer = start_timer(p, remaining, track_finished);
+}
+
+static gboolean about_to_finish(gpointer userdata) {
+	struct null_player *p = (struct null_player*) userdata;
+	g_mutex_lock(&p->mutex);
+	if (!timer_cancelled()) {
+		g_source_unref(p->about_to_finish_timer);
+		p->about_to_finish_timer = NULL;
+		// Like playbin, we commit to the next URI now; setting it
+		// later won't make it in time for a seamless transition.
+		free(p->queued_uri);
+		p->queued_uri = p->next_uri;
+		p->next_uri = NULL;
+		Log_info("null", "About to finish; next: %s",
+			 p->queued_uri ? p->queued_uri : "(none)");
+	}
+	g_mutex_unlock(&p->mutex);
+	return FALSE;
+}
+
+static gboolean track_finished(gpointer userdata) {
+	struct null_player *p = (struct null_player*) userdata;
+	output_transition_cb_t callback = NULL;
+	void *callback_userdata = NULL;
+	enum PlayFeedback feedback = PLAY_STOPPED;
+	g_mutex_lock(&p->mutex);
+	if (!timer_cancelled()) {
+		g_source_unref(p->end_timer);
+		p->end_timer = NULL;
+		// If the track was shorter than the about-to-finish time,
+		// we never had a chance to take the next URI.
+		if (p->queued_uri == NULL) {
+			p->queued_uri = p->next_uri;
+			p->next_uri = NULL;
+		}
+		callback = p->play_trans_callback;
+		callback_userdata = p->play_trans_userdata;
+		if (p->queued_uri != NULL) {
+			free(p->uri);
+			p->uri = p->queued_uri;
+			p->queued_uri = NULL;
+			set_position(p, 0);
+			schedule_timers(p);
+			p->tracks_played++;
+			feedback = PLAY_STARTED_NEXT_STREAM;
+			Log_info("null", "End of stream; playing next '%s'",
+				 p->uri);
+		} else {
+			p->state = NULL_STOPPED;
+			set_position(p, 0);
+			Log_info("null", "End of stream (%lu tracks played).",
+				 p->tracks_played);
+		}
+	}
+	g_mutex_unlock(&p->mutex);
+	// Not holding our lock: the transport will call us back.
+	if (callback) {
+		callback(feedback, callback_userdata);
+	}
+	return FALSE;
+}
+
+static void output_null_set_uri(void *instance, const char *uri,
+				output_update_meta_cb_t meta_cb,
+				void *userdata) {
+	struct null_player *p = (struct null_player*) instance;
+	(void) meta_cb;  // We never learn anything about the stream.
+	(void) userdata;
+	Log_info("null", "Set uri to '%s'", uri);
+	g_mutex_lock(&p->mutex);
+	free(p->uri);
+	p->uri = (uri && *uri) ? strdup(uri) : NULL;
+	g_mutex_unlock(&p->mutex);
+}
+
+static void output_null_set_next_uri(void *instance, const char *uri) {
+	struct null_player *p = (struct null_player*) instance;
+	Log_info("null", "Set next uri to '%s'", uri);
+	g_mutex_lock(&p->mutex);
+	free(p->next_uri);
+	p->next_uri = (uri && *uri) ? strdup(uri) : NULL;
+	g_mutex_unlock(&p->mutex);
+}
+
+static int output_null_play(void *instance, output_transition_cb_t callback,
+			    void *userdata) {
+	struct null_player *p = (struct null_player*) instance;
+	int result = 0;
+	g_mutex_lock(&p->mutex);
+	p->play_trans_callback = callback;
+	p->play_trans_userdata = userdata;
+	if (p->uri == NULL) {
+		Log_error("null", "Nothing to play.");
+		result = -1;
+	} else if (p->state != NULL_PLAYING) {
+		if (p->state == NULL_STOPPED) {
+			set_position(p, 0);
+			p->tracks_played++;
+		} else {
+			set_position(p, p->position_ns);  // Continue from pause.
+		}
+		p->state = NULL_PLAYING;
+		schedule_timers(p);
+	}
+	g_mutex_unlock(&p->mutex);
+	return result;
+}
+
+static int output_null_stop(void *instance) {
+	struct null_player *p = (struct null_player*) instance;
+	g_mutex_lock(&p->mutex);
+	p->state = NULL_STOPPED;
+	set_position(p, 0);
+	free(p->queued_uri);
+	p->queued_uri = NULL;
+	schedule_timers(p);
+	g_mutex_unlock(&p->mutex);
+	return 0;
+}
+
+static int output_null_pause(void *instance) {
+	struct null_player *p = (struct null_player*) instance;
+	g_mutex_lock(&p->mutex);
+	if (p->state == NULL_PLAYING) {
+		set_position(p, current_position_ns(p));
+		p->state = NULL_PAUSED;
+		schedule_timers(p);
+	}
+	g_mutex_unlock(&p->mutex);
+	return 0;
+}
+
+static int output_null_seek(void *instance, gint64 position_nanos) {
+	struct null_player *p = (struct null_player*) instance;
+	g_mutex_lock(&p->mutex);
+	if (position_nanos < 0)
+		position_nanos = 0;
+	if (position_nanos > track_duration_ns())
+		position_nanos = track_duration_ns();
+	set_position(p, position_nanos);
+	schedule_timers(p);
+	g_mutex_unlock(&p->mutex);
+	return 0;
+}
+
+static int output_null_get_position(void *instance, gint64 *track_duration,
+				    gint64 *track_pos) {
+	struct null_player *p = (struct null_player*) instance;
+	g_mutex_lock(&p->mutex);
+	*track_duration = track_duration_ns();
+	*track_pos = current_position_ns(p);
+	g_mutex_unlock(&p->mutex);
+	return 0;
+}
+
+static int output_null_get_volume(void *instance, float *v) {
+	*v = ((struct null_player*) instance)->volume;
+	return 0;
+}
+static int output_null_set_volume(void *instance, float value) {
+	((struct null_player*) instance)->volume = value;
+	return 0;
+}
+static int output_null_get_mute(void *instance, int *m) {
+	*m = ((struct null_player*) instance)->mute;
+	return 0;
+}
+static int output_null_set_mute(void *instance, int m) {
+	((struct null_player*) instance)->mute = m;
+	return 0;
+}
+
+static int output_null_add_options(GOptionContext *ctx)
+{
+	GOptionGroup *option_group;
+	option_group = g_option_group_new("nullout", "Null Output Options",
+	                                  "Show Null Output Options",
+	                                  NULL, NULL);
+	g_option_group_add_entries(option_group, option_entries);
+
+	g_option_context_add_group (ctx, option_group);
+	return 0;
+}
+
+static int output_null_init(void)
+{
+	if (track_duration_sec <= 0 || speed_ <= 0) {
+		Log_error("null", "--nullout-duration and --nullout-speed "
+			  "need to be positive.");
+		return -1;
+	}
+	// We can 'play' anything.
+	register_mime_type("audio/*");
+	Log_info("null", "Tracks of %ds; virtual clock at %.1fx speed.",
+		 track_duration_sec, speed_);
+	return 0;
+}
+
+static void *output_null_create(const char *sink)
+{
+	(void) sink;  // Nowhere to play to anyway.
+	struct null_player *p =
+		(struct null_player*) calloc(1, sizeof(struct null_player));
+	g_mutex_init(&p->mutex);
+	p->state = NULL_STOPPED;
+	p->volume = 1.0;
+	return p;
+}
+
+struct output_module null_output = {
+        .shortname = "null",
+	.description = "No output; simulates playback with a virtual clock",
+	.add_options = output_null_add_options,
+
+	.init        = output_null_init,
+	.create      = output_null_create,
+	.set_uri     = output_null_set_uri,
+	.set_next_uri= output_null_set_next_uri,
+	.play        = output_null_play,
+	.stop        = output_null_stop,
+	.pause       = output_null_pause,
+	.seek        = output_null_seek,
+
+	.get_position = output_null_get_position,
+	.get_volume  = output_null_get_volume,
+	.set_volume  = output_null_set_volume,
+	.get_mute  = output_null_get_mute,
+	.set_mute  = output_null_set_mute,
+};
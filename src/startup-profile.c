@@ -0,0 +1,78 @@
+/* startup-profile - Time the phases of startup.
+ *
+ * Copyright (C) 2026 GMediaRender contributors
+ *
+ * This file is part of GMediaRender.
+ *
+ * GMediaRender is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * GMediaRender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GMediaRender; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include "startup-profile.h"
+
+#include <glib.h>
+
+#include "logging.h"
+
+#define MAX_PHASES 32
+
+struct phase {
+	const char *name;
+	gint64 duration_us;
+};
+
+// Startup is single threaded, no locking needed.
+static gint64 start_us_ = 0;
+static gint64 last_mark_us_ = 0;
+static struct phase phases_[MAX_PHASES];
+static int phase_count_ = 0;
+
+void StartupProfile_start(void) {
+	start_us_ = last_mark_us_ = g_get_monotonic_time();
+	phase_count_ = 0;
+}
+
+void StartupProfile_phase(const char *name) {
+	if (start_us_ == 0 || phase_count_ >= MAX_PHASES)
+		return;
+	const gint64 now = g_get_monotonic_time();
+	phases_[phase_count_].name = name;
+	phases_[phase_count_].duration_us = now - last_mark_us_;
+	++phase_count_;
+	last_mark_us_ = now;
+}
+
+void StartupProfile_report(FILE *out) {
+	if (start_us_ == 0)
+		return;
+	const gint64 total_us = last_mark_us_ - start_us_;
+	for (int i = 0; i < phase_count_; ++i) {
+		const double ms = phases_[i].duration_us / 1000.0;
+		Log_info("startup", "%-24s %8.1fms", phases_[i].name, ms);
+		if (out) {
+			fprintf(out, "phase %s %.3f\n", phases_[i].name, ms);
+		}
+	}
+	Log_info("startup", "%-24s %8.1fms", "total", total_us / 1000.0);
+	if (out) {
+		fprintf(out, "total %.3f\n", total_us / 1000.0);
+		fflush(out);
+	}
+}
@@ -0,0 +1,43 @@
+/* startup-profile - Time the phases of startup.
+ *
+ * Copyright (C) 2026 GMediaRender contributors
+ *
+ * This file is part of GMediaRender.
+ *
+ * GMediaRender is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * GMediaRender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GMediaRender; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ * -----------------
+ *
+ * Startup is a sequence of phases; each call to StartupProfile_phase()
+ * ends one, the time since the previous call is attributed to it.
+ */
+#ifndef _STARTUP_PROFILE_H
+#define _STARTUP_PROFILE_H
+
+#include <stdio.h>
+
+// Start the clock. Until called, phases are not recorded, so code shared
+// with other programs can mark phases unconditionally.
+void StartupProfile_start(void);
+
+// End the current phase, giving it a name (a string constant).
+void StartupProfile_phase(const char *name);
+
+// Log the time of each phase and the total. If 'out' is not NULL, also
+// print it there, in a format simple to parse in scripts.
+void StartupProfile_report(FILE *out);
+
+#endif /* _STARTUP_PROFILE_H */
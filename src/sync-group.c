@@ -0,0 +1,411 @@
+/* sync-group - Play in lockstep with other renderers on the network.
+ *
+ * Copyright (C) 2026 GMediaRender contributors
+ *
+ * This file is part of GMediaRender.
+ *
+ * GMediaRender is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * GMediaRender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GMediaRender; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include "sync-group.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <gst/net/gstnet.h>
+
+#include "logging.h"
+
+// Stream starts the serving renderer remembers.
+#define MAX_STARTS 16
+
+// Base time requests to the serving renderer.
+static const int kRequestTimeoutMs = 200;
+static const int kRequestAttempts = 3;
+
+// How long to wait at startup for the following clock to lock.
+static const GstClockTime kSyncWait = 5 * GST_SECOND;
+
+static const int kStatsIntervalSeconds = 30;
+
+// A stream start handed out by the serving renderer. Everyone starting the
+// same stream until start_time + delay gets the same base time.
+struct stream_start {
+	char key[41];                // SHA1 of the uri.
+	GstClockTime base_time;
+	GstClockTime start_time;     // Clock time the first sample plays.
+};
+
+struct sync_group {
+	GstClock *clock;
+	GstNetTimeProvider *provider;  // Only if serving.
+	int fd;                        // Base time socket.
+	GstClockTime delay;
+	GstClockTime latency;
+
+	// Base times are asked for from UPnP action handlers and, if
+	// serving, handed out in the main loop.
+	GMutex mutex;
+	struct stream_start starts[MAX_STARTS];  // Only if serving.
+	unsigned int next_seq;  // Only if following; under request_mutex.
+	struct sync_group_stats stats;
+
+	// Only one request on the socket at a time, otherwise we'd read each
+	// other's answers. Not 'mutex', so stats don't wait for the network.
+	GMutex request_mutex;
+};
+
+static struct sync_group *sync_group_new(int delay_ms, int latency_ms) {
+	struct sync_group *group =
+		(struct sync_group*) calloc(1, sizeof(struct sync_group));
+	group->fd = -1;
+	group->delay = (GstClockTime) delay_ms * GST_MSECOND;
+	group->latency = (GstClockTime) latency_ms * GST_MSECOND;
+	g_mutex_init(&group->mutex);
+	g_mutex_init(&group->request_mutex);
+	return group;
+}
+
+static void sync_group_free(struct sync_group *group) {
+	if (group->fd >= 0) close(group->fd);
+	if (group->provider) gst_object_unref(group->provider);
+	if (group->clock) gst_object_unref(group->clock);
+	g_mutex_clear(&group->mutex);
+	g_mutex_clear(&group->request_mutex);
+	free(group);
+}
+
+// Base time to play running_time 'delay' from now.
+static GstClockTime local_base_time(struct sync_group *group,
+				    GstClockTime running_time) {
+	const GstClockTime start = gst_clock_get_time(group->clock)
+		+ group->delay;
+	return start > running_time ? start - running_time : 0;
+}
+
+static GstClockTime serve_base_time(struct sync_group *group,
+				    const char *key,
+				    GstClockTime running_time) {
+	const GstClockTime now = gst_clock_get_time(group->clock);
+	struct stream_start *found = NULL;
+	struct stream_start *oldest = &group->starts[0];
+	GstClockTime base_time;
+	int i;
+
+	g_mutex_lock(&group->mutex);
+	for (i = 0; i < MAX_STARTS && found == NULL; ++i) {
+		struct stream_start *s = &group->starts[i];
+		if (strcmp(s->key, key) == 0
+		    && now < s->start_time + group->delay) {
+			found = s;
+		}
+		if (s->start_time < oldest->start_time) {
+			oldest = s;
+		}
+	}
+	if (found == NULL) {
+		found = oldest;
+		snprintf(found->key, sizeof(found->key), "%s", key);
+		found->base_time = local_base_time(group, running_time);
+		found->start_time = found->base_time + running_time;
+	}
+	base_time = found->base_time;
+	group->stats.agreements++;
+	g_mutex_unlock(&group->mutex);
+	return base_time;
+}
+
+// Request:  "gmr-sync base <seq> <running-time> <key>"
+// Response: "gmr-sync base <seq> <base-time>"
+static gboolean handle_request(GIOChannel *source, GIOCondition condition,
+			       gpointer data) {
+	struct sync_group *group = (struct sync_group*) data;
+	struct sockaddr_storage peer;
+	socklen_t peer_len = sizeof(peer);
+	char buf[256];
+	char key[41];
+	unsigned int seq;
+	guint64 running_time;
+	(void)source;
+	(void)condition;
+
+	const ssize_t len = recvfrom(group->fd, buf, sizeof(buf) - 1, 0,
+				     (struct sockaddr*) &peer, &peer_len);
+	if (len <= 0) {
+		return TRUE;
+	}
+	buf[len] = '\0';
+	if (sscanf(buf, "gmr-sync base %u %" G_GUINT64_FORMAT " %40s",
+		   &seq, &running_time, key) != 3) {
+		Log_error("sync", "Ignoring malformed request '%.40s'", buf);
+		return TRUE;
+	}
+	const GstClockTime base_time =
+		serve_base_time(group, key, running_time);
+	const int reply_len = snprintf(buf, sizeof(buf),
+				       "gmr-sync base %u %" G_GUINT64_FORMAT
+				       "\n", seq, (guint64) base_time);
+	sendto(group->fd, buf, reply_len, 0,
+	       (struct sockaddr*) &peer, peer_len);
+	return TRUE;
+}
+
+// Ask the serving renderer. Returns FALSE if it didn't answer in time.
+static gboolean request_base_time(struct sync_group *group, const char *key,
+				  GstClockTime running_time,
+				  GstClockTime *base_time) {
+	gboolean success = FALSE;
+	gint64 rtt = 0;
+	char buf[256];
+	int attempt;
+
+	g_mutex_lock(&group->request_mutex);
+	for (attempt = 0; attempt < kRequestAttempts && !success; ++attempt) {
+		const unsigned int seq = ++group->next_seq;
+		const int len = snprintf(buf, sizeof(buf),
+					 "gmr-sync base %u %" G_GUINT64_FORMAT
+					 " %s\n", seq, (guint64) running_time,
+					 key);
+		if (len < 0 || len >= (int) sizeof(buf)) {
+			Log_error("sync", "Base time request too long.");
+			break;
+		}
+		const gint64 sent = g_get_monotonic_time();
+		if (send(group->fd, buf, len, 0) != len) {
+			continue;
+		}
+		// Skip late answers to earlier attempts.
+		for (;;) {
+			unsigned int reply_seq;
+			guint64 reply_base;
+			const ssize_t got = recv(group->fd, buf,
+						 sizeof(buf) - 1, 0);
+			if (got <= 0) {
+				break;  // timeout
+			}
+			buf[got] = '\0';
+			if (sscanf(buf, "gmr-sync base %u %" G_GUINT64_FORMAT,
+				   &reply_seq, &reply_base) != 2
+			    || reply_seq != seq) {
+				continue;
+			}
+			rtt = g_get_monotonic_time() - sent;
+			*base_time = reply_base;
+			success = TRUE;
+			break;
+		}
+	}
+	g_mutex_unlock(&group->request_mutex);
+
+	g_mutex_lock(&group->mutex);
+	if (success) {
+		group->stats.agreements++;
+		if (rtt > group->stats.max_rtt_us) {
+			group->stats.max_rtt_us = rtt;
+		}
+	} else {
+		group->stats.local_fallbacks++;
+	}
+	g_mutex_unlock(&group->mutex);
+	return success;
+}
+
+static gboolean log_stats(gpointer data) {
+	struct sync_group_stats stats;
+	SyncGroup_get_stats((struct sync_group*) data, &stats);
+	if (stats.serving) {
+		Log_info("sync", "Serving clock; %lu stream starts handed out.",
+			 stats.agreements);
+	} else {
+		Log_info("sync", "Clock %s, offset %+.3fms, drift %+.2fppm; "
+			 "%lu stream starts (%lu without master), "
+			 "max rtt %" PRId64 "us",
+			 stats.synced ? "synced" : "NOT synced",
+			 stats.offset_ns / 1e6, stats.drift_ppm,
+			 stats.agreements, stats.local_fallbacks,
+			 stats.max_rtt_us);
+	}
+	return TRUE;
+}
+
+struct sync_group *SyncGroup_serve(int port, int delay_ms, int latency_ms) {
+	struct sync_group *group = sync_group_new(delay_ms, latency_ms);
+	struct sockaddr_in addr;
+
+	group->stats.serving = TRUE;
+	group->clock = gst_system_clock_obtain();
+	group->provider = gst_net_time_provider_new(group->clock, NULL, port);
+	if (group->provider == NULL) {
+		Log_error("sync", "Can't serve clock on port %d", port);
+		sync_group_free(group);
+		return NULL;
+	}
+
+	group->fd = socket(AF_INET, SOCK_DGRAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port + 1);
+	if (group->fd < 0
+	    || bind(group->fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+		Log_error("sync", "Can't serve start times on port %d: %s",
+			  port + 1, strerror(errno));
+		sync_group_free(group);
+		return NULL;
+	}
+	GIOChannel *channel = g_io_channel_unix_new(group->fd);
+	g_io_add_watch(channel, G_IO_IN, handle_request, group);
+	g_io_channel_unref(channel);
+	g_timeout_add_seconds(kStatsIntervalSeconds, log_stats, group);
+
+	Log_info("sync", "Serving clock on port %d, start times on port %d "
+		 "(start delay %dms, latency %dms)",
+		 port, port + 1, delay_ms, latency_ms);
+	return group;
+}
+
+struct sync_group *SyncGroup_join(const char *host, int port,
+				  int delay_ms, int latency_ms) {
+	struct sync_group *group = sync_group_new(delay_ms, latency_ms);
+	struct addrinfo hints, *addrs = NULL;
+	struct timeval tv;
+	char service[16];
+
+	// Start out with our own time, so that we don't jump around until
+	// the first answer arrives.
+	GstClock *local = gst_system_clock_obtain();
+	group->clock = gst_net_client_clock_new("gmr-sync-clock", host, port,
+						gst_clock_get_time(local));
+	gst_object_unref(local);
+	if (group->clock == NULL) {
+		Log_error("sync", "Can't follow clock at %s:%d", host, port);
+		sync_group_free(group);
+		return NULL;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	snprintf(service, sizeof(service), "%d", port + 1);
+	if (getaddrinfo(host, service, &hints, &addrs) != 0 || addrs == NULL) {
+		Log_error("sync", "Can't resolve %s", host);
+		sync_group_free(group);
+		return NULL;
+	}
+	group->fd = socket(addrs->ai_family, addrs->ai_socktype,
+			   addrs->ai_protocol);
+	if (group->fd < 0
+	    || connect(group->fd, addrs->ai_addr, addrs->ai_addrlen) < 0) {
+		Log_error("sync", "Can't reach %s:%d: %s",
+			  host, port + 1, strerror(errno));
+		freeaddrinfo(addrs);
+		sync_group_free(group);
+		return NULL;
+	}
+	freeaddrinfo(addrs);
+	tv.tv_sec = 0;
+	tv.tv_usec = kRequestTimeoutMs * 1000;
+	setsockopt(group->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	if (gst_clock_wait_for_sync(group->clock, kSyncWait)) {
+		Log_info("sync", "Following clock at %s:%d "
+			 "(start delay %dms, latency %dms)",
+			 host, port, delay_ms, latency_ms);
+	} else {
+		Log_error("sync", "Clock at %s:%d not in sync yet; playback "
+			  "may be off until it is.", host, port);
+	}
+	g_timeout_add_seconds(kStatsIntervalSeconds, log_stats, group);
+	return group;
+}
+
+void SyncGroup_setup_pipeline(struct sync_group *group, GstElement *pipeline)
+{
+	gst_pipeline_use_clock(GST_PIPELINE(pipeline), group->clock);
+	// Don't let the pipeline pick its own base time on PLAYING.
+	gst_element_set_start_time(pipeline, GST_CLOCK_TIME_NONE);
+	if (group->latency > 0) {
+		gst_pipeline_set_latency(GST_PIPELINE(pipeline),
+					 group->latency);
+	}
+}
+
+void SyncGroup_set_base_time(struct sync_group *group, GstElement *pipeline,
+			     const char *uri, GstClockTime running_time) {
+	gchar *key = g_compute_checksum_for_string(G_CHECKSUM_SHA1,
+						   uri ? uri : "", -1);
+	GstClockTime base_time;
+	const char *source;
+	if (group->provider) {
+		base_time = serve_base_time(group, key, running_time);
+		source = "served";
+	} else if (request_base_time(group, key, running_time, &base_time)) {
+		source = "from master";
+	} else {
+		base_time = local_base_time(group, running_time);
+		source = "master didn't answer, local";
+	}
+	gst_element_set_base_time(pipeline, base_time);
+	Log_info("sync", "Stream %.8s continues at running time %"
+		 GST_TIME_FORMAT ", base time %" G_GUINT64_FORMAT " (%s)",
+		 key, GST_TIME_ARGS(running_time), (guint64) base_time,
+		 source);
+	g_free(key);
+}
+
+GstClockTime SyncGroup_running_time(struct sync_group *group,
+				    GstElement *pipeline) {
+	const GstClockTime now = gst_clock_get_time(group->clock);
+	const GstClockTime base_time = gst_element_get_base_time(pipeline);
+	return now > base_time ? now - base_time : 0;
+}
+
+void SyncGroup_get_stats(struct sync_group *group,
+			 struct sync_group_stats *stats) {
+	GstClockTime internal, external, rate_num, rate_denom;
+	g_mutex_lock(&group->mutex);
+	*stats = group->stats;
+	g_mutex_unlock(&group->mutex);
+	if (group->provider) {
+		stats->synced = TRUE;
+		stats->offset_ns = 0;
+		stats->drift_ppm = 0.0;
+		return;
+	}
+	// Our net clock runs on the local system clock (internal) mapped
+	// to the master's time (external).
+	gst_clock_get_calibration(group->clock, &internal, &external,
+				  &rate_num, &rate_denom);
+	stats->synced = gst_clock_is_synced(group->clock);
+	stats->offset_ns = GST_CLOCK_DIFF(internal, external);
+	stats->drift_ppm = rate_denom > 0
+		? ((double) rate_num / rate_denom - 1.0) * 1e6
+		: 0.0;
+}
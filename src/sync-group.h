@@ -0,0 +1,77 @@
+/* sync-group - Play in lockstep with other renderers on the network.
+ *
+ * Copyright (C) 2026 GMediaRender contributors
+ *
+ * This file is part of GMediaRender.
+ *
+ * GMediaRender is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * GMediaRender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GMediaRender; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ * -----------------
+ *
+ * One renderer serves its clock to the network (GstNetTimeProvider), the
+ * others follow it with a GstNetClientClock. All pipelines of the group run
+ * on that shared clock, so a sample with the same running time is played at
+ * the same moment everywhere, as long as they agree on the base time.
+ *
+ * The base time is handed out by the serving renderer on the clock port + 1
+ * (UDP). Whoever starts a stream first within a short window fixes the base
+ * time a little in the future; everyone else starting the same stream gets
+ * the same one.
+ */
+#ifndef _SYNC_GROUP_H
+#define _SYNC_GROUP_H
+
+#include <gst/gst.h>
+
+struct sync_group;
+
+struct sync_group_stats {
+	gboolean serving;
+	gboolean synced;              // Following clock is locked to master.
+	GstClockTimeDiff offset_ns;   // Master minus local clock.
+	double drift_ppm;             // Rate of master relative to ours.
+	unsigned long agreements;     // Base times handed out/received.
+	unsigned long local_fallbacks;  // Master didn't answer in time.
+	gint64 max_rtt_us;            // Of the base time requests.
+};
+
+// Serve the clock on the given UDP port and base times on port + 1.
+// Streams start delay_ms after they are first requested; latency_ms is
+// the fixed pipeline latency all members use. Returns NULL on failure.
+struct sync_group *SyncGroup_serve(int port, int delay_ms, int latency_ms);
+
+// Follow the clock served by another renderer at host:port.
+struct sync_group *SyncGroup_join(const char *host, int port,
+				  int delay_ms, int latency_ms);
+
+// Let the pipeline run on the group clock with the group latency. We are
+// then in charge of its base time.
+void SyncGroup_setup_pipeline(struct sync_group *group, GstElement *pipeline);
+
+// To be called right before setting the pipeline to PLAYING: sets the base
+// time agreed on with the group for the stream with the given uri to
+// continue at the given running time.
+void SyncGroup_set_base_time(struct sync_group *group, GstElement *pipeline,
+			     const char *uri, GstClockTime running_time);
+
+// Running time the pipeline has reached, e.g. before pausing it.
+GstClockTime SyncGroup_running_time(struct sync_group *group,
+				    GstElement *pipeline);
+
+void SyncGroup_get_stats(struct sync_group *group,
+			 struct sync_group_stats *stats);
+
+#endif /* _SYNC_GROUP_H */
@@ -54,8 +54,9 @@
 #define CONNMGR_SERVICE_ID "urn:upnp-org:serviceId:ConnectionManager"
 //#define CONNMGR_SERVICE_ID CONNMGR_TYPE
 #define CONNMGR_SCPD_URL "/upnp/renderconnmgrSCPD.xml"
-#define CONNMGR_CONTROL_URL "/upnp/control/renderconnmgr1"
-#define CONNMGR_EVENT_URL "/upnp/event/renderconnmgr1"
+// Numbered by zone, starting with 1.
+#define CONNMGR_CONTROL_URL "/upnp/control/renderconnmgr%d"
+#define CONNMGR_EVENT_URL "/upnp/event/renderconnmgr%d"
 
 typedef enum {
 	CONNMGR_VAR_AAT_CONN_MGR,
@@ -141,7 +142,9 @@ static const char *direction_values[] = {
 	NULL
 };
 
-static ithread_mutex_t connmgr_mutex;
+// Protocol info of the sinks, the same for all zones. NULL until
+// connmgr_init() ran.
+static char *sink_protocol_info_ = NULL;
 
 static GSList* supported_types_list;
 
@@ -308,9 +311,21 @@ static void connmgr_filter_mime_type_root(const mime_type_filters_t* mime_filter
 	}
 }
 
-int connmgr_init(const char* mime_filter_string) {
+static void set_sink_protocol_info(struct service *srv) {
+	if (sink_protocol_info_ != NULL) {
+		VariableContainer_change(srv->variable_container,
+					 CONNMGR_VAR_SINK_PROTO_INFO,
+					 sink_protocol_info_);
+	}
+}
 
-	struct service *srv = upnp_connmgr_get_service();
+// All connection managers, indexed by zone.
+static GPtrArray *zones_ = NULL;
+
+int connmgr_init(const char* mime_filter_string) {
+	if (sink_protocol_info_ != NULL) {
+		return 0;  // Another zone did already.
+	}
 
 	// Parse MIME filter into separate fields
 	mime_type_filters_t mime_filter = connmgr_parse_mime_filter_string(mime_filter_string);
@@ -334,8 +349,10 @@ int connmgr_init(const char* mime_filter_string) {
 	if (protoInfo->len > 0) {
 		// Truncate final comma
 		protoInfo = g_string_truncate(protoInfo, protoInfo->len - 1);
-		VariableContainer_change(srv->variable_container,
-					 CONNMGR_VAR_SINK_PROTO_INFO, protoInfo->str);
+		sink_protocol_info_ = g_strdup(protoInfo->str);
+		for (guint i = 0; zones_ != NULL && i < zones_->len; ++i) {
+			set_sink_protocol_info(g_ptr_array_index(zones_, i));
+		}
 	}
 
 	// Free string and its data
@@ -403,53 +420,67 @@ static struct action connmgr_actions[] = {
 	[CONNMGR_CMD_COUNT] =			{NULL, NULL}
 };
 
-struct service *upnp_connmgr_get_service(void) {
-	static struct service connmgr_service_ = {
-		.service_mutex =        &connmgr_mutex,
-		.service_id =		CONNMGR_SERVICE_ID,
-		.service_type =		CONNMGR_TYPE,
-		.scpd_url =		CONNMGR_SCPD_URL,
-		.control_url =		CONNMGR_CONTROL_URL,
-		.event_url =		CONNMGR_EVENT_URL,
-		.event_xml_ns =         NULL,  // we never send change events.
-		.actions =		connmgr_actions,
-		.action_arguments =     argument_list,
-		.variable_container =   NULL, // initialized below
-		.last_change =          NULL,
-		.command_count =        CONNMGR_CMD_COUNT,
-	};
-
-	static struct var_meta connmgr_var_meta[] = {
-		{ CONNMGR_VAR_SRC_PROTO_INFO, "SourceProtocolInfo", "",
-		  EV_YES, DATATYPE_STRING, NULL, NULL },
-		{ CONNMGR_VAR_SINK_PROTO_INFO, "SinkProtocolInfo", "http-get:*:audio/mpeg:*",
-		  EV_YES, DATATYPE_STRING, NULL, NULL },
-		{ CONNMGR_VAR_CUR_CONN_IDS, "CurrentConnectionIDs", "0",
-		  EV_YES, DATATYPE_STRING, NULL, NULL },
-
-		{ CONNMGR_VAR_AAT_CONN_STATUS,"A_ARG_TYPE_ConnectionStatus", "Unknown",
-		  EV_NO, DATATYPE_STRING, connstatus_values, NULL },
-		{ CONNMGR_VAR_AAT_CONN_MGR, "A_ARG_TYPE_ConnectionManager", "/",
-		  EV_NO, DATATYPE_STRING, NULL, NULL },
-		{ CONNMGR_VAR_AAT_DIR, "A_ARG_TYPE_Direction", "Input",
-		  EV_NO, DATATYPE_STRING, direction_values, NULL },
-		{ CONNMGR_VAR_AAT_PROTO_INFO, "A_ARG_TYPE_ProtocolInfo", ":::",
-		  EV_NO, DATATYPE_STRING, NULL, NULL },
-		{ CONNMGR_VAR_AAT_CONN_ID, "A_ARG_TYPE_ConnectionID", "-1",
-		  EV_NO, DATATYPE_I4, NULL, NULL },
-		{ CONNMGR_VAR_AAT_AVT_ID, "A_ARG_TYPE_AVTransportID", "0",
-		  EV_NO, DATATYPE_I4, NULL, NULL },
-		{ CONNMGR_VAR_AAT_RCS_ID, "A_ARG_TYPE_RcsID", "0",
-		  EV_NO, DATATYPE_I4, NULL, NULL },
-
-		{ CONNMGR_VAR_COUNT, NULL, NULL, EV_NO, DATATYPE_UNKNOWN, NULL, NULL }
-	};
-
-	if (connmgr_service_.variable_container == NULL) {
-		connmgr_service_.variable_container
-			= VariableContainer_new(CONNMGR_VAR_COUNT,
-						connmgr_var_meta);
-		// no changes expected; no collector.
+static struct var_meta connmgr_var_meta[] = {
+	{ CONNMGR_VAR_SRC_PROTO_INFO, "SourceProtocolInfo", "",
+	  EV_YES, DATATYPE_STRING, NULL, NULL },
+	{ CONNMGR_VAR_SINK_PROTO_INFO, "SinkProtocolInfo", "http-get:*:audio/mpeg:*",
+	  EV_YES, DATATYPE_STRING, NULL, NULL },
+	{ CONNMGR_VAR_CUR_CONN_IDS, "CurrentConnectionIDs", "0",
+	  EV_YES, DATATYPE_STRING, NULL, NULL },
+
+	{ CONNMGR_VAR_AAT_CONN_STATUS,"A_ARG_TYPE_ConnectionStatus", "Unknown",
+	  EV_NO, DATATYPE_STRING, connstatus_values, NULL },
+	{ CONNMGR_VAR_AAT_CONN_MGR, "A_ARG_TYPE_ConnectionManager", "/",
+	  EV_NO, DATATYPE_STRING, NULL, NULL },
+	{ CONNMGR_VAR_AAT_DIR, "A_ARG_TYPE_Direction", "Input",
+	  EV_NO, DATATYPE_STRING, direction_values, NULL },
+	{ CONNMGR_VAR_AAT_PROTO_INFO, "A_ARG_TYPE_ProtocolInfo", ":::",
+	  EV_NO, DATATYPE_STRING, NULL, NULL },
+	{ CONNMGR_VAR_AAT_CONN_ID, "A_ARG_TYPE_ConnectionID", "-1",
+	  EV_NO, DATATYPE_I4, NULL, NULL },
+	{ CONNMGR_VAR_AAT_AVT_ID, "A_ARG_TYPE_AVTransportID", "0",
+	  EV_NO, DATATYPE_I4, NULL, NULL },
+	{ CONNMGR_VAR_AAT_RCS_ID, "A_ARG_TYPE_RcsID", "0",
+	  EV_NO, DATATYPE_I4, NULL, NULL },
+
+	{ CONNMGR_VAR_COUNT, NULL, NULL, EV_NO, DATATYPE_UNKNOWN, NULL, NULL }
+};
+
+static struct service *connmgr_new(int zone) {
+	struct service *srv =
+		(struct service*) calloc(1, sizeof(struct service));
+	ithread_mutex_t *mutex =
+		(ithread_mutex_t*) malloc(sizeof(ithread_mutex_t));
+	ithread_mutex_init(mutex, NULL);
+	srv->service_mutex = mutex;
+	srv->service_id = CONNMGR_SERVICE_ID;
+	srv->service_type = CONNMGR_TYPE;
+	srv->scpd_url = CONNMGR_SCPD_URL;
+	srv->control_url = g_strdup_printf(CONNMGR_CONTROL_URL, zone + 1);
+	srv->event_url = g_strdup_printf(CONNMGR_EVENT_URL, zone + 1);
+	srv->event_xml_ns = NULL;  // we never send change events.
+	srv->actions = connmgr_actions;
+	srv->action_arguments = argument_list;
+	srv->variable_container = VariableContainer_new(CONNMGR_VAR_COUNT,
+							connmgr_var_meta);
+	// no changes expected; no collector.
+	srv->last_change = NULL;
+	srv->command_count = CONNMGR_CMD_COUNT;
+	set_sink_protocol_info(srv);
+	return srv;
+}
+
+struct service *upnp_connmgr_get_zone_service(int zone) {
+	assert(zone >= 0);
+	if (zones_ == NULL) {
+		zones_ = g_ptr_array_new();
 	}
-	return &connmgr_service_;
+	while ((int) zones_->len <= zone) {
+		g_ptr_array_add(zones_, connmgr_new(zones_->len));
+	}
+	return g_ptr_array_index(zones_, zone);
+}
+
+struct service *upnp_connmgr_get_service(void) {
+	return upnp_connmgr_get_zone_service(0);
 }
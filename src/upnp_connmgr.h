@@ -33,7 +33,11 @@ typedef struct mime_type_filters_t
 	GSList* added_types;
 } mime_type_filters_t;
 
+// The ConnectionManager of the given zone, created on first use.
+struct service *upnp_connmgr_get_zone_service(int zone);
+// The connection manager of the first (or only) zone.
 struct service *upnp_connmgr_get_service(void);
+// Determine the supported protocols, the same for all zones. Runs once.
 int connmgr_init(const char* mime_filter);
 
 void register_mime_type(const char *mime_type);
@@ -56,8 +56,9 @@
 #define CONTROL_SERVICE_ID "urn:upnp-org:serviceId:RenderingControl"
 //#define CONTROL_SERVICE_ID CONTROL_TYPE
 #define CONTROL_SCPD_URL "/upnp/rendercontrolSCPD.xml"
-#define CONTROL_CONTROL_URL "/upnp/control/rendercontrol1"
-#define CONTROL_EVENT_URL "/upnp/event/rendercontrol1"
+// Numbered by zone, starting with 1.
+#define CONTROL_CONTROL_URL "/upnp/control/rendercontrol%d"
+#define CONTROL_EVENT_URL "/upnp/event/rendercontrol%d"
 
 // Namespace, see UPnP-av-RenderingControl-v3-Service-20101231.pdf page 19
 #define CONTROL_EVENT_XML_NS "urn:schemas-upnp-org:metadata-1-0/RCS/"
@@ -176,28 +177,32 @@ typedef enum {
 	CONTROL_VAR_COUNT
 } control_variable_t;
 
-static variable_container_t *state_variables_ = NULL;
-
-static ithread_mutex_t control_mutex;
+// One RenderingControl; each renderer zone has its own.
+struct control {
+	struct service service;
+	struct output *output;
+	variable_container_t *state_variables;
+	ithread_mutex_t mutex;
+};
 
-static void service_lock(void)
+static void service_lock(struct control *c)
 {
-	ithread_mutex_lock(&control_mutex);
+	ithread_mutex_lock(&c->mutex);
 	struct upnp_last_change_collector*
-		collector = upnp_control_get_service()->last_change;
+		collector = c->service.last_change;
 	if (collector) {
 		UPnPLastChangeCollector_start(collector);
 	}
 }
 
-static void service_unlock(void)
+static void service_unlock(struct control *c)
 {
 	struct upnp_last_change_collector*
-		collector = upnp_control_get_service()->last_change;
+		collector = c->service.last_change;
 	if (collector) {
 		UPnPLastChangeCollector_finish(collector);
 	}
-	ithread_mutex_unlock(&control_mutex);
+	ithread_mutex_unlock(&c->mutex);
 }
 
 static struct argument arguments_list_presets[] = {
@@ -429,13 +434,15 @@ static struct argument *argument_list[] = {
 
 
 // Replace given variable without sending an state-change event.
-static void replace_var(control_variable_t varnum, const char *new_value) {
-	VariableContainer_change(state_variables_, varnum, new_value);
+static void replace_var(struct control *c,
+			control_variable_t varnum, const char *new_value) {
+	VariableContainer_change(c->state_variables, varnum, new_value);
 }
 
-static void change_volume(const char *volume, const char *db_volume) {
-	replace_var(CONTROL_VAR_VOLUME, volume);
-	replace_var(CONTROL_VAR_VOLUME_DB, db_volume);
+static void change_volume(struct control *c,
+			  const char *volume, const char *db_volume) {
+	replace_var(c, CONTROL_VAR_VOLUME, volume);
+	replace_var(c, CONTROL_VAR_VOLUME_DB, db_volume);
 }
 
 static int cmd_obtain_variable(struct action_event *event,
@@ -537,18 +544,19 @@ static int get_mute(struct action_event *event)
 	return cmd_obtain_variable(event, CONTROL_VAR_MUTE, "CurrentMute");
 }
 
-static void set_mute_toggle(int do_mute) {
-	replace_var(CONTROL_VAR_MUTE, do_mute ? "1" : "0");
-	output_set_mute(do_mute);
+static void set_mute_toggle(struct control *c, int do_mute) {
+	replace_var(c, CONTROL_VAR_MUTE, do_mute ? "1" : "0");
+	output_set_mute(c->output, do_mute);
 }
 
 static int set_mute(struct action_event *event) {
+	struct control *c = (struct control*) event->service->instance;
 	const char *value = upnp_get_string(event, "DesiredMute");
-	service_lock();
+	service_lock(c);
 	const int do_mute = atoi(value);
-	set_mute_toggle(do_mute);
-	replace_var(CONTROL_VAR_MUTE, do_mute ? "1" : "0");
-	service_unlock();
+	set_mute_toggle(c, do_mute);
+	replace_var(c, CONTROL_VAR_MUTE, do_mute ? "1" : "0");
+	service_unlock(c);
 	return 0;
 }
 
@@ -588,7 +596,7 @@ static int volume_decibel_to_level(float decibel) {
 
 // Change volume variables from the given decibel. Quantize value according to
 // our ranges.
-static float change_volume_decibel(float raw_decibel) {
+static float change_volume_decibel(struct control *c, float raw_decibel) {
 	int volume_level = volume_decibel_to_level(raw_decibel);
 	// Since we quantize it to the level, lets calculate the
 	// actual level.
@@ -602,39 +610,44 @@ static float change_volume_decibel(float raw_decibel) {
 	Log_info("control", "Setting volume-db to %.2fdb == #%d",
 		decibel, volume_level);
 
-	change_volume(volume, db_volume);
+	change_volume(c, volume, db_volume);
 	return decibel;
 }
 
 static int set_volume_db(struct action_event *event) {
+	struct control *c = (struct control*) event->service->instance;
 	const char *str_decibel_in = upnp_get_string(event, "DesiredVolume");
-	service_lock();
+	service_lock(c);
 	float raw_decibel_in = atof(str_decibel_in);
-	float decibel = change_volume_decibel(raw_decibel_in);
+	float decibel = change_volume_decibel(c, raw_decibel_in);
 
-	output_set_volume(exp(decibel / 20 * log(10)));
-	service_unlock();
+	output_set_volume(c->output, exp(decibel / 20 * log(10)));
+	service_unlock(c);
 
 	return 0;
 }
 
 static int set_volume(struct action_event *event) {
-	const char *volume = upnp_get_string(event, "DesiredVolume");
-	service_lock();
-	int volume_level = atoi(volume);  // range 0..100
+	struct control *c = (struct control*) event->service->instance;
+	const char *desired_volume = upnp_get_string(event, "DesiredVolume");
+	service_lock(c);
+	int volume_level = atoi(desired_volume);  // range 0..100
 	if (volume_level < volume_range.min) volume_level = volume_range.min;
 	if (volume_level > volume_range.max) volume_level = volume_range.max;
 	const float decibel = volume_level_to_decibel(volume_level);
 
+	char volume[10];
+	snprintf(volume, sizeof(volume), "%d", volume_level);
+
 	char db_volume[10];
 	snprintf(db_volume, sizeof(db_volume), "%d", (int) (256 * decibel));
 
 	const double fraction = exp(decibel / 20 * log(10));
 
-	change_volume(volume, db_volume);
-	output_set_volume(fraction);
-	set_mute_toggle(volume_level == 0);
-	service_unlock();
+	change_volume(c, volume, db_volume);
+	output_set_volume(c->output, fraction);
+	set_mute_toggle(c, volume_level == 0);
+	service_unlock(c);
 
 	return 0;
 }
@@ -703,88 +716,108 @@ static struct action control_actions[] = {
 	[CONTROL_CMD_COUNT] =			{NULL, NULL}
 };
 
-struct service *upnp_control_get_service(void) {
-	static struct service control_service_ = {
-		.service_mutex =       &control_mutex,
-		.service_id =	       CONTROL_SERVICE_ID,
-		.service_type =	       CONTROL_TYPE,
-		.scpd_url =            CONTROL_SCPD_URL,
-		.control_url =         CONTROL_CONTROL_URL,
-		.event_url =           CONTROL_EVENT_URL,
-		.event_xml_ns =        CONTROL_EVENT_XML_NS,
-		.actions =	       control_actions,
-		.action_arguments =    argument_list,
-		.variable_container =  NULL,  // set later.
-		.last_change =         NULL,
-		.command_count =       CONTROL_CMD_COUNT,
-	};
-
-	static struct var_meta control_var_meta[] = {
-		{CONTROL_VAR_LAST_CHANGE, "LastChange", "<Event xmlns = \"urn:schemas-upnp-org:metadata-1-0/RCS/\"/>",
-		 EV_YES, DATATYPE_STRING, NULL, NULL },
-		{CONTROL_VAR_PRESET_NAME_LIST, "PresetNameList", "",
-		 EV_NO, DATATYPE_STRING, NULL, NULL },
-		{CONTROL_VAR_AAT_CHANNEL, "A_ARG_TYPE_Channel", "",
-		 EV_NO, DATATYPE_STRING, aat_channels, NULL },
-		{CONTROL_VAR_AAT_INSTANCE_ID, "A_ARG_TYPE_InstanceID", "0",
-		 EV_NO, DATATYPE_UI4, NULL, NULL },
-		{CONTROL_VAR_AAT_PRESET_NAME, "A_ARG_TYPE_PresetName", "",
-		 EV_NO, DATATYPE_STRING, aat_presetnames, NULL },
-		{CONTROL_VAR_BRIGHTNESS, "Brightness", "0",
-		 EV_NO, DATATYPE_UI2, NULL, &brightness_range },
-		{CONTROL_VAR_CONTRAST, "Contrast", "0",
-		 EV_NO, DATATYPE_UI2, NULL, &contrast_range },
-		{CONTROL_VAR_SHARPNESS, "Sharpness", "0",
-		 EV_NO, DATATYPE_UI2, NULL, &sharpness_range },
-		{CONTROL_VAR_R_GAIN, "RedVideoGain", "0",
-		 EV_NO, DATATYPE_UI2, NULL, &vid_gain_range },
-		{CONTROL_VAR_G_GAIN, "GreenVideoGain", "0",
-		 EV_NO, DATATYPE_UI2, NULL, &vid_gain_range },
-		{CONTROL_VAR_B_GAIN, "BlueVideoGain", "0",
-		 EV_NO, DATATYPE_UI2, NULL, &vid_gain_range },
-		{CONTROL_VAR_R_BLACK, "RedVideoBlackLevel", "0",
-		 EV_NO, DATATYPE_UI2, NULL, &vid_black_range },
-		{CONTROL_VAR_G_BLACK, "GreenVideoBlackLevel", "0",
-		 EV_NO, DATATYPE_UI2, NULL, &vid_black_range },
-		{CONTROL_VAR_B_BLACK, "BlueVideoBlackLevel", "0",
-		 EV_NO, DATATYPE_UI2, NULL, &vid_black_range },
-		{CONTROL_VAR_COLOR_TEMP, "ColorTemperature", "0",
-		 EV_NO, DATATYPE_UI2, NULL, &colortemp_range },
-		{CONTROL_VAR_HOR_KEYSTONE, "HorizontalKeystone", "0",
-		 EV_NO, DATATYPE_I2, NULL, &keystone_range },
-		{CONTROL_VAR_VER_KEYSTONE, "VerticalKeystone", "0",
-		 EV_NO, DATATYPE_I2, NULL, &keystone_range },
-		{CONTROL_VAR_MUTE, "Mute", "0",
-		 EV_NO, DATATYPE_BOOLEAN, NULL, NULL },
-		{CONTROL_VAR_VOLUME, "Volume", "0",
-		 EV_NO, DATATYPE_UI2, NULL, &volume_range },
-		{CONTROL_VAR_VOLUME_DB, "VolumeDB", "0",
-		 EV_NO, DATATYPE_I2, NULL, &volume_db_range },
-		{CONTROL_VAR_LOUDNESS, "Loudness", "0",
-		 EV_NO, DATATYPE_BOOLEAN, NULL, NULL },
-
-		{CONTROL_VAR_COUNT, NULL, NULL, EV_NO, DATATYPE_UNKNOWN, NULL, NULL }
-	};
-
-	if (control_service_.variable_container == NULL) {
-		state_variables_ =
-			VariableContainer_new(CONTROL_VAR_COUNT,
-					      control_var_meta);
-		control_service_.variable_container = state_variables_;
+static struct var_meta control_var_meta[] = {
+	{CONTROL_VAR_LAST_CHANGE, "LastChange", "<Event xmlns = \"urn:schemas-upnp-org:metadata-1-0/RCS/\"/>",
+	 EV_YES, DATATYPE_STRING, NULL, NULL },
+	{CONTROL_VAR_PRESET_NAME_LIST, "PresetNameList", "",
+	 EV_NO, DATATYPE_STRING, NULL, NULL },
+	{CONTROL_VAR_AAT_CHANNEL, "A_ARG_TYPE_Channel", "",
+	 EV_NO, DATATYPE_STRING, aat_channels, NULL },
+	{CONTROL_VAR_AAT_INSTANCE_ID, "A_ARG_TYPE_InstanceID", "0",
+	 EV_NO, DATATYPE_UI4, NULL, NULL },
+	{CONTROL_VAR_AAT_PRESET_NAME, "A_ARG_TYPE_PresetName", "",
+	 EV_NO, DATATYPE_STRING, aat_presetnames, NULL },
+	{CONTROL_VAR_BRIGHTNESS, "Brightness", "0",
+	 EV_NO, DATATYPE_UI2, NULL, &brightness_range },
+	{CONTROL_VAR_CONTRAST, "Contrast", "0",
+	 EV_NO, DATATYPE_UI2, NULL, &contrast_range },
+	{CONTROL_VAR_SHARPNESS, "Sharpness", "0",
+	 EV_NO, DATATYPE_UI2, NULL, &sharpness_range },
+	{CONTROL_VAR_R_GAIN, "RedVideoGain", "0",
+	 EV_NO, DATATYPE_UI2, NULL, &vid_gain_range },
+	{CONTROL_VAR_G_GAIN, "GreenVideoGain", "0",
+	 EV_NO, DATATYPE_UI2, NULL, &vid_gain_range },
+	{CONTROL_VAR_B_GAIN, "BlueVideoGain", "0",
+	 EV_NO, DATATYPE_UI2, NULL, &vid_gain_range },
+	{CONTROL_VAR_R_BLACK, "RedVideoBlackLevel", "0",
+	 EV_NO, DATATYPE_UI2, NULL, &vid_black_range },
+	{CONTROL_VAR_G_BLACK, "GreenVideoBlackLevel", "0",
+	 EV_NO, DATATYPE_UI2, NULL, &vid_black_range },
+	{CONTROL_VAR_B_BLACK, "BlueVideoBlackLevel", "0",
+	 EV_NO, DATATYPE_UI2, NULL, &vid_black_range },
+	{CONTROL_VAR_COLOR_TEMP, "ColorTemperature", "0",
+	 EV_NO, DATATYPE_UI2, NULL, &colortemp_range },
+	{CONTROL_VAR_HOR_KEYSTONE, "HorizontalKeystone", "0",
+	 EV_NO, DATATYPE_I2, NULL, &keystone_range },
+	{CONTROL_VAR_VER_KEYSTONE, "VerticalKeystone", "0",
+	 EV_NO, DATATYPE_I2, NULL, &keystone_range },
+	{CONTROL_VAR_MUTE, "Mute", "0",
+	 EV_NO, DATATYPE_BOOLEAN, NULL, NULL },
+	{CONTROL_VAR_VOLUME, "Volume", "0",
+	 EV_NO, DATATYPE_UI2, NULL, &volume_range },
+	{CONTROL_VAR_VOLUME_DB, "VolumeDB", "0",
+	 EV_NO, DATATYPE_I2, NULL, &volume_db_range },
+	{CONTROL_VAR_LOUDNESS, "Loudness", "0",
+	 EV_NO, DATATYPE_BOOLEAN, NULL, NULL },
+
+	{CONTROL_VAR_COUNT, NULL, NULL, EV_NO, DATATYPE_UNKNOWN, NULL, NULL }
+};
+
+static struct control *control_new(int zone) {
+	struct control *c =
+		(struct control*) calloc(1, sizeof(struct control));
+	ithread_mutex_init(&c->mutex, NULL);
+	c->state_variables = VariableContainer_new(CONTROL_VAR_COUNT,
+						   control_var_meta);
+
+	struct service *srv = &c->service;
+	srv->service_mutex = &c->mutex;
+	srv->service_id = CONTROL_SERVICE_ID;
+	srv->service_type = CONTROL_TYPE;
+	srv->scpd_url = CONTROL_SCPD_URL;
+	srv->control_url = g_strdup_printf(CONTROL_CONTROL_URL, zone + 1);
+	srv->event_url = g_strdup_printf(CONTROL_EVENT_URL, zone + 1);
+	srv->event_xml_ns = CONTROL_EVENT_XML_NS;
+	srv->actions = control_actions;
+	srv->action_arguments = argument_list;
+	srv->variable_container = c->state_variables;
+	srv->last_change = NULL;  // set in upnp_control_init()
+	srv->command_count = CONTROL_CMD_COUNT;
+	srv->instance = c;
+	return c;
+}
+
+// All controls, indexed by zone. Only grows, from the main thread while
+// setting up.
+static GPtrArray *zones_ = NULL;
+
+struct service *upnp_control_get_zone_service(int zone) {
+	assert(zone >= 0);
+	if (zones_ == NULL) {
+		zones_ = g_ptr_array_new();
+	}
+	while ((int) zones_->len <= zone) {
+		g_ptr_array_add(zones_, control_new(zones_->len));
 	}
+	struct control *c = g_ptr_array_index(zones_, zone);
+	return &c->service;
+}
 
-	return &control_service_;
+struct service *upnp_control_get_service(void) {
+	return upnp_control_get_zone_service(0);
 }
 
-void upnp_control_init(struct upnp_device *device) {
-	struct service *service = upnp_control_get_service();
+void upnp_control_init(struct service *service, struct upnp_device *device,
+		       struct output *output) {
+	struct control *c = (struct control*) service->instance;
+	c->output = output;
 
 	// Set initial volume.
 	float volume_fraction = 0;
-	if (output_get_volume(&volume_fraction) == 0) {
+	if (output_get_volume(output, &volume_fraction) == 0) {
 		Log_info("control", "Output initial volume is %f; setting "
 			 "control variables accordingly.", volume_fraction);
-		change_volume_decibel(20 * log(volume_fraction) / log(10));
+		change_volume_decibel(c, 20 * log(volume_fraction) / log(10));
 	}
 
 	assert(service->last_change == NULL);
@@ -792,7 +825,8 @@ void upnp_control_init(struct upnp_device *device) {
 		UPnPLastChangeCollector_new(service->variable_container,
 					    CONTROL_EVENT_XML_NS,
 					    device,
-					    CONTROL_SERVICE_ID);
+					    CONTROL_SERVICE_ID,
+					    service->service_mutex);
 	// According to UPnP-av-RenderingControl-v3-Service-20101231.pdf, 2.3.1
 	// page 51, the A_ARG_TYPE* variables are not evented.
 	UPnPLastChangeCollector_add_ignore(service->last_change,
@@ -803,7 +837,9 @@ void upnp_control_init(struct upnp_device *device) {
 					   CONTROL_VAR_AAT_PRESET_NAME);
 }
 
-void upnp_control_register_variable_listener(variable_change_listener_t cb,
+void upnp_control_register_variable_listener(struct service *service,
+					     variable_change_listener_t cb,
 					     void *userdata) {
-	VariableContainer_register_callback(state_variables_, cb, userdata);
+	VariableContainer_register_callback(service->variable_container,
+					    cb, userdata);
 }
@@ -25,11 +25,22 @@
 
 #include "variable-container.h"
 
+struct service;
 struct upnp_device;
+struct output;
 
-void upnp_control_init(struct upnp_device *device);
+// The RenderingControl of the given zone, created on first use.
+struct service *upnp_control_get_zone_service(int zone);
+
+// The control of the first (or only) zone.
 struct service *upnp_control_get_service(void);
-void upnp_control_register_variable_listener(variable_change_listener_t cb,
+
+// Start the control as part of the given device, changing the volume of
+// "output".
+void upnp_control_init(struct service *service, struct upnp_device *device,
+		       struct output *output);
+void upnp_control_register_variable_listener(struct service *service,
+					     variable_change_listener_t cb,
 					     void *userdata);
 
 #endif /* _UPNP_CONTROL_H */
@@ -31,7 +31,9 @@
 #include <errno.h>
 #include <stdarg.h>
 #include <assert.h>
+#include <ctype.h>
 #include <string.h>
+#include <strings.h>
 #include <glib.h>
 
 #include <sys/types.h>
@@ -44,7 +46,8 @@
 
 #include "logging.h"
 
-#include "xmlescape.h"
+#include "interface-watch.h"
+#include "startup-profile.h"
 #include "webserver.h"
 #include "xmldoc.h"
 #include "upnp_service.h"
@@ -54,10 +57,63 @@
 // Enable logging of action requests.
 //#define ENABLE_ACTION_LOGGING
 
+// Maximum number of prepared events waiting to be sent. If subscribers are
+// so slow that this fills up, further events are dropped: whoever notifies
+// holds the service lock, and must not wait for the network.
+#define NOTIFY_QUEUE_SIZE 64
+
+// A prepared event waiting to be sent by the notifier thread.
+struct notification {
+	char *service_id;
+	int varcount;
+	char **varnames;
+	char **varvalues;
+	gint64 enqueue_time;         // monotonic, microseconds.
+	struct notification *next;
+};
+
+struct notify_stats {
+	unsigned long delivered;
+	unsigned long dropped;         // because the queue was full.
+	int max_depth;
+	gint64 total_latency_us;       // enqueue until UpnpNotify() returned.
+	gint64 max_latency_us;
+};
+
+// Upper bound for the number of arguments of any action we implement.
+#define MAX_ACTION_ARGUMENTS 16
+
+// Lookup tables of a service, so that dispatching a request does not need
+// to compare names one by one.
+struct service_index {
+	struct service *service;
+	GHashTable *actions;    // action name -> struct action*
+	GHashTable *variables;  // variable name -> variable number + 1
+};
+
 struct upnp_device {
 	struct upnp_device_descriptor *upnp_device_descriptor;
 	ithread_mutex_t device_mutex;
-        UpnpDevice_Handle device_handle;
+        UpnpDevice_Handle device_handle;  // Shared by all devices.
+	// UDN -> struct upnp_device* of the devices embedded in this root
+	// device, NULL if there are none.
+	GHashTable *embedded;
+
+	// service id -> struct service_index*. Built once in
+	// upnp_device_init(), read-only afterwards.
+	GHashTable *services;
+
+	// Events are sent from a separate thread, so that neither action
+	// handlers nor the main loop are blocked by slow subscribers.
+	ithread_mutex_t notify_mutex;  // Protects the queue and stats.
+	ithread_cond_t notify_available;
+	struct notification *notify_head;
+	struct notification *notify_tail;
+	int notify_depth;
+	int notify_overflow;  // Dropping events since the queue got full.
+	int notify_shutdown;
+	ithread_t notify_thread;
+	struct notify_stats notify_stats;
 };
 
 int upnp_add_response(struct action_event *event,
@@ -98,13 +154,13 @@ void upnp_append_variable(struct action_event *event,
 	assert(event != NULL);
 	assert(paramname != NULL);
 
-	ithread_mutex_lock(service->service_mutex);
-
-	value = VariableContainer_get(service->variable_container, varnum, NULL);
+	if (event->snapshot == NULL) {
+		event->snapshot = VariableContainer_snapshot_acquire(
+			service->variable_container);
+	}
+	value = VariableSnapshot_get(event->snapshot, varnum);
 	assert(value != NULL);   // triggers on invalid variable.
 	upnp_add_response(event, paramname, value);
-
-	ithread_mutex_unlock(service->service_mutex);
 }
 
 void upnp_set_error(struct action_event *event, int error_code,
@@ -128,7 +184,10 @@ void upnp_set_error(struct action_event *event, int error_code,
 		  error_code);
 }
 
-const char *upnp_get_string(struct action_event *event, const char *key)
+// Find the value of the argument in the request document. Only needed for
+// arguments that are not in the argument table of the action.
+static const char *find_request_argument(struct action_event *event,
+					 const char *key)
 {
 	IXML_Node *node;
 
@@ -161,6 +220,193 @@ const char *upnp_get_string(struct action_event *event, const char *key)
 	return NULL;
 }
 
+// The values are extracted in one pass already, but handlers still ask for
+// them by name, so this scans the argument table of the action with strcmp.
+// With at most MAX_ACTION_ARGUMENTS, that is cheap compared to the request.
+const char *upnp_get_string(struct action_event *event, const char *key)
+{
+	if (event->arguments != NULL) {
+		for (int i = 0; event->arguments[i].name != NULL; ++i) {
+			if (event->arguments[i].direction != PARAM_DIR_IN
+			    || strcmp(event->arguments[i].name, key) != 0)
+				continue;
+			if (event->argument_values[i] == NULL) {
+				upnp_set_error(event, UPNP_SOAP_E_INVALID_ARGS,
+					       "Missing action request "
+					       "argument (%s)", key);
+			}
+			return event->argument_values[i];
+		}
+	}
+	return find_request_argument(event, key);
+}
+
+// Check that the value can be represented by the variable type and is
+// within its allowed range. Returns 0 if fine, otherwise sets the error
+// and returns -1.
+static int validate_argument(struct action_event *event,
+			     const char *name, const char *value,
+			     const struct var_meta *meta) {
+	long long min = 0, max = 0;
+	switch (meta->datatype) {
+	case DATATYPE_BOOLEAN:
+		if (strcmp(value, "0") == 0 || strcmp(value, "1") == 0
+		    || strcasecmp(value, "true") == 0
+		    || strcasecmp(value, "false") == 0
+		    || strcasecmp(value, "yes") == 0
+		    || strcasecmp(value, "no") == 0)
+			return 0;
+		upnp_set_error(event, UPNP_SOAP_E_INVALID_ARGS,
+			       "Argument %s: '%s' is not a boolean",
+			       name, value);
+		return -1;
+	case DATATYPE_I2:  min = -32768; max = 32767; break;
+	case DATATYPE_I4:  min = -2147483648LL; max = 2147483647; break;
+	case DATATYPE_UI2: min = 0; max = 65535; break;
+	case DATATYPE_UI4: min = 0; max = 4294967295LL; break;
+	default:
+		return 0;   // Strings and unknown: anything goes.
+	}
+
+	// Digits, with a '-' for the signed types. strtoll() alone would
+	// also take leading white space and '+'.
+	const char *digits = (value[0] == '-' && min < 0) ? value + 1 : value;
+	char *end;
+	errno = 0;
+	const long long number = strtoll(value, &end, 10);
+	if (!isdigit((unsigned char) digits[0])
+	    || errno != 0 || *end != '\0'
+	    || number < min || number > max) {
+		upnp_set_error(event, UPNP_SOAP_E_INVALID_ARGS,
+			       "Argument %s: '%s' is not a valid %s",
+			       name, value, upnp_get_datatype_name(meta->datatype));
+		return -1;
+	}
+	// Values outside the allowed range are not rejected: the handlers
+	// clamp them, which lenient control points rely on (e.g. SetVolume
+	// with 120).
+	return 0;
+}
+
+// Collect the values of all IN arguments of the action in one pass over the
+// request document and validate them against the type of their state
+// variable. Arguments that are not sent are left NULL; it is up to the
+// action to decide if it needs them.
+// Returns 0 on success, otherwise sets the error and returns -1.
+static int extract_arguments(struct action_event *event) {
+	IXML_Node *node =
+		(IXML_Node *)UpnpActionRequest_get_ActionRequest(event->request);
+	node = node ? ixmlNode_getFirstChild(node) : NULL;
+	if (node == NULL) {
+		upnp_set_error(event, UPNP_SOAP_E_INVALID_ARGS,
+			       "Invalid action request document");
+		return -1;
+	}
+	struct argument *args = event->arguments;
+	for (node = ixmlNode_getFirstChild(node); node != NULL;
+	     node = ixmlNode_getNextSibling(node)) {
+		const char *node_name = ixmlNode_getNodeName(node);
+		for (int i = 0; args[i].name != NULL; ++i) {
+			if (args[i].direction != PARAM_DIR_IN
+			    || strcmp(args[i].name, node_name) != 0)
+				continue;
+			IXML_Node *text = ixmlNode_getFirstChild(node);
+			const char *value = text ? ixmlNode_getNodeValue(text)
+				: NULL;
+			event->argument_values[i] = value ? value : "";
+			break;
+		}
+	}
+
+	int meta_count = 0;
+	const struct var_meta *meta =
+		VariableContainer_get_meta(event->service->variable_container,
+					   &meta_count);
+	for (int i = 0; args[i].name != NULL; ++i) {
+		const char *value = event->argument_values[i];
+		if (value == NULL || args[i].statevar >= meta_count)
+			continue;
+		if (validate_argument(event, args[i].name, value,
+				      &meta[args[i].statevar]) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+// Returns NULL if the service can't be handled.
+static struct service_index *build_service_index(struct service *srv) {
+	// The values of the IN arguments are kept in an array of fixed size
+	// while handling an action; make sure every action fits.
+	for (int i = 0; srv->actions[i].action_name != NULL; ++i) {
+		struct argument *args = srv->action_arguments
+			? srv->action_arguments[i] : NULL;
+		int arg_count = 0;
+		while (args && args[arg_count].name != NULL)
+			++arg_count;
+		if (arg_count > MAX_ACTION_ARGUMENTS) {
+			Log_error("upnp", "%s: action %s has %d arguments, "
+				  "only %d supported.", srv->service_id,
+				  srv->actions[i].action_name, arg_count,
+				  MAX_ACTION_ARGUMENTS);
+			return NULL;
+		}
+	}
+	struct service_index *index =
+		(struct service_index*) malloc(sizeof(struct service_index));
+	index->service = srv;
+	index->actions = g_hash_table_new(g_str_hash, g_str_equal);
+	for (int i = 0; srv->actions[i].action_name != NULL; ++i) {
+		g_hash_table_insert(index->actions,
+				    (gpointer) srv->actions[i].action_name,
+				    &srv->actions[i]);
+	}
+	index->variables = g_hash_table_new(g_str_hash, g_str_equal);
+	const int var_count =
+		VariableContainer_get_num_vars(srv->variable_container);
+	for (int i = 0; i < var_count; ++i) {
+		const char *name = NULL;
+		VariableContainer_get(srv->variable_container, i, &name);
+		if (name == NULL)
+			continue;
+		// Names are the static strings from the variable meta data.
+		g_hash_table_insert(index->variables, (gpointer) name,
+				    GINT_TO_POINTER(i + 1));
+	}
+	return index;
+}
+
+// Returns FALSE if one of the services can't be handled.
+static void service_index_free(gpointer data) {
+	struct service_index *index = (struct service_index*) data;
+	g_hash_table_destroy(index->actions);
+	g_hash_table_destroy(index->variables);
+	free(index);
+}
+
+static gboolean build_device_index(struct upnp_device *device) {
+	struct upnp_device_descriptor *device_def =
+		device->upnp_device_descriptor;
+	device->services = g_hash_table_new_full(g_str_hash, g_str_equal,
+						 NULL, service_index_free);
+	struct service *srv;
+	for (int i = 0; (srv = device_def->services[i]); i++) {
+		struct service_index *index = build_service_index(srv);
+		if (index == NULL)
+			return FALSE;
+		g_hash_table_insert(device->services,
+				    (gpointer) srv->service_id, index);
+	}
+	return TRUE;
+}
+
+static struct service_index *lookup_service(struct upnp_device *device,
+					    const char *service_id) {
+	if (service_id == NULL)
+		return NULL;
+	return (struct service_index*) g_hash_table_lookup(device->services,
+							   service_id);
+}
+
 static int handle_subscription_request(struct upnp_device *priv,
 				       const UpnpSubscriptionRequest *sr_event)
 {
@@ -172,15 +418,26 @@ static int handle_subscription_request(struct upnp_device *priv,
 	const char *serviceId = UpnpSubscriptionRequest_get_ServiceId_cstr(sr_event);
 	const char *udn = UpnpSubscriptionRequest_get_UDN_cstr(sr_event);
 	Log_info("upnp", "Subscription request for %s (%s)", serviceId, udn);
-	srv = find_service(priv->upnp_device_descriptor, serviceId);
+	struct service_index *index = lookup_service(priv, serviceId);
+	srv = index ? index->service : NULL;
 	if (srv == NULL) {
 		Log_error("upnp", "%s: Unknown service '%s'", __FUNCTION__,
 			serviceId);
 		return -1;
 	}
 
-	int result = -1;
-	ithread_mutex_lock(&(priv->device_mutex));
+	// The current state of the variables as one gigantic initial
+	// LastChange update. Only assembled again if something changed since
+	// the last subscription.
+	ithread_mutex_lock(srv->service_mutex);
+	if (srv->initial_state == NULL) {
+		srv->initial_state =
+			UPnPStateSnapshotCache_new(srv->variable_container,
+						   srv->event_xml_ns);
+	}
+	upnp_state_snapshot_t *snapshot =
+		UPnPStateSnapshotCache_get(srv->initial_state);
+	ithread_mutex_unlock(srv->service_mutex);
 
 	// There is really only one variable evented: LastChange
 	const char *eventvar_names[] = {
@@ -188,33 +445,11 @@ static int handle_subscription_request(struct upnp_device *priv,
 		NULL
 	};
 	const char *eventvar_values[] = {
-		NULL, NULL
+		UPnPStateSnapshot_escaped_xml(snapshot), NULL
 	};
 
-	// Build the current state of the variables as one gigantic initial
-	// LastChange update.
-	ithread_mutex_lock(srv->service_mutex);
-	const int var_count =
-		VariableContainer_get_num_vars(srv->variable_container);
-	// TODO(hzeller): maybe use srv->last_change directly ?
-	upnp_last_change_builder_t *builder = UPnPLastChangeBuilder_new(srv->event_xml_ns);
-	for (int i = 0; i < var_count; ++i) {
-		const char *name;
-		const char *value =
-			VariableContainer_get(srv->variable_container, i, &name);
-		// Send over all variables except "LastChange" itself. Also all
-		// A_ARG_TYPE variables are not evented.
-		if (value && strcmp("LastChange", name) != 0
-		    && strncmp("A_ARG_TYPE_", name, strlen("A_ARG_TYPE_")) != 0) {
-			UPnPLastChangeBuilder_add(builder, name, value);
-		}
-	}
-	ithread_mutex_unlock(srv->service_mutex);
-	char *xml_value = UPnPLastChangeBuilder_to_xml(builder);
-	Log_info("upnp", "Initial variable sync: %s", xml_value);
-	eventvar_values[0] = xmlescape(xml_value, 0);
-	free(xml_value);
-	UPnPLastChangeBuilder_delete(builder);
+	int result = -1;
+	ithread_mutex_lock(&(priv->device_mutex));
 
 	const char *sid = UpnpSubscriptionRequest_get_SID_cstr(sr_event);
 	rc = UpnpAcceptSubscription(priv->device_handle,
@@ -229,19 +464,119 @@ static int handle_subscription_request(struct upnp_device *priv,
 
 	ithread_mutex_unlock(&(priv->device_mutex));
 
-	free((char*)eventvar_values[0]);
+	UPnPStateSnapshot_unref(snapshot);
 
 	return result;
 }
 
+static void notification_free(struct notification *n) {
+	for (int i = 0; i < n->varcount; ++i) {
+		free(n->varnames[i]);
+		free(n->varvalues[i]);
+	}
+	free(n->varnames);
+	free(n->varvalues);
+	free(n->service_id);
+	free(n);
+}
+
+static void log_notify_stats(const struct notify_stats *stats) {
+	Log_info("upnp", "Events: %lu delivered; latency avg %" G_GINT64_FORMAT
+		 "us, max %" G_GINT64_FORMAT "us; max queue depth %d/%d; "
+		 "%lu dropped",
+		 stats->delivered,
+		 stats->delivered
+		 ? stats->total_latency_us / (gint64) stats->delivered : 0,
+		 stats->max_latency_us, stats->max_depth, NOTIFY_QUEUE_SIZE,
+		 stats->dropped);
+}
+
+static void *notify_thread(void *userdata) {
+	struct upnp_device *device = (struct upnp_device*) userdata;
+	ithread_mutex_lock(&device->notify_mutex);
+	for (;;) {
+		while (device->notify_head == NULL
+		       && !device->notify_shutdown) {
+			ithread_cond_wait(&device->notify_available,
+					  &device->notify_mutex);
+		}
+		struct notification *n = device->notify_head;
+		if (n == NULL)
+			break;  // Shutdown, and everything is delivered.
+		device->notify_head = n->next;
+		if (device->notify_head == NULL)
+			device->notify_tail = NULL;
+		const int depth = device->notify_depth--;
+		ithread_mutex_unlock(&device->notify_mutex);
+
+		UpnpNotify(device->device_handle,
+			   device->upnp_device_descriptor->udn, n->service_id,
+			   (const char **) n->varnames,
+			   (const char **) n->varvalues, n->varcount);
+		const gint64 latency = g_get_monotonic_time() - n->enqueue_time;
+		if (latency > 100000 || depth > NOTIFY_QUEUE_SIZE / 2) {
+			Log_info("upnp", "Slow event delivery for %s: %"
+				 G_GINT64_FORMAT "us, queue depth %d",
+				 n->service_id, latency, depth);
+		}
+		notification_free(n);
+
+		ithread_mutex_lock(&device->notify_mutex);
+		struct notify_stats *stats = &device->notify_stats;
+		stats->delivered++;
+		stats->total_latency_us += latency;
+		if (latency > stats->max_latency_us)
+			stats->max_latency_us = latency;
+	}
+	ithread_mutex_unlock(&device->notify_mutex);
+	return NULL;
+}
+
+// Only enqueues a copy of the event; it is sent by the notifier thread.
 int upnp_device_notify(struct upnp_device *device,
                        const char *serviceID,
                        const char **varnames,
                        const char **varvalues, int varcount)
 {
-        UpnpNotify(device->device_handle,
-                   device->upnp_device_descriptor->udn, serviceID,
-		   varnames, varvalues, varcount);
+	struct notification *n =
+		(struct notification*) malloc(sizeof(struct notification));
+	n->service_id = strdup(serviceID);
+	n->varcount = varcount;
+	n->varnames = (char**) calloc(varcount + 1, sizeof(char*));
+	n->varvalues = (char**) calloc(varcount + 1, sizeof(char*));
+	for (int i = 0; i < varcount; ++i) {
+		n->varnames[i] = strdup(varnames[i]);
+		n->varvalues[i] = strdup(varvalues[i]);
+	}
+	n->next = NULL;
+
+	ithread_mutex_lock(&device->notify_mutex);
+	if (device->notify_depth >= NOTIFY_QUEUE_SIZE) {
+		device->notify_stats.dropped++;
+		if (!device->notify_overflow) {
+			// Log once when it starts, not for every event.
+			device->notify_overflow = 1;
+			Log_error("upnp", "Event queue full (%d); dropping "
+				  "events for %s until subscribers catch up.",
+				  device->notify_depth, serviceID);
+		}
+		ithread_mutex_unlock(&device->notify_mutex);
+		notification_free(n);
+		return -1;
+	}
+	device->notify_overflow = 0;
+	n->enqueue_time = g_get_monotonic_time();
+	if (device->notify_tail) {
+		device->notify_tail->next = n;
+	} else {
+		device->notify_head = n;
+	}
+	device->notify_tail = n;
+	device->notify_depth++;
+	if (device->notify_depth > device->notify_stats.max_depth)
+		device->notify_stats.max_depth = device->notify_depth;
+	ithread_cond_signal(&device->notify_available);
+	ithread_mutex_unlock(&device->notify_mutex);
 
 	return 0;
 }
@@ -252,29 +587,28 @@ static int handle_var_request(struct upnp_device *priv,
 {
 	const char *serviceID = UpnpStateVarRequest_get_ServiceID_cstr(event);
 
-	struct service *srv = find_service(priv->upnp_device_descriptor, serviceID);
-	if (srv == NULL) {
+	struct service_index *index = lookup_service(priv, serviceID);
+	if (index == NULL) {
 		UpnpStateVarRequest_set_ErrCode(event, UPNP_SOAP_E_INVALID_ARGS);
 		return -1;
 	}
-
-	ithread_mutex_lock(srv->service_mutex);
+	struct service *srv = index->service;
 
 	char *result = NULL;
-	const int var_count =
-		VariableContainer_get_num_vars(srv->variable_container);
-	for (int i = 0; i < var_count; ++i) {
-		const char *name = NULL;
-		const char *value = VariableContainer_get(srv->variable_container, i, &name);
-		const char *stateVarName = UpnpStateVarRequest_get_StateVarName_cstr(event);
-		if (value && strcmp(stateVarName, name) == 0) {
+	const char *stateVarName = UpnpStateVarRequest_get_StateVarName_cstr(event);
+	const int var_num = GPOINTER_TO_INT(
+		g_hash_table_lookup(index->variables, stateVarName)) - 1;
+	if (var_num >= 0) {
+		variable_snapshot_t *snapshot =
+			VariableContainer_snapshot_acquire(
+				srv->variable_container);
+		const char *value = VariableSnapshot_get(snapshot, var_num);
+		if (value) {
 			result = strdup(value);
-			break;
 		}
+		VariableSnapshot_release(snapshot);
 	}
 
-	ithread_mutex_unlock(srv->service_mutex);
-
 	UpnpStateVarRequest_set_CurrentVal(event, result);
 	int errCode = (result == NULL) ? UPNP_SOAP_E_INVALID_VAR : UPNP_E_SUCCESS;
 	UpnpStateVarRequest_set_ErrCode(event, errCode);
@@ -289,8 +623,13 @@ static int handle_action_request(struct upnp_device *priv,
 	const char *serviceID = UpnpActionRequest_get_ServiceID_cstr(ar_event);
 	const char *actionName = UpnpActionRequest_get_ActionName_cstr(ar_event);
 
-	struct service *event_service = find_service(priv->upnp_device_descriptor, serviceID);
-	struct action *event_action = find_action(event_service, actionName);
+	struct service_index *index = lookup_service(priv, serviceID);
+	struct service *event_service = index ? index->service : NULL;
+	struct action *event_action = NULL;
+	if (index != NULL && actionName != NULL) {
+		event_action = (struct action*)
+			g_hash_table_lookup(index->actions, actionName);
+	}
 	if (event_action == NULL) {
 		Log_error("upnp", "Unknown action '%s' for service '%s'",
 			  actionName, serviceID);
@@ -304,15 +643,11 @@ static int handle_action_request(struct upnp_device *priv,
 	// react to get LastChange notifictions while in the middle of
 	// issuing an action.
 	//
-	// So we nest the change collector level here, so that we only send the
-	// LastChange after the action is finished ().
-	//
-	// Note, this is, in fact, only a preparation and not yet working as
-	// described above: we are still in the middle
-	// of executing the event-callback while sending the last change
-	// event implicitly when calling UPnPLastChangeCollector_finish() below.
-	// It would be good to enqueue the upnp_device_notify() after
-	// the action event is finished.
+	// So we nest the change collector level here, so that we only
+	// assemble the LastChange after the action is finished. The
+	// upnp_device_notify() implicitly called by
+	// UPnPLastChangeCollector_finish() below only enqueues the event; it
+	// is sent by the notifier thread while we return the response.
 	if (event_service->last_change) {
 		ithread_mutex_lock(event_service->service_mutex);
 		UPnPLastChangeCollector_start(event_service->last_change);
@@ -332,14 +667,25 @@ static int handle_action_request(struct upnp_device *priv,
 	}
 #endif
 
-	if (event_action->callback) {
-		struct action_event event;
-		int rc;
-		event.request = ar_event;
-		event.status = 0;
-		event.service = event_service;
-                event.device = priv;
+	// Values of the IN arguments, indexed like the argument table.
+	const char *argument_values[MAX_ACTION_ARGUMENTS] = { NULL };
+	struct action_event event;
+	event.request = ar_event;
+	event.status = 0;
+	event.service = event_service;
+	event.device = priv;
+	event.arguments = NULL;
+	event.argument_values = argument_values;
+	event.snapshot = NULL;
+	if (event_service->action_arguments != NULL) {
+		event.arguments = event_service->action_arguments[
+			event_action - event_service->actions];
+	}
 
+	if (event.arguments != NULL && extract_arguments(&event) != 0) {
+		// Error already set; the action does not get to see this.
+	} else if (event_action->callback) {
+		int rc;
 		rc = (event_action->callback) (&event);
 		if (rc == 0) {
 			UpnpActionRequest_set_ErrCode(event.request, UPNP_E_SUCCESS);
@@ -381,6 +727,7 @@ static int handle_action_request(struct upnp_device *priv,
 			  errCode, sock, errStr, actionName, devUDN, serviceID);
 		UpnpActionRequest_set_ErrCode(ar_event, UPNP_E_SUCCESS);
 	}
+	VariableSnapshot_release(event.snapshot);
 
 	if (event_service->last_change) {   // See comment above.
 		ithread_mutex_lock(event_service->service_mutex);
@@ -390,22 +737,47 @@ static int handle_action_request(struct upnp_device *priv,
 	return 0;
 }
 
+int upnp_device_handle_action(struct upnp_device *device,
+			      UpnpActionRequest *request) {
+	return handle_action_request(device, request);
+}
+
+// All requests arrive at the root device; find the device they are for.
+static struct upnp_device *find_device(struct upnp_device *root,
+				       const char *udn)
+{
+	struct upnp_device *device = NULL;
+	if (root->embedded != NULL && udn != NULL) {
+		device = g_hash_table_lookup(root->embedded, udn);
+	}
+	return device ? device : root;
+}
+
 static UPNP_CALLBACK(event_handler, EventType, event, userdata)
 {
 	struct upnp_device *priv = (struct upnp_device *) userdata;
 	switch (EventType) {
-	case UPNP_CONTROL_ACTION_REQUEST:
-		handle_action_request(priv, (UpnpActionRequest*)event);
+	case UPNP_CONTROL_ACTION_REQUEST: {
+		UpnpActionRequest *ar_event = (UpnpActionRequest*)event;
+		const char *udn = UpnpActionRequest_get_DevUDN_cstr(ar_event);
+		handle_action_request(find_device(priv, udn), ar_event);
 		break;
+	}
 
-	case UPNP_CONTROL_GET_VAR_REQUEST:
-		handle_var_request(priv, (UpnpStateVarRequest*)event);
+	case UPNP_CONTROL_GET_VAR_REQUEST: {
+		UpnpStateVarRequest *sv_event = (UpnpStateVarRequest*)event;
+		const char *udn = UpnpStateVarRequest_get_DevUDN_cstr(sv_event);
+		handle_var_request(find_device(priv, udn), sv_event);
 		break;
+	}
 
-	case UPNP_EVENT_SUBSCRIPTION_REQUEST:
-		handle_subscription_request(priv,
-				     (const UpnpSubscriptionRequest*)event);
+	case UPNP_EVENT_SUBSCRIPTION_REQUEST: {
+		const UpnpSubscriptionRequest *sr_event =
+			(const UpnpSubscriptionRequest*)event;
+		const char *udn = UpnpSubscriptionRequest_get_UDN_cstr(sr_event);
+		handle_subscription_request(find_device(priv, udn), sr_event);
 		break;
+	}
 
 	default:
 		Log_error("upnp", "Unknown event type: %d", EventType);
@@ -414,118 +786,261 @@ static UPNP_CALLBACK(event_handler, EventType, event, userdata)
 	return 0;
 }
 
-static gboolean initialize_device(struct upnp_device_descriptor *device_def,
-				  struct upnp_device *result_device,
-				  const char *interface_name,
-				  unsigned short port)
+// How long we keep trying to initialize libupnp, e.g. waiting for the
+// network to come up at boot.
+static const int kUpnpInitTimeoutSeconds = 300;
+static const int kUpnpInitMinBackoffMs = 10;
+static const int kUpnpInitMaxBackoffMs = 5000;
+
+// Start libupnp and its webserver; everything it serves has to be
+// registered before.
+static gboolean start_upnp(const char *interface_name, unsigned short port)
 {
 	int rc;
-	char *buf;
 
+	// There have been situations reported in which UPNP had issues
+	// initializing right after network came up. #129
+	// Retry whenever the interface changes; with increasing delays in
+	// case we don't hear about it.
+	struct interface_watch *watch = InterfaceWatch_new(interface_name);
+	const gint64 give_up = g_get_monotonic_time()
+		+ kUpnpInitTimeoutSeconds * G_USEC_PER_SEC;
+	int backoff_ms = kUpnpInitMinBackoffMs;
+	int attempts = 1;
 	rc = UpnpInit2(interface_name, port);
-	/* There have been situations reported in which UPNP had issues
-	 * initializing right after network came up. #129
-	 */
-	int retries_left = 60;
-	static const int kRetryTimeMs = 1000;
-	while (rc != UPNP_E_SUCCESS && retries_left--) {
-		usleep(kRetryTimeMs * 1000);
-		Log_error("upnp", "UpnpInit2(interface=%s, port=%d) Error: %s (%d). Retrying... (%ds)",
-			  interface_name, port, UpnpGetErrorMessage(rc), rc, retries_left);
+	while (rc != UPNP_E_SUCCESS) {
+		const gint64 left_ms = (give_up - g_get_monotonic_time()) / 1000;
+		if (left_ms <= 0)
+			break;
+		if (backoff_ms > left_ms)
+			backoff_ms = left_ms;
+		Log_error("upnp", "UpnpInit2(interface=%s, port=%d) Error: %s (%d). Retrying in %dms%s",
+			  interface_name, port, UpnpGetErrorMessage(rc), rc,
+			  backoff_ms, watch ? " or when the interface changes." : ".");
+		if (watch && InterfaceWatch_wait(watch, backoff_ms)) {
+			backoff_ms = kUpnpInitMinBackoffMs;
+		} else {
+			if (!watch)
+				usleep(backoff_ms * 1000);
+			backoff_ms = MIN(2 * backoff_ms, kUpnpInitMaxBackoffMs);
+		}
 		rc = UpnpInit2(interface_name, port);
+		++attempts;
 	}
+	InterfaceWatch_free(watch);
 	if (UPNP_E_SUCCESS != rc) {
-		Log_error("upnp", "UpnpInit2(interface=%s, port=%d) Error: %s (%d). Giving up.",
-			  interface_name, port, UpnpGetErrorMessage(rc), rc);
+		Log_error("upnp", "UpnpInit2(interface=%s, port=%d) Error: %s (%d). Giving up after %d attempts.",
+			  interface_name, port, UpnpGetErrorMessage(rc), rc, attempts);
 		return FALSE;
 	}
 	Log_info("upnp", "Registered IP=%s port=%d\n",
 		 UpnpGetServerIpAddress(), UpnpGetServerPort());
+	StartupProfile_phase("upnp-init");
 
 	rc = UpnpEnableWebserver(TRUE);
 	if (UPNP_E_SUCCESS != rc) {
 		Log_error("upnp", "UpnpEnableWebServer() Error: %s (%d)",
 			  UpnpGetErrorMessage(rc), rc);
-		return FALSE;
+		goto finish_upnp;
 	}
 
 	if (!webserver_register_callbacks())
-	  return FALSE;
+		goto finish_upnp;
 
 	rc = UpnpAddVirtualDir("/upnp");
 	if (UPNP_E_SUCCESS != rc) {
 		Log_error("upnp", "UpnpAddVirtualDir() Error: %s (%d)",
 			  UpnpGetErrorMessage(rc), rc);
-		return FALSE;
+		goto finish_upnp;
 	}
+	StartupProfile_phase("webserver");
 
-       	buf = upnp_create_device_desc(device_def);
-	rc = UpnpRegisterRootDevice2(UPNPREG_BUF_DESC,
-				     buf, strlen(buf), 1,
-				     &event_handler, result_device,
-				     &(result_device->device_handle));
-	free(buf);
+	return TRUE;
 
-	if (UPNP_E_SUCCESS != rc) {
-		Log_error("upnp", "UpnpRegisterRootDevice2() Error: %s (%d)",
-			  UpnpGetErrorMessage(rc), rc);
-		return FALSE;
-	}
+finish_upnp:
+	UpnpFinish();
+	return FALSE;
+}
 
-	rc = UpnpSendAdvertisement(result_device->device_handle, 100);
+// Register the root device; its description contains the embedded ones,
+// so this is done only once.
+static gboolean register_device(struct upnp_device *device)
+{
+	struct upnp_device_descriptor *device_def =
+		device->upnp_device_descriptor;
+	const char *buf = upnp_get_device_desc(device_def);
+	int rc = UpnpRegisterRootDevice2(UPNPREG_BUF_DESC,
+					 buf, strlen(buf), 1,
+					 &event_handler, device,
+					 &(device->device_handle));
 	if (UPNP_E_SUCCESS != rc) {
-		Log_error("unpp", "Error sending advertisements: %s (%d)",
+		Log_error("upnp", "UpnpRegisterRootDevice2(%s) Error: %s (%d)",
+			  device_def->friendly_name,
 			  UpnpGetErrorMessage(rc), rc);
 		return FALSE;
 	}
-
 	return TRUE;
 }
 
-struct upnp_device *upnp_device_init(struct upnp_device_descriptor *device_def,
-				     const char *interface_name,
-				     unsigned short port)
+static struct upnp_device *device_new(struct upnp_device_descriptor *device_def)
+{
+	struct upnp_device *result_device = (struct upnp_device*)malloc(sizeof(*result_device));
+	result_device->upnp_device_descriptor = device_def;
+	result_device->embedded = NULL;
+	result_device->services = NULL;
+	ithread_mutex_init(&(result_device->device_mutex), NULL);
+	ithread_mutex_init(&(result_device->notify_mutex), NULL);
+	ithread_cond_init(&(result_device->notify_available), NULL);
+	result_device->notify_head = result_device->notify_tail = NULL;
+	result_device->notify_depth = 0;
+	result_device->notify_overflow = 0;
+	result_device->notify_shutdown = 0;
+	memset(&result_device->notify_stats, 0,
+	       sizeof(result_device->notify_stats));
+	return result_device;
+}
+
+// Only for devices that never started.
+static void device_free(struct upnp_device *device)
+{
+	if (device->embedded != NULL)
+		g_hash_table_destroy(device->embedded);
+	if (device->services != NULL)
+		g_hash_table_destroy(device->services);
+	ithread_cond_destroy(&(device->notify_available));
+	ithread_mutex_destroy(&(device->notify_mutex));
+	ithread_mutex_destroy(&(device->device_mutex));
+	free(device);
+}
+
+// Devices started and not shut down yet; libupnp is finished with the last.
+static int running_devices_ = 0;
+
+int upnp_devices_init(struct upnp_device_descriptor **device_defs, int count,
+		      const char *interface_name, unsigned short port,
+		      struct upnp_device **result)
 {
 	int rc;
-	char *buf;
+	const char *buf;
 	struct service *srv;
 	struct icon *icon_entry;
+	struct upnp_device *root;
+
+	assert(count > 0);
+	for (int d = 0; d < count; ++d) {
+		assert(device_defs[d] != NULL);
+		assert(device_defs[d]->embedded_devices == NULL);
+		if (device_defs[d]->init_function) {
+			rc = device_defs[d]->init_function();
+			if (rc != 0) {
+				return -1;
+			}
+		}
+	}
+	StartupProfile_phase("renderer-init");
 
-	assert(device_def != NULL);
+	for (int d = 0; d < count; ++d) {
+		struct upnp_device_descriptor *device_def = device_defs[d];
+		result[d] = device_new(device_def);
 
-	if (device_def->init_function) {
-		rc = device_def->init_function();
-		if (rc != 0) {
-			return NULL;
+		/* register icons in web server */
+		for (int i = 0; (icon_entry = device_def->icons[i]); i++) {
+			webserver_register_file(icon_entry->url, "image/png");
+		}
+	}
+	StartupProfile_phase("icons");
+
+	for (int d = 0; d < count; ++d) {
+		struct upnp_device_descriptor *device_def = device_defs[d];
+		/* generate and register service schemas in web server */
+		for (int i = 0; (srv = device_def->services[i]); i++) {
+			buf = upnp_get_scpd(srv);
+			assert(buf != NULL);
+			webserver_register_buf(srv->scpd_url, buf, "text/xml");
 		}
+		if (!build_device_index(result[d]))
+			goto free_devices;
 	}
 
-	struct upnp_device *result_device = (struct upnp_device*)malloc(sizeof(*result_device));
-	result_device->upnp_device_descriptor = device_def;
-	ithread_mutex_init(&(result_device->device_mutex), NULL);
+	// libupnp only takes one root device per process: the others are
+	// embedded in the first one and share its handle.
+	root = result[0];
+	if (count > 1) {
+		root->upnp_device_descriptor->embedded_devices =
+			g_new0(struct upnp_device_descriptor*, count);
+		root->embedded = g_hash_table_new(g_str_hash, g_str_equal);
+		for (int d = 1; d < count; ++d) {
+			root->upnp_device_descriptor->embedded_devices[d - 1] =
+				device_defs[d];
+			g_hash_table_insert(root->embedded,
+					    (gpointer) device_defs[d]->udn,
+					    result[d]);
+		}
+	}
+	StartupProfile_phase("scpd");
+	if (!start_upnp(interface_name, port))
+		goto free_embedded;
+	if (!register_device(root))
+		goto finish_upnp;
+	StartupProfile_phase("register-device");
+	for (int d = 1; d < count; ++d) {
+		result[d]->device_handle = root->device_handle;
+	}
+	rc = UpnpSendAdvertisement(root->device_handle, 100);
+	if (UPNP_E_SUCCESS != rc) {
+		Log_error("unpp", "Error sending advertisements: %s (%d)",
+			  UpnpGetErrorMessage(rc), rc);
+		goto finish_upnp;
+	}
+	StartupProfile_phase("ssdp-advertisement");
 
-	/* register icons in web server */
-        for (int i = 0; (icon_entry = device_def->icons[i]); i++) {
-		webserver_register_file(icon_entry->url, "image/png");
-        }
+	for (int d = 0; d < count; ++d) {
+		ithread_create(&result[d]->notify_thread, NULL,
+			       notify_thread, result[d]);
+	}
+	running_devices_ += count;
+
+	return 0;
 
-	/* generate and register service schemas in web server */
-        for (int i = 0; (srv = device_def->services[i]); i++) {
-       		buf = upnp_get_scpd(srv);
-		assert(buf != NULL);
-		webserver_register_buf(srv->scpd_url, buf, "text/xml");
+finish_upnp:
+	UpnpFinish();  // Also unregisters the root device.
+free_embedded:
+	g_free(root->upnp_device_descriptor->embedded_devices);
+	root->upnp_device_descriptor->embedded_devices = NULL;
+free_devices:
+	for (int d = 0; d < count; ++d) {
+		device_free(result[d]);
+		result[d] = NULL;
 	}
+	return -1;
+}
 
-	if (!initialize_device(device_def, result_device, interface_name, port)) {
-		UpnpFinish();
-		free(result_device);
+struct upnp_device *upnp_device_init(struct upnp_device_descriptor *device_def,
+				     const char *interface_name,
+				     unsigned short port)
+{
+	struct upnp_device *result_device = NULL;
+	if (upnp_devices_init(&device_def, 1, interface_name, port,
+			      &result_device) != 0) {
 		return NULL;
 	}
-
 	return result_device;
 }
 
 void upnp_device_shutdown(struct upnp_device *device) {
+	// Deliver what is still in the queue before we go.
+	ithread_mutex_lock(&device->notify_mutex);
+	device->notify_shutdown = 1;
+	ithread_cond_signal(&device->notify_available);
+	ithread_mutex_unlock(&device->notify_mutex);
+	ithread_join(device->notify_thread, NULL);
+	log_notify_stats(&device->notify_stats);
+
+	// All devices share the handle of the root device; it is
+	// unregistered together with the last one.
+	if (--running_devices_ > 0) {
+		return;
+	}
 	UpnpFinish();
 }
 
@@ -611,20 +1126,13 @@ gen_desc_servicelist(struct upnp_device_descriptor *device_def,
 
 
 
-static struct xmldoc *generate_desc(struct upnp_device_descriptor *device_def)
+static struct xmlelement *
+gen_desc_device(struct upnp_device_descriptor *device_def, struct xmldoc *doc)
 {
-	struct xmldoc *doc;
-	struct xmlelement *root;
 	struct xmlelement *child;
 	struct xmlelement *parent;
 
-	doc = xmldoc_new();
-
-	root=xmldoc_new_topelement(doc, "root", "urn:schemas-upnp-org:device-1-0");
-	child=gen_specversion(doc,1,0);
-	xmlelement_add_element(doc, root, child);
 	parent=xmlelement_new(doc, "device");
-	xmlelement_add_element(doc, root, parent);
 	add_value_element(doc,parent,"deviceType", device_def->device_type);
 	add_value_element(doc,parent,"presentationURL", device_def->presentation_url);
 	add_value_element(doc,parent,"friendlyName", device_def->friendly_name);
@@ -643,19 +1151,46 @@ static struct xmldoc *generate_desc(struct upnp_device_descriptor *device_def)
 	}
 	child=gen_desc_servicelist(device_def, doc);
 	xmlelement_add_element(doc, parent, child);
+	if (device_def->embedded_devices) {
+		struct upnp_device_descriptor *embedded;
+		child=xmlelement_new(doc, "deviceList");
+		for (int i = 0; (embedded = device_def->embedded_devices[i]); i++) {
+			xmlelement_add_element(doc, child,
+					       gen_desc_device(embedded, doc));
+		}
+		xmlelement_add_element(doc, parent, child);
+	}
+
+	return parent;
+}
+
+static struct xmldoc *generate_desc(struct upnp_device_descriptor *device_def)
+{
+	struct xmldoc *doc;
+	struct xmlelement *root;
+	struct xmlelement *child;
+
+	doc = xmldoc_new();
+
+	root=xmldoc_new_topelement(doc, "root", "urn:schemas-upnp-org:device-1-0");
+	child=gen_specversion(doc,1,0);
+	xmlelement_add_element(doc, root, child);
+	xmlelement_add_element(doc, root, gen_desc_device(device_def, doc));
 
 	return doc;
 }
 
-char *upnp_create_device_desc(struct upnp_device_descriptor *device_def) {
-        char *result = NULL;
+const char *upnp_get_device_desc(struct upnp_device_descriptor *device_def) {
         struct xmldoc *doc;
 
+        if (device_def->description != NULL)
+                return device_def->description;
+
         doc = generate_desc(device_def);
 
         if (doc != NULL) {
-                result = xmldoc_tostring(doc);
+                device_def->description = xmldoc_tostring(doc);
                 xmldoc_free(doc);
         }
-        return result;
+        return device_def->description;
 }
@@ -24,6 +24,7 @@
 #ifndef _UPNP_DEVICE_H
 #define _UPNP_DEVICE_H
 
+#include "upnp_compat.h"
 
 struct upnp_device_descriptor {
 	int (*init_function) (void);
@@ -42,6 +43,10 @@ struct upnp_device_descriptor {
 	const char *mime_filter;
 	struct icon **icons;
 	struct service **services;
+	// Devices described as embedded in this one; NULL terminated. Set by
+	// upnp_devices_init() for the first of several devices.
+	struct upnp_device_descriptor **embedded_devices;
+	char *description;  // serialized once by upnp_get_device_desc()
 };
 
 // ..  and this 'device'. This is an opaque type containing internals.
@@ -52,8 +57,22 @@ struct upnp_device *upnp_device_init(struct upnp_device_descriptor *device_def,
 				     const char *interface_name,
 				     unsigned short port);
 
+// Start several devices in one process, e.g. one renderer per zone. They
+// share libupnp and its webserver, so this can only be called once.
+// libupnp handles one root device per process, so the first device is the
+// root device and the others are embedded in it.
+// result[i] is the device for device_defs[i]. Returns 0 on success.
+int upnp_devices_init(struct upnp_device_descriptor **device_defs, int count,
+		      const char *interface_name, unsigned short port,
+		      struct upnp_device **result);
+
 void upnp_device_shutdown(struct upnp_device *device);
 
+// Handle an action request as if it came in from the network; regular
+// requests arrive through the libupnp callback. Used by benchmarks.
+int upnp_device_handle_action(struct upnp_device *device,
+			      UpnpActionRequest *request);
+
 int upnp_add_response(struct action_event *event,
 		      const char *key, const char *value);
 void upnp_set_error(struct action_event *event, int error_code,
@@ -69,6 +88,10 @@ const char *upnp_get_string(struct action_event *event, const char *key);
 void upnp_append_variable(struct action_event *event,
                           int varnum, const char *paramname);
 
+// Send an event for the given variables to all subscribers of the service.
+// This does not block on the subscribers: a copy of the values is queued
+// and sent by a separate thread. If too many events are waiting already,
+// the event is dropped and -1 returned.
 int upnp_device_notify(struct upnp_device *device,
 		       const char *serviceID,
 		       const char **varnames,
@@ -78,7 +101,9 @@ int upnp_device_notify(struct upnp_device *device,
 struct service *find_service(struct upnp_device_descriptor *device_def,
                              const char *service_name);
 
-// Returns a newly allocated string with the device descriptor.
-char *upnp_create_device_desc(struct upnp_device_descriptor *device_def);
+// Returns the device descriptor XML. It is generated on the first call and
+// the same buffer is returned afterwards, so what is registered with libupnp
+// and what --dump-devicedesc prints are the same bytes.
+const char *upnp_get_device_desc(struct upnp_device_descriptor *device_def);
 
 #endif /* _UPNP_DEVICE_H */
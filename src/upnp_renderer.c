@@ -92,53 +92,72 @@ static struct upnp_device_descriptor render_device = {
         .presentation_url       = "",  // TODO(hzeller) show something useful.
         .mime_filter            = NULL,
         .icons                  = renderer_icon,
-	.services               = NULL,  /* set later */
+	.services               = NULL,  /* set per zone */
 };
 
 void upnp_renderer_dump_connmgr_scpd(void)
 {
-	char *buf;
+	const char *buf;
 	buf = upnp_get_scpd(upnp_connmgr_get_service());
 	assert(buf != NULL);
 	fputs(buf, stdout);
 }
 void upnp_renderer_dump_control_scpd(void)
 {
-	char *buf;
+	const char *buf;
 	buf = upnp_get_scpd(upnp_control_get_service());
 	assert(buf != NULL);
 	fputs(buf, stdout);
 }
 void upnp_renderer_dump_transport_scpd(void)
 {
-	char *buf;
+	const char *buf;
 	buf = upnp_get_scpd(upnp_transport_get_service());
 	assert(buf != NULL);
 	fputs(buf, stdout);
 }
 
+// The supported mime types are the same for all zones.
+static const char *mime_filter_ = NULL;
+
 static int upnp_renderer_init(void)
 {
-	static struct service *upnp_services[4];
-	upnp_services[0] = upnp_transport_get_service();
-	upnp_services[1] = upnp_connmgr_get_service();
-	upnp_services[2] = upnp_control_get_service();
-	upnp_services[3] = NULL;
-	render_device.services = upnp_services;
-	return connmgr_init(render_device.mime_filter);
+	return connmgr_init(mime_filter_);
 }
 
 struct upnp_device_descriptor *
-upnp_renderer_descriptor(const char *friendly_name,
-			 const char *uuid,
-			 const char* mime_filter)
+upnp_renderer_zone_descriptor(int zone,
+			      const char *friendly_name,
+			      const char *uuid,
+			      const char* mime_filter)
 {
-	render_device.friendly_name = friendly_name;
-	render_device.mime_filter = mime_filter;
+	struct upnp_device_descriptor *device =
+		(struct upnp_device_descriptor*) malloc(sizeof(*device));
+	*device = render_device;
+	device->friendly_name = friendly_name;
+	device->mime_filter = mime_filter;
+	mime_filter_ = mime_filter;
 
 	char *udn = NULL;
 	if (asprintf(&udn, "uuid:%s", uuid) > 0) {
-		render_device.udn = udn;
+		device->udn = udn;
 	}
-	return &render_device;
+
+	struct service **services =
+		(struct service**) malloc(4 * sizeof(struct service*));
+	services[0] = upnp_transport_get_zone_service(zone);
+	services[1] = upnp_connmgr_get_zone_service(zone);
+	services[2] = upnp_control_get_zone_service(zone);
+	services[3] = NULL;
+	device->services = services;
+	return device;
+}
+
+struct upnp_device_descriptor *
+upnp_renderer_descriptor(const char *friendly_name,
+			 const char *uuid,
+			 const char* mime_filter)
+{
+	return upnp_renderer_zone_descriptor(0, friendly_name, uuid,
+					     mime_filter);
 }
@@ -33,4 +33,10 @@ struct upnp_device_descriptor *upnp_renderer_descriptor(const char *name,
 							const char *uuid,
 							const char* mime_filter);
 
+// Descriptor of the renderer for the given zone, with the services of that
+// zone. Zone 0 is what upnp_renderer_descriptor() returns.
+struct upnp_device_descriptor *
+upnp_renderer_zone_descriptor(int zone, const char *name, const char *uuid,
+			      const char* mime_filter);
+
 #endif /* _UPNP_RENDERER_H */
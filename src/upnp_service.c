@@ -216,6 +216,11 @@ static struct xmldoc *generate_scpd(struct service *srv)
 	return doc;
 }
 
+const char *upnp_get_datatype_name(param_datatype datatype)
+{
+	return param_datatype_names[datatype];
+}
+
 struct action *find_action(struct service *event_service,
 			   const char *action_name)
 {
@@ -233,16 +238,18 @@ struct action *find_action(struct service *event_service,
 	return NULL;
 }
 
-char *upnp_get_scpd(struct service *srv)
+const char *upnp_get_scpd(struct service *srv)
 {
-	char *result = NULL;
 	struct xmldoc *doc;
 
+	if (srv->scpd != NULL)
+		return srv->scpd;
+
 	doc = generate_scpd(srv);
 	if (doc != NULL)
 	{
-       		result = xmldoc_tostring(doc);
+       		srv->scpd = xmldoc_tostring(doc);
 		xmldoc_free(doc);
 	}
-	return result;
+	return srv->scpd;
 }
@@ -32,6 +32,7 @@ struct action;
 struct service;
 struct action_event;
 struct variable_container;
+struct variable_snapshot;
 struct upnp_last_change_collector;
 
 struct action {
@@ -102,7 +103,10 @@ struct service {
 	struct argument **action_arguments;
 	struct variable_container *variable_container;
 	struct upnp_last_change_collector *last_change;
+	struct upnp_state_snapshot_cache *initial_state;  // created on demand.
+	char *scpd;  // serialized once by upnp_get_scpd()
 	int command_count;
+	void *instance;  // state of this service instance for the handlers.
 };
 
 struct action_event {
@@ -110,11 +114,25 @@ struct action_event {
 	int status;
 	struct service *service;
 	struct upnp_device *device;
+	// The argument table of the action and the values of its IN arguments
+	// extracted from the request, indexed the same way. NULL for
+	// arguments that were not sent.
+	struct argument *arguments;
+	const char **argument_values;
+	// All OUT values are taken from the same snapshot of the variables,
+	// acquired on first use.
+	struct variable_snapshot *snapshot;
 };
 
 struct action *find_action(struct service *event_service,
                                   const char *action_name);
 
-char *upnp_get_scpd(struct service *srv);
+// Returns the service description XML, generated on the first call. The
+// buffer is kept for the lifetime of the service: the webserver serves it
+// and the --dump-*-scpd options print it.
+const char *upnp_get_scpd(struct service *srv);
+
+// Name of the datatype as used in the SCPD, e.g. "ui4".
+const char *upnp_get_datatype_name(param_datatype datatype);
 
 #endif /* _UPNP_SERVICE_H */
@@ -41,6 +41,7 @@
 #include <upnp.h>
 #include <ithread.h>
 
+#include "logging.h"
 #include "output.h"
 #include "upnp_service.h"
 #include "upnp_device.h"
@@ -51,8 +52,9 @@
 #define TRANSPORT_SERVICE_ID "urn:upnp-org:serviceId:AVTransport"
 
 #define TRANSPORT_SCPD_URL "/upnp/rendertransportSCPD.xml"
-#define TRANSPORT_CONTROL_URL "/upnp/control/rendertransport1"
-#define TRANSPORT_EVENT_URL "/upnp/event/rendertransport1"
+// Numbered by zone, starting with 1.
+#define TRANSPORT_CONTROL_URL "/upnp/control/rendertransport%d"
+#define TRANSPORT_EVENT_URL "/upnp/event/rendertransport%d"
 
 // Namespace, see UPnP-av-AVTransport-v3-Service-20101231.pdf page 15
 #define TRANSPORT_EVENT_XML_NS "urn:schemas-upnp-org:metadata-1-0/AVT/"
@@ -400,33 +402,48 @@ static struct argument *argument_list[] = {
 };
 
 
-// Our 'instance' variables.
-static enum transport_state transport_state_ = TRANSPORT_STOPPED;
-static variable_container_t *state_variables_ = NULL;
+// One AVTransport; each renderer zone has its own.
+struct transport {
+	struct service service;
+	struct output *output;
+	enum transport_state state;
+	variable_container_t *state_variables;
 
-/* protects transport_values, and service-specific state */
+	/* protects the state variables, and service-specific state */
+	ithread_mutex_t mutex;
 
-static ithread_mutex_t transport_mutex;
+	// Position tracking, see below.
+	GSource *position_timer;
+	gint64 position_last_duration;
+	gint64 position_last_second;
+	gint64 position_tracking_start;  // monotonic, micro seconds.
+	unsigned long position_wakeups;  // since position_tracking_start.
+};
+
+// Position tracking, following the transport state.
+static void position_tracking_follow_state(struct transport *t,
+					   enum transport_state state);
+static void position_tracking_restart(struct transport *t);
 
-static void service_lock(void)
+static void service_lock(struct transport *t)
 {
-	ithread_mutex_lock(&transport_mutex);
+	ithread_mutex_lock(&t->mutex);
 
 	struct upnp_last_change_collector *
-		collector = upnp_transport_get_service()->last_change;
+		collector = t->service.last_change;
 	if (collector) {
 		UPnPLastChangeCollector_start(collector);
 	}
 }
 
-static void service_unlock(void)
+static void service_unlock(struct transport *t)
 {
 	struct upnp_last_change_collector *
-		collector = upnp_transport_get_service()->last_change;
+		collector = t->service.last_change;
 	if (collector) {
 		UPnPLastChangeCollector_finish(collector);
 	}
-	ithread_mutex_unlock(&transport_mutex);
+	ithread_mutex_unlock(&t->mutex);
 }
 
 static char has_instance_id(struct action_event *event)
@@ -462,26 +479,28 @@ static int get_media_info(struct action_event *event)
 }
 
 // Replace given variable without sending an state-change event.
-static int replace_var(transport_variable_t varnum, const char *new_value) {
-	return VariableContainer_change(state_variables_, varnum, new_value);
+static int replace_var(struct transport *t, transport_variable_t varnum, const char *new_value) {
+	return VariableContainer_change(t->state_variables, varnum, new_value);
 }
 
-static const char *get_var(transport_variable_t varnum) {
-	return VariableContainer_get(state_variables_, varnum, NULL);
+static const char *get_var(struct transport *t,
+			   transport_variable_t varnum) {
+	return VariableContainer_get(t->state_variables, varnum, NULL);
 }
 
 // Transport uri always comes in uri/meta pairs. Set these and also the related
 // track uri/meta variables.
 // Returns 1, if this meta-data likely needs to be updated while the stream
 // is playing (e.g. radio broadcast).
-static int replace_transport_uri_and_meta(const char *uri, const char *meta) {
-	replace_var(TRANSPORT_VAR_AV_URI, uri);
-	replace_var(TRANSPORT_VAR_AV_URI_META, meta);
+static int replace_transport_uri_and_meta(struct transport *t,
+					  const char *uri, const char *meta) {
+	replace_var(t, TRANSPORT_VAR_AV_URI, uri);
+	replace_var(t, TRANSPORT_VAR_AV_URI_META, meta);
 
 	// This influences as well the tracks. If there is a non-empty URI,
 	// we have exactly one track.
 	const char *tracks = (uri != NULL && strlen(uri) > 0) ? "1" : "0";
-	replace_var(TRANSPORT_VAR_NR_TRACKS, tracks);
+	replace_var(t, TRANSPORT_VAR_NR_TRACKS, tracks);
 
 	// We only really want to send back meta data if we didn't get anything
 	// useful or if this is an audio item.
@@ -490,26 +509,29 @@ static int replace_transport_uri_and_meta(const char *uri, const char *meta) {
 	return requires_stream_meta_callback;
 }
 
-// Similar to replace_transport_uri_and_meta() above, but current values.
-static void replace_current_uri_and_meta(const char *uri, const char *meta){
+// Similar to replace_transport_uri_and_meta(t, ) above, but current values.
+static void replace_current_uri_and_meta(struct transport *t,
+					 const char *uri, const char *meta){
 	const char *tracks = (uri != NULL && strlen(uri) > 0) ? "1" : "0";
-	replace_var(TRANSPORT_VAR_CUR_TRACK, tracks);
-	replace_var(TRANSPORT_VAR_CUR_TRACK_URI, uri);
-	replace_var(TRANSPORT_VAR_CUR_TRACK_META, meta);
+	replace_var(t, TRANSPORT_VAR_CUR_TRACK, tracks);
+	replace_var(t, TRANSPORT_VAR_CUR_TRACK_URI, uri);
+	replace_var(t, TRANSPORT_VAR_CUR_TRACK_META, meta);
 }
 
-static void change_transport_state(enum transport_state new_state) {
-	transport_state_ = new_state;
+static void change_transport_state(struct transport *t,
+				   enum transport_state new_state) {
+	t->state = new_state;
 	assert(new_state >= TRANSPORT_STOPPED
 	       && new_state < TRANSPORT_NO_MEDIA_PRESENT);
-	if (!replace_var(TRANSPORT_VAR_TRANSPORT_STATE,
+	position_tracking_follow_state(t, new_state);
+	if (!replace_var(t, TRANSPORT_VAR_TRANSPORT_STATE,
 			 transport_states[new_state])) {
 		return;  // no change.
 	}
 	const char *available_actions = NULL;
 	switch (new_state) {
 	case TRANSPORT_STOPPED:
-		if (strlen(get_var(TRANSPORT_VAR_AV_URI)) == 0) {
+		if (strlen(get_var(t, TRANSPORT_VAR_AV_URI)) == 0) {
 			available_actions = "PLAY";
 		} else {
 			available_actions = "PLAY,SEEK";
@@ -529,22 +551,24 @@ static void change_transport_state(enum transport_state new_state) {
 		break;
 	}
 	if (available_actions) {
-		replace_var(TRANSPORT_VAR_CUR_TRANSPORT_ACTIONS,
+		replace_var(t, TRANSPORT_VAR_CUR_TRANSPORT_ACTIONS,
 			    available_actions);
 	}
 }
 
 // Callback from our output if the song meta data changed.
-static void update_meta_from_stream(const struct SongMetaData *meta) {
+static void update_meta_from_stream(const struct SongMetaData *meta,
+				    void *userdata) {
+	struct transport *t = (struct transport*) userdata;
 	if (meta->title == NULL || strlen(meta->title) == 0) {
 		return;
 	}
-	const char *original_xml = get_var(TRANSPORT_VAR_AV_URI_META);
+	const char *original_xml = get_var(t, TRANSPORT_VAR_AV_URI_META);
 	char *didl = SongMetaData_to_DIDL(meta, original_xml);
-	service_lock();
-	replace_var(TRANSPORT_VAR_AV_URI_META, didl);
-	replace_var(TRANSPORT_VAR_CUR_TRACK_META, didl);
-	service_unlock();
+	service_lock(t);
+	replace_var(t, TRANSPORT_VAR_AV_URI_META, didl);
+	replace_var(t, TRANSPORT_VAR_CUR_TRACK_META, didl);
+	service_unlock(t);
 	free(didl);
 }
 
@@ -552,6 +576,7 @@ static void update_meta_from_stream(const struct SongMetaData *meta) {
 
 static int set_avtransport_uri(struct action_event *event)
 {
+	struct transport *t = (struct transport*) event->service->instance;
 	if (!has_instance_id(event)) {
 		return -1;
 	}
@@ -560,30 +585,31 @@ static int set_avtransport_uri(struct action_event *event)
 		return -1;
 	}
 
-	service_lock();
+	service_lock(t);
 	const char *meta = upnp_get_string(event, "CurrentURIMetaData");
 	// Transport URI/Meta set now, current URI/Meta when it starts playing.
-	int requires_meta_update = replace_transport_uri_and_meta(uri, meta);
+	int requires_meta_update = replace_transport_uri_and_meta(t, uri, meta);
 
-	if (transport_state_ == TRANSPORT_PLAYING) {
+	if (t->state == TRANSPORT_PLAYING) {
 		// Uh, wrong state.
 		// Usually, this should not be called while we are PLAYING, only
 		// STOPPED or PAUSED. But if actually some controller sets this
 		// while playing, probably the best is to update the current
 		// current URI/Meta as well to reflect the state best.
-		replace_current_uri_and_meta(uri, meta);
+		replace_current_uri_and_meta(t, uri, meta);
 	}
 
-	output_set_uri(uri, (requires_meta_update
-			     ? update_meta_from_stream
-			     : NULL));
-	service_unlock();
+	output_set_uri(t->output, uri,
+		       (requires_meta_update ? update_meta_from_stream : NULL),
+		       t);
+	service_unlock(t);
 
 	return 0;
 }
 
 static int set_next_avtransport_uri(struct action_event *event)
 {
+	struct transport *t = (struct transport*) event->service->instance;
 	if (!has_instance_id(event)) {
 		return -1;
 	}
@@ -594,19 +620,19 @@ static int set_next_avtransport_uri(struct action_event *event)
 	}
 
 	int rc = 0;
-	service_lock();
+	service_lock(t);
 
-	output_set_next_uri(next_uri);
-	replace_var(TRANSPORT_VAR_NEXT_AV_URI, next_uri);
+	output_set_next_uri(t->output, next_uri);
+	replace_var(t, TRANSPORT_VAR_NEXT_AV_URI, next_uri);
 
 	const char *next_uri_meta = upnp_get_string(event, "NextURIMetaData");
 	if (next_uri_meta == NULL) {
 		rc = -1;
 	} else {
-		replace_var(TRANSPORT_VAR_NEXT_AV_URI_META, next_uri_meta);
+		replace_var(t, TRANSPORT_VAR_NEXT_AV_URI_META, next_uri_meta);
 	}
 
-	service_unlock();
+	service_unlock(t);
 
 	return rc;
 }
@@ -670,32 +696,141 @@ static gint64 parse_upnp_time(const char *time_string) {
 	return one_sec_unit * seconds;
 }
 
-// We constantly update the track time to event about it to our clients.
-static void *thread_update_track_time(void *userdata) {
-	(void)userdata;
-	const gint64 one_sec_unit = 1000000000LL;
+// Position tracking.
+//
+// The track time is only moving while we are PLAYING, so we only keep a
+// GLib timer on the main loop while in that state. Each wakeup queries the
+// output once and schedules the next wakeup right after the position crosses
+// the next whole second, which is the resolution of the UPnP time string.
+// While paused or stopped, nothing wakes up and nothing takes the
+// transport lock.
+//
+// All position_* fields are protected by the transport mutex.
+static const gint64 kOneSecUnit = 1000000000LL;  // nanoseconds.
+
+// Wake up slightly after the boundary, so that the position we read has
+// safely advanced to the next second.
+static const guint kPositionSlackMillis = 20;
+
+// If the output can't tell the position yet (e.g. still prerolling), retry
+// after this time.
+static const guint kPositionRetryMillis = 250;
+
+// What the old polling thread did; only used to report what we saved.
+static const gint64 kLegacyPollMicros = 500000;
+
+static gboolean position_timer_tick(gpointer userdata);
+
+static void position_timer_schedule(struct transport *t, guint millis) {
+	if (t->position_timer != NULL) {
+		g_source_destroy(t->position_timer);
+		g_source_unref(t->position_timer);
+	}
+	t->position_timer = g_timeout_source_new(millis);
+	g_source_set_callback(t->position_timer, position_timer_tick, t, NULL);
+	g_source_attach(t->position_timer, NULL);
+}
+
+static void position_timer_cancel(struct transport *t) {
+	if (t->position_timer == NULL)
+		return;
+	g_source_destroy(t->position_timer);
+	g_source_unref(t->position_timer);
+	t->position_timer = NULL;
+}
+
+// Query output and update time variables. Returns the position in
+// nanoseconds or -1 if not available. Needs to be called with the
+// transport mutex held.
+static gint64 position_update_vars(struct transport *t) {
 	char tbuf[32];
-	gint64 last_duration = -1, last_position = -1;
-	for (;;) {
-		usleep(500000);  // 500ms
-		service_lock();
-		gint64 duration, position;
-		const int pos_result = output_get_position(&duration, &position);
-		if (pos_result == 0) {
-			if (duration != last_duration) {
-				print_upnp_time(tbuf, sizeof(tbuf), duration);
-				replace_var(TRANSPORT_VAR_CUR_TRACK_DUR, tbuf);
-				last_duration = duration;
-			}
-			if (position / one_sec_unit != last_position) {
-				print_upnp_time(tbuf, sizeof(tbuf), position);
-				replace_var(TRANSPORT_VAR_REL_TIME_POS, tbuf);
-				last_position = position / one_sec_unit;
-			}
+	gint64 duration, position;
+	++t->position_wakeups;
+	if (output_get_position(t->output, &duration, &position) != 0) {
+		return -1;
+	}
+	if (duration != t->position_last_duration) {
+		print_upnp_time(tbuf, sizeof(tbuf), duration);
+		replace_var(t, TRANSPORT_VAR_CUR_TRACK_DUR, tbuf);
+		t->position_last_duration = duration;
+	}
+	if (position / kOneSecUnit != t->position_last_second) {
+		print_upnp_time(tbuf, sizeof(tbuf), position);
+		replace_var(t, TRANSPORT_VAR_REL_TIME_POS, tbuf);
+		t->position_last_second = position / kOneSecUnit;
+	}
+	return position;
+}
+
+// Milliseconds until the given stream position crosses the next second.
+static guint position_millis_to_next_second(gint64 position) {
+	const gint64 remain = kOneSecUnit - (position % kOneSecUnit);
+	return (guint) (remain / 1000000) + kPositionSlackMillis;
+}
+
+static gboolean position_timer_tick(gpointer userdata) {
+	struct transport *t = (struct transport*) userdata;
+	service_lock(t);
+	// We might have been cancelled or re-scheduled while waiting for
+	// the lock; the source is then already destroyed.
+	if (g_source_is_destroyed(g_main_current_source())) {
+		service_unlock(t);
+		return FALSE;
+	}
+	const gint64 position = position_update_vars(t);
+	position_timer_schedule(t, position < 0
+				? kPositionRetryMillis
+				: position_millis_to_next_second(position));
+	service_unlock(t);
+	return FALSE;  // we re-scheduled a fresh source above.
+}
+
+static void position_log_stats(struct transport *t) {
+	const gint64 elapsed = (g_get_monotonic_time()
+				- t->position_tracking_start);
+	const unsigned long legacy = elapsed / kLegacyPollMicros;
+	const unsigned long saved = (legacy > t->position_wakeups)
+		? legacy - t->position_wakeups : 0;
+	Log_info("transport", "Position tracking: %lu wakeups in %" G_GINT64_FORMAT
+		 "s of playing; saved %lu wakeups and lock acquisitions compared to "
+		 "polling.", t->position_wakeups, elapsed / 1000000, saved);
+	struct variable_container_stats stats;
+	VariableContainer_get_stats(t->state_variables, &stats);
+	Log_info("transport", "State variables: %lu changes, %lu allocations "
+		 "since startup.", stats.changes, stats.allocations);
+}
+
+// Start or stop the timer according to the transport state. Needs to be
+// called with the transport mutex held.
+static void position_tracking_follow_state(struct transport *t,
+					   enum transport_state state) {
+	if (state == TRANSPORT_PLAYING) {
+		if (t->position_timer == NULL) {
+			// Statistics are per playing session.
+			t->position_tracking_start = g_get_monotonic_time();
+			t->position_wakeups = 0;
+			position_timer_schedule(t, kPositionRetryMillis);
 		}
-		service_unlock();
+		return;
+	}
+	if (t->position_timer == NULL)
+		return;
+	position_timer_cancel(t);
+	if (state == TRANSPORT_PAUSED_PLAYBACK) {
+		// Make sure we report where exactly we stopped.
+		position_update_vars(t);
+	}
+	position_log_stats(t);
+}
+
+// The stream position jumped (seek, new stream). Re-align the timer to
+// the new second boundaries.
+static void position_tracking_restart(struct transport *t) {
+	t->position_last_second = -1;
+	t->position_last_duration = -1;
+	if (t->position_timer != NULL) {
+		position_timer_schedule(t, kPositionRetryMillis);
 	}
-	return NULL;  // not reached.
 }
 
 static int get_position_info(struct action_event *event)
@@ -729,12 +864,13 @@ static int get_device_caps(struct action_event *event)
 
 static int stop(struct action_event *event)
 {
+	struct transport *t = (struct transport*) event->service->instance;
 	if (!has_instance_id(event)) {
 		return -1;
 	}
 
-	service_lock();
-	switch (transport_state_) {
+	service_lock(t);
+	switch (t->state) {
 	case TRANSPORT_STOPPED:
 		// nothing to change.
 		break;
@@ -743,54 +879,58 @@ static int stop(struct action_event *event)
 	case TRANSPORT_PAUSED_RECORDING:
 	case TRANSPORT_RECORDING:
 	case TRANSPORT_PAUSED_PLAYBACK:
-		output_stop();
-		change_transport_state(TRANSPORT_STOPPED);
+		output_stop(t->output);
+		change_transport_state(t, TRANSPORT_STOPPED);
 		break;
 
 	case TRANSPORT_NO_MEDIA_PRESENT:
 		/* action not allowed in these states - error 701 */
 		upnp_set_error(event, UPNP_TRANSPORT_E_TRANSITION_NA,
 			       "Transition to STOP not allowed; allowed=%s",
-			       get_var(TRANSPORT_VAR_CUR_TRANSPORT_ACTIONS));
+			       get_var(t, TRANSPORT_VAR_CUR_TRANSPORT_ACTIONS));
 
 		break;
 	}
-	service_unlock();
+	service_unlock(t);
 
 	return 0;
 }
 
-static void inform_play_transition_from_output(enum PlayFeedback fb) {
-	service_lock();
+static void inform_play_transition_from_output(enum PlayFeedback fb,
+					      void *userdata) {
+	struct transport *t = (struct transport*) userdata;
+	service_lock(t);
 	switch (fb) {
 	case PLAY_STOPPED:
-		replace_transport_uri_and_meta("", "");
-		replace_current_uri_and_meta("", "");
-		change_transport_state(TRANSPORT_STOPPED);
+		replace_transport_uri_and_meta(t, "", "");
+		replace_current_uri_and_meta(t, "", "");
+		change_transport_state(t, TRANSPORT_STOPPED);
 		break;
 
 	case PLAY_STARTED_NEXT_STREAM: {
-		const char *av_uri = get_var(TRANSPORT_VAR_NEXT_AV_URI);
-		const char *av_meta = get_var(TRANSPORT_VAR_NEXT_AV_URI_META);
-		replace_transport_uri_and_meta(av_uri, av_meta);
-		replace_current_uri_and_meta(av_uri, av_meta);
-		replace_var(TRANSPORT_VAR_NEXT_AV_URI, "");
-		replace_var(TRANSPORT_VAR_NEXT_AV_URI_META, "");
+		const char *av_uri = get_var(t, TRANSPORT_VAR_NEXT_AV_URI);
+		const char *av_meta = get_var(t, TRANSPORT_VAR_NEXT_AV_URI_META);
+		replace_transport_uri_and_meta(t, av_uri, av_meta);
+		replace_current_uri_and_meta(t, av_uri, av_meta);
+		replace_var(t, TRANSPORT_VAR_NEXT_AV_URI, "");
+		replace_var(t, TRANSPORT_VAR_NEXT_AV_URI_META, "");
+		position_tracking_restart(t);
 		break;
 	}
 	}
-	service_unlock();
+	service_unlock(t);
 }
 
 static int play(struct action_event *event)
 {
+	struct transport *t = (struct transport*) event->service->instance;
 	if (!has_instance_id(event)) {
 		return -1;
 	}
 
 	int rc = 0;
-	service_lock();
-	switch (transport_state_) {
+	service_lock(t);
+	switch (t->state) {
 	case TRANSPORT_PLAYING:
 		// Nothing to change.
 		break;
@@ -800,19 +940,20 @@ static int play(struct action_event *event)
 		// set the time to zero now; otherwise we will see the old
 		// value of the previous song until it updates some fractions
 		// of a second later.
-		replace_var(TRANSPORT_VAR_REL_TIME_POS, kZeroTime);
+		replace_var(t, TRANSPORT_VAR_REL_TIME_POS, kZeroTime);
 
 		/* >>> fall through */
 
 	case TRANSPORT_PAUSED_PLAYBACK:
-		if (output_play(&inform_play_transition_from_output)) {
+		if (output_play(t->output, &inform_play_transition_from_output,
+				t)) {
 			upnp_set_error(event, 704, "Playing failed");
 			rc = -1;
 		} else {
-			change_transport_state(TRANSPORT_PLAYING);
-			const char *av_uri = get_var(TRANSPORT_VAR_AV_URI);
-			const char *av_meta = get_var(TRANSPORT_VAR_AV_URI_META);
-			replace_current_uri_and_meta(av_uri, av_meta);
+			change_transport_state(t, TRANSPORT_PLAYING);
+			const char *av_uri = get_var(t, TRANSPORT_VAR_AV_URI);
+			const char *av_meta = get_var(t, TRANSPORT_VAR_AV_URI_META);
+			replace_current_uri_and_meta(t, av_uri, av_meta);
 		}
 		break;
 
@@ -823,34 +964,35 @@ static int play(struct action_event *event)
 		/* action not allowed in these states - error 701 */
 		upnp_set_error(event, UPNP_TRANSPORT_E_TRANSITION_NA,
 			       "Transition to PLAY not allowed; allowed=%s",
-			       get_var(TRANSPORT_VAR_CUR_TRANSPORT_ACTIONS));
+			       get_var(t, TRANSPORT_VAR_CUR_TRANSPORT_ACTIONS));
 		rc = -1;
 		break;
 	}
-	service_unlock();
+	service_unlock(t);
 
 	return rc;
 }
 
 static int pause_stream(struct action_event *event)
 {
+	struct transport *t = (struct transport*) event->service->instance;
 	if (!has_instance_id(event)) {
 		return -1;
 	}
 
 	int rc = 0;
-	service_lock();
-	switch (transport_state_) {
+	service_lock(t);
+	switch (t->state) {
         case TRANSPORT_PAUSED_PLAYBACK:
 		// Nothing to change.
 		break;
 
 	case TRANSPORT_PLAYING:
-		if (output_pause()) {
+		if (output_pause(t->output)) {
 			upnp_set_error(event, 704, "Pause failed");
 			rc = -1;
 		} else {
-			change_transport_state(TRANSPORT_PAUSED_PLAYBACK);
+			change_transport_state(t, TRANSPORT_PAUSED_PLAYBACK);
 		}
 		break;
 
@@ -858,16 +1000,17 @@ static int pause_stream(struct action_event *event)
 		/* action not allowed in these states - error 701 */
 		upnp_set_error(event, UPNP_TRANSPORT_E_TRANSITION_NA,
 			       "Transition to PAUSE not allowed; allowed=%s",
-			       get_var(TRANSPORT_VAR_CUR_TRANSPORT_ACTIONS));
+			       get_var(t, TRANSPORT_VAR_CUR_TRANSPORT_ACTIONS));
 		rc = -1;
         }
-	service_unlock();
+	service_unlock(t);
 
 	return rc;
 }
 
 static int seek(struct action_event *event)
 {
+	struct transport *t = (struct transport*) event->service->instance;
 	if (!has_instance_id(event)) {
 		return -1;
 	}
@@ -877,15 +1020,16 @@ static int seek(struct action_event *event)
 		// This is the only thing we support right now.
 		const char *target = upnp_get_string(event, "Target");
 		gint64 nanos = parse_upnp_time(target);
-		service_lock();
-		if (output_seek(nanos) == 0) {
+		service_lock(t);
+		if (output_seek(t->output, nanos) == 0) {
 			// TODO(hzeller): Seeking might take some time,
 			// pretend to already be there. Should we go into
 			// TRANSITION mode ?
 			// (gstreamer will go into PAUSE, then PLAYING)
-			replace_var(TRANSPORT_VAR_REL_TIME_POS, target);
+			replace_var(t, TRANSPORT_VAR_REL_TIME_POS, target);
+			position_tracking_restart(t);
 		}
-		service_unlock();
+		service_unlock(t);
 	}
 
 	return 0;
@@ -914,102 +1058,128 @@ static struct action transport_actions[] = {
 	[TRANSPORT_CMD_COUNT] =                  {NULL, NULL}
 };
 
-struct service *upnp_transport_get_service(void) {
-	static struct service transport_service_ = {
-		.service_mutex =        &transport_mutex,
-		.service_id =           TRANSPORT_SERVICE_ID,
-		.service_type =         TRANSPORT_TYPE,
-		.scpd_url =		TRANSPORT_SCPD_URL,
-		.control_url =		TRANSPORT_CONTROL_URL,
-		.event_url =		TRANSPORT_EVENT_URL,
-		.event_xml_ns =         TRANSPORT_EVENT_XML_NS,
-		.actions =              transport_actions,
-		.action_arguments =     argument_list,
-		.variable_container =   NULL, // set later.
-		.last_change =          NULL,
-		.command_count =        TRANSPORT_CMD_COUNT,
-	};
-
-	static struct var_meta transport_var_meta[] = {
-		{TRANSPORT_VAR_TRANSPORT_STATE, "TransportState", "STOPPED",
-		 EV_NO, DATATYPE_STRING, transport_states, NULL },
-		{TRANSPORT_VAR_TRANSPORT_STATUS, "TransportStatus", "OK",
-		 EV_NO, DATATYPE_STRING, transport_stati, NULL },
-		{TRANSPORT_VAR_PLAY_MEDIUM, "PlaybackStorageMedium", "UNKNOWN",
-		 EV_NO, DATATYPE_STRING, media, NULL },
-		{TRANSPORT_VAR_REC_MEDIUM, "RecordStorageMedium", "NOT_IMPLEMENTED",
-		 EV_NO, DATATYPE_STRING, media, NULL },
-		{TRANSPORT_VAR_PLAY_MEDIA, "PossiblePlaybackStorageMedia", "NETWORK,UNKNOWN",
-		 EV_NO, DATATYPE_STRING, NULL, NULL },
-		{TRANSPORT_VAR_REC_MEDIA, "PossibleRecordStorageMedia","NOT_IMPLEMENTED",
-		 EV_NO, DATATYPE_STRING, NULL, NULL },
-		{TRANSPORT_VAR_CUR_PLAY_MODE, "CurrentPlayMode", "NORMAL",
-		 EV_NO, DATATYPE_STRING, playmodi, NULL},
-		{TRANSPORT_VAR_TRANSPORT_PLAY_SPEED, "TransportPlaySpeed", "1",
-		 EV_NO, DATATYPE_STRING, playspeeds, NULL },
-		{TRANSPORT_VAR_REC_MEDIUM_WR_STATUS, "RecordMediumWriteStatus", "NOT_IMPLEMENTED",
-		 EV_NO, DATATYPE_STRING, rec_write_stati, NULL },
-		{TRANSPORT_VAR_CUR_REC_QUAL_MODE, "CurrentRecordQualityMode","NOT_IMPLEMENTED",
-		 EV_NO, DATATYPE_STRING, rec_quality_modi, NULL },
-		{TRANSPORT_VAR_POS_REC_QUAL_MODE, "PossibleRecordQualityModes", "NOT_IMPLEMENTED",
-		 EV_NO, DATATYPE_STRING, NULL, NULL },
-		{TRANSPORT_VAR_NR_TRACKS, "NumberOfTracks", "0",
-		 EV_NO, DATATYPE_UI4, NULL, &track_nr_range }, /* no step */
-		{TRANSPORT_VAR_CUR_TRACK, "CurrentTrack", "0",
-		 EV_NO, DATATYPE_UI4, NULL, &track_range },
-		{TRANSPORT_VAR_CUR_TRACK_DUR, "CurrentTrackDuration", kZeroTime,
-		 EV_NO, DATATYPE_STRING, NULL, NULL },
-		{TRANSPORT_VAR_CUR_MEDIA_DUR, "CurrentMediaDuration", "",
-		 EV_NO, DATATYPE_STRING, NULL, NULL },
-		{TRANSPORT_VAR_CUR_TRACK_META, "CurrentTrackMetaData", "",
-		 EV_NO, DATATYPE_STRING, NULL, NULL },
-		{TRANSPORT_VAR_CUR_TRACK_URI, "CurrentTrackURI", "",
-		 EV_NO, DATATYPE_STRING, NULL, NULL },
-		{TRANSPORT_VAR_AV_URI, "AVTransportURI", "",
-		 EV_NO, DATATYPE_STRING, NULL, NULL },
-		{TRANSPORT_VAR_AV_URI_META, "AVTransportURIMetaData", "",
-		 EV_NO, DATATYPE_STRING, NULL, NULL },
-		{TRANSPORT_VAR_NEXT_AV_URI, "NextAVTransportURI", "",
-		 EV_NO, DATATYPE_STRING, NULL, NULL },
-		{TRANSPORT_VAR_NEXT_AV_URI_META, "NextAVTransportURIMetaData", "",
-		 EV_NO, DATATYPE_STRING, NULL, NULL },
-		{TRANSPORT_VAR_REL_TIME_POS, "RelativeTimePosition", kZeroTime,
-		 EV_NO, DATATYPE_STRING, NULL, NULL },
-		{TRANSPORT_VAR_ABS_TIME_POS, "AbsoluteTimePosition", "NOT_IMPLEMENTED",
-		 EV_NO, DATATYPE_STRING, NULL, NULL },
-		{TRANSPORT_VAR_REL_CTR_POS, "RelativeCounterPosition", "2147483647",
-		 EV_NO, DATATYPE_I4, NULL, NULL },
-		{TRANSPORT_VAR_ABS_CTR_POS, "AbsoluteCounterPosition", "2147483647",
-		 EV_NO, DATATYPE_I4, NULL, NULL },
-		{TRANSPORT_VAR_LAST_CHANGE, "LastChange", "<Event xmlns=\"urn:schemas-upnp-org:metadata-1-0/AVT/\"/>",
-		 EV_YES, DATATYPE_STRING, NULL, NULL },
-		{TRANSPORT_VAR_AAT_SEEK_MODE, "A_ARG_TYPE_SeekMode", "TRACK_NR",
-		 EV_NO, DATATYPE_STRING, aat_seekmodi, NULL },
-		{TRANSPORT_VAR_AAT_SEEK_TARGET, "A_ARG_TYPE_SeekTarget", "",
-		 EV_NO, DATATYPE_STRING, NULL, NULL },
-		{TRANSPORT_VAR_AAT_INSTANCE_ID, "A_ARG_TYPE_InstanceID", "0",
-		 EV_NO, DATATYPE_UI4, NULL, NULL },
-		{TRANSPORT_VAR_CUR_TRANSPORT_ACTIONS, "CurrentTransportActions", "PLAY",
-		 EV_NO, DATATYPE_STRING, NULL, NULL },
-
-		{TRANSPORT_VAR_COUNT, NULL, NULL, EV_NO, DATATYPE_UNKNOWN, NULL, NULL }
-	};
-
-	if (transport_service_.variable_container == NULL) {
-		state_variables_ = VariableContainer_new(TRANSPORT_VAR_COUNT,
-							 transport_var_meta);
-		transport_service_.variable_container = state_variables_;
+static struct var_meta transport_var_meta[] = {
+	{TRANSPORT_VAR_TRANSPORT_STATE, "TransportState", "STOPPED",
+	 EV_NO, DATATYPE_STRING, transport_states, NULL },
+	{TRANSPORT_VAR_TRANSPORT_STATUS, "TransportStatus", "OK",
+	 EV_NO, DATATYPE_STRING, transport_stati, NULL },
+	{TRANSPORT_VAR_PLAY_MEDIUM, "PlaybackStorageMedium", "UNKNOWN",
+	 EV_NO, DATATYPE_STRING, media, NULL },
+	{TRANSPORT_VAR_REC_MEDIUM, "RecordStorageMedium", "NOT_IMPLEMENTED",
+	 EV_NO, DATATYPE_STRING, media, NULL },
+	{TRANSPORT_VAR_PLAY_MEDIA, "PossiblePlaybackStorageMedia", "NETWORK,UNKNOWN",
+	 EV_NO, DATATYPE_STRING, NULL, NULL },
+	{TRANSPORT_VAR_REC_MEDIA, "PossibleRecordStorageMedia","NOT_IMPLEMENTED",
+	 EV_NO, DATATYPE_STRING, NULL, NULL },
+	{TRANSPORT_VAR_CUR_PLAY_MODE, "CurrentPlayMode", "NORMAL",
+	 EV_NO, DATATYPE_STRING, playmodi, NULL},
+	{TRANSPORT_VAR_TRANSPORT_PLAY_SPEED, "TransportPlaySpeed", "1",
+	 EV_NO, DATATYPE_STRING, playspeeds, NULL },
+	{TRANSPORT_VAR_REC_MEDIUM_WR_STATUS, "RecordMediumWriteStatus", "NOT_IMPLEMENTED",
+	 EV_NO, DATATYPE_STRING, rec_write_stati, NULL },
+	{TRANSPORT_VAR_CUR_REC_QUAL_MODE, "CurrentRecordQualityMode","NOT_IMPLEMENTED",
+	 EV_NO, DATATYPE_STRING, rec_quality_modi, NULL },
+	{TRANSPORT_VAR_POS_REC_QUAL_MODE, "PossibleRecordQualityModes", "NOT_IMPLEMENTED",
+	 EV_NO, DATATYPE_STRING, NULL, NULL },
+	{TRANSPORT_VAR_NR_TRACKS, "NumberOfTracks", "0",
+	 EV_NO, DATATYPE_UI4, NULL, &track_nr_range }, /* no step */
+	{TRANSPORT_VAR_CUR_TRACK, "CurrentTrack", "0",
+	 EV_NO, DATATYPE_UI4, NULL, &track_range },
+	{TRANSPORT_VAR_CUR_TRACK_DUR, "CurrentTrackDuration", kZeroTime,
+	 EV_NO, DATATYPE_STRING, NULL, NULL },
+	{TRANSPORT_VAR_CUR_MEDIA_DUR, "CurrentMediaDuration", "",
+	 EV_NO, DATATYPE_STRING, NULL, NULL },
+	{TRANSPORT_VAR_CUR_TRACK_META, "CurrentTrackMetaData", "",
+	 EV_NO, DATATYPE_STRING, NULL, NULL },
+	{TRANSPORT_VAR_CUR_TRACK_URI, "CurrentTrackURI", "",
+	 EV_NO, DATATYPE_STRING, NULL, NULL },
+	{TRANSPORT_VAR_AV_URI, "AVTransportURI", "",
+	 EV_NO, DATATYPE_STRING, NULL, NULL },
+	{TRANSPORT_VAR_AV_URI_META, "AVTransportURIMetaData", "",
+	 EV_NO, DATATYPE_STRING, NULL, NULL },
+	{TRANSPORT_VAR_NEXT_AV_URI, "NextAVTransportURI", "",
+	 EV_NO, DATATYPE_STRING, NULL, NULL },
+	{TRANSPORT_VAR_NEXT_AV_URI_META, "NextAVTransportURIMetaData", "",
+	 EV_NO, DATATYPE_STRING, NULL, NULL },
+	{TRANSPORT_VAR_REL_TIME_POS, "RelativeTimePosition", kZeroTime,
+	 EV_NO, DATATYPE_STRING, NULL, NULL },
+	{TRANSPORT_VAR_ABS_TIME_POS, "AbsoluteTimePosition", "NOT_IMPLEMENTED",
+	 EV_NO, DATATYPE_STRING, NULL, NULL },
+	{TRANSPORT_VAR_REL_CTR_POS, "RelativeCounterPosition", "2147483647",
+	 EV_NO, DATATYPE_I4, NULL, NULL },
+	{TRANSPORT_VAR_ABS_CTR_POS, "AbsoluteCounterPosition", "2147483647",
+	 EV_NO, DATATYPE_I4, NULL, NULL },
+	{TRANSPORT_VAR_LAST_CHANGE, "LastChange", "<Event xmlns=\"urn:schemas-upnp-org:metadata-1-0/AVT/\"/>",
+	 EV_YES, DATATYPE_STRING, NULL, NULL },
+	{TRANSPORT_VAR_AAT_SEEK_MODE, "A_ARG_TYPE_SeekMode", "TRACK_NR",
+	 EV_NO, DATATYPE_STRING, aat_seekmodi, NULL },
+	{TRANSPORT_VAR_AAT_SEEK_TARGET, "A_ARG_TYPE_SeekTarget", "",
+	 EV_NO, DATATYPE_STRING, NULL, NULL },
+	{TRANSPORT_VAR_AAT_INSTANCE_ID, "A_ARG_TYPE_InstanceID", "0",
+	 EV_NO, DATATYPE_UI4, NULL, NULL },
+	{TRANSPORT_VAR_CUR_TRANSPORT_ACTIONS, "CurrentTransportActions", "PLAY",
+	 EV_NO, DATATYPE_STRING, NULL, NULL },
+
+	{TRANSPORT_VAR_COUNT, NULL, NULL, EV_NO, DATATYPE_UNKNOWN, NULL, NULL }
+};
+
+static struct transport *transport_new(int zone) {
+	struct transport *t =
+		(struct transport*) calloc(1, sizeof(struct transport));
+	ithread_mutex_init(&t->mutex, NULL);
+	t->state = TRANSPORT_STOPPED;
+	t->state_variables = VariableContainer_new(TRANSPORT_VAR_COUNT,
+						   transport_var_meta);
+	t->position_last_duration = -1;
+	t->position_last_second = -1;
+
+	struct service *srv = &t->service;
+	srv->service_mutex = &t->mutex;
+	srv->service_id = TRANSPORT_SERVICE_ID;
+	srv->service_type = TRANSPORT_TYPE;
+	srv->scpd_url = TRANSPORT_SCPD_URL;
+	srv->control_url = g_strdup_printf(TRANSPORT_CONTROL_URL, zone + 1);
+	srv->event_url = g_strdup_printf(TRANSPORT_EVENT_URL, zone + 1);
+	srv->event_xml_ns = TRANSPORT_EVENT_XML_NS;
+	srv->actions = transport_actions;
+	srv->action_arguments = argument_list;
+	srv->variable_container = t->state_variables;
+	srv->last_change = NULL;  // set in upnp_transport_init()
+	srv->command_count = TRANSPORT_CMD_COUNT;
+	srv->instance = t;
+	return t;
+}
+
+// All transports, indexed by zone. Only grows, from the main thread while
+// setting up.
+static GPtrArray *zones_ = NULL;
+
+struct service *upnp_transport_get_zone_service(int zone) {
+	assert(zone >= 0);
+	if (zones_ == NULL) {
+		zones_ = g_ptr_array_new();
 	}
-	return &transport_service_;
+	while ((int) zones_->len <= zone) {
+		g_ptr_array_add(zones_, transport_new(zones_->len));
+	}
+	struct transport *t = g_ptr_array_index(zones_, zone);
+	return &t->service;
+}
+
+struct service *upnp_transport_get_service(void) {
+	return upnp_transport_get_zone_service(0);
 }
 
-void upnp_transport_init(struct upnp_device *device) {
-	struct service *service = upnp_transport_get_service();
+void upnp_transport_init(struct service *service, struct upnp_device *device,
+			 struct output *output) {
+	struct transport *t = (struct transport*) service->instance;
+	t->output = output;
 	assert(service->last_change == NULL);
 	service->last_change =
 		UPnPLastChangeCollector_new(service->variable_container,
 					    TRANSPORT_EVENT_XML_NS,
-					    device, TRANSPORT_SERVICE_ID);
+					    device, TRANSPORT_SERVICE_ID,
+					    service->service_mutex);
 	// Times and counters should not be evented. We only change REL_TIME
 	// right now anyway (AVTransport-v1 document, 2.3.1 Event Model)
 	UPnPLastChangeCollector_add_ignore(service->last_change,
@@ -1021,11 +1191,13 @@ void upnp_transport_init(struct upnp_device *device) {
 	UPnPLastChangeCollector_add_ignore(service->last_change,
 					   TRANSPORT_VAR_ABS_CTR_POS);
 
-	pthread_t thread;
-	pthread_create(&thread, NULL, thread_update_track_time, NULL);
+	// No thread needed for the track time anymore: it is updated from
+	// a main loop timer while we're playing.
 }
 
-void upnp_transport_register_variable_listener(variable_change_listener_t cb,
+void upnp_transport_register_variable_listener(struct service *service,
+					       variable_change_listener_t cb,
 					       void *userdata) {
-	VariableContainer_register_callback(state_variables_, cb, userdata);
+	VariableContainer_register_callback(service->variable_container,
+					    cb, userdata);
 }
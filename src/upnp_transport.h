@@ -28,13 +28,23 @@
 
 struct service;
 struct upnp_device;
+struct output;
 
+// The AVTransport of the given zone, created on first use. Each zone has
+// its own state and control/event URLs; the SCPD is the same for all.
+struct service *upnp_transport_get_zone_service(int zone);
+
+// The transport of the first (or only) zone.
 struct service *upnp_transport_get_service(void);
-void upnp_transport_init(struct upnp_device *);
+
+// Start the transport as part of the given device, playing on "output".
+void upnp_transport_init(struct service *service, struct upnp_device *device,
+			 struct output *output);
 
 // Register a callback to get informed when variables change. This should
 // return quickly.
-void upnp_transport_register_variable_listener(variable_change_listener_t cb,
-						       void *userdata);
+void upnp_transport_register_variable_listener(struct service *service,
+					       variable_change_listener_t cb,
+					       void *userdata);
 
 #endif /* _UPNP_TRANSPORT_H */
@@ -0,0 +1,462 @@
+/* variable-container-test - Checks for variables and LastChange eventing.
+ *
+ * Copyright (C) 2026 GMediaRender contributors
+ *
+ * This file is part of GMediaRender.
+ *
+ * GMediaRender is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * GMediaRender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GMediaRender; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ * -----------------
+ *
+ * Run with 'make check'.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "upnp_device.h"
+#include "upnp_service.h"
+#include "variable-container.h"
+#include "xmlescape.h"
+
+#define LASTCHANGE_NS "urn:schemas-upnp-org:metadata-1-0/AVT/"
+
+static int failures = 0;
+
+#define CHECK(cond) do {						\
+		if (!(cond)) {						\
+			fprintf(stderr, "%s:%d: FAILED: %s\n",		\
+				__FILE__, __LINE__, #cond);		\
+			++failures;					\
+		}							\
+	} while (0)
+
+// Count every allocation, including those done inside glib. Only possible
+// where we can forward to the real allocator.
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static volatile gint allocations = 0;
+
+void *malloc(size_t size) {
+	g_atomic_int_inc(&allocations);
+	return __libc_malloc(size);
+}
+void *calloc(size_t nmemb, size_t size) {
+	g_atomic_int_inc(&allocations);
+	return __libc_calloc(nmemb, size);
+}
+void *realloc(void *ptr, size_t size) {
+	g_atomic_int_inc(&allocations);
+	return __libc_realloc(ptr, size);
+}
+#  define HAVE_ALLOCATION_COUNT 1
+#else
+static volatile gint allocations = 0;
+#  define HAVE_ALLOCATION_COUNT 0
+#endif
+
+// Instead of sending events, we count them and keep the last one.
+static int events_sent = 0;
+static char last_event[4096];
+
+int upnp_device_notify(struct upnp_device *device,
+                       const char *serviceID,
+                       const char **varnames,
+                       const char **varvalues, int varcount) {
+	++events_sent;
+	snprintf(last_event, sizeof(last_event), "%s", varvalues[0]);
+	return 0;
+}
+
+enum {
+	TEST_TRANSPORT_STATE,
+	TEST_POSITION,
+	TEST_METADATA,
+	TEST_LAST_CHANGE,
+	TEST_VAR_COUNT
+};
+
+static const struct var_meta kTestVars[] = {
+	{ TEST_TRANSPORT_STATE, "TransportState", "STOPPED", EV_NO,
+	  DATATYPE_STRING, NULL, NULL },
+	{ TEST_POSITION, "RelativeTimePosition", "0:00:00", EV_NO,
+	  DATATYPE_STRING, NULL, NULL },
+	{ TEST_METADATA, "CurrentTrackMetaData", "", EV_NO,
+	  DATATYPE_STRING, NULL, NULL },
+	{ TEST_LAST_CHANGE, "LastChange", "<Event/>", EV_YES,
+	  DATATYPE_STRING, NULL, NULL },
+};
+
+static int count_occurrences(const char *haystack, const char *needle) {
+	int count = 0;
+	while ((haystack = strstr(haystack, needle)) != NULL) {
+		++count;
+		haystack += strlen(needle);
+	}
+	return count;
+}
+
+// Document of the last event sent.
+static const char *last_change(variable_container_t *vars) {
+	return VariableContainer_get(vars, TEST_LAST_CHANGE, NULL);
+}
+
+// Changes within nested transactions go out in one event when the
+// outermost one finishes, each variable once with its final value.
+static void test_nested_transactions(void) {
+	variable_container_t *vars =
+		VariableContainer_new(TEST_VAR_COUNT, kTestVars);
+	UPnPLastChangeCollector_set_moderation_window(0);
+	upnp_last_change_collector_t *collector =
+		UPnPLastChangeCollector_new(vars, LASTCHANGE_NS, NULL,
+					    "test", NULL);
+	CHECK(events_sent == 1);  // Initial state.
+	CHECK(strstr(last_change(vars), "<TransportState val=\"STOPPED\"/>"));
+
+	UPnPLastChangeCollector_start(collector);
+	VariableContainer_change(vars, TEST_POSITION, "0:00:01");
+	UPnPLastChangeCollector_start(collector);
+	VariableContainer_change(vars, TEST_POSITION, "0:00:02");
+	VariableContainer_change(vars, TEST_TRANSPORT_STATE, "PLAYING");
+	UPnPLastChangeCollector_finish(collector);
+	CHECK(events_sent == 1);  // Outer transaction still open.
+	VariableContainer_change(vars, TEST_POSITION, "0:00:03");
+	UPnPLastChangeCollector_finish(collector);
+	CHECK(events_sent == 2);
+	const char *xml = last_change(vars);
+	CHECK(count_occurrences(xml, "<RelativeTimePosition ") == 1);
+	CHECK(strstr(xml, "<RelativeTimePosition val=\"0:00:03\"/>"));
+	CHECK(strstr(xml, "<TransportState val=\"PLAYING\"/>"));
+	CHECK(strstr(xml, "CurrentTrackMetaData") == NULL);
+
+	// Changed and back again: nothing to tell.
+	UPnPLastChangeCollector_start(collector);
+	UPnPLastChangeCollector_start(collector);
+	VariableContainer_change(vars, TEST_TRANSPORT_STATE, "STOPPED");
+	UPnPLastChangeCollector_finish(collector);
+	VariableContainer_change(vars, TEST_TRANSPORT_STATE, "PLAYING");
+	UPnPLastChangeCollector_finish(collector);
+	CHECK(events_sent == 2);
+
+	// Outside of a transaction, every change is sent right away.
+	VariableContainer_change(vars, TEST_METADATA, "<DIDL-Lite/>");
+	CHECK(events_sent == 3);
+	CHECK(strstr(last_change(vars),
+		     "<CurrentTrackMetaData val=\"&lt;DIDL-Lite/&gt;\"/>"));
+
+	// Ignored variables don't cause an event.
+	UPnPLastChangeCollector_add_ignore(collector, TEST_POSITION);
+	VariableContainer_change(vars, TEST_POSITION, "0:00:04");
+	CHECK(events_sent == 3);
+}
+
+// -- LastChange documents.
+
+static const struct var_meta kEventVars[] = {
+	{ 0, "TransportState", "STOPPED", EV_NO, DATATYPE_STRING, NULL, NULL },
+	{ 1, "Volume", "0", EV_NO, DATATYPE_UI2, NULL, NULL },
+	{ 2, "Mute", "0", EV_NO, DATATYPE_BOOLEAN, NULL, NULL },
+	{ 3, "CurrentTrackMetaData", "", EV_NO, DATATYPE_STRING, NULL, NULL },
+	{ 4, "LastChange", "", EV_YES, DATATYPE_STRING, NULL, NULL },
+};
+#define EVENT_VAR_COUNT 4  // Without LastChange.
+
+static const char *const kEventValues[EVENT_VAR_COUNT] = {
+	"PLAYING",
+	"42",
+	"1",
+	"<DIDL-Lite xmlns=\"urn:x\"><dc:title>Rock & Roll</dc:title>"
+	"</DIDL-Lite>",
+};
+
+// The document as the builder wrote it when variables were still added by
+// name, before the event plan. The value sent is the same document passed
+// through xmlescape().
+static const char kExpectedEvent[] =
+	"<?xml version=\"1.0\"?>\n"
+	"<Event xmlns=\"urn:schemas-upnp-org:metadata-1-0/AVT/\">"
+	"<InstanceID val=\"0\">"
+	"<TransportState val=\"PLAYING\"/>"
+	"<Volume val=\"42\" channel=\"Master\"/>"
+	"<Mute val=\"1\" channel=\"Master\"/>"
+	"<CurrentTrackMetaData val=\"&lt;DIDL-Lite xmlns=&quot;urn:x&quot;&gt;"
+	"&lt;dc:title&gt;Rock &amp; Roll&lt;/dc:title&gt;&lt;/DIDL-Lite&gt;\"/>"
+	"</InstanceID></Event>\n";
+
+// The per-service event plan writes the same documents as before.
+static void test_lastchange_output(void) {
+	variable_container_t *vars = VariableContainer_new(5, kEventVars);
+	upnp_last_change_builder_t *builder =
+		UPnPLastChangeBuilder_new(LASTCHANGE_NS);
+	const char *escaped = NULL;
+	CHECK(UPnPLastChangeBuilder_get_xml(builder, &escaped) == NULL);
+	for (int i = 0; i < EVENT_VAR_COUNT; ++i) {
+		UPnPLastChangeBuilder_add_variable(builder, vars, i,
+						   kEventValues[i]);
+	}
+	const char *xml = UPnPLastChangeBuilder_get_xml(builder, &escaped);
+	char *expected_escaped = xmlescape(kExpectedEvent, 0);
+	CHECK(xml != NULL && strcmp(xml, kExpectedEvent) == 0);
+	CHECK(escaped != NULL && strcmp(escaped, expected_escaped) == 0);
+	// Asking again doesn't change it.
+	CHECK(strcmp(UPnPLastChangeBuilder_get_xml(builder, NULL),
+		     kExpectedEvent) == 0);
+	UPnPLastChangeBuilder_reset(builder);
+	CHECK(UPnPLastChangeBuilder_get_xml(builder, NULL) == NULL);
+	UPnPLastChangeBuilder_delete(builder);
+
+	// Same when sent by the collector.
+	UPnPLastChangeCollector_set_moderation_window(0);
+	upnp_last_change_collector_t *collector =
+		UPnPLastChangeCollector_new(vars, LASTCHANGE_NS, NULL,
+					    "test", NULL);
+	UPnPLastChangeCollector_start(collector);
+	for (int i = 0; i < EVENT_VAR_COUNT; ++i) {
+		VariableContainer_change(vars, i, kEventValues[i]);
+	}
+	UPnPLastChangeCollector_finish(collector);
+	CHECK(strcmp(VariableContainer_get(vars, 4, NULL),
+		     kExpectedEvent) == 0);
+	CHECK(strcmp(last_event, expected_escaped) == 0);
+	free(expected_escaped);
+}
+
+// -- Snapshots.
+
+#define SNAPSHOT_CHANGES 200000
+#define SNAPSHOT_READERS 3
+
+// The writer sets the transport state, then the position, to the same
+// number n; so snapshot version v has state (v + 1) / 2 and position v / 2.
+// Every few values are long, so that buffers are replaced and reused.
+static void format_value(int n, char *buf, size_t size) {
+	const int padding = (n % 7 == 6) ? 100 : (n % 3);
+	snprintf(buf, size, "%d%.*s", n, padding,
+		 "...................................................."
+		 "....................................................");
+}
+
+static int value_ok(const char *value, int n) {
+	char expected[128];
+	format_value(n, expected, sizeof(expected));
+	return value != NULL && strcmp(value, expected) == 0;
+}
+
+static volatile gint snapshot_writer_done = 0;
+
+struct snapshot_reader {
+	variable_container_t *vars;
+	pthread_t thread;
+	unsigned long reads;
+	unsigned long versions_seen;
+	unsigned long errors;
+};
+
+static void *snapshot_reader_thread(void *userdata) {
+	struct snapshot_reader *r = (struct snapshot_reader*) userdata;
+	unsigned long last_version = 0;
+	while (!g_atomic_int_get(&snapshot_writer_done)) {
+		variable_snapshot_t *snapshot =
+			VariableContainer_snapshot_acquire(r->vars);
+		const unsigned long version =
+			VariableSnapshot_version(snapshot);
+		const char *state =
+			VariableSnapshot_get(snapshot, TEST_TRANSPORT_STATE);
+		const char *position =
+			VariableSnapshot_get(snapshot, TEST_POSITION);
+		if (version < last_version)
+			r->errors++;   // Went back in time.
+		if (version != last_version)
+			r->versions_seen++;
+		last_version = version;
+		// Both values belong to the same version, and stay unchanged
+		// while we hold the snapshot, even if the writer moves on.
+		for (int i = 0; i < 3; ++i) {
+			if (i > 0)
+				g_thread_yield();
+			if (!value_ok(state, (version + 1) / 2)
+			    || !value_ok(position, version / 2))
+				r->errors++;
+		}
+		VariableSnapshot_release(snapshot);
+		r->reads++;
+	}
+	return NULL;
+}
+
+// Readers don't take the mutex, yet always see a consistent state.
+static void test_snapshot_consistency(void) {
+	static const struct var_meta kVars[] = {
+		{ TEST_TRANSPORT_STATE, "TransportState", "0", EV_NO,
+		  DATATYPE_STRING, NULL, NULL },
+		{ TEST_POSITION, "RelativeTimePosition", "0", EV_NO,
+		  DATATYPE_STRING, NULL, NULL },
+	};
+	variable_container_t *vars = VariableContainer_new(2, kVars);
+	struct snapshot_reader readers[SNAPSHOT_READERS];
+	for (int i = 0; i < SNAPSHOT_READERS; ++i) {
+		memset(&readers[i], 0, sizeof(readers[i]));
+		readers[i].vars = vars;
+		pthread_create(&readers[i].thread, NULL,
+			       snapshot_reader_thread, &readers[i]);
+	}
+	char value[128];
+	for (int n = 1; n <= SNAPSHOT_CHANGES / 2; ++n) {
+		format_value(n, value, sizeof(value));
+		VariableContainer_change(vars, TEST_TRANSPORT_STATE, value);
+		VariableContainer_change(vars, TEST_POSITION, value);
+		g_thread_yield();  // Let readers in, even on one CPU.
+	}
+	g_atomic_int_set(&snapshot_writer_done, 1);
+	for (int i = 0; i < SNAPSHOT_READERS; ++i) {
+		pthread_join(readers[i].thread, NULL);
+		CHECK(readers[i].errors == 0);
+		CHECK(readers[i].reads > 0);
+	}
+	// Nothing is left referenced after the readers are gone.
+	variable_snapshot_t *snapshot = VariableContainer_snapshot_acquire(vars);
+	CHECK(VariableSnapshot_version(snapshot) == SNAPSHOT_CHANGES);
+	CHECK(value_ok(VariableSnapshot_get(snapshot, TEST_POSITION),
+		       SNAPSHOT_CHANGES / 2));
+	VariableSnapshot_release(snapshot);
+	printf("snapshots: %lu reads seeing %lu versions during %d changes\n",
+	       readers[0].reads + readers[1].reads + readers[2].reads,
+	       readers[0].versions_seen + readers[1].versions_seen
+	       + readers[2].versions_seen, SNAPSHOT_CHANGES);
+	VariableContainer_delete(vars);
+}
+
+// The state for new subscribers is not rebuilt for changes of variables
+// that are not evented, like the position while playing.
+static void test_subscription_snapshot(void) {
+	variable_container_t *vars =
+		VariableContainer_new(TEST_VAR_COUNT, kTestVars);
+	upnp_last_change_collector_t *collector =
+		UPnPLastChangeCollector_new(vars, LASTCHANGE_NS, NULL,
+					    "test", NULL);
+	UPnPLastChangeCollector_add_ignore(collector, TEST_POSITION);
+	upnp_state_snapshot_cache_t *cache =
+		UPnPStateSnapshotCache_new(vars, LASTCHANGE_NS);
+
+	upnp_state_snapshot_t *first = UPnPStateSnapshotCache_get(cache);
+	CHECK(strstr(UPnPStateSnapshot_escaped_xml(first),
+		     "TransportState") != NULL);
+	CHECK(strstr(UPnPStateSnapshot_escaped_xml(first),
+		     "RelativeTimePosition") == NULL);
+	VariableContainer_change(vars, TEST_POSITION, "0:00:01");
+	upnp_state_snapshot_t *second = UPnPStateSnapshotCache_get(cache);
+	CHECK(second == first);
+
+	VariableContainer_change(vars, TEST_TRANSPORT_STATE, "PLAYING");
+	upnp_state_snapshot_t *third = UPnPStateSnapshotCache_get(cache);
+	CHECK(third != first);
+	CHECK(UPnPStateSnapshot_version(third)
+	      > UPnPStateSnapshot_version(first));
+	CHECK(strstr(UPnPStateSnapshot_escaped_xml(third), "PLAYING") != NULL);
+	UPnPStateSnapshot_unref(first);
+	UPnPStateSnapshot_unref(second);
+	UPnPStateSnapshot_unref(third);
+}
+
+// -- Allocations.
+
+// Steady state while playing: the position changes every second, the
+// metadata with every new track (here: every 200 seconds).
+static void play_seconds(variable_container_t *vars,
+			 upnp_last_change_collector_t *collector,
+			 int from, int count) {
+	char position[16];
+	char meta[1024];
+	for (int i = from; i < from + count; ++i) {
+		UPnPLastChangeCollector_start(collector);
+		snprintf(position, sizeof(position), "%d:%02d:%02d",
+			 i / 3600, i / 60 % 60, i % 60);
+		VariableContainer_change(vars, TEST_POSITION, position);
+		if (i % 200 == 0) {
+			snprintf(meta, sizeof(meta),
+				 "<DIDL-Lite xmlns=\"urn:schemas-upnp-org:"
+				 "metadata-1-0/DIDL-Lite/\"><item id=\"%d\">"
+				 "<dc:title>Track %d</dc:title>"
+				 "<upnp:class>object.item.audioItem.musicTrack"
+				 "</upnp:class><res>http://192.168.1.2:8200/"
+				 "MediaItems/%d.flac</res></item></DIDL-Lite>",
+				 i / 200, i / 200, i / 200);
+			VariableContainer_change(vars, TEST_TRANSPORT_STATE,
+						 "TRANSITIONING");
+			VariableContainer_change(vars, TEST_METADATA, meta);
+			VariableContainer_change(vars, TEST_TRANSPORT_STATE,
+						 "PLAYING");
+		}
+		UPnPLastChangeCollector_finish(collector);
+	}
+}
+
+// Once playing, changing variables and sending LastChange events does not
+// allocate.
+static void test_steady_state_allocations(void) {
+	variable_container_t *vars =
+		VariableContainer_new(TEST_VAR_COUNT, kTestVars);
+	UPnPLastChangeCollector_set_moderation_window(0);
+	upnp_last_change_collector_t *collector =
+		UPnPLastChangeCollector_new(vars, LASTCHANGE_NS, NULL,
+					    "test", NULL);
+	play_seconds(vars, collector, 0, 1000);  // Warm up: a few tracks.
+
+	struct variable_container_stats before, after;
+	VariableContainer_get_stats(vars, &before);
+	const int events_before = events_sent;
+	const gint allocations_before = g_atomic_int_get(&allocations);
+	play_seconds(vars, collector, 1000, 10000);
+	const gint steady_allocations =
+		g_atomic_int_get(&allocations) - allocations_before;
+	VariableContainer_get_stats(vars, &after);
+
+	CHECK(events_sent - events_before == 10000);
+	CHECK(after.changes - before.changes > 20000);
+	CHECK(after.allocations == before.allocations);
+	if (HAVE_ALLOCATION_COUNT) {
+		CHECK(steady_allocations == 0);
+	}
+	printf("steady state: %lu changes, %lu container allocations, "
+	       "%d allocations in total%s\n", after.changes - before.changes,
+	       after.allocations - before.allocations, steady_allocations,
+	       HAVE_ALLOCATION_COUNT ? "" : " (not counted)");
+}
+
+int main(void) {
+	test_nested_transactions();
+	test_lastchange_output();
+	test_snapshot_consistency();
+	test_subscription_snapshot();
+	test_steady_state_allocations();
+	if (failures) {
+		fprintf(stderr, "%d checks failed.\n", failures);
+		return 1;
+	}
+	printf("variable-container-test: all checks passed.\n");
+	return 0;
+}
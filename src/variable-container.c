@@ -37,10 +37,16 @@
 #include <ctype.h>
 #include <stdint.h>
 
+#include <glib.h>
+
+#include "logging.h"
 #include "upnp_device.h"
 #include "upnp_service.h"
-#include "xmlescape.h"
-#include "xmldoc.h"
+
+// Built on demand by the LastChange collector and the state snapshot cache.
+struct upnp_event_plan;
+typedef struct upnp_event_plan upnp_event_plan_t;
+static void UPnPEventPlan_delete(upnp_event_plan_t *plan);
 
 // -- VariableContainer
 struct cb_list {
@@ -49,13 +55,156 @@ struct cb_list {
 	struct cb_list *next;
 };
 
+// The values are published as immutable snapshots, so that readers get a
+// consistent view of all variables without taking the service mutex. A
+// change copies the array of value pointers (not the strings) into a new
+// snapshot.
+// Every snapshot holds a reference to its successor, so it can only be
+// released after all older snapshots are gone. A replaced value buffer is
+// released with the last snapshot that contained it, at which point no
+// reader can still see it.
+//
+// Released snapshots and value buffers are not freed but kept as spares
+// for the next change; steady state playback, say the position changing
+// every second or a new track's metadata, does not allocate.
+struct variable_snapshot {
+	gint refcount;
+	int variable_num;
+	unsigned long version;
+	variable_container_t *container;
+	struct variable_snapshot *next;  // Newer snapshot; referenced.
+	struct value_buffer *garbage;    // Buffer that was replaced in 'next'
+	int garbage_var;                 // ... for this variable.
+	const char *values[];
+};
+
+// Storage for a value. Values from the allowed_values or the default value
+// of a variable are not copied but point to the meta-data.
+struct value_buffer {
+	size_t capacity;
+	int in_arena;  // Part of the block allocated with the container.
+	char str[];
+};
+
+// Each variable starts with two buffers of this size in the arena: one for
+// the current value, one for the next. Enough for times, counters and
+// volumes.
+#define SMALL_VALUE_SIZE 32
+
+// A variable needs at most two buffers in steady state: the one of the
+// current value and the one of the previous value, which becomes available
+// again once the previous snapshot is gone.
+#define SPARE_SLOTS 2
+
 struct variable_container {
 	int variable_num;
 	const struct var_meta *vars;
-	char **values;
+	struct variable_snapshot *current;  // Changed with the mutex held.
 	struct cb_list *callbacks;
+
+	// Buffer holding the current value of each variable; NULL if the
+	// value is interned. Only accessed with the mutex held.
+	struct value_buffer **buffers;
+	// Buffers and snapshots ready for reuse. Filled by whoever releases
+	// the last reference, taken by the writer.
+	struct value_buffer *(*spare_buffers)[SPARE_SLOTS];
+	struct variable_snapshot *spare_snapshots[SPARE_SLOTS];
+	void *arena;
+
+	// Readers taking a reference to the current snapshot are counted in
+	// the slot of the epoch they started in. A writer flips the epoch
+	// and waits for the old slot to drain before it drops its reference
+	// to the previous snapshot.
+	gint epoch;
+	gint readers[2];
+
+	struct variable_container_stats stats;
+
+	struct upnp_event_plan *event_plan;  // Built on first use.
 };
 
+// Put an object into one of the spare slots; returns FALSE if all are
+// taken.
+static gboolean put_spare(gpointer *slots, gpointer object) {
+	for (int i = 0; i < SPARE_SLOTS; ++i) {
+		if (g_atomic_pointer_compare_and_exchange(&slots[i],
+							  NULL, object))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+// Take an object out of the spare slots; only called by the writer, so
+// nobody else empties the slots meanwhile.
+static gpointer take_spare(gpointer *slots) {
+	for (int i = 0; i < SPARE_SLOTS; ++i) {
+		gpointer object = g_atomic_pointer_get(&slots[i]);
+		if (object != NULL
+		    && g_atomic_pointer_compare_and_exchange(&slots[i],
+							     object, NULL))
+			return object;
+	}
+	return NULL;
+}
+
+static void free_buffer(struct value_buffer *buffer) {
+	if (buffer != NULL && !buffer->in_arena)
+		free(buffer);
+}
+
+static struct variable_snapshot *new_snapshot(variable_container_t *object) {
+	struct variable_snapshot *snapshot = (struct variable_snapshot*)
+		take_spare((gpointer*) object->spare_snapshots);
+	if (snapshot == NULL) {
+		snapshot = (struct variable_snapshot*)
+			malloc(sizeof(*snapshot)
+			       + object->variable_num * sizeof(char*));
+		object->stats.allocations++;
+	}
+	snapshot->refcount = 1;
+	snapshot->variable_num = object->variable_num;
+	snapshot->version = 0;
+	snapshot->container = object;
+	snapshot->next = NULL;
+	snapshot->garbage = NULL;
+	snapshot->garbage_var = -1;
+	return snapshot;
+}
+
+// Returns the interned version of the value if it is one of the allowed
+// values or the default value of the variable, NULL otherwise.
+static const char *find_interned(const struct var_meta *meta,
+				 const char *value) {
+	if (strcmp(value, meta->default_value) == 0)
+		return meta->default_value;
+	if (meta->allowed_values == NULL)
+		return NULL;
+	for (const char **allowed = meta->allowed_values; *allowed; ++allowed) {
+		if (strcmp(value, *allowed) == 0)
+			return *allowed;
+	}
+	return NULL;
+}
+
+// Get a buffer for a value of the given size (including NUL) for variable
+// "var"; reuses a spare if it fits.
+static struct value_buffer *get_buffer(variable_container_t *object,
+				       int var, size_t size) {
+	struct value_buffer *buffer = (struct value_buffer*)
+		take_spare((gpointer*) object->spare_buffers[var]);
+	if (buffer != NULL && buffer->capacity >= size)
+		return buffer;
+	free_buffer(buffer);
+	size_t capacity = SMALL_VALUE_SIZE;
+	while (capacity < size)
+		capacity *= 2;   // Room for the next track's metadata.
+	buffer = (struct value_buffer*) malloc(sizeof(*buffer) + capacity);
+	buffer->capacity = capacity;
+	buffer->in_arena = 0;
+	object->stats.allocations++;
+	return buffer;
+}
+
 static int cmp_meta_id(const void *a, const void *b) {
 	return ((struct var_meta*)a)->id - ((struct var_meta*)b)->id;
 }
@@ -85,28 +234,68 @@ variable_container_t *VariableContainer_new(int variable_num,
 	// take care of it here. However accesses the meta-data does it through
 	// VariableContainer
 	result->vars = create_sorted_meta(variable_num, unordered_vars);
-	result->values = (char **) malloc(variable_num * sizeof(char*));
 	result->callbacks = NULL;
+	result->epoch = 0;
+	result->readers[0] = result->readers[1] = 0;
+	memset(&result->stats, 0, sizeof(result->stats));
+	result->buffers = (struct value_buffer**)
+		calloc(variable_num, sizeof(struct value_buffer*));
+	result->spare_buffers = calloc(variable_num,
+				       sizeof(*result->spare_buffers));
+
+	// Two small buffers per variable to start with.
+	const size_t small_size = sizeof(struct value_buffer)
+		+ SMALL_VALUE_SIZE;
+	char *arena = (char*) malloc(2 * variable_num * small_size);
+	result->arena = arena;
+	for (int i = 0; i < 2 * variable_num; ++i) {
+		struct value_buffer *buffer =
+			(struct value_buffer*) (arena + i * small_size);
+		buffer->capacity = SMALL_VALUE_SIZE;
+		buffer->in_arena = 1;
+		result->spare_buffers[i / 2][i % 2] = buffer;
+	}
+	for (int i = 0; i < SPARE_SLOTS; ++i) {
+		result->spare_snapshots[i] = NULL;
+	}
+
+	result->current = new_snapshot(result);
 	for (int i = 0; i < variable_num; ++i) {
 		assert(result->vars[i].name != NULL);
 		assert(result->vars[i].id == i);
 		assert(result->vars[i].default_value != NULL);
-		result->values[i] = strdup(result->vars[i].default_value);
+		result->current->values[i] = result->vars[i].default_value;
 	}
+	// One more snapshot, so that the first change does not allocate.
+	put_spare((gpointer*) result->spare_snapshots, new_snapshot(result));
+	result->stats.allocations = 0;
+	result->event_plan = NULL;
 	return result;
 }
 
 void VariableContainer_delete(variable_container_t *object) {
+	// There must not be any readers left; so everything but the current
+	// snapshot has been released.
 	for (int i = 0; i < object->variable_num; ++i) {
-		free(object->values[i]);
+		free_buffer(object->buffers[i]);
+		for (int j = 0; j < SPARE_SLOTS; ++j) {
+			free_buffer(object->spare_buffers[i][j]);
+		}
 	}
-	free(object->values);
+	free(object->current);
+	for (int i = 0; i < SPARE_SLOTS; ++i) {
+		free(object->spare_snapshots[i]);
+	}
+	free(object->buffers);
+	free(object->spare_buffers);
+	free(object->arena);
 
 	for (struct cb_list *list = object->callbacks; list; /**/) {
 		struct cb_list *next = list->next;
 		free(list);
 		list = next;
 	}
+	UPnPEventPlan_delete(object->event_plan);
 	free((void*)object->vars);
 	free(object);
 }
@@ -128,7 +317,64 @@ const char *VariableContainer_get(variable_container_t *object,
 	const char *varname = object->vars[var].name;
 	if (name) *name = varname;
 	// Names of not used variables are set to NULL.
-	return varname ? object->values[var] : NULL;
+	return varname ? object->current->values[var] : NULL;
+}
+
+variable_snapshot_t *
+VariableContainer_snapshot_acquire(variable_container_t *object) {
+	for (;;) {
+		const gint epoch = g_atomic_int_get(&object->epoch);
+		g_atomic_int_inc(&object->readers[epoch]);
+		// If a writer flipped the epoch meanwhile, it might not have
+		// seen us; it is not waiting for this slot anymore.
+		if (g_atomic_int_get(&object->epoch) == epoch) {
+			variable_snapshot_t *snapshot =
+				g_atomic_pointer_get(&object->current);
+			g_atomic_int_inc(&snapshot->refcount);
+			g_atomic_int_add(&object->readers[epoch], -1);
+			return snapshot;
+		}
+		g_atomic_int_add(&object->readers[epoch], -1);
+	}
+}
+
+const char *VariableSnapshot_get(const variable_snapshot_t *snapshot,
+				 int var) {
+	if (var < 0 || var >= snapshot->variable_num)
+		return NULL;
+	return snapshot->values[var];
+}
+
+unsigned long VariableSnapshot_version(const variable_snapshot_t *snapshot) {
+	return snapshot->version;
+}
+
+void VariableSnapshot_release(variable_snapshot_t *snapshot) {
+	// Releasing a snapshot drops its reference to the next one.
+	while (snapshot && g_atomic_int_dec_and_test(&snapshot->refcount)) {
+		variable_container_t *const object = snapshot->container;
+		struct variable_snapshot *next = snapshot->next;
+		if (snapshot->garbage != NULL
+		    && !put_spare((gpointer*) object->spare_buffers[
+					  snapshot->garbage_var],
+				  snapshot->garbage)) {
+			free_buffer(snapshot->garbage);
+		}
+		if (!put_spare((gpointer*) object->spare_snapshots, snapshot)) {
+			free(snapshot);
+		}
+		snapshot = next;
+	}
+}
+
+// Wait until readers that might have picked up the previous snapshot have
+// taken their reference. They only hold the epoch for a few instructions.
+static void wait_for_readers(variable_container_t *object) {
+	const gint old_epoch = object->epoch;  // Only changed by writers.
+	g_atomic_int_set(&object->epoch, !old_epoch);
+	while (g_atomic_int_get(&object->readers[old_epoch]) != 0) {
+		g_thread_yield();
+	}
 }
 
 // Change content of variable with given number to NUL terminated content.
@@ -136,20 +382,48 @@ int VariableContainer_change(variable_container_t *object,
 			     int var_num, const char *value) {
 	assert(var_num >= 0 && var_num < object->variable_num);
 	if (value == NULL) value = "";
-	if (strcmp(value, object->values[var_num]) == 0)
+	struct variable_snapshot *previous = object->current;
+	const char *old_value = previous->values[var_num];
+	if (strcmp(value, old_value) == 0)
 		return 0;  // no change.
-	char *old_value = object->values[var_num];
-	char *new_value = strdup(value);
-	object->values[var_num] = new_value;
+	struct variable_snapshot *snapshot = new_snapshot(object);
+	memcpy(snapshot->values, previous->values,
+	       object->variable_num * sizeof(char*));
+	snapshot->version = previous->version + 1;
+
+	struct value_buffer *buffer = NULL;
+	const char *new_value = find_interned(&object->vars[var_num], value);
+	if (new_value == NULL) {
+		const size_t size = strlen(value) + 1;
+		buffer = get_buffer(object, var_num, size);
+		memcpy(buffer->str, value, size);
+		new_value = buffer->str;
+	}
+	snapshot->values[var_num] = new_value;
+	previous->garbage = object->buffers[var_num];
+	previous->garbage_var = var_num;
+	object->buffers[var_num] = buffer;
+	object->stats.changes++;
+
+	g_atomic_int_inc(&snapshot->refcount);  // Held by previous->next
+	previous->next = snapshot;
+	g_atomic_pointer_set(&object->current, snapshot);
+
 	for (struct cb_list *it = object->callbacks; it; it = it->next) {
 		it->callback(it->userdata,
 			     var_num, object->vars[var_num].name,
 			     old_value, new_value);
 	}
-	free(old_value);
+	wait_for_readers(object);
+	VariableSnapshot_release(previous);
 	return 1;
 }
 
+void VariableContainer_get_stats(variable_container_t *object,
+				 struct variable_container_stats *stats) {
+	*stats = object->stats;
+}
+
 void VariableContainer_register_callback(variable_container_t *object,
 					 variable_change_listener_t callback,
 					 void *userdata) {
@@ -162,83 +436,297 @@ void VariableContainer_register_callback(variable_container_t *object,
 }
 
 // -- UPnPLastChangeBuilder
+// The document is assembled as text directly, together with its escaped
+// form that is sent as value of the LastChange variable. Both buffers are
+// kept between events, so steady state operation does not allocate.
 struct upnp_last_change_builder {
 	const char *xml_namespace;
-	struct xmldoc *change_event_doc;
-	struct xmlelement *instance_element;
+	GString *xml;          // The LastChange document.
+	GString *escaped_xml;  // Same, escaped once more to be sent as value.
 };
 
+// Append markup, escaped to be sent as variable value.
+static void escape_markup(GString *out, const char *markup) {
+	for (const char *c = markup; *c; ++c) {
+		// Copy runs of plain characters in one go.
+		const size_t plain = strcspn(c, "<>&");
+		g_string_append_len(out, c, plain);
+		c += plain;
+		switch (*c) {
+		case '<': g_string_append(out, "&lt;"); break;
+		case '>': g_string_append(out, "&gt;"); break;
+		case '&': g_string_append(out, "&amp;"); break;
+		default:  return;  // End of string.
+		}
+	}
+}
+
+// Append markup that does not need escaping in the document itself.
+static void UPnPLastChangeBuilder_append_markup(upnp_last_change_builder_t *b,
+						const char *markup) {
+	g_string_append(b->xml, markup);
+	escape_markup(b->escaped_xml, markup);
+}
+
+// Append an attribute value; it is escaped for the document and the
+// result escaped again for the event.
+static void UPnPLastChangeBuilder_append_value(upnp_last_change_builder_t *b,
+					       const char *value) {
+	for (const char *c = value; *c; ++c) {
+		// Copy runs of plain characters in one go.
+		const size_t plain = strcspn(c, "<>&\"");
+		g_string_append_len(b->xml, c, plain);
+		g_string_append_len(b->escaped_xml, c, plain);
+		c += plain;
+		switch (*c) {
+		case '<':
+			g_string_append(b->xml, "&lt;");
+			g_string_append(b->escaped_xml, "&amp;lt;");
+			break;
+		case '>':
+			g_string_append(b->xml, "&gt;");
+			g_string_append(b->escaped_xml, "&amp;gt;");
+			break;
+		case '&':
+			g_string_append(b->xml, "&amp;");
+			g_string_append(b->escaped_xml, "&amp;amp;");
+			break;
+		case '"':
+			g_string_append(b->xml, "&quot;");
+			g_string_append(b->escaped_xml, "&amp;quot;");
+			break;
+		default:
+			return;  // End of string.
+		}
+	}
+}
+
 upnp_last_change_builder_t *UPnPLastChangeBuilder_new(const char *xml_namespace) {
 	upnp_last_change_builder_t *result = (upnp_last_change_builder_t*)
 		malloc(sizeof(upnp_last_change_builder_t));
 	result->xml_namespace = xml_namespace;
-	result->change_event_doc = NULL;
-	result->instance_element = NULL;
+	result->xml = g_string_sized_new(512);
+	result->escaped_xml = g_string_sized_new(1024);
 	return result;
 }
 
 void UPnPLastChangeBuilder_delete(upnp_last_change_builder_t *builder) {
-	if (builder->change_event_doc != NULL) {
-		xmldoc_free(builder->change_event_doc);
-	}
+	g_string_free(builder->xml, TRUE);
+	g_string_free(builder->escaped_xml, TRUE);
 	free(builder);
 }
 
-void UPnPLastChangeBuilder_add(upnp_last_change_builder_t *builder,
-			       const char *name, const char *value) {
-	assert(name != NULL);
+// HACK!
+// The volume related events need another qualifying
+// attribute that represents the channel. Since all other elements just
+// have one value to transmit without qualifier, the variable container
+// is oblivious about this notion of a qualifier.
+// So this is a bit ugly: if we see the variables in question,
+// we add the attribute manually.
+static int needs_channel_qualifier(const char *name) {
+	return (strcmp(name, "Volume") == 0
+		|| strcmp(name, "VolumeDB") == 0
+		|| strcmp(name, "Mute") == 0
+		|| strcmp(name, "Loudness") == 0);
+}
+
+static const char kElementEnd[] = "\"/>";
+static const char kQualifiedElementEnd[] = "\" channel=\"Master\"/>";
+
+static void UPnPLastChangeBuilder_start(upnp_last_change_builder_t *builder) {
+	if (builder->xml->len != 0)
+		return;
+	UPnPLastChangeBuilder_append_markup(builder,
+					    "<?xml version=\"1.0\"?>\n"
+					    "<Event xmlns=\"");
+	UPnPLastChangeBuilder_append_value(builder, builder->xml_namespace);
+	// Right now, we only have exactly one instance.
+	UPnPLastChangeBuilder_append_markup(builder,
+					    "\"><InstanceID val=\"0\">");
+}
+
+// -- UPnPEventPlan
+// Everything about eventing a variable that does not depend on its value
+// is decided once per container (i.e. service): which variables are part
+// of the state sent to new subscribers, and the markup around the value,
+// already escaped.
+
+// Bitset over variable numbers, as wide as needed.
+#define BITSET_WORDS(bits) (((bits) + 31) / 32)
+static uint32_t *bitset_new(int bits) {
+	return (uint32_t*) calloc(BITSET_WORDS(bits), sizeof(uint32_t));
+}
+static void bitset_set(uint32_t *set, int bit) {
+	set[bit / 32] |= (uint32_t) 1 << (bit % 32);
+}
+static void bitset_clear(uint32_t *set, int bit) {
+	set[bit / 32] &= ~((uint32_t) 1 << (bit % 32));
+}
+static int bitset_test(const uint32_t *set, int bit) {
+	return (set[bit / 32] >> (bit % 32)) & 1;
+}
+
+struct event_markup {
+	char *start;            // <Name val="
+	char *start_escaped;
+	size_t start_len;
+	size_t start_escaped_len;
+	const char *end;        // "/> with the channel qualifier if needed.
+	const char *end_escaped;
+};
+
+struct upnp_event_plan {
+	int var_count;
+	int last_change_var;       // -1 if there is none.
+	uint32_t *subscription;    // Variables in the state for subscribers.
+	struct event_markup *markup;
+	char *end_escaped;
+	char *qualified_end_escaped;
+};
+
+static char *escaped_markup(const char *markup, size_t *len) {
+	GString *out = g_string_new(NULL);
+	escape_markup(out, markup);
+	if (len) *len = out->len;
+	return g_string_free(out, FALSE);
+}
+
+static upnp_event_plan_t *UPnPEventPlan_get(variable_container_t *vars) {
+	if (vars->event_plan != NULL)
+		return vars->event_plan;
+	upnp_event_plan_t *plan = (upnp_event_plan_t*)
+		malloc(sizeof(upnp_event_plan_t));
+	plan->var_count = vars->variable_num;
+	plan->last_change_var = -1;
+	plan->subscription = bitset_new(plan->var_count);
+	plan->markup = (struct event_markup*)
+		calloc(plan->var_count, sizeof(struct event_markup));
+	plan->end_escaped = escaped_markup(kElementEnd, NULL);
+	plan->qualified_end_escaped =
+		escaped_markup(kQualifiedElementEnd, NULL);
+	for (int i = 0; i < plan->var_count; ++i) {
+		const char *name = vars->vars[i].name;
+		if (name == NULL)
+			continue;
+		if (strcmp("LastChange", name) == 0) {
+			plan->last_change_var = i;
+		}
+		// Send over all variables except "LastChange" itself. Also
+		// all A_ARG_TYPE variables are not evented.
+		if (strcmp("LastChange", name) != 0
+		    && strncmp("A_ARG_TYPE_", name,
+			       strlen("A_ARG_TYPE_")) != 0) {
+			bitset_set(plan->subscription, i);
+		}
+		struct event_markup *m = &plan->markup[i];
+		m->start = g_strdup_printf("<%s val=\"", name);
+		m->start_len = strlen(m->start);
+		m->start_escaped = escaped_markup(m->start,
+						  &m->start_escaped_len);
+		if (needs_channel_qualifier(name)) {
+			m->end = kQualifiedElementEnd;
+			m->end_escaped = plan->qualified_end_escaped;
+		} else {
+			m->end = kElementEnd;
+			m->end_escaped = plan->end_escaped;
+		}
+	}
+	vars->event_plan = plan;
+	return plan;
+}
+
+static void UPnPEventPlan_delete(upnp_event_plan_t *plan) {
+	if (plan == NULL)
+		return;
+	for (int i = 0; i < plan->var_count; ++i) {
+		g_free(plan->markup[i].start);
+		g_free(plan->markup[i].start_escaped);
+	}
+	g_free(plan->end_escaped);
+	g_free(plan->qualified_end_escaped);
+	free(plan->markup);
+	free(plan->subscription);
+	free(plan);
+}
+
+// Add variable with given number of the planned service.
+static void UPnPLastChangeBuilder_add_planned(upnp_last_change_builder_t *b,
+					      const upnp_event_plan_t *plan,
+					      int var_num, const char *value) {
+	const struct event_markup *m = &plan->markup[var_num];
+	UPnPLastChangeBuilder_start(b);
+	g_string_append_len(b->xml, m->start, m->start_len);
+	g_string_append_len(b->escaped_xml, m->start_escaped,
+			    m->start_escaped_len);
+	UPnPLastChangeBuilder_append_value(b, value);
+	g_string_append(b->xml, m->end);
+	g_string_append(b->escaped_xml, m->end_escaped);
+}
+
+void UPnPLastChangeBuilder_add_variable(upnp_last_change_builder_t *builder,
+					variable_container_t *container,
+					int var_num, const char *value) {
+	assert(var_num >= 0 && var_num < container->variable_num);
 	assert(value != NULL);
-	if (builder->change_event_doc == NULL) {
-		builder->change_event_doc = xmldoc_new();
-		struct xmlelement *toplevel =
-			xmldoc_new_topelement(builder->change_event_doc, "Event",
-					      builder->xml_namespace);
-		// Right now, we only have exactly one instance.
-		builder->instance_element =
-			add_attributevalue_element(builder->change_event_doc,
-						   toplevel,
-						   "InstanceID", "val", "0");
-	}
-	struct xmlelement *xml_value;
-	xml_value = add_attributevalue_element(builder->change_event_doc,
-					       builder->instance_element,
-					       name, "val", value);
-	// HACK!
-	// The volume related events need another qualifying
-	// attribute that represents the channel. Since all other elements just
-	// have one value to transmit without qualifier, the variable container
-	// is oblivious about this notion of a qualifier.
-	// So this is a bit ugly: if we see the variables in question,
-	// we add the attribute manually.
-	if (strcmp(name, "Volume") == 0
-	    || strcmp(name, "VolumeDB") == 0
-	    || strcmp(name, "Mute") == 0
-	    || strcmp(name, "Loudness") == 0) {
-	  xmlelement_set_attribute(builder->change_event_doc,
-				   xml_value, "channel", "Master");
-	}
-}
-
-char *UPnPLastChangeBuilder_to_xml(upnp_last_change_builder_t *builder) {
-	if (builder->change_event_doc == NULL)
+	UPnPLastChangeBuilder_add_planned(builder,
+					  UPnPEventPlan_get(container),
+					  var_num, value);
+}
+
+const char *UPnPLastChangeBuilder_get_xml(upnp_last_change_builder_t *builder,
+					  const char **escaped_xml) {
+	if (builder->xml->len == 0)
 		return NULL;
 
-	char *xml_doc_string = xmldoc_tostring(builder->change_event_doc);
-	xmldoc_free(builder->change_event_doc);
-	builder->change_event_doc = NULL;
-	builder->instance_element = NULL;
-	return xml_doc_string;
+	// Only close the document on the first call after adding.
+	if (builder->xml->str[builder->xml->len - 1] != '\n') {
+		UPnPLastChangeBuilder_append_markup(builder,
+						    "</InstanceID></Event>\n");
+	}
+	if (escaped_xml != NULL)
+		*escaped_xml = builder->escaped_xml->str;
+	return builder->xml->str;
+}
+
+void UPnPLastChangeBuilder_reset(upnp_last_change_builder_t *builder) {
+	g_string_truncate(builder->xml, 0);
+	g_string_truncate(builder->escaped_xml, 0);
 }
 
 // -- UPnPLastChangeCollector
+
+// Minimum time between two LastChange events of a service, in microseconds.
+static gint64 moderation_window_us = 200000;
+
+// Per variable state of the collector, indexed by variable number.
+struct last_change_slot {
+	int pending;        // Changed since the last event.
+	char *sent_value;   // Value in the last event or NULL if never sent.
+	size_t sent_capacity;  // Kept, so that steady state doesn't allocate.
+};
+
 struct upnp_last_change_collector {
 	variable_container_t *variable_container;
 	int last_change_variable_num;      // the variable we manipulate.
-	uint32_t not_eventable_variables;  // variables not to event on.
+	const upnp_event_plan_t *plan;
+	uint32_t *eventable_variables;     // bitset; var_count wide.
+	int var_count;
+	struct last_change_slot *slots;    // var_count slots.
+	int pending_count;                 // slots pending for next event.
+	unsigned long repeated_changes;    // changes merged into a slot.
 	struct upnp_device *upnp_device;
 	const char *service_id;
 	int open_transactions;
 	upnp_last_change_builder_t *builder;
+
+	// Moderation: changes within the window are merged into one event.
+	ithread_mutex_t *service_mutex;    // needed for the delayed event.
+	gint64 window_us;
+	gint64 last_sent_us;               // monotonic time of last event.
+	GSource *flush_timer;              // scheduled delayed event.
+	int pending_notifications;         // merged into the next event.
+	unsigned long events_sent;
+	unsigned long events_suppressed;
 };
 
 static void UPnPLastChangeCollector_notify(upnp_last_change_collector_t *obj);
@@ -247,45 +735,54 @@ static void UPnPLastChangeCollector_callback(void *userdata,
 					     const char *old_value,
 					     const char *new_value);
 
+void UPnPLastChangeCollector_set_moderation_window(int millis) {
+	moderation_window_us = (millis > 0) ? (gint64) millis * 1000 : 0;
+}
+
 upnp_last_change_collector_t *
 UPnPLastChangeCollector_new(variable_container_t *variable_container,
 			    const char *event_xml_namespace,
 			    struct upnp_device *upnp_device,
-			    const char *service_id) {
+			    const char *service_id,
+			    ithread_mutex_t *service_mutex) {
 	upnp_last_change_collector_t *result = (upnp_last_change_collector_t*)
 		malloc(sizeof(upnp_last_change_collector_t));
 	result->variable_container = variable_container;
-	result->last_change_variable_num = -1;
-	result->not_eventable_variables = 0;
+	result->plan = UPnPEventPlan_get(variable_container);
+	result->last_change_variable_num = result->plan->last_change_var;
+	result->var_count = VariableContainer_get_num_vars(variable_container);
+	result->eventable_variables = bitset_new(result->var_count);
+	result->slots = (struct last_change_slot*)
+		calloc(result->var_count, sizeof(struct last_change_slot));
+	result->pending_count = 0;
+	result->repeated_changes = 0;
 	result->upnp_device = upnp_device;
 	result->service_id = service_id;
 	result->open_transactions = 0;
 	result->builder = UPnPLastChangeBuilder_new(event_xml_namespace);
+	result->service_mutex = service_mutex;
+	result->window_us = moderation_window_us;
+	result->last_sent_us = 0;
+	result->flush_timer = NULL;
+	result->pending_notifications = 0;
+	result->events_sent = 0;
+	result->events_suppressed = 0;
 
 	// Create initial LastChange that contains all variables in their
 	// current state. This might help devices that silently re-connect
 	// without proper registration.
-	// Also determine, which variable is actually the "LastChange" one.
-	const int var_count = VariableContainer_get_num_vars(variable_container);
-	assert(var_count < 32);  // otherwise widen not_eventable_variables
+	assert(result->last_change_variable_num >= 0); // we expect to have one.
+	const int var_count = result->var_count;
 	for (int i = 0; i < var_count; ++i) {
-		const char *name;
-		const char *value = VariableContainer_get(variable_container,
-							  i, &name);
-		if (!value) {
-			continue;
-		}
-		if (strcmp("LastChange", name) == 0) {
-			result->last_change_variable_num = i;
+		// Send over all variables except "LastChange" itself.
+		if (VariableContainer_get(variable_container, i, NULL) == NULL
+		    || i == result->last_change_variable_num) {
 			continue;
 		}
-		// Send over all variables except "LastChange" itself.
-		UPnPLastChangeBuilder_add(result->builder, name, value);
+		bitset_set(result->eventable_variables, i);
+		result->slots[i].pending = 1;
+		result->pending_count++;
 	}
-	assert(result->last_change_variable_num >= 0); // we expect to have one.
-	// The state change variable itself is not eventable.
-	UPnPLastChangeCollector_add_ignore(result,
-					   result->last_change_variable_num);
 	UPnPLastChangeCollector_notify(result);
 
 	VariableContainer_register_callback(variable_container,
@@ -296,7 +793,12 @@ UPnPLastChangeCollector_new(variable_container_t *variable_container,
 
 void UPnPLastChangeCollector_add_ignore(upnp_last_change_collector_t *object,
 					int variable_num) {
-	object->not_eventable_variables |= (1 << variable_num);
+	assert(variable_num >= 0 && variable_num < object->var_count);
+	bitset_clear(object->eventable_variables, variable_num);
+	// Not part of the state for new subscribers either, so that its
+	// changes don't invalidate their snapshot.
+	bitset_clear(UPnPEventPlan_get(object->variable_container)
+		     ->subscription, variable_num);
 }
 
 void UPnPLastChangeCollector_start(upnp_last_change_collector_t *object) {
@@ -309,15 +811,41 @@ void UPnPLastChangeCollector_finish(upnp_last_change_collector_t *object) {
 	UPnPLastChangeCollector_notify(object);
 }
 
-// TODO(hzeller): add rate limiting. The standard talks about some limited
-// amount of events per time-unit.
-static void UPnPLastChangeCollector_notify(upnp_last_change_collector_t *obj) {
-	if (obj->open_transactions != 0)
-		return;
+// Assemble the changed variables with their current value and send them
+// out as LastChange event. Each variable is in there at most once, no
+// matter how often it changed; variables that went back to the value
+// we sent last time are left out.
+static void UPnPLastChangeCollector_send(upnp_last_change_collector_t *obj) {
+	for (int i = 0; i < obj->var_count; ++i) {
+		struct last_change_slot *slot = &obj->slots[i];
+		if (!slot->pending)
+			continue;
+		slot->pending = 0;
+		const char *value = VariableContainer_get(obj->variable_container,
+							  i, NULL);
+		if (value == NULL)
+			continue;
+		if (slot->sent_value && strcmp(slot->sent_value, value) == 0)
+			continue;
+		UPnPLastChangeBuilder_add_planned(obj->builder, obj->plan,
+						  i, value);
+		const size_t size = strlen(value) + 1;
+		if (size > slot->sent_capacity) {
+			free(slot->sent_value);
+			slot->sent_capacity = 2 * size;  // Room to grow.
+			slot->sent_value = (char*) malloc(slot->sent_capacity);
+		}
+		memcpy(slot->sent_value, value, size);
+	}
+	obj->pending_count = 0;
 
-	char *xml_doc_string = UPnPLastChangeBuilder_to_xml(obj->builder);
-	if (xml_doc_string == NULL)
+	const char *escaped_xml;
+	const char *xml_doc_string =
+		UPnPLastChangeBuilder_get_xml(obj->builder, &escaped_xml);
+	if (xml_doc_string == NULL) {
+		obj->pending_notifications = 0;  // Nothing left to tell.
 		return;
+	}
 
 	// Only if there is actually a change, send it over.
 	if (VariableContainer_change(obj->variable_container,
@@ -327,36 +855,207 @@ static void UPnPLastChangeCollector_notify(upnp_last_change_collector_t *obj) {
 			"LastChange",
 			NULL
 		};
-		const char *varvalues[] = {
-			NULL, NULL
-		};
 		// Yes, now, the whole XML document is encapsulated in
 		// XML so needs to be XML quoted. The time around 2000 was
-		// pretty sick - people did everything in XML.
-		varvalues[0] = xmlescape(xml_doc_string, 0);
+		// pretty sick - people did everything in XML. The builder
+		// prepared the quoted version already.
+		const char *varvalues[] = {
+			escaped_xml, NULL
+		};
 		upnp_device_notify(obj->upnp_device,
 				   obj->service_id,
 				   varnames, varvalues, 1);
-		free((char*)varvalues[0]);
+
+		obj->events_sent++;
+		obj->events_suppressed += obj->pending_notifications - 1;
+		if (obj->pending_notifications > 1) {
+			Log_info("event", "%s: merged %d changes into one event "
+				 "(%lu sent, %lu suppressed, %lu repeated "
+				 "variable changes dropped so far)",
+				 obj->service_id, obj->pending_notifications,
+				 obj->events_sent, obj->events_suppressed,
+				 obj->repeated_changes);
+		}
+	}
+	obj->pending_notifications = 0;
+	obj->last_sent_us = g_get_monotonic_time();
+
+	UPnPLastChangeBuilder_reset(obj->builder);
+}
+
+// Called from the main loop when the moderation window is over.
+static gboolean UPnPLastChangeCollector_flush(gpointer userdata) {
+	upnp_last_change_collector_t *obj =
+		(upnp_last_change_collector_t*) userdata;
+	ithread_mutex_lock(obj->service_mutex);
+	g_source_unref(obj->flush_timer);
+	obj->flush_timer = NULL;
+	// If a transaction is open right now, its finish() will send it.
+	if (obj->open_transactions == 0 && obj->pending_count != 0) {
+		UPnPLastChangeCollector_send(obj);
 	}
+	ithread_mutex_unlock(obj->service_mutex);
+	return FALSE;
+}
+
+// Send out the collected changes, unless we already sent an event within
+// the moderation window (the standard allows at most 5 per second); in
+// that case, they go out with a single event once the window is over.
+static void UPnPLastChangeCollector_notify(upnp_last_change_collector_t *obj) {
+	if (obj->open_transactions != 0 || obj->pending_count == 0)
+		return;
 
-	free(xml_doc_string);
+	obj->pending_notifications++;
+	if (obj->flush_timer != NULL)
+		return;  // Will be sent with the already scheduled event.
+
+	const gint64 wait_us = (obj->last_sent_us + obj->window_us
+				- g_get_monotonic_time());
+	if (wait_us > 0 && obj->service_mutex != NULL) {
+		obj->flush_timer = g_timeout_source_new(wait_us / 1000 + 1);
+		g_source_set_callback(obj->flush_timer,
+				      UPnPLastChangeCollector_flush, obj, NULL);
+		g_source_attach(obj->flush_timer, NULL);
+		return;
+	}
+	UPnPLastChangeCollector_send(obj);
 }
 
-// The actual callback collecting changes by building an <Event/> XML document.
-// This is not very robust if in the same transaction, we get the same variable
-// changed twice -- it emits two changes.
+// The actual callback collecting changes. We only mark the slot of the
+// variable pending; a variable changing several times within a transaction
+// or moderation window is sent once, with its final value.
 static void UPnPLastChangeCollector_callback(void *userdata,
 					     int var_num, const char *var_name,
 					     const char *old_value,
 					     const char *new_value) {
+	(void)var_name;
 	(void)old_value;
+	(void)new_value;
 	upnp_last_change_collector_t *object =
 		(upnp_last_change_collector_t*) userdata;
 
-	if (object->not_eventable_variables & (1 << var_num)) {
+	if (!bitset_test(object->eventable_variables, var_num)) {
 		return;  // ignore changes on non-eventable variables.
 	}
-	UPnPLastChangeBuilder_add(object->builder, var_name, new_value);
+	struct last_change_slot *slot = &object->slots[var_num];
+	if (slot->pending) {
+		object->repeated_changes++;
+	} else {
+		slot->pending = 1;
+		object->pending_count++;
+	}
 	UPnPLastChangeCollector_notify(object);
 }
+
+// -- UPnPStateSnapshot
+struct upnp_state_snapshot {
+	gint refcount;
+	unsigned long version;
+	char *escaped_xml;
+};
+
+struct upnp_state_snapshot_cache {
+	variable_container_t *variable_container;
+	const upnp_event_plan_t *plan;
+	upnp_last_change_builder_t *builder;
+	unsigned long version;             // Incremented on every change
+					   // of a variable in the snapshot.
+	upnp_state_snapshot_t *current;    // Snapshot of some version or NULL.
+	unsigned long rebuilds;
+	unsigned long reuses;
+};
+
+static void UPnPStateSnapshotCache_callback(void *userdata,
+					    int var_num, const char *var_name,
+					    const char *old_value,
+					    const char *new_value) {
+	(void)var_name;
+	(void)old_value;
+	(void)new_value;
+	upnp_state_snapshot_cache_t *cache =
+		(upnp_state_snapshot_cache_t*) userdata;
+	if (bitset_test(cache->plan->subscription, var_num)) {
+		cache->version++;
+	}
+}
+
+upnp_state_snapshot_cache_t *
+UPnPStateSnapshotCache_new(variable_container_t *variable_container,
+			   const char *xml_namespace) {
+	upnp_state_snapshot_cache_t *result = (upnp_state_snapshot_cache_t*)
+		malloc(sizeof(upnp_state_snapshot_cache_t));
+	result->variable_container = variable_container;
+	result->plan = UPnPEventPlan_get(variable_container);
+	result->builder = UPnPLastChangeBuilder_new(xml_namespace);
+	result->version = 1;
+	result->current = NULL;
+	result->rebuilds = 0;
+	result->reuses = 0;
+	VariableContainer_register_callback(variable_container,
+					    UPnPStateSnapshotCache_callback,
+					    result);
+	return result;
+}
+
+static upnp_state_snapshot_t *
+UPnPStateSnapshotCache_build(upnp_state_snapshot_cache_t *cache) {
+	const int var_count =
+		VariableContainer_get_num_vars(cache->variable_container);
+	for (int i = 0; i < var_count; ++i) {
+		if (!bitset_test(cache->plan->subscription, i))
+			continue;
+		const char *value =
+			VariableContainer_get(cache->variable_container,
+					      i, NULL);
+		if (value) {
+			UPnPLastChangeBuilder_add_planned(cache->builder,
+							  cache->plan,
+							  i, value);
+		}
+	}
+	const char *escaped_xml = NULL;
+	UPnPLastChangeBuilder_get_xml(cache->builder, &escaped_xml);
+
+	upnp_state_snapshot_t *result = (upnp_state_snapshot_t*)
+		malloc(sizeof(upnp_state_snapshot_t));
+	result->refcount = 1;
+	result->version = cache->version;
+	result->escaped_xml = strdup(escaped_xml ? escaped_xml : "");
+	UPnPLastChangeBuilder_reset(cache->builder);
+	return result;
+}
+
+upnp_state_snapshot_t *
+UPnPStateSnapshotCache_get(upnp_state_snapshot_cache_t *cache) {
+	if (cache->current != NULL
+	    && cache->current->version == cache->version) {
+		cache->reuses++;
+	} else {
+		if (cache->current != NULL) {
+			UPnPStateSnapshot_unref(cache->current);
+		}
+		cache->current = UPnPStateSnapshotCache_build(cache);
+		cache->rebuilds++;
+		if (cache->rebuilds % 100 == 0) {
+			Log_info("upnp", "State snapshot: %lu rebuilt, "
+				 "%lu reused", cache->rebuilds, cache->reuses);
+		}
+	}
+	g_atomic_int_inc(&cache->current->refcount);
+	return cache->current;
+}
+
+const char *UPnPStateSnapshot_escaped_xml(const upnp_state_snapshot_t *s) {
+	return s->escaped_xml;
+}
+
+unsigned long UPnPStateSnapshot_version(const upnp_state_snapshot_t *s) {
+	return s->version;
+}
+
+void UPnPStateSnapshot_unref(upnp_state_snapshot_t *snapshot) {
+	if (g_atomic_int_dec_and_test(&snapshot->refcount)) {
+		free(snapshot->escaped_xml);
+		free(snapshot);
+	}
+}
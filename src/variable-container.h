@@ -41,10 +41,16 @@
  *   Hooks into the callback mechanism of the variable_container to assemble
  *   the LastChange variable to be sent over (using the last change builder).
  *
+ * upnp_state_snapshot - the full state of all eventable variables as
+ *   LastChange document, sent to new subscribers. Cached until a variable
+ *   changes.
+ *
  */
 #ifndef VARIABLE_CONTAINER_H
 #define VARIABLE_CONTAINER_H
 
+#include <ithread.h>
+
 // -- VariableContainer
 struct variable_container;
 typedef struct variable_container variable_container_t;
@@ -80,6 +86,30 @@ const char *VariableContainer_get(variable_container_t *object, int var,
 int VariableContainer_change(variable_container_t *object,
 			     int variable_num, const char *value);
 
+// Lock-free read access. The above functions need the mutex protecting the
+// container held; a snapshot can be acquired and read without it. It is
+// an immutable, consistent view of all variables at one point in time and
+// stays valid until released, independent of later changes.
+struct variable_snapshot;
+typedef struct variable_snapshot variable_snapshot_t;
+
+variable_snapshot_t *
+VariableContainer_snapshot_acquire(variable_container_t *object);
+// Value of variable with given number or NULL if it does not exist.
+const char *VariableSnapshot_get(const variable_snapshot_t *snapshot, int var);
+// Increments with every change.
+unsigned long VariableSnapshot_version(const variable_snapshot_t *snapshot);
+void VariableSnapshot_release(variable_snapshot_t *snapshot);
+
+// Counters, to verify that changing variables does not allocate once
+// playing is under way.
+struct variable_container_stats {
+	unsigned long changes;
+	unsigned long allocations;  // Since the container was created.
+};
+void VariableContainer_get_stats(variable_container_t *object,
+				 struct variable_container_stats *stats);
+
 // Callback handling. Whenever a variable changes, the callback is called.
 // Be careful when changing variables in the original container as this will
 // trigger recursive calls to the container.
@@ -101,27 +131,45 @@ typedef struct upnp_last_change_builder upnp_last_change_builder_t;
 upnp_last_change_builder_t *UPnPLastChangeBuilder_new(const char *xml_namespace);
 void UPnPLastChangeBuilder_delete(upnp_last_change_builder_t *builder);
 
-void UPnPLastChangeBuilder_add(upnp_last_change_builder_t *builder,
-			       const char *name, const char *value);
-// Returns a newly allocated XML string that needs to be free()'d by the caller.
-// Resets the document. If no changes have been added, NULL is returned.
-char *UPnPLastChangeBuilder_to_xml(upnp_last_change_builder_t *builder);
+// Add the given value of variable "var_num" of the container. How the
+// variable is written is decided once per container, not on every call.
+void UPnPLastChangeBuilder_add_variable(upnp_last_change_builder_t *builder,
+					variable_container_t *container,
+					int var_num, const char *value);
+// Returns the XML document of all changes added since the last reset, or
+// NULL if none have been added. If "escaped_xml" is not NULL, it is set to
+// the same document XML-escaped once more, ready to be sent as the value
+// of the LastChange variable.
+// Both strings are owned by the builder and only valid until the next call
+// to UPnPLastChangeBuilder_add_variable() or UPnPLastChangeBuilder_reset().
+const char *UPnPLastChangeBuilder_get_xml(upnp_last_change_builder_t *builder,
+					  const char **escaped_xml);
+// Start a new document. Keeps the allocated buffers for reuse.
+void UPnPLastChangeBuilder_reset(upnp_last_change_builder_t *builder);
 
 // -- UPnP LastChange collector
 struct upnp_device;  // forward declare.
 struct upnp_last_change_collector;
 typedef struct upnp_last_change_collector upnp_last_change_collector_t;
 
+// Set the minimum time between two LastChange events of a service. All
+// changes within that window are merged into one event carrying the final
+// values. Applies to collectors created afterwards; 0 disables moderation.
+void UPnPLastChangeCollector_set_moderation_window(int millis);
+
 // Create a new last change collector that registers at the
 // "variable_container" for changes in variables. It assembles a LastChange
 // event and sends it to the given "upnp_device".
 // The variable_container is expected to contain one variable with name
 // "LastChange", otherwise this collector is not applicable and fails.
+// The "service_mutex" protecting the variable container is locked when
+// sending an event delayed by moderation (from the GLib main loop).
 upnp_last_change_collector_t *
 UPnPLastChangeCollector_new(variable_container_t *variable_container,
 			    const char *event_xml_namespac,
 			    struct upnp_device *upnp_device,
-			    const char *service_id);
+			    const char *service_id,
+			    ithread_mutex_t *service_mutex);
 
 // Set variable number that should be ignored in eventing.
 void UPnPLastChangeCollector_add_ignore(upnp_last_change_collector_t *object,
@@ -134,4 +182,32 @@ void UPnPLastChangeCollector_start(upnp_last_change_collector_t *object);
 void UPnPLastChangeCollector_finish(upnp_last_change_collector_t *object);
 
 // no delete yet. We leak that.
+
+// -- UPnP state snapshot
+struct upnp_state_snapshot_cache;
+typedef struct upnp_state_snapshot_cache upnp_state_snapshot_cache_t;
+struct upnp_state_snapshot;
+typedef struct upnp_state_snapshot upnp_state_snapshot_t;
+
+// Create a cache for the initial LastChange event of the variables in the
+// container. It registers for changes, so must be created (and used) with
+// the mutex protecting the variable container held.
+// The xml_namespace must exist for the lifetime of this object.
+upnp_state_snapshot_cache_t *
+UPnPStateSnapshotCache_new(variable_container_t *variable_container,
+			   const char *xml_namespace);
+
+// Get the snapshot of the current state; only rebuilt if a variable changed
+// since the last call. Variables ignored by the LastChange collector of the
+// container are neither part of it nor considered as change. Returns a reference that needs to be released with
+// UPnPStateSnapshot_unref(); this can be done without holding the mutex.
+upnp_state_snapshot_t *
+UPnPStateSnapshotCache_get(upnp_state_snapshot_cache_t *cache);
+
+// The LastChange document, escaped to be sent as variable value.
+const char *UPnPStateSnapshot_escaped_xml(const upnp_state_snapshot_t *s);
+// Version of the state; increments with every variable change.
+unsigned long UPnPStateSnapshot_version(const upnp_state_snapshot_t *s);
+void UPnPStateSnapshot_unref(upnp_state_snapshot_t *snapshot);
+
 #endif  /* VARIABLE_CONTAINER_H */
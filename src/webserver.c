@@ -29,11 +29,14 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
 #include <limits.h>
 #include <assert.h>
+#include <time.h>
 
 #include <upnp.h>
 #include <upnptools.h>  // UpnpGetErrorMessage
@@ -43,35 +46,84 @@
 #include "webserver.h"
 #include "upnp_compat.h"
 
-typedef struct {
-	off_t pos;
+// Everything we serve is known at startup and never changes afterwards:
+// icons are mapped from PKG_DATADIR, service descriptions are generated
+// once. So length and modification time are known at registration; requests
+// only do a hash lookup.
+// (No ETag: libupnp answers the request itself and gives us no way to reply
+// 304 Not Modified to a conditional GET.)
+struct virtual_file {
+	const char *virtual_fname;
 	const char *contents;
+	const char *content_type;
 	size_t len;
+	time_t last_modified;
+	int mapped;           // contents are mmap()ed.
+};
+
+// virtual_fname -> struct virtual_file. Filled before the webserver is
+// started, read-only afterwards, so lookups don't need a lock.
+static GHashTable *virtual_files = NULL;
+
+typedef struct {
+	off_t pos;
+	const struct virtual_file *file;
 } WebServerFile;
 
-struct virtual_file;
+static const struct virtual_file *find_virtual_file(const char *filename)
+{
+	if (virtual_files == NULL)
+		return NULL;
+	return g_hash_table_lookup(virtual_files, filename);
+}
 
-static struct virtual_file {
-	const char *virtual_fname;
-	const char *contents;
-	const char *content_type;
-	size_t len;
-	struct virtual_file *next;
-} *virtual_files = NULL;
+static void free_virtual_file(struct virtual_file *entry)
+{
+	if (entry->mapped)
+		munmap((void*) entry->contents, entry->len);
+	free(entry);
+}
+
+// Takes ownership of the entry. Several devices provide the same files;
+// the first one is kept. A path registered again with a different content
+// is a bug: the later one wins, but we complain.
+static void add_virtual_file(struct virtual_file *entry)
+{
+	if (virtual_files == NULL) {
+		virtual_files = g_hash_table_new(g_str_hash, g_str_equal);
+	}
+	struct virtual_file *existing =
+		g_hash_table_lookup(virtual_files, entry->virtual_fname);
+	if (existing != NULL) {
+		if (existing->len == entry->len
+		    && (entry->len == 0
+			|| memcmp(existing->contents, entry->contents,
+				  entry->len) == 0)) {
+			free_virtual_file(entry);
+			return;  // Shared by several devices; provided already.
+		}
+		Log_error("webserver", "%s registered twice with different "
+			  "content; replacing it.", entry->virtual_fname);
+		g_hash_table_remove(virtual_files, existing->virtual_fname);
+		free_virtual_file(existing);
+	}
+	g_hash_table_insert(virtual_files, (gpointer) entry->virtual_fname,
+			    entry);
+}
 
 int webserver_register_buf(const char *path, const char *contents,
 			   const char *content_type)
 {
 	struct virtual_file *entry;
 
-	Log_info("webserver", "Provide %s (%s) from buffer",
-		 path, content_type);
-
 	assert(path != NULL);
 	assert(contents != NULL);
 	assert(content_type != NULL);
 
-	entry = (struct virtual_file*)malloc(sizeof(struct virtual_file));
+	Log_info("webserver", "Provide %s (%s) from buffer",
+		 path, content_type);
+
+	entry = (struct virtual_file*)calloc(1, sizeof(struct virtual_file));
 	if (entry == NULL) {
 		return -1;
 	}
@@ -79,8 +131,8 @@ int webserver_register_buf(const char *path, const char *contents,
 	entry->contents = contents;
 	entry->virtual_fname = path;
 	entry->content_type = content_type;
-	entry->next = virtual_files;
-	virtual_files = entry;
+	entry->last_modified = time(NULL);
+	add_virtual_file(entry);
 
 	return 0;
 }
@@ -90,7 +142,7 @@ int webserver_register_file(const char *path, const char *content_type)
 	char local_fname[512];  // PATH_MAX, but that is not defined everywhere
 	struct stat buf;
 	struct virtual_file *entry;
-	int rc;
+	int fd;
 
 	snprintf(local_fname, sizeof(local_fname), "%s%s", PKG_DATADIR,
 	         strrchr(path, '/'));
@@ -98,75 +150,67 @@ int webserver_register_file(const char *path, const char *content_type)
 	Log_info("webserver", "Provide %s (%s) from %s", path, content_type,
 		 local_fname);
 
-	rc = stat(local_fname, &buf);
-	if (rc) {
-		Log_error("webserver", "Could not stat '%s': %s",
+	fd = open(local_fname, O_RDONLY);
+	if (fd < 0 || fstat(fd, &buf) != 0) {
+		Log_error("webserver", "Could not open '%s': %s",
 			  local_fname, strerror(errno));
+		if (fd >= 0)
+			close(fd);
 		return -1;
 	}
 
-	entry = (struct virtual_file*)malloc(sizeof(struct virtual_file));
+	entry = (struct virtual_file*)calloc(1, sizeof(struct virtual_file));
 	if (entry == NULL) {
+		close(fd);
 		return -1;
 	}
 	if (buf.st_size) {
-		char *cbuf;
-		FILE *in;
-		in = fopen(local_fname, "r");
-		if (in == NULL) {
-			free(entry);
-			return -1;
-		}
-		cbuf = (char*)malloc(buf.st_size);
-		if (cbuf == NULL) {
-			free(entry);
-			return -1;
-		}
-		if (fread(cbuf, buf.st_size, 1, in) != 1) {
+		// The mapping stays valid after closing the descriptor; pages
+		// are shared with the page cache instead of copied to the heap.
+		void *map = mmap(NULL, buf.st_size, PROT_READ, MAP_PRIVATE,
+				 fd, 0);
+		if (map == MAP_FAILED) {
+			Log_error("webserver", "Could not map '%s': %s",
+				  local_fname, strerror(errno));
+			close(fd);
 			free(entry);
-			free(cbuf);
 			return -1;
 		}
-		fclose(in);
 		entry->len = buf.st_size;
-		entry->contents = cbuf;
-
+		entry->contents = map;
+		entry->mapped = 1;
 	} else {
 		entry->len = 0;
 		entry->contents = NULL;
 	}
+	close(fd);
 	entry->virtual_fname = path;
 	entry->content_type = content_type;
-	entry->next = virtual_files;
-	virtual_files = entry;
+	entry->last_modified = buf.st_mtime;
+	add_virtual_file(entry);
 
 	return 0;
 }
 
 static VD_GET_INFO_CALLBACK(webserver_get_info, filename, info, cookie)
 {
-	struct virtual_file *virtfile = virtual_files;
-
-	while (virtfile != NULL) {
-		if (strcmp(filename, virtfile->virtual_fname) == 0) {
-			UpnpFileInfo_set_FileLength(info, virtfile->len);
-			UpnpFileInfo_set_LastModified(info, 0);
-			UpnpFileInfo_set_IsDirectory(info, 0);
-			UpnpFileInfo_set_IsReadable(info, 1);
-			const char *contentType =
-				ixmlCloneDOMString(virtfile->content_type);
-			UpnpFileInfo_set_ContentType(info, (char*) contentType);
-			Log_info("webserver", "Access %s (%s) len=%zd",
-				 filename, contentType, virtfile->len);
-			return 0;
-		}
-		virtfile = virtfile->next;
-	}
+	const struct virtual_file *virtfile = find_virtual_file(filename);
 
-	Log_info("webserver", "404 Not found. (attempt to access "
-		 "non-existent '%s')", filename);
+	if (virtfile == NULL) {
+		Log_info("webserver", "404 Not found. (attempt to access "
+			 "non-existent '%s')", filename);
+		return -1;
+	}
 
-	return -1;
+	UpnpFileInfo_set_FileLength(info, virtfile->len);
+	UpnpFileInfo_set_LastModified(info, virtfile->last_modified);
+	UpnpFileInfo_set_IsDirectory(info, 0);
+	UpnpFileInfo_set_IsReadable(info, 1);
+	const char *contentType = ixmlCloneDOMString(virtfile->content_type);
+	UpnpFileInfo_set_ContentType(info, (char*) contentType);
+	Log_info("webserver", "Access %s (%s) len=%zd",
+		 filename, contentType, virtfile->len);
+	return 0;
 }
 
 static VD_OPEN_CALLBACK(webserver_open, filename, mode, cookie)
@@ -178,40 +222,27 @@ static VD_OPEN_CALLBACK(webserver_open, filename, mode, cookie)
 		return NULL;
 	}
 
-	for (struct virtual_file *vf = virtual_files; vf; vf = vf->next) {
-		if (strcmp(filename, vf->virtual_fname) == 0) {
-			WebServerFile *file = (WebServerFile*)malloc(sizeof(WebServerFile));
-			file->pos = 0;
-			file->len = vf->len;
-			file->contents = vf->contents;
-			return file;
-		}
-	}
+	const struct virtual_file *vf = find_virtual_file(filename);
+	if (vf == NULL)
+		return NULL;
 
-	return NULL;
-}
-
-static inline int minimum(int a, int b)
-{
-	return (a<b)?a:b;
+	WebServerFile *file = (WebServerFile*)malloc(sizeof(WebServerFile));
+	file->pos = 0;
+	file->file = vf;
+	return file;
 }
 
 static VD_READ_CALLBACK(webserver_read, fh, buf, buflen, cookie)
 {
 	WebServerFile *file = (WebServerFile *) fh;
-	ssize_t len = -1;
-
-	len = minimum(buflen, file->len - file->pos);
-	memcpy(buf, file->contents + file->pos, len);
-
-	if (len < 0) {
-		Log_error("webserver", "In %s: %s",
-			  __FUNCTION__, strerror(errno));
+	size_t len = file->file->len - file->pos;
 
-	} else {
+	if (len > buflen)
+		len = buflen;
+	if (len > 0) {
+		memcpy(buf, file->file->contents + file->pos, len);
 		file->pos += len;
 	}
-
 	return len;
 }
 
@@ -233,11 +264,11 @@ static VD_SEEK_CALLBACK(webserver_seek, fh, offset, origin, cookie)
 		newpos = file->pos + offset;
 		break;
 	case SEEK_END:
-		newpos = file->len + offset;
+		newpos = file->file->len + offset;
 		break;
 	}
 
-	if (newpos < 0 || newpos > (off_t) file->len) {
+	if (newpos < 0 || newpos > (off_t) file->file->len) {
 		Log_error("webserver", "in %s: seek failed with %s",
 			  __FUNCTION__, strerror(errno));
 		return -1;